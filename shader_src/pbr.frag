@@ -5,6 +5,7 @@ layout(early_fragment_tests) in;
 in vec3 frag_position_viewspace;
 in vec2 texcoord_0;
 in mat3 tbn_matrix;
+flat in uint draw_index;
 
 layout (location = 0) out vec4 frag_color;
 
@@ -59,14 +60,25 @@ const float LUT_SIZE = 64.0;  // dimensions of the LTC textures
 const float LUT_SCALE = (LUT_SIZE - 1.0) / LUT_SIZE;
 const float LUT_BIAS = 0.5 / LUT_SIZE;
 
-// PBR material parameters
-layout (location = 10) uniform vec4 base_color_factor;
-layout (location = 11) uniform float metallic_factor;
-layout (location = 12) uniform float roughness_factor;
-layout (location = 13) uniform vec3 emissive_factor;
-layout (location = 14) uniform float alpha_mask_cutoff;
-layout (location = 15) uniform int is_normal_mapping_enabled;
-layout (location = 16) uniform int is_alpha_blending_enabled;
+// Per draw matrices and PBR material parameters
+struct DrawData
+{
+    mat4 mvp;
+    mat4 model_view;
+    mat4 normal_matrix;
+    vec4 base_color_factor;
+    vec3 emissive_factor;
+    float alpha_mask_cutoff;
+    float metallic_factor;
+    float roughness_factor;
+    int is_normal_mapping_enabled;
+    int is_alpha_blending_enabled;
+};
+
+layout (std430, binding = 8) restrict readonly buffer draw_data_ssbo
+{
+    DrawData draw_data[];
+};
 
 #ifdef ENABLE_CLUSTERED_SHADING
     #ifndef CLUSTER_MAX_LIGHTS
@@ -254,6 +266,15 @@ LTC_evaluate(vec3 N, vec3 V, vec3 P, mat3 Minv, vec4 viewspace_points[MAX_UNCLIP
 void
 main()
 {
+    DrawData material = draw_data[draw_index];
+    vec4 base_color_factor = material.base_color_factor;
+    float metallic_factor = material.metallic_factor;
+    float roughness_factor = material.roughness_factor;
+    vec3 emissive_factor = material.emissive_factor;
+    float alpha_mask_cutoff = material.alpha_mask_cutoff;
+    int is_normal_mapping_enabled = material.is_normal_mapping_enabled;
+    int is_alpha_blending_enabled = material.is_alpha_blending_enabled;
+
     vec4 base_color = texture(base_color_linear_space, texcoord_0) * base_color_factor;
     float alpha = base_color.a;
     if (alpha < alpha_mask_cutoff)
@@ -276,7 +297,14 @@ main()
     vec3 N;
     if (is_normal_mapping_enabled == 1)
     {
+    #if TEXTURE_COMPRESSION
+        // Normal maps are BC5, which only keeps x and y
+        vec3 normal_sample;
+        normal_sample.xy = texture(normal_texture, texcoord_0).rg * 2.0 - vec2(1.0);
+        normal_sample.z = sqrt(max(1.0 - dot(normal_sample.xy, normal_sample.xy), 0.0));
+    #else
         vec3 normal_sample = texture(normal_texture, texcoord_0).rgb * 2.0 - vec3(1.0);
+    #endif
         N = normalize(tbn_matrix * normal_sample);
     }
     else
@@ -1,30 +1,90 @@
 #version 460 core
 
+#if QUANTIZE_VERTICES
+// Positions are unorm16 in the primitive's bounds, the draw's matrices scale them back. w is the bitangent sign (0 or 1)
+layout (location = 0) in vec4 v_position;
+layout (location = 1) in vec2 v_normal;  // Octahedral
+layout (location = 2) in vec2 v_texcoord_0;
+layout (location = 3) in vec2 v_tangent;  // Octahedral
+#else
 layout (location = 0) in vec3 v_position;
 layout (location = 1) in vec3 v_normal;
 layout (location = 2) in vec2 v_texcoord_0;
 layout (location = 3) in vec4 v_tangent;
+#endif
+
+// Set once per draw call, the index of the draw's first instance is passed as the base instance
+struct DrawData
+{
+    mat4 mvp;
+    mat4 model_view;
+    mat4 normal_matrix;
+    vec4 base_color_factor;
+    vec3 emissive_factor;
+    float alpha_mask_cutoff;
+    float metallic_factor;
+    float roughness_factor;
+    int is_normal_mapping_enabled;
+    int is_alpha_blending_enabled;
+};
 
-// Set once per draw call
-layout (location = 0) uniform mat4 mvp;
-layout (location = 1) uniform mat4 model_view;
-layout (location = 2) uniform mat4 normal_matrix;
+layout (std430, binding = 8) restrict readonly buffer draw_data_ssbo
+{
+    DrawData draw_data[];
+};
+
+// Draw data indices for instances picked by occlusion culling
+layout (std430, binding = 9) restrict readonly buffer instance_remap_ssbo
+{
+    uint instance_remap[];
+};
+layout (location = 22) uniform bool is_instance_remap_enabled;
 
 out vec3 frag_position_viewspace;
 out vec2 texcoord_0;
 out mat3 tbn_matrix;
 out vec3 sun_direction_viewspace;
+flat out uint draw_index;
+
+vec3
+decode_octahedral(vec2 e)
+{
+    // Unfolds the lower hemisphere from the corners of the square (Cigolle et al. 2014)
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-n.z, 0.0);
+    n.xy += vec2(n.x >= 0.0 ? -t : t, n.y >= 0.0 ? -t : t);
+    return normalize(n);
+}
 
 void
 main()
 {
+    draw_index = gl_BaseInstance + gl_InstanceID;
+    if (is_instance_remap_enabled)
+    {
+        draw_index = instance_remap[draw_index];
+    }
+    mat4 mvp = draw_data[draw_index].mvp;
+    mat4 model_view = draw_data[draw_index].model_view;
+    mat4 normal_matrix = draw_data[draw_index].normal_matrix;
+
+#if QUANTIZE_VERTICES
+    vec3 position = v_position.xyz;
+    vec3 normal = decode_octahedral(v_normal);
+    vec4 tangent = vec4(decode_octahedral(v_tangent), v_position.w * 2.0 - 1.0);
+#else
+    vec3 position = v_position;
+    vec3 normal = v_normal;
+    vec4 tangent = v_tangent;
+#endif
+
     // Calculate TBN matrix for normal mapping
-    vec3 view_normal = normalize(mat3(normal_matrix) * v_normal);
-    vec3 view_tangent = normalize(mat3(normal_matrix) * vec3(v_tangent));
-    vec3 view_bitangent = normalize(cross(view_normal, view_tangent) * v_tangent.w);
+    vec3 view_normal = normalize(mat3(normal_matrix) * normal);
+    vec3 view_tangent = normalize(mat3(normal_matrix) * vec3(tangent));
+    vec3 view_bitangent = normalize(cross(view_normal, view_tangent) * tangent.w);
     tbn_matrix = mat3(view_tangent, view_bitangent, view_normal);
 
-    frag_position_viewspace = (model_view * vec4(v_position, 1.0)).xyz;  // Outgoing light direction from fragment view space to camera
+    frag_position_viewspace = (model_view * vec4(position, 1.0)).xyz;  // Outgoing light direction from fragment view space to camera
     texcoord_0 = v_texcoord_0;
-    gl_Position = mvp * vec4(v_position, 1.0);
+    gl_Position = mvp * vec4(position, 1.0);
 }
@@ -127,6 +127,32 @@ load_text_file(const char* filename)
     return buffer;
 }
 
+void*
+load_binary_file(const char* filename, size_t* out_size)
+{
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    size_t file_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    void* buffer = malloc(file_size > 0 ? file_size : 1);
+    if (buffer == NULL || fread(buffer, 1, file_size, file) != file_size)
+    {
+        free(buffer);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+
+    *out_size = file_size;
+    return buffer;
+}
+
 DynamicArray
 create_array(size_t starting_capacity)
 {
@@ -0,0 +1,242 @@
+#include "bvh.h"
+
+typedef struct BVHBuilder
+{
+    vec3* item_bounds;
+    vec3* centroids;
+    u32* item_indices;
+    DynamicArray nodes;
+}
+BVHBuilder;
+
+static void
+partition_around_nth(u32* indices, vec3* centroids, int axis, s64 count, s64 nth)
+{
+    // Quickselect: after this, indices[nth] holds the item with the nth smallest centroid on the axis,
+    // everything before it is <= and everything after it is >=. Median splits keep the tree balanced
+    // even for scenes like Lost Empire where most nodes are bunched into a few chunks.
+    s64 lo = 0;
+    s64 hi = count - 1;
+    while (lo < hi)
+    {
+        f32 pivot = centroids[indices[(lo + hi) / 2]][axis];
+        s64 i = lo;
+        s64 j = hi;
+        while (i <= j)
+        {
+            while (centroids[indices[i]][axis] < pivot) ++i;
+            while (centroids[indices[j]][axis] > pivot) --j;
+            if (i <= j)
+            {
+                u32 temp = indices[i];
+                indices[i] = indices[j];
+                indices[j] = temp;
+                ++i;
+                --j;
+            }
+        }
+
+        if (nth <= j)      hi = j;
+        else if (nth >= i) lo = i;
+        else               break;
+    }
+}
+
+static u32
+build_bvh_node(BVHBuilder* builder, u32 first, u32 count)
+{
+    u32 node_index = (u32)array_length(&builder->nodes, sizeof(BVHNode));
+    BVHNode* node = push_size(&builder->nodes, sizeof(BVHNode), 1);
+
+    // Bounds of every item under this node, and bounds of their centroids for choosing the split axis
+    vec3 bounds[2];
+    vec3 centroid_bounds[2];
+    glm_vec3_copy(builder->item_bounds[2 * builder->item_indices[first] + 0], bounds[0]);
+    glm_vec3_copy(builder->item_bounds[2 * builder->item_indices[first] + 1], bounds[1]);
+    glm_vec3_copy(builder->centroids[builder->item_indices[first]], centroid_bounds[0]);
+    glm_vec3_copy(builder->centroids[builder->item_indices[first]], centroid_bounds[1]);
+    for (u32 i = first + 1; i < first + count; ++i)
+    {
+        u32 item = builder->item_indices[i];
+        glm_vec3_minv(bounds[0], builder->item_bounds[2 * item + 0], bounds[0]);
+        glm_vec3_maxv(bounds[1], builder->item_bounds[2 * item + 1], bounds[1]);
+        glm_vec3_minv(centroid_bounds[0], builder->centroids[item], centroid_bounds[0]);
+        glm_vec3_maxv(centroid_bounds[1], builder->centroids[item], centroid_bounds[1]);
+    }
+
+    glm_vec3_copy(bounds[0], node->bounds[0]);
+    glm_vec3_copy(bounds[1], node->bounds[1]);
+    node->first = first;
+    node->count = count;
+
+    vec3 extent;
+    glm_vec3_sub(centroid_bounds[1], centroid_bounds[0], extent);
+    int axis = 0;
+    if (extent[1] > extent[axis]) axis = 1;
+    if (extent[2] > extent[axis]) axis = 2;
+
+    // Stay a leaf when small enough, or when every centroid is in the same spot so no split can separate them
+    if (count <= BVH_MAX_LEAF_ITEMS || extent[axis] <= 0.0f)
+    {
+        return node_index;
+    }
+
+    u32 left_count = count / 2;
+    partition_around_nth(&builder->item_indices[first], builder->centroids, axis, count, left_count);
+
+    // NOTE: node pointer is invalidated by the pushes in the recursive calls
+    build_bvh_node(builder, first, left_count);  // Left child is always node_index + 1
+    u32 right_child = build_bvh_node(builder, first + left_count, count - left_count);
+
+    node = get_element(&builder->nodes, sizeof(BVHNode), node_index);
+    node->first = right_child;
+    node->count = 0;
+
+    return node_index;
+}
+
+BVH
+build_bvh(vec3* item_bounds, u32 items_count)
+{
+    BVH bvh = { 0 };
+    if (items_count == 0)
+    {
+        return bvh;
+    }
+
+    BVHBuilder builder;
+    builder.item_bounds = item_bounds;
+    builder.centroids = malloc(items_count * sizeof(vec3));
+    builder.item_indices = malloc(items_count * sizeof(u32));
+    builder.nodes = create_array(2 * (items_count / BVH_MAX_LEAF_ITEMS + 1) * sizeof(BVHNode));
+
+    for (u32 i = 0; i < items_count; ++i)
+    {
+        glm_vec3_center(item_bounds[2 * i + 0], item_bounds[2 * i + 1], builder.centroids[i]);
+        builder.item_indices[i] = i;
+    }
+
+    build_bvh_node(&builder, 0, items_count);
+    free(builder.centroids);
+
+    bvh.nodes = builder.nodes.data_buffer;
+    bvh.nodes_count = (u32)array_length(&builder.nodes, sizeof(BVHNode));
+    bvh.item_indices = builder.item_indices;
+    bvh.items_count = items_count;
+    return bvh;
+}
+
+void
+free_bvh(BVH* bvh)
+{
+    if (bvh->nodes) free(bvh->nodes);
+    if (bvh->item_indices) free(bvh->item_indices);
+    bvh->nodes = NULL;
+    bvh->item_indices = NULL;
+    bvh->nodes_count = 0;
+    bvh->items_count = 0;
+}
+
+enum FrustumTestResult
+{
+    FRUSTUM_OUTSIDE,
+    FRUSTUM_INTERSECTING,
+    FRUSTUM_INSIDE,
+};
+
+static int
+classify_aabb_against_frustum(vec3 box[2], vec4 planes[6])
+{
+    // Same plane convention as glm_aabb_frustum (inside when dot(n, p) + d >= 0), but also reports when
+    // the box is entirely inside so whole subtrees can skip testing.
+    int result = FRUSTUM_INSIDE;
+    for (int i = 0; i < 6; ++i)
+    {
+        f32* p = planes[i];
+
+        // Distance of the box corner furthest along the plane normal
+        f32 max_dist = p[0] * box[p[0] > 0.0f][0] + p[1] * box[p[1] > 0.0f][1] + p[2] * box[p[2] > 0.0f][2] + p[3];
+        if (max_dist < 0.0f)
+        {
+            return FRUSTUM_OUTSIDE;
+        }
+
+        // Distance of the corner furthest against the plane normal
+        f32 min_dist = p[0] * box[p[0] <= 0.0f][0] + p[1] * box[p[1] <= 0.0f][1] + p[2] * box[p[2] <= 0.0f][2] + p[3];
+        if (min_dist < 0.0f)
+        {
+            result = FRUSTUM_INTERSECTING;
+        }
+    }
+
+    return result;
+}
+
+u32
+bvh_frustum_cull(BVH* bvh, vec3* item_bounds, vec4 planes[6], u32* out_visible_items, BVHCullStats* out_stats)
+{
+    BVHCullStats stats = { 0 };
+    u32 visible_count = 0;
+
+    if (bvh->nodes_count > 0)
+    {
+        // Median splits bound the depth by log2 of the item count, so this can't overflow
+        u32 stack[64];
+        b8 stack_inside[64];
+        int stack_top = 0;
+        stack[0] = 0;
+        stack_inside[0] = 0;
+        ++stack_top;
+
+        while (stack_top > 0)
+        {
+            --stack_top;
+            BVHNode* node = &bvh->nodes[stack[stack_top]];
+            b8 parent_inside = stack_inside[stack_top];
+            ++stats.nodes_visited;
+
+            int result = parent_inside ? FRUSTUM_INSIDE : classify_aabb_against_frustum(node->bounds, planes);
+            if (result == FRUSTUM_OUTSIDE)
+            {
+                continue;
+            }
+
+            if (node->count > 0)
+            {
+                for (u32 i = node->first; i < node->first + node->count; ++i)
+                {
+                    u32 item = bvh->item_indices[i];
+                    if (result == FRUSTUM_INTERSECTING)
+                    {
+                        ++stats.items_tested;
+                        if (!glm_aabb_frustum(&item_bounds[2 * item], planes))
+                        {
+                            continue;
+                        }
+                    }
+
+                    out_visible_items[visible_count++] = item;
+                }
+            }
+            else
+            {
+                u32 left_child = (u32)(node - bvh->nodes) + 1;
+                b8 inside = (result == FRUSTUM_INSIDE);
+
+                stack[stack_top] = node->first;
+                stack_inside[stack_top] = inside;
+                ++stack_top;
+                stack[stack_top] = left_child;
+                stack_inside[stack_top] = inside;
+                ++stack_top;
+            }
+        }
+    }
+
+    if (out_stats)
+    {
+        *out_stats = stats;
+    }
+
+    return visible_count;
+}
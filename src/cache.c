@@ -0,0 +1,275 @@
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+
+#ifdef _WIN32
+    #define WIN32_LEAN_AND_MEAN
+    #include <windows.h>
+    #include <direct.h>
+    #define make_directory(path) _mkdir(path)
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <unistd.h>
+    #define make_directory(path) mkdir(path, 0755)
+#endif
+
+#define CACHE_FILE_MAGIC 0x32434341u  // "ACC2"
+
+typedef struct CacheFileHeader
+{
+    u32 magic;
+    u32 version;
+    u64 key;
+    u64 size;
+    u64 _padding;  // Keeps the data 16 byte aligned in mapped files
+}
+CacheFileHeader;
+
+u64
+hash_fnv1a_64(const void* data, size_t size, u64 hash)
+{
+    const u8* bytes = data;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static void
+cache_file_path(char* out_path, size_t path_size, const char* kind, u64 key)
+{
+    snprintf(out_path, path_size, "%s/%s_%016llx.bin", CACHE_DIRECTORY, kind, (unsigned long long)key);
+}
+
+void*
+cache_read(const char* kind, u64 key, u32 version, size_t* out_size)
+{
+    char path[256];
+    cache_file_path(path, sizeof(path), kind, key);
+
+    FILE* file = fopen(path, "rb");
+    if (!file)
+    {
+        return NULL;
+    }
+
+    // The header repeats the key so a truncated or mismatched file is treated as a miss
+    CacheFileHeader header;
+    void* data = NULL;
+    if (fread(&header, sizeof(header), 1, file) == 1 &&
+        header.magic == CACHE_FILE_MAGIC && header.version == version && header.key == key)
+    {
+        data = malloc(header.size > 0 ? header.size : 1);
+        if (fread(data, 1, header.size, file) != header.size)
+        {
+            free(data);
+            data = NULL;
+        }
+        *out_size = header.size;
+    }
+
+    fclose(file);
+    return data;
+}
+
+static const u8 empty_file_view[1];  // Nothing can be mapped for an empty file, but callers still get a view
+
+b32
+map_file(const char* path, FileMapping* out_mapping)
+{
+    memset(out_mapping, 0, sizeof(*out_mapping));
+
+    size_t file_size = 0;
+    void* view = NULL;
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return 0;
+    }
+
+    LARGE_INTEGER large_file_size;
+    HANDLE mapping = NULL;
+    b32 is_sized = GetFileSizeEx(file, &large_file_size);
+    if (is_sized && large_file_size.QuadPart == 0)
+    {
+        CloseHandle(file);
+        out_mapping->view = (void*)empty_file_view;
+        return 1;
+    }
+    if (is_sized)
+    {
+        file_size = (size_t)large_file_size.QuadPart;
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping)
+        {
+            view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        }
+    }
+
+    if (view == NULL)
+    {
+        if (mapping) CloseHandle(mapping);
+        CloseHandle(file);
+        return 0;
+    }
+    out_mapping->file_handle = file;
+    out_mapping->mapping_handle = mapping;
+#else
+    int file = open(path, O_RDONLY);
+    if (file < 0)
+    {
+        return 0;
+    }
+
+    struct stat file_info;
+    b32 is_sized = fstat(file, &file_info) == 0;
+    if (is_sized && file_info.st_size == 0)
+    {
+        close(file);
+        out_mapping->view = (void*)empty_file_view;
+        return 1;
+    }
+    if (is_sized)
+    {
+        file_size = (size_t)file_info.st_size;
+        view = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, file, 0);
+        if (view == MAP_FAILED)
+        {
+            view = NULL;
+        }
+    }
+    close(file);  // The mapping stays valid without it
+
+    if (view == NULL)
+    {
+        return 0;
+    }
+#endif
+    out_mapping->view = view;
+    out_mapping->size = file_size;
+    return 1;
+}
+
+void
+unmap_file(FileMapping* mapping)
+{
+    if (mapping->view && mapping->view != empty_file_view)
+    {
+    #ifdef _WIN32
+        UnmapViewOfFile(mapping->view);
+        CloseHandle(mapping->mapping_handle);
+        CloseHandle(mapping->file_handle);
+    #else
+        munmap(mapping->view, mapping->size);
+    #endif
+    }
+    memset(mapping, 0, sizeof(*mapping));
+}
+
+b32
+cache_map(const char* kind, u64 key, u32 version, CacheMapping* out_mapping)
+{
+    memset(out_mapping, 0, sizeof(*out_mapping));
+
+    char path[256];
+    cache_file_path(path, sizeof(path), kind, key);
+
+    // Map the whole file, the header is checked the same way cache_read() does
+    FileMapping file;
+    if (!map_file(path, &file))
+    {
+        return 0;
+    }
+
+    CacheFileHeader* header = (CacheFileHeader*)file.view;
+    if (file.size < sizeof(CacheFileHeader) || header->magic != CACHE_FILE_MAGIC || header->version != version ||
+        header->key != key || header->size != file.size - sizeof(CacheFileHeader))
+    {
+        unmap_file(&file);
+        return 0;
+    }
+
+    out_mapping->data = (u8*)file.view + sizeof(CacheFileHeader);
+    out_mapping->size = header->size;
+    out_mapping->file = file;
+    return 1;
+}
+
+void
+cache_unmap(CacheMapping* mapping)
+{
+    unmap_file(&mapping->file);
+    memset(mapping, 0, sizeof(*mapping));
+}
+
+void
+cache_write(const char* kind, u64 key, u32 version, const void* data, size_t size)
+{
+    cache_write_parts(kind, key, version, &data, &size, 1);
+}
+
+void
+cache_write_parts(const char* kind, u64 key, u32 version, const void** parts, const size_t* part_sizes, u32 part_count)
+{
+    make_directory(CACHE_DIRECTORY);  // Fails harmlessly when it already exists
+
+    char path[256];
+    cache_file_path(path, sizeof(path), kind, key);
+
+    // Written next to it and renamed into place, so a crash or full disk never leaves a half written file to be mapped
+    char temp_path[sizeof(path) + 4];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+    FILE* file = fopen(temp_path, "wb");
+    if (!file)
+    {
+        printf("Failed to write cache file %s\n", path);
+        return;
+    }
+
+    u64 size = 0;
+    for (u32 i = 0; i < part_count; ++i)
+    {
+        size += part_sizes[i];
+    }
+
+    CacheFileHeader header = { CACHE_FILE_MAGIC, version, key, size, 0 };
+    b32 is_written = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (u32 i = 0; is_written && i < part_count; ++i)
+    {
+        is_written = fwrite(parts[i], 1, part_sizes[i], file) == part_sizes[i];
+    }
+    is_written = fclose(file) == 0 && is_written;
+
+#ifdef _WIN32
+    is_written = is_written && MoveFileExA(temp_path, path, MOVEFILE_REPLACE_EXISTING);
+#else
+    is_written = is_written && rename(temp_path, path) == 0;
+#endif
+    if (!is_written)
+    {
+        printf("Failed to write cache file %s\n", path);
+        remove(temp_path);
+    }
+}
+
+u64
+file_stamp(const char* path)
+{
+    struct stat file_info;
+    if (stat(path, &file_info) != 0)
+    {
+        return 0;
+    }
+
+    u64 stamp[2] = { (u64)file_info.st_size, (u64)file_info.st_mtime };
+    return hash_fnv1a_64(stamp, sizeof(stamp), FNV1A_64_OFFSET_BASIS);
+}
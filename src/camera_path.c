@@ -0,0 +1,126 @@
+#include "camera_path.h"
+
+#include "cache.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+b32
+load_camera_path(const char* path, DynamicArray* keyframes)
+{
+    FileMapping mapping;
+    if (!map_file(path, &mapping))
+    {
+        printf("Failed to open camera path %s\n", path);
+        return 0;
+    }
+
+    const u8* data = mapping.view;
+    CameraPathHeader header = { 0 };
+    b32 is_valid = mapping.size >= sizeof(header);
+    if (is_valid)
+    {
+        memcpy(&header, data, sizeof(header));
+        is_valid = header.magic == CAMERA_PATH_MAGIC && header.version == CAMERA_PATH_VERSION && header.keyframes_count > 0
+            && (size_t)header.keyframes_count * sizeof(CameraKeyframe) <= mapping.size - sizeof(header);
+    }
+
+    if (is_valid)
+    {
+        // Sampling searches by time, so it has to only ever go forwards
+        f32 previous_time = -INFINITY;
+        for (u32 i = 0; is_valid && i < header.keyframes_count; ++i)
+        {
+            CameraKeyframe keyframe;
+            memcpy(&keyframe, data + sizeof(header) + i * sizeof(keyframe), sizeof(keyframe));
+            is_valid = keyframe.time >= previous_time;
+            previous_time = keyframe.time;
+        }
+    }
+
+    if (is_valid)
+    {
+        CameraKeyframe* out_keyframes = push_size(keyframes, sizeof(CameraKeyframe), header.keyframes_count);
+        memcpy(out_keyframes, data + sizeof(header), header.keyframes_count * sizeof(CameraKeyframe));
+    }
+    else
+    {
+        printf("%s isn't a valid version %d camera path\n", path, CAMERA_PATH_VERSION);
+    }
+    unmap_file(&mapping);
+    return is_valid;
+}
+
+b32
+save_camera_path(const char* path, const CameraKeyframe* keyframes, u32 keyframes_count)
+{
+    FILE* file = fopen(path, "wb");
+    if (!file)
+    {
+        printf("Failed to write camera path %s\n", path);
+        return 0;
+    }
+
+    CameraPathHeader header = { CAMERA_PATH_MAGIC, CAMERA_PATH_VERSION, keyframes_count };
+    b32 is_written = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(keyframes, sizeof(CameraKeyframe), keyframes_count, file) == keyframes_count;
+    fclose(file);
+
+    if (!is_written)
+    {
+        printf("Failed to write camera path %s\n", path);
+    }
+    return is_written;
+}
+
+CameraKeyframe
+sample_camera_path(const CameraKeyframe* keyframes, u32 keyframes_count, f32 time)
+{
+    if (time <= keyframes[0].time)
+    {
+        return keyframes[0];
+    }
+    if (time >= keyframes[keyframes_count - 1].time)
+    {
+        return keyframes[keyframes_count - 1];
+    }
+
+    // Last keyframe at or before time
+    u32 low = 0;
+    u32 high = keyframes_count - 1;
+    while (high - low > 1)
+    {
+        u32 middle = low + (high - low) / 2;
+        if (keyframes[middle].time <= time)
+        {
+            low = middle;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    const CameraKeyframe* a = &keyframes[low];
+    const CameraKeyframe* b = &keyframes[high];
+    f32 t = (time - a->time) / (b->time - a->time);
+
+    CameraKeyframe pose;
+    pose.time = time;
+    for (int i = 0; i < 3; ++i)
+    {
+        pose.position[i] = a->position[i] + t * (b->position[i] - a->position[i]);
+    }
+    pose.pitch = a->pitch + t * (b->pitch - a->pitch);
+    pose.fov_y = a->fov_y + t * (b->fov_y - a->fov_y);
+
+    // Yaw wraps at 2PI, so turn whichever way is shorter
+    f32 yaw_delta = fmodf(b->yaw - a->yaw, 2.0f * PI);
+    if (yaw_delta > PI)       yaw_delta -= 2.0f * PI;
+    else if (yaw_delta < -PI) yaw_delta += 2.0f * PI;
+    pose.yaw = fmodf(a->yaw + t * yaw_delta + 2.0f * PI, 2.0f * PI);
+
+    return pose;
+}
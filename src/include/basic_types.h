@@ -42,6 +42,7 @@ void rgb_to_hsv(float r, float g, float b, float out_hsv[3]);
 
 char* malloc_strcat(const char* a, const char* b);
 char* load_text_file(const char* filename);
+void* load_binary_file(const char* filename, size_t* out_size);
 
 
 typedef struct DynamicArray
@@ -0,0 +1,45 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <cglm/cglm.h>
+#include "basic_types.h"
+
+// Leaves are split until they hold at most this many items
+#define BVH_MAX_LEAF_ITEMS 4
+
+typedef struct BVHNode
+{
+    vec3 bounds[2];  // AABB { min, max }, same layout as cglm's box functions
+
+    // Leaf:     items are item_indices[first .. first+count)
+    // Interior: count is 0, left child is the next node in the array and first is the right child's node index
+    u32 first;
+    u32 count;
+}
+BVHNode;
+
+typedef struct BVH
+{
+    BVHNode* nodes;
+    u32 nodes_count;
+    u32* item_indices;
+    u32 items_count;
+}
+BVH;
+
+typedef struct BVHCullStats
+{
+    u32 nodes_visited;
+    u32 items_tested;  // Items in leaves that straddled a frustum plane and had to be tested individually
+}
+BVHCullStats;
+
+// item_bounds holds 2 vec3s (min, max) per item
+BVH build_bvh(vec3* item_bounds, u32 items_count);
+void free_bvh(BVH* bvh);
+
+// Writes the indices of items whose bounds intersect the frustum into out_visible_items and returns how many there are.
+// out_visible_items must have room for items_count indices. Planes come from glm_frustum_planes.
+u32 bvh_frustum_cull(BVH* bvh, vec3* item_bounds, vec4 planes[6], u32* out_visible_items, BVHCullStats* out_stats);
+
+#endif  // BVH_H
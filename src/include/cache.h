@@ -0,0 +1,52 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include "basic_types.h"
+
+// Disk cache for data that is slow to build at load time (e.g. simplified meshes), stored as files in .cache/
+// named by a content hash of whatever the data was built from. Delete the directory to rebuild everything.
+#define CACHE_DIRECTORY ".cache"
+
+#define FNV1A_64_OFFSET_BASIS 0xcbf29ce484222325ull
+
+// 64-bit FNV-1a, pass FNV1A_64_OFFSET_BASIS to start a hash or a previous result to continue it
+u64 hash_fnv1a_64(const void* data, size_t size, u64 hash);
+
+// Returns a malloc'd copy of the cached data and its size, or NULL when it isn't cached (or was written by another version)
+void* cache_read(const char* kind, u64 key, u32 version, size_t* out_size);
+void cache_write(const char* kind, u64 key, u32 version, const void* data, size_t size);
+
+// cache_write() for data in several pieces, stored one after the other
+void cache_write_parts(const char* kind, u64 key, u32 version, const void** parts, const size_t* part_sizes, u32 part_count);
+
+typedef struct FileMapping
+{
+    void* view;  // Read only
+    size_t size;
+    void* file_handle;  // Windows only
+    void* mapping_handle;
+}
+FileMapping;
+
+// Maps a whole file into memory read only, returns 0 when it can't be opened. An empty file gives a size 0 mapping
+// whose view isn't NULL but mustn't be read
+b32 map_file(const char* path, FileMapping* out_mapping);
+void unmap_file(FileMapping* mapping);
+
+typedef struct CacheMapping
+{
+    const void* data;  // 16 byte aligned, read only
+    size_t size;
+    FileMapping file;
+}
+CacheMapping;
+
+// Maps the cached data into memory instead of copying it, returns 0 when it isn't cached (or was written by another version)
+b32 cache_map(const char* kind, u64 key, u32 version, CacheMapping* out_mapping);
+void cache_unmap(CacheMapping* mapping);
+
+// Changes whenever the file is modified (a hash of its size and modification time), 0 when it doesn't exist
+u64 file_stamp(const char* path);
+
+#endif  // CACHE_H
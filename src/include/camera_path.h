@@ -0,0 +1,44 @@
+#ifndef CAMERA_PATH_H
+#define CAMERA_PATH_H
+
+#include "basic_types.h"
+
+// Camera paths are recorded camera poses over time, played back at a fixed timestep so every frame of a run sees the
+// same view on any machine, build or frame rate.
+//
+// A .cpath file is a CameraPathHeader then keyframes_count CameraKeyframes in increasing time order. Everything is
+// little endian.
+
+#define CAMERA_PATH_MAGIC 0x48545043u  // "CPTH"
+#define CAMERA_PATH_VERSION 1
+
+typedef struct CameraPathHeader
+{
+    u32 magic;
+    u32 version;
+    u32 keyframes_count;
+}
+CameraPathHeader;
+
+typedef struct CameraKeyframe
+{
+    f32 time;  // Seconds since the first keyframe
+    f32 position[3];
+    f32 pitch;
+    f32 yaw;  // [0, 2PI)
+    f32 fov_y;
+}
+CameraKeyframe;
+
+// Appends the keyframes of a .cpath file to the array. Returns 0 and appends nothing when it can't be read or isn't
+// a valid path
+b32 load_camera_path(const char* path, DynamicArray* keyframes);
+
+// Returns 0 when the file can't be written
+b32 save_camera_path(const char* path, const CameraKeyframe* keyframes, u32 keyframes_count);
+
+// The pose at time, interpolated between the keyframes around it (yaw the short way round). Holds the first or last
+// pose outside the path
+CameraKeyframe sample_camera_path(const CameraKeyframe* keyframes, u32 keyframes_count, f32 time);
+
+#endif  // CAMERA_PATH_H
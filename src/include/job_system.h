@@ -0,0 +1,38 @@
+#ifndef JOB_SYSTEM_H
+#define JOB_SYSTEM_H
+
+#include "basic_types.h"
+
+// Pool of worker threads for load time work that doesn't touch OpenGL (e.g. decoding images). Jobs are run in the
+// order they were submitted and handed back to the submitting thread in the order they finish, so it can upload
+// each result as soon as it's ready. Only one thread should submit and wait for jobs.
+
+typedef void (*JobFunction)(void* data);
+
+// Starts worker_count workers, or one less than the number of cores (at least one) when worker_count is 0
+void init_job_system(u32 worker_count);
+
+// Waits for the workers to finish any submitted jobs and joins them
+void shutdown_job_system(void);
+
+u32 get_job_worker_count(void);
+
+void submit_job(JobFunction function, void* data);
+
+// Blocks until a submitted job has finished and returns its data. Every submitted job is returned exactly once,
+// it's an error to wait when none are left.
+void* wait_for_completed_job(void);
+
+// Long running work on a thread of its own rather than a worker, e.g. loading a scene while the main thread keeps
+// rendering. It may submit and wait for jobs itself as long as no other thread does at the same time.
+typedef struct BackgroundTask BackgroundTask;
+
+BackgroundTask* start_background_task(JobFunction function, void* data);
+
+// Returns 1 and frees the task once its function has returned, without blocking
+b32 finish_background_task_if_done(BackgroundTask* task);
+
+// Blocks until the task's function has returned and frees it
+void finish_background_task(BackgroundTask* task);
+
+#endif  // JOB_SYSTEM_H
@@ -0,0 +1,90 @@
+#ifndef LIGHT_RIG_H
+#define LIGHT_RIG_H
+
+#include "basic_types.h"
+#include "pointlight.h"
+#include "arealight.h"
+
+// Light rigs are sets of point and area lights loaded at runtime instead of compiled in, either from a .lrig file or
+// generated procedurally over a scene, so runs can swap or scale up their lights without recompiling.
+//
+// A .lrig file is a LightRigHeader, then point_lights_count LightRigPointLights, then area_lights_count
+// LightRigAreaLights each directly followed by its n world space points (3 floats each). Everything is little endian.
+
+#define LIGHT_RIG_MAGIC 0x4749524cu  // "LRIG"
+#define LIGHT_RIG_VERSION 1
+
+typedef struct LightRigHeader
+{
+    u32 magic;
+    u32 version;
+    u32 point_lights_count;
+    u32 area_lights_count;
+}
+LightRigHeader;
+
+typedef struct LightRigPointLight
+{
+    f32 position[3];
+    f32 color[3];
+    f32 intensity;
+}
+LightRigPointLight;
+
+typedef struct LightRigAreaLight
+{
+    f32 color[3];
+    f32 intensity;
+    u32 n;  // 3 to MAX_UNCLIPPED_NGON points follow
+    u32 is_double_sided;
+}
+LightRigAreaLight;
+
+// Whether size bytes of memory hold a whole rig of this version
+b32 is_light_rig_valid(const void* rig, size_t size);
+
+// Appends the lights of a rig in memory to the arrays. Returns 0 and appends nothing when it isn't a valid rig
+b32 read_light_rig(const void* rig, size_t size, DynamicArray* point_lights, DynamicArray* area_lights);
+
+// Returns the lights as a malloc'd rig of *out_size bytes
+void* write_light_rig(const PointLight* point_lights, u32 point_lights_count, const AreaLight* area_lights, u32 area_lights_count,
+    size_t* out_size);
+
+// read_light_rig() for a .lrig file, returns 0 when it can't be read either
+b32 load_light_rig(const char* path, DynamicArray* point_lights, DynamicArray* area_lights);
+
+// Returns 0 when the file can't be written
+b32 save_light_rig(const char* path, const PointLight* point_lights, u32 point_lights_count,
+    const AreaLight* area_lights, u32 area_lights_count);
+
+typedef enum LightRigPlacement
+{
+    LIGHT_RIG_PLACEMENT_VOLUME,  // Uniformly inside the bounds of all the boxes, area lights facing any way
+    LIGHT_RIG_PLACEMENT_SURFACES,  // Just off the faces of the boxes (weighted by area), area lights facing out
+}
+LightRigPlacement;
+
+typedef struct LightRigGenerator
+{
+    u32 point_lights_count;
+    u32 area_lights_count;
+    u32 seed;  // The same seed and boxes always give the same lights
+    LightRigPlacement placement;
+    f32 area_light_size;  // Width and height, 0 picks one from the spacing between lights
+}
+LightRigGenerator;
+
+// Parses a generator spec such as "points=100000,areas=1000,surfaces,seed=7", a comma separated list of points=N,
+// areas=N, seed=N and volume or surfaces. Returns 0 when spec isn't one (e.g. it's a .lrig path instead)
+b32 parse_light_rig_generator(const char* spec, LightRigGenerator* out_generator);
+
+// Steps a xorshift32 state (never 0) and returns a number in [0, 1) from its top 24 bits. The same state always
+// gives the same sequence, for lights that come out the same every run
+f32 next_random(u32* state);
+
+// Appends the generated lights to the arrays. boxes holds a min and a max corner for each of boxes_count boxes,
+// e.g. the world bounds of a scene's instances
+void generate_light_rig(const LightRigGenerator* generator, const vec3* boxes, u32 boxes_count,
+    DynamicArray* point_lights, DynamicArray* area_lights);
+
+#endif  // LIGHT_RIG_H
@@ -0,0 +1,77 @@
+#ifndef MESH_PROCESSING_H
+#define MESH_PROCESSING_H
+
+#include "basic_types.h"
+
+// Simplifies an indexed triangle list with quadric error metrics (Garland & Heckbert), collapsing edges onto existing
+// vertices so the vertex buffer can be shared with the original. Vertices that share a position but not attributes
+// (UV/normal seams) only collapse along the seam, and open borders never move.
+// positions are tightly packed xyz, out_indices needs room for index_count indices (it can't alias indices).
+// Stops at target_index_count, when a collapse would move the surface by more than max_error, or when nothing can collapse.
+// Returns the new index count, *out_error is the largest error (distance in mesh units) of a collapse that was done.
+u32 simplify_mesh(u32* out_indices, const u32* indices, u32 index_count, const f32* positions, u32 vertex_count,
+                  u32 target_index_count, f32 max_error, f32* out_error);
+
+#define MESHLET_MAX_VERTICES 64
+#define MESHLET_MAX_TRIANGLES 124
+
+typedef struct Meshlet
+{
+    u32 first_index;  // Into the reordered index buffer
+    u32 index_count;
+
+    // Culling bounds in mesh space. The cone holds every triangle normal, the meshlet faces away from a viewer
+    // at v when dot(center - v, cone_axis) >= cone_cutoff * length(center - v) + radius
+    f32 center[3];
+    f32 radius;
+    f32 cone_axis[3];
+    f32 cone_cutoff;  // Sine of the cone's half angle, 1 when the normals spread too far for the test to ever pass
+}
+Meshlet;
+
+// Upper bound on how many meshlets build_meshlets() makes from index_count indices
+u32 meshlet_count_bound(u32 index_count);
+
+// Splits an indexed triangle list into meshlets of at most MESHLET_MAX_VERTICES unique vertices and MESHLET_MAX_TRIANGLES
+// triangles. Triangles are grown out from a seed over shared vertices, falling back on the nearest unused triangle
+// along a Morton curve so disconnected pieces still end up spatially compact.
+// out_indices gets the same triangles reordered so each meshlet is a contiguous range (it can't alias indices),
+// out_meshlets needs room for meshlet_count_bound(index_count). Returns the number of meshlets.
+u32 build_meshlets(Meshlet* out_meshlets, u32* out_indices, const u32* indices, u32 index_count, const f32* positions, u32 vertex_count);
+
+// Size of the FIFO post-transform cache the triangle orders are measured against
+#define VERTEX_CACHE_FIFO_SIZE 16
+
+// Reorders triangles for the post-transform vertex cache with Forsyth's linear-speed algorithm, which favours triangles
+// whose vertices are in a simulated LRU cache and vertices with few triangles left. out_indices can't alias indices.
+void optimize_vertex_cache(u32* out_indices, const u32* indices, u32 index_count, u32 vertex_count);
+
+// Reorders the clusters of a vertex cache optimized triangle list so outward facing ones are drawn first, which cuts
+// overdraw from most views (Sander et al. 2007). Clusters are split wherever that keeps their cache miss ratio within
+// threshold times the original's (e.g. 1.05). out_indices can't alias indices.
+void optimize_overdraw(u32* out_indices, const u32* indices, u32 index_count, const f32* positions, u32 vertex_count, f32 threshold);
+
+// Renumbers vertices in the order the indices first use them, rewriting indices in place. out_remap[old] is the new
+// index of each vertex, unused vertices go after all the used ones.
+void optimize_vertex_fetch_remap(u32* out_remap, u32* indices, u32 index_count, u32 vertex_count);
+
+// Vertex shader invocations a triangle list costs with a VERTEX_CACHE_FIFO_SIZE FIFO cache
+u32 count_vertex_cache_misses(const u32* indices, u32 index_count, u32 vertex_count);
+
+// Merges an indexed triangle list into convex polygons of at most max_points corners (at least 3), e.g. to turn an
+// emissive mesh into area lights. Each polygon grows out from a seed triangle across edges it shares with coplanar
+// triangles wound the same way, keeps their winding and drops points on straight edges. Degenerate triangles are skipped.
+// out_points gets each polygon's corners in turn as tightly packed xyz and needs room for index_count points,
+// out_polygon_sizes needs room for index_count / 3 sizes. Returns the number of polygons.
+u32 merge_coplanar_triangles(u32* out_polygon_sizes, f32* out_points, const u32* indices, u32 index_count, const f32* positions,
+                             u32 vertex_count, u32 max_points);
+
+// Vertex attribute quantization
+u16 quantize_unorm16(f32 v);  // Clamps to [0, 1]
+s16 quantize_snorm16(f32 v);  // Clamps to [-1, 1]
+u16 quantize_half(f32 v);  // IEEE half float, rounded to nearest. Out of range values become infinity
+
+// Unit vector to octahedral coordinates as two snorm16 (Cigolle et al. 2014), decoded in pbr.vert
+void encode_octahedral_snorm16(const f32* n, s16* out);
+
+#endif  // MESH_PROCESSING_H
@@ -0,0 +1,10 @@
+#ifndef RADIX_SORT_H
+#define RADIX_SORT_H
+
+#include "basic_types.h"
+
+// Stable LSD radix sort of 64-bit keys (8 bits per pass) carrying a u32 value along with each key.
+// temp_keys and temp_values must have room for count elements. The sorted result ends up in keys and values.
+void radix_sort_u64(u64* keys, u32* values, u32 count, u64* temp_keys, u32* temp_values);
+
+#endif  // RADIX_SORT_H
@@ -0,0 +1,61 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include <stddef.h>
+#include "basic_types.h"
+
+// CPU side texture preparation: mip chains and block compression, with the results kept in the disk cache (cache.h)
+// keyed by a hash of the source image file so later runs skip decoding and encoding altogether.
+
+typedef enum TextureFormat
+{
+    TEXTURE_FORMAT_RGBA8,
+    TEXTURE_FORMAT_BC1,  // RGB, 0.5 bytes per texel. Promoted to BC3 when the image has any alpha
+    TEXTURE_FORMAT_BC3,  // RGBA, BC1 color and BC4 alpha
+    TEXTURE_FORMAT_BC5,  // RG, two BC4 blocks. For normal maps, z is reconstructed in the shader
+    TEXTURE_FORMAT_BC7,  // RGBA, mode 6 only
+}
+TextureFormat;
+
+typedef enum TextureMipFilter
+{
+    TEXTURE_MIP_FILTER_LINEAR,
+    TEXTURE_MIP_FILTER_SRGB,  // RGB is averaged in linear space, alpha as it is
+    TEXTURE_MIP_FILTER_NORMAL,  // Tangent space normals in RGB, renormalized after averaging
+}
+TextureMipFilter;
+
+#define TEXTURE_CACHE_VERSION 2  // Bump when the encoders or mip filtering change
+#define TEXTURE_MAX_LEVELS 16
+#define TEXTURE_MAX_SIZE 16384  // Largest width or height an image read back from a cache is trusted to have
+
+typedef struct TextureLevels
+{  // A whole mip chain in one allocation
+    u32 format;  // TextureFormat
+    u32 width;  // Of level 0
+    u32 height;
+    u32 level_count;
+    u32 level_offsets[TEXTURE_MAX_LEVELS];  // Into data
+    u32 level_sizes[TEXTURE_MAX_LEVELS];
+    u8* data;
+    void* allocation;  // What to free, data may point into a cache file's contents
+}
+TextureLevels;
+
+u32 texture_level_count(u32 width, u32 height);  // Of a full mip chain down to 1x1
+
+// Bytes of a level of a width by height image in format, 0 when format isn't a TextureFormat
+u32 texture_level_size(u32 format, u32 width, u32 height, u32 level);
+
+// Builds the full mip chain of an RGBA8 image and encodes each level in format (TEXTURE_FORMAT_BC1 may become BC3)
+TextureLevels build_texture_levels(const u8* rgba, u32 width, u32 height, TextureFormat format, TextureMipFilter filter);
+void free_texture_levels(TextureLevels* levels);
+
+// Cache key of the levels built from an encoded image file (PNG, JPG...) with the given settings
+u64 texture_cache_key(const void* file_data, size_t file_size, TextureFormat format, TextureMipFilter filter);
+
+// Returns 0 on a miss
+b32 read_cached_texture(u64 key, TextureLevels* out_levels);
+void write_cached_texture(u64 key, const TextureLevels* levels);
+
+#endif  // TEXTURE_CACHE_H
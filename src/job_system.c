@@ -0,0 +1,321 @@
+#include "job_system.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+    #define WIN32_LEAN_AND_MEAN
+    #include <windows.h>
+    typedef HANDLE Thread;
+    typedef CRITICAL_SECTION Mutex;
+    typedef CONDITION_VARIABLE Condition;
+    #define THREAD_FUNCTION(name) DWORD WINAPI name(LPVOID arg)
+    #define THREAD_RETURN return 0
+    #define mutex_init(mutex) InitializeCriticalSection(mutex)
+    #define mutex_destroy(mutex) DeleteCriticalSection(mutex)
+    #define mutex_lock(mutex) EnterCriticalSection(mutex)
+    #define mutex_unlock(mutex) LeaveCriticalSection(mutex)
+    #define condition_init(condition) InitializeConditionVariable(condition)
+    #define condition_destroy(condition) ((void)(condition))
+    #define condition_wait(condition, mutex) SleepConditionVariableCS(condition, mutex, INFINITE)
+    #define condition_signal(condition) WakeConditionVariable(condition)
+    #define condition_broadcast(condition) WakeAllConditionVariable(condition)
+#else
+    #include <pthread.h>
+    #include <unistd.h>
+    typedef pthread_t Thread;
+    typedef pthread_mutex_t Mutex;
+    typedef pthread_cond_t Condition;
+    #define THREAD_FUNCTION(name) void* name(void* arg)
+    #define THREAD_RETURN return NULL
+    #define mutex_init(mutex) pthread_mutex_init(mutex, NULL)
+    #define mutex_destroy(mutex) pthread_mutex_destroy(mutex)
+    #define mutex_lock(mutex) pthread_mutex_lock(mutex)
+    #define mutex_unlock(mutex) pthread_mutex_unlock(mutex)
+    #define condition_init(condition) pthread_cond_init(condition, NULL)
+    #define condition_destroy(condition) pthread_cond_destroy(condition)
+    #define condition_wait(condition, mutex) pthread_cond_wait(condition, mutex)
+    #define condition_signal(condition) pthread_cond_signal(condition)
+    #define condition_broadcast(condition) pthread_cond_broadcast(condition)
+#endif
+
+typedef struct Job
+{
+    JobFunction function;
+    void* data;
+}
+Job;
+
+typedef struct JobQueue
+{  // Ring buffer that doubles when full
+    Job* jobs;
+    u32 capacity;
+    u32 head;
+    u32 count;
+}
+JobQueue;
+
+typedef struct JobSystem
+{
+    Thread* workers;
+    u32 worker_count;
+
+    Mutex mutex;  // Guards everything below
+    Condition job_submitted;
+    Condition job_completed;
+    JobQueue pending;
+    JobQueue completed;
+    u32 jobs_outstanding;  // Submitted and not yet returned by wait_for_completed_job()
+    b32 is_shutting_down;
+}
+JobSystem;
+
+static JobSystem job_system = { 0 };
+
+static void
+push_job(JobQueue* queue, Job job)
+{
+    if (queue->count == queue->capacity)
+    {
+        u32 new_capacity = queue->capacity ? 2 * queue->capacity : 64;
+        Job* jobs = malloc(new_capacity * sizeof(Job));
+        for (u32 i = 0; i < queue->count; ++i)
+        {
+            jobs[i] = queue->jobs[(queue->head + i) % queue->capacity];
+        }
+
+        free(queue->jobs);
+        queue->jobs = jobs;
+        queue->capacity = new_capacity;
+        queue->head = 0;
+    }
+
+    queue->jobs[(queue->head + queue->count) % queue->capacity] = job;
+    ++queue->count;
+}
+
+static Job
+pop_job(JobQueue* queue)
+{
+    assert(queue->count > 0);
+    Job job = queue->jobs[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    --queue->count;
+    return job;
+}
+
+static
+THREAD_FUNCTION(job_worker)
+{
+    (void)arg;
+
+    mutex_lock(&job_system.mutex);
+    for (;;)
+    {
+        while (job_system.pending.count == 0 && !job_system.is_shutting_down)
+        {
+            condition_wait(&job_system.job_submitted, &job_system.mutex);
+        }
+
+        if (job_system.pending.count == 0)
+        {
+            break;  // Shutting down and nothing left to do
+        }
+
+        Job job = pop_job(&job_system.pending);
+        mutex_unlock(&job_system.mutex);
+
+        job.function(job.data);
+
+        mutex_lock(&job_system.mutex);
+        push_job(&job_system.completed, job);
+        condition_signal(&job_system.job_completed);
+    }
+    mutex_unlock(&job_system.mutex);
+
+    THREAD_RETURN;
+}
+
+static u32
+get_processor_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (u32)info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (u32)count : 1;
+#endif
+}
+
+void
+init_job_system(u32 worker_count)
+{
+    assert(job_system.worker_count == 0 && "Job system is already running");
+
+    if (worker_count == 0)
+    {
+        // The main thread is busy consuming the results so leave it a core
+        u32 processor_count = get_processor_count();
+        worker_count = processor_count > 1 ? processor_count - 1 : 1;
+    }
+
+    mutex_init(&job_system.mutex);
+    condition_init(&job_system.job_submitted);
+    condition_init(&job_system.job_completed);
+    job_system.is_shutting_down = 0;
+
+    job_system.workers = calloc(worker_count, sizeof(Thread));
+    for (u32 i = 0; i < worker_count; ++i)
+    {
+    #ifdef _WIN32
+        job_system.workers[i] = CreateThread(NULL, 0, job_worker, NULL, 0, NULL);
+        int failed = job_system.workers[i] == NULL;
+    #else
+        int failed = pthread_create(&job_system.workers[i], NULL, job_worker, NULL) != 0;
+    #endif
+        if (failed)
+        {
+            printf("Failed to create job worker thread %u\n", i);
+            exit(1);
+        }
+    }
+    job_system.worker_count = worker_count;
+}
+
+void
+shutdown_job_system(void)
+{
+    mutex_lock(&job_system.mutex);
+    job_system.is_shutting_down = 1;
+    condition_broadcast(&job_system.job_submitted);
+    mutex_unlock(&job_system.mutex);
+
+    for (u32 i = 0; i < job_system.worker_count; ++i)
+    {
+    #ifdef _WIN32
+        WaitForSingleObject(job_system.workers[i], INFINITE);
+        CloseHandle(job_system.workers[i]);
+    #else
+        pthread_join(job_system.workers[i], NULL);
+    #endif
+    }
+
+    condition_destroy(&job_system.job_submitted);
+    condition_destroy(&job_system.job_completed);
+    mutex_destroy(&job_system.mutex);
+
+    free(job_system.workers);
+    free(job_system.pending.jobs);
+    free(job_system.completed.jobs);
+    memset(&job_system, 0, sizeof(job_system));
+}
+
+u32
+get_job_worker_count(void)
+{
+    return job_system.worker_count;
+}
+
+void
+submit_job(JobFunction function, void* data)
+{
+    assert(job_system.worker_count > 0 && "Job system isn't running");
+
+    mutex_lock(&job_system.mutex);
+    push_job(&job_system.pending, (Job){ function, data });
+    ++job_system.jobs_outstanding;
+    condition_signal(&job_system.job_submitted);
+    mutex_unlock(&job_system.mutex);
+}
+
+void*
+wait_for_completed_job(void)
+{
+    mutex_lock(&job_system.mutex);
+    assert(job_system.jobs_outstanding > 0 && "Waiting for a job that was never submitted");
+    while (job_system.completed.count == 0)
+    {
+        condition_wait(&job_system.job_completed, &job_system.mutex);
+    }
+
+    Job job = pop_job(&job_system.completed);
+    --job_system.jobs_outstanding;
+    mutex_unlock(&job_system.mutex);
+
+    return job.data;
+}
+
+struct BackgroundTask
+{
+    Thread thread;
+    JobFunction function;
+    void* data;
+    Mutex mutex;  // Guards is_done
+    b32 is_done;
+};
+
+static
+THREAD_FUNCTION(background_task_thread)
+{
+    BackgroundTask* task = arg;
+    task->function(task->data);
+
+    mutex_lock(&task->mutex);
+    task->is_done = 1;
+    mutex_unlock(&task->mutex);
+
+    THREAD_RETURN;
+}
+
+BackgroundTask*
+start_background_task(JobFunction function, void* data)
+{
+    BackgroundTask* task = calloc(1, sizeof(BackgroundTask));
+    task->function = function;
+    task->data = data;
+    mutex_init(&task->mutex);
+
+#ifdef _WIN32
+    task->thread = CreateThread(NULL, 0, background_task_thread, task, 0, NULL);
+    int failed = task->thread == NULL;
+#else
+    int failed = pthread_create(&task->thread, NULL, background_task_thread, task) != 0;
+#endif
+    if (failed)
+    {
+        printf("Failed to create background task thread\n");
+        exit(1);
+    }
+    return task;
+}
+
+void
+finish_background_task(BackgroundTask* task)
+{
+#ifdef _WIN32
+    WaitForSingleObject(task->thread, INFINITE);
+    CloseHandle(task->thread);
+#else
+    pthread_join(task->thread, NULL);
+#endif
+    mutex_destroy(&task->mutex);
+    free(task);
+}
+
+b32
+finish_background_task_if_done(BackgroundTask* task)
+{
+    mutex_lock(&task->mutex);
+    b32 is_done = task->is_done;
+    mutex_unlock(&task->mutex);
+
+    if (is_done)
+    {
+        finish_background_task(task);  // Only has to wait for the thread to exit
+    }
+    return is_done;
+}
@@ -0,0 +1,435 @@
+#include "light_rig.h"
+
+#include "cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+b32
+is_light_rig_valid(const void* rig, size_t size)
+{
+    const u8* data = rig;
+    LightRigHeader header;
+    if (size < sizeof(header))
+    {
+        return 0;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != LIGHT_RIG_MAGIC || header.version != LIGHT_RIG_VERSION)
+    {
+        return 0;
+    }
+
+    size_t offset = sizeof(header);
+    size_t point_lights_size = (size_t)header.point_lights_count * sizeof(LightRigPointLight);
+    b32 is_valid = point_lights_size <= size - offset;
+    offset += point_lights_size;
+    for (u32 i = 0; is_valid && i < header.area_lights_count; ++i)
+    {
+        LightRigAreaLight area_light;
+        is_valid = sizeof(area_light) <= size - offset;
+        if (is_valid)
+        {
+            memcpy(&area_light, data + offset, sizeof(area_light));
+            offset += sizeof(area_light);
+            is_valid = area_light.n >= 3 && area_light.n <= MAX_UNCLIPPED_NGON
+                && area_light.n * 3 * sizeof(f32) <= size - offset;
+            offset += is_valid ? area_light.n * 3 * sizeof(f32) : 0;
+        }
+    }
+    return is_valid;
+}
+
+b32
+read_light_rig(const void* rig, size_t size, DynamicArray* point_lights, DynamicArray* area_lights)
+{
+    // Check the whole rig before appending anything
+    if (!is_light_rig_valid(rig, size))
+    {
+        return 0;
+    }
+
+    const u8* data = rig;
+    LightRigHeader header;
+    memcpy(&header, data, sizeof(header));
+    size_t area_lights_offset = sizeof(header) + (size_t)header.point_lights_count * sizeof(LightRigPointLight);
+
+    PointLight* out_point_lights = push_size(point_lights, sizeof(PointLight), header.point_lights_count);
+    for (u32 i = 0; i < header.point_lights_count; ++i)
+    {
+        LightRigPointLight point_light;
+        memcpy(&point_light, data + sizeof(header) + i * sizeof(point_light), sizeof(point_light));
+
+        PointLight* out = &out_point_lights[i];
+        memset(out, 0, sizeof(PointLight));
+        memcpy(out->position, point_light.position, sizeof(point_light.position));
+        memcpy(out->color, point_light.color, sizeof(point_light.color));
+        out->intensity = point_light.intensity;
+    }
+
+    AreaLight* out_area_lights = push_size(area_lights, sizeof(AreaLight), header.area_lights_count);
+    size_t offset = area_lights_offset;
+    for (u32 i = 0; i < header.area_lights_count; ++i)
+    {
+        LightRigAreaLight area_light;
+        memcpy(&area_light, data + offset, sizeof(area_light));
+        offset += sizeof(area_light);
+
+        AreaLight* out = &out_area_lights[i];
+        memset(out, 0, sizeof(AreaLight));
+        memcpy(out->color_rgb_intensity_a, area_light.color, sizeof(area_light.color));
+        out->color_rgb_intensity_a[3] = area_light.intensity;
+        out->n = (int)area_light.n;
+        out->is_double_sided = (int)area_light.is_double_sided;
+        for (u32 point = 0; point < MAX_UNCLIPPED_NGON; ++point)
+        {
+            if (point < area_light.n)
+            {
+                memcpy(out->points_worldspace[point], data + offset, 3 * sizeof(f32));
+                offset += 3 * sizeof(f32);
+            }
+            out->points_worldspace[point][3] = 1.0f;
+        }
+    }
+
+    return 1;
+}
+
+void*
+write_light_rig(const PointLight* point_lights, u32 point_lights_count, const AreaLight* area_lights, u32 area_lights_count,
+    size_t* out_size)
+{
+    size_t size = sizeof(LightRigHeader) + point_lights_count * sizeof(LightRigPointLight);
+    for (u32 i = 0; i < area_lights_count; ++i)
+    {
+        size += sizeof(LightRigAreaLight) + area_lights[i].n * 3 * sizeof(f32);
+    }
+
+    u8* rig = malloc(size);
+    LightRigHeader header = { LIGHT_RIG_MAGIC, LIGHT_RIG_VERSION, point_lights_count, area_lights_count };
+    memcpy(rig, &header, sizeof(header));
+    size_t offset = sizeof(header);
+
+    for (u32 i = 0; i < point_lights_count; ++i)
+    {
+        const PointLight* light = &point_lights[i];
+        LightRigPointLight point_light;
+        memcpy(point_light.position, light->position, sizeof(point_light.position));
+        memcpy(point_light.color, light->color, sizeof(point_light.color));
+        point_light.intensity = light->intensity;
+        memcpy(rig + offset, &point_light, sizeof(point_light));
+        offset += sizeof(point_light);
+    }
+
+    for (u32 i = 0; i < area_lights_count; ++i)
+    {
+        const AreaLight* light = &area_lights[i];
+        LightRigAreaLight area_light;
+        memcpy(area_light.color, light->color_rgb_intensity_a, sizeof(area_light.color));
+        area_light.intensity = light->color_rgb_intensity_a[3];
+        area_light.n = (u32)light->n;
+        area_light.is_double_sided = (u32)light->is_double_sided;
+        memcpy(rig + offset, &area_light, sizeof(area_light));
+        offset += sizeof(area_light);
+
+        for (int point = 0; point < light->n; ++point)
+        {
+            memcpy(rig + offset, light->points_worldspace[point], 3 * sizeof(f32));
+            offset += 3 * sizeof(f32);
+        }
+    }
+    assert(offset == size);
+
+    *out_size = size;
+    return rig;
+}
+
+b32
+load_light_rig(const char* path, DynamicArray* point_lights, DynamicArray* area_lights)
+{
+    FileMapping mapping;
+    if (!map_file(path, &mapping))
+    {
+        printf("Failed to open light rig %s\n", path);
+        return 0;
+    }
+
+    b32 is_valid = read_light_rig(mapping.view, mapping.size, point_lights, area_lights);
+    if (!is_valid)
+    {
+        printf("%s isn't a valid version %d light rig\n", path, LIGHT_RIG_VERSION);
+    }
+    unmap_file(&mapping);
+    return is_valid;
+}
+
+b32
+save_light_rig(const char* path, const PointLight* point_lights, u32 point_lights_count,
+    const AreaLight* area_lights, u32 area_lights_count)
+{
+    FILE* file = fopen(path, "wb");
+    if (!file)
+    {
+        printf("Failed to write light rig %s\n", path);
+        return 0;
+    }
+
+    size_t size;
+    void* rig = write_light_rig(point_lights, point_lights_count, area_lights, area_lights_count, &size);
+    b32 is_written = fwrite(rig, 1, size, file) == size;
+    fclose(file);
+    free(rig);
+
+    if (!is_written)
+    {
+        printf("Failed to write light rig %s\n", path);
+    }
+    return is_written;
+}
+
+b32
+parse_light_rig_generator(const char* spec, LightRigGenerator* out_generator)
+{
+    LightRigGenerator generator = { 0 };
+    generator.seed = 12345;
+    generator.placement = LIGHT_RIG_PLACEMENT_SURFACES;
+
+    b32 has_lights = 0;
+    const char* token = spec;
+    while (*token)
+    {
+        size_t length = strcspn(token, ",");
+        char value[64];
+        if (length >= sizeof(value))
+        {
+            return 0;
+        }
+        memcpy(value, token, length);
+        value[length] = '\0';
+
+        unsigned count;
+        char end;
+        if (sscanf(value, "points=%u%c", &count, &end) == 1)
+        {
+            generator.point_lights_count = count;
+            has_lights = 1;
+        }
+        else if (sscanf(value, "areas=%u%c", &count, &end) == 1)
+        {
+            generator.area_lights_count = count;
+            has_lights = 1;
+        }
+        else if (sscanf(value, "seed=%u%c", &count, &end) == 1)
+        {
+            generator.seed = count;
+        }
+        else if (strcmp(value, "volume") == 0)
+        {
+            generator.placement = LIGHT_RIG_PLACEMENT_VOLUME;
+        }
+        else if (strcmp(value, "surfaces") == 0)
+        {
+            generator.placement = LIGHT_RIG_PLACEMENT_SURFACES;
+        }
+        else
+        {
+            return 0;
+        }
+
+        token += length;
+        token += *token == ',';
+    }
+
+    if (!has_lights)
+    {
+        return 0;
+    }
+    *out_generator = generator;
+    return 1;
+}
+
+f32
+next_random(u32* state)
+{
+    u32 x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return (f32)(x >> 8) / 16777216.0f;
+}
+
+static f32
+random_range(u32* state, f32 min_value, f32 max_value)
+{
+    return min_value + (max_value - min_value) * next_random(state);
+}
+
+typedef struct LightRigSampler
+{
+    const vec3* boxes;
+    u32 boxes_count;
+    LightRigPlacement placement;
+    vec3 min_point;  // Of all the boxes
+    vec3 max_point;
+    f64* face_areas_prefix_sum;  // 6 faces per box, -x +x -y +y -z +z
+    f64 total_area;
+    f32 spacing;  // Roughly the distance between neighbouring lights
+}
+LightRigSampler;
+
+static void
+sample_light_rig_position(LightRigSampler* sampler, u32* state, vec3 out_position, vec3 out_normal)
+{
+    if (sampler->placement == LIGHT_RIG_PLACEMENT_VOLUME)
+    {
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            out_position[axis] = random_range(state, sampler->min_point[axis], sampler->max_point[axis]);
+        }
+
+        // Uniformly on the sphere
+        f32 z = random_range(state, -1.0f, 1.0f);
+        f32 angle = random_range(state, 0.0f, 2.0f * PI);
+        f32 r = sqrtf(1.0f - z * z);
+        out_normal[0] = r * cosf(angle);
+        out_normal[1] = r * sinf(angle);
+        out_normal[2] = z;
+        return;
+    }
+
+    // Pick a face weighted by its area
+    u32 faces_count = 6 * sampler->boxes_count;
+    f64 target = next_random(state) * sampler->total_area;
+    u32 low = 0;
+    u32 high = faces_count - 1;
+    while (low < high)
+    {
+        u32 middle = (low + high) / 2;
+        if (sampler->face_areas_prefix_sum[middle] <= target)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+
+    const vec3* box = &sampler->boxes[2 * (low / 6)];
+    int axis = (low % 6) / 2;
+    int side = low % 2;
+    for (int i = 0; i < 3; ++i)
+    {
+        out_position[i] = random_range(state, box[0][i], box[1][i]);
+        out_normal[i] = random_range(state, -0.3f, 0.3f);  // Tilted a little so not every light is axis aligned
+    }
+    out_normal[axis] = side ? 1.0f : -1.0f;
+    glm_vec3_normalize(out_normal);
+
+    // Just off the face so lights aren't buried in the geometry they light
+    f32 offset = 0.25f * sampler->spacing;
+    offset = offset < 1.0f ? offset : 1.0f;
+    out_position[axis] = box[side][axis] + (side ? offset : -offset);
+}
+
+void
+generate_light_rig(const LightRigGenerator* generator, const vec3* boxes, u32 boxes_count,
+    DynamicArray* point_lights, DynamicArray* area_lights)
+{
+    assert(boxes_count > 0);
+
+    LightRigSampler sampler = { 0 };
+    sampler.boxes = boxes;
+    sampler.boxes_count = boxes_count;
+    sampler.placement = generator->placement;
+    glm_vec3_copy((f32*)boxes[0], sampler.min_point);
+    glm_vec3_copy((f32*)boxes[1], sampler.max_point);
+    for (u32 i = 1; i < boxes_count; ++i)
+    {
+        glm_vec3_minv(sampler.min_point, (f32*)boxes[2 * i], sampler.min_point);
+        glm_vec3_maxv(sampler.max_point, (f32*)boxes[2 * i + 1], sampler.max_point);
+    }
+
+    u32 lights_count = generator->point_lights_count + generator->area_lights_count;
+    lights_count = lights_count > 0 ? lights_count : 1;
+    if (sampler.placement == LIGHT_RIG_PLACEMENT_SURFACES)
+    {
+        sampler.face_areas_prefix_sum = malloc(6 * boxes_count * sizeof(f64));
+        for (u32 i = 0; i < boxes_count; ++i)
+        {
+            vec3 size;
+            glm_vec3_sub((f32*)boxes[2 * i + 1], (f32*)boxes[2 * i], size);
+            for (int face = 0; face < 6; ++face)
+            {
+                int axis = face / 2;
+                sampler.total_area += (f64)size[(axis + 1) % 3] * size[(axis + 2) % 3];
+                sampler.face_areas_prefix_sum[6 * i + face] = sampler.total_area;
+            }
+        }
+
+        if (sampler.total_area > 0.0)
+        {
+            sampler.spacing = (f32)sqrt(sampler.total_area / lights_count);
+        }
+        else
+        {
+            printf("Light rig boxes have no surface area, scattering lights through their volume instead\n");
+            sampler.placement = LIGHT_RIG_PLACEMENT_VOLUME;
+        }
+    }
+    if (sampler.placement == LIGHT_RIG_PLACEMENT_VOLUME)
+    {
+        vec3 size;
+        glm_vec3_sub(sampler.max_point, sampler.min_point, size);
+        f64 volume = (f64)size[0] * size[1] * size[2];
+        sampler.spacing = volume > 0.0 ? (f32)cbrt(volume / lights_count) : 1.0f;
+    }
+
+    f32 area_light_size = generator->area_light_size;
+    if (area_light_size <= 0.0f)
+    {
+        // As big as make_area_light()'s random sizes at most, small enough not to overlap their neighbours much
+        area_light_size = 0.5f * sampler.spacing;
+        area_light_size = area_light_size < 3.0f ? area_light_size : 3.0f;
+        area_light_size = area_light_size > 0.01f ? area_light_size : 0.01f;
+    }
+
+    u32 state = generator->seed ? generator->seed : 1;
+    vec3 position, normal;
+
+    PointLight* out_point_lights = push_size(point_lights, sizeof(PointLight), generator->point_lights_count);
+    for (u32 i = 0; i < generator->point_lights_count; ++i)
+    {
+        sample_light_rig_position(&sampler, &state, position, normal);
+
+        PointLight* light = &out_point_lights[i];
+        memset(light, 0, sizeof(PointLight));
+        glm_vec3_copy(position, light->position);
+        hsv_to_rgb(next_random(&state), 1.0f, 1.0f, light->color);
+        light->intensity = random_range(&state, 3.0f, 8.0f);
+    }
+
+    AreaLight* out_area_lights = push_size(area_lights, sizeof(AreaLight), generator->area_lights_count);
+    for (u32 i = 0; i < generator->area_lights_count; ++i)
+    {
+        sample_light_rig_position(&sampler, &state, position, normal);
+
+        int n = 3 + (int)(next_random(&state) * 3.0f);  // Triangles, quads and pentagons
+        int is_double_sided = sampler.placement == LIGHT_RIG_PLACEMENT_VOLUME;
+        f32 hue = next_random(&state);
+        f32 intensity = random_range(&state, 3.0f, 25.0f);
+        f32 width = area_light_size * random_range(&state, 0.5f, 1.0f);
+        f32 height = area_light_size * random_range(&state, 0.5f, 1.0f);
+
+        AreaLight* light = &out_area_lights[i];
+        *light = make_area_light(position, normal, is_double_sided, n, hue, intensity, width, height);
+        for (int point = n; point < MAX_UNCLIPPED_NGON; ++point)
+        {
+            glm_vec4_copy((vec4){ 0.0f, 0.0f, 0.0f, 1.0f }, light->points_worldspace[point]);
+        }
+    }
+
+    free(sampler.face_areas_prefix_sum);
+}
@@ -36,11 +36,20 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <stddef.h>
 
 #include "basic_types.h"
 #include "pointlight.h"
 #include "arealight.h"
+#include "bvh.h"
+#include "radix_sort.h"
+#include "mesh_processing.h"
+#include "cache.h"
+#include "job_system.h"
+#include "texture_cache.h"
 #include "ltc_matrix.h"
+#include "light_rig.h"
+#include "camera_path.h"
 
 #include "point_light_data.h"
 
@@ -67,13 +76,34 @@ enum GlobalBindingPoints
     GLOBAL_SSBO_INDEX_POINTLIGHTS = 0,
     GLOBAL_SSBO_INDEX_CLUSTERGRID = 1,
     GLOBAL_SSBO_INDEX_AREALIGHTS  = 2,
+
+    // Occlusion culling
+    GLOBAL_SSBO_INDEX_INSTANCE_BOUNDS     = 3,
+    GLOBAL_SSBO_INDEX_INSTANCE_VISIBILITY = 4,
+    GLOBAL_SSBO_INDEX_OCCLUSION_DRAWS     = 5,
+    GLOBAL_SSBO_INDEX_OCCLUSION_COMMANDS  = 6,
+    GLOBAL_SSBO_INDEX_OCCLUSION_STATS     = 7,
+
+    // Per-draw matrices and material parameters, indexed with gl_BaseInstance
+    GLOBAL_SSBO_INDEX_DRAW_DATA = 8,
+    GLOBAL_SSBO_INDEX_INSTANCE_REMAP = 9,  // Draw data indices of the instances occlusion culling let through
+
+    // Meshlet culling
+    GLOBAL_SSBO_INDEX_MESHLETS           = 10,
+    GLOBAL_SSBO_INDEX_MESHLET_JOBS       = 11,
+    GLOBAL_SSBO_INDEX_MESHLET_DRAWS      = 12,
+    GLOBAL_SSBO_INDEX_MESHLET_COMMANDS   = 13,
+    GLOBAL_SSBO_INDEX_MESHLET_COUNTS     = 14,
+
+    // GPU light animation
+    GLOBAL_SSBO_INDEX_ANIMATED_POINT_LIGHTS       = 15,
+    GLOBAL_SSBO_INDEX_ANIMATED_AREA_LIGHTS        = 16,
+    GLOBAL_SSBO_INDEX_AREA_LIGHT_POLYGON_VERTICES = 17,
 };
 
 enum PBRShaderLocations
 {
-    PBR_LOC_mvp                        =0,
-    PBR_LOC_model_view                 =1,
-    PBR_LOC_normal_matrix              =2,
+    // 0-2 are unused, per-draw data is in the draw data SSBO
     PBR_LOC_sun_direction_viewspace    =3,
     PBR_LOC_sun_intensity              =4,
     PBR_LOC_sun_color                  =5,
@@ -83,13 +113,7 @@ enum PBRShaderLocations
 
     PBR_LOC_num_point_lights           =9,
 
-    PBR_LOC_base_color_factor          =10,
-    PBR_LOC_metallic_factor            =11,
-    PBR_LOC_roughness_factor           =12,
-    PBR_LOC_emissive_factor            =13,
-    PBR_LOC_alpha_mask_cutoff          =14,
-    PBR_LOC_is_normal_mapping_enabled  =15,
-    PBR_LOC_is_alpha_blending_enabled  =16,
+    // 10-16 are unused, material parameters are in the draw data SSBO
 
     // Clustered shading params
     PBR_LOC_near              =17,
@@ -98,6 +122,8 @@ enum PBRShaderLocations
     PBR_LOC_screen_dimensions =20,
 
     PBR_LOC_num_area_lights =21,
+
+    PBR_LOC_is_instance_remap_enabled =22,
 };
 
 enum PBR_Shader_Texture_Units
@@ -117,19 +143,15 @@ enum PBR_Shader_Texture_Units
 #define TEXUNIT_representative_normals_texture 8
 
 u32
-gl_component_type_from_cgltf(cgltf_component_type component_type)
+gl_index_type_size(u32 index_type)
 {
-    assert(component_type != cgltf_component_type_invalid && "glTF file contained invalid component type");
-    switch (component_type)
+    switch (index_type)
     {
-        case cgltf_component_type_r_8: return GL_BYTE; break;
-        case cgltf_component_type_r_8u: return GL_UNSIGNED_BYTE; break;
-        case cgltf_component_type_r_16: return GL_SHORT; break;
-        case cgltf_component_type_r_16u: return GL_UNSIGNED_SHORT; break;
-        case cgltf_component_type_r_32u: return GL_UNSIGNED_INT; break;
-        case cgltf_component_type_r_32f: return GL_FLOAT; break;
+        case GL_UNSIGNED_BYTE:  return 1;
+        case GL_UNSIGNED_SHORT: return 2;
+        case GL_UNSIGNED_INT:   return 4;
         default:
-            assert(0 && "cgltf parsing bug occurred, invalid component type.");
+            assert(0 && "glDrawElements documentation: Must be one of GL_UNSIGNED_BYTE, GL_UNSIGNED_SHORT, or GL_UNSIGNED_INT.");
             return 0;
     }
 }
@@ -155,6 +177,86 @@ gl_primitive_mode_from_cgltf(cgltf_primitive_type primitive_type)
 typedef struct VAO_Attributes { b8 has_position, has_texcoord_0, has_normal, has_tangent; } VAO_Attributes;
 typedef struct VAO_Range { u32 begin; u32 count; } VAO_Range;
 
+// Vertex attributes are repacked at load into one interleaved VBO per primitive, 20 bytes a vertex instead of up to 48.
+// Positions are unorm16 within the primitive's bounds, normals and tangents octahedral snorm16, and texcoords unorm16
+// (half floats when they tile outside [0, 1]). Set to 0 to interleave the attributes as floats instead (FloatVertex)
+#define QUANTIZE_VERTICES 1
+
+// Textures are block compressed on the CPU at first load and kept in .cache/ (see texture_cache.h): BC7 for base color and
+// emissive, BC5 for normal maps and BC1/BC3 for the rest. Set to 0 to upload them as RGBA8 (mips still come from the cache)
+#define TEXTURE_COMPRESSION 1
+
+// S3TC isn't core so glad doesn't define it, every desktop driver has it though
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+    #define GL_COMPRESSED_RGB_S3TC_DXT1_EXT        0x83F0
+    #define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT       0x83F3
+    #define GL_COMPRESSED_SRGB_S3TC_DXT1_EXT       0x8C4C
+    #define GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT 0x8C4F
+#endif
+
+typedef struct QuantizedVertex
+{  // Matches the QUANTIZE_VERTICES inputs in pbr.vert
+    u16 position[4];  // unorm16 xyz, w is the bitangent sign (0 for -1, 65535 for +1)
+    s16 normal[2];
+    s16 tangent[2];
+    u16 texcoord_0[2];
+}
+QuantizedVertex;
+
+typedef struct FloatVertex
+{  // Matches the float inputs in pbr.vert, attributes the primitive doesn't have are left zeroed
+    f32 position[3];
+    f32 normal[3];
+    f32 texcoord_0[2];
+    f32 tangent[4];
+}
+FloatVertex;
+
+#define SCENE_VERTEX_SIZE (QUANTIZE_VERTICES ? sizeof(QuantizedVertex) : sizeof(FloatVertex))
+
+// Simplified index buffers generated per primitive at load, picked per instance by how many pixels their error covers
+#define MAX_PRIMITIVE_LODS 4  // Including the original
+#define LOD_MIN_TRIANGLES 512  // Smaller primitives aren't worth simplifying
+#define LOD_MAX_ERROR_RATIO 0.05f  // Largest simplification error allowed, relative to the primitive's bounding box diagonal
+#define LOD_PIXEL_ERROR_THRESHOLD 1.0f  // Use the coarsest level whose error projects to at most this many pixels
+#define LOD_CACHE_VERSION 2  // Bump when the simplifier changes so cached levels get rebuilt
+
+// Indexed triangle lists are reordered at load for the post-transform vertex cache and then against overdraw
+#define OVERDRAW_CACHE_MISS_THRESHOLD 1.05f  // How much the overdraw pass may raise the vertex cache miss ratio
+#define TRIANGLE_ORDER_CACHE_VERSION 1
+
+typedef struct PrimitiveLODs
+{
+    // Index ranges into the scene's lod_index_buffer (u32 indices), level 0 is the original primitive (reordered for
+    // the vertex cache). Every indexed primitive has level 0, count is only 0 for primitives without indices
+    u32 count;
+    u32 first_index[MAX_PRIMITIVE_LODS];
+    u32 index_count[MAX_PRIMITIVE_LODS];
+    f32 error[MAX_PRIMITIVE_LODS];  // Distance the surface moved, in the primitive's local units
+}
+PrimitiveLODs;
+
+// Primitives with at least this many triangles are also split into meshlets, which a compute pass culls against the
+// frustum and by their normal cones. Meshlets are built over LOD 0, so it must be at least LOD_MIN_TRIANGLES
+#define MESHLET_MIN_TRIANGLES 1024
+typedef struct MeshletRange { u32 first; u32 count; } MeshletRange;
+
+typedef struct MeshletData
+{  // Matches Meshlet in meshlet_cull.comp (std430)
+    vec4 bounding_sphere;  // Mesh space center and radius
+    vec4 cone;  // Axis and cutoff, see Meshlet in mesh_processing.h
+    u32 first_index;  // Into the scene's lod_index_buffer
+    u32 index_count;
+    u32 _padding[2];
+}
+MeshletData;
+
+// Lights imported with a scene, from its emissive materials (merged into polygonal area lights) and KHR_lights_punctual.
+// Only the brightest are kept past the limits
+#define MAX_IMPORTED_AREA_LIGHTS 4096
+#define MAX_IMPORTED_POINT_LIGHTS 65536
+#define EMISSIVE_MIN_RELATIVE_FLUX 0.001f  // Emissive polygons dimmer than this fraction of the brightest one are culled
+
 // #define INTEGRATED_GPU
 #define ONE_CLUSTER_PER_WORKGROUP  // <-- Much better bruteforce performance  TODO: Remove previous version because it isn't supported any more and this define must be enabled
 #ifdef INTEGRATED_GPU
@@ -170,6 +272,37 @@ typedef struct VAO_Range { u32 begin; u32 count; } VAO_Range;
 #define NUM_CLUSTERS (CLUSTER_GRID_SIZE_X * CLUSTER_GRID_SIZE_Y * CLUSTER_GRID_SIZE_Z * CLUSTER_NORMALS_COUNT)
 #define CLUSTER_DEFAULT_MAX_LIGHTS 200
 
+typedef struct PBRMaterialUniforms
+{
+    vec4 base_color_factor;
+    f32 metallic_factor;
+    f32 roughness_factor;
+    vec3 emissive_factor;
+    f32 alpha_mask_cutoff;
+    s32 is_alpha_blending_enabled;
+}
+PBRMaterialUniforms;
+
+typedef struct PBRMaterial
+{
+    // Built once per glTF material at load, draw calls just point at these
+    PBRMaterialUniforms uniforms;
+    u32 texture_ids[PBR_NUM_USED_TEXTURE_UNITS];
+    u32 sampler_ids[PBR_NUM_USED_TEXTURE_UNITS];  // Filtering and wrapping of each texture, which is shared by content
+    b32 double_sided;
+    b32 is_blended;  // glTF alpha mode BLEND, unlike MASK its draws have to stay in order
+}
+PBRMaterial;
+
+typedef struct PrimitiveInstance
+{
+    // Node transforms are static so the world matrix and bounds are computed once at load
+    u32 mesh_index;
+    u32 prim_index;
+    mat4 model;
+}
+PrimitiveInstance;
+
 typedef struct  ClusterMetaData
 {  // Manually padded so size is same as the std430 glsl struct Cluster
     vec4 min_point;
@@ -185,24 +318,229 @@ typedef struct  ClusterMetaData
 }
 ClusterMetaData;
 
+// A scene's CPU side data, everything needed to create its GL objects with nothing left to parse or build. The first
+// load of a glTF file builds one and writes it to the disk cache as a single file, later loads map that file and
+// upload straight from it. See load_gltf_scene()
+#define SCENE_PACKAGE_VERSION 4  // Bump when the package layout or anything it's built from changes
+#define SCENE_NO_MATERIAL 0xffffffffu
+#define SCENE_NO_TEXTURE -1
+
+typedef struct PackagedPrimitive
+{  // One per vao
+    VAO_Attributes attributes;
+    u32 primitive_mode;  // e.g. GL_TRIANGLES
+    u32 material_index;  // SCENE_NO_MATERIAL when the glTF primitive has none
+    u32 first_vertex;  // Into the package's vertices, SCENE_VERTEX_SIZE bytes each
+    u32 vertex_count;
+    b32 is_texcoord_half;
+    vec4 position_dequantization;  // Offset (xyz) and uniform scale (w) back to mesh space
+    PrimitiveLODs lods;
+    MeshletRange meshlets;
+}
+PackagedPrimitive;
+
+typedef struct PackagedMaterial
+{
+    PBRMaterialUniforms uniforms;
+    s32 texture_indices[PBR_NUM_USED_TEXTURE_UNITS];  // Into the package's textures, SCENE_NO_TEXTURE for the fallback texture
+    b32 double_sided;
+    b32 is_blended;
+}
+PackagedMaterial;
+
+typedef struct PackagedTexture
+{
+    u32 image_index;
+    b32 has_sampler;  // Otherwise the filtering and wrapping below are left as the image's defaults
+    u32 min_filter;
+    u32 mag_filter;
+    u32 wrap_s;
+    u32 wrap_t;
+}
+PackagedTexture;
+
+typedef struct PackagedImage
+{
+    u32 format;  // TextureFormat
+    b32 is_srgb;
+    u32 width;  // Of level 0
+    u32 height;
+    u32 level_count;
+    u64 content_key;  // Of the encoded image and how it's loaded, equal for images that would make identical textures
+    u32 level_sizes[TEXTURE_MAX_LEVELS];
+    u64 level_offsets[TEXTURE_MAX_LEVELS];  // Into the package's image data
+}
+PackagedImage;
+
+typedef struct ScenePackageHeader
+{
+    // Counts of everything in the package, its sections follow in the order of ScenePackage's pointers
+    u64 dependencies_stamp;  // Of the files it was built from, see hash_scene_package_dependencies()
+    u32 meshes_count;
+    u32 primitives_count;
+    u32 lod_indices_count;
+    u32 meshlets_count;
+    u32 materials_count;
+    u32 textures_count;
+    u32 images_count;
+    u32 instances_count;
+    u64 vertices_size;
+    u64 image_data_size;
+    u64 lights_size;
+    u64 dependencies_size;
+    u32 total_opaque_primitives;
+    u32 total_transparent_primitives;
+}
+ScenePackageHeader;
+
+typedef struct ScenePackage
+{
+    ScenePackageHeader header;
+    VAO_Range* vao_ranges;  // One per mesh
+    PackagedPrimitive* primitives;
+    u8* vertices;  // Interleaved QuantizedVertex (or FloatVertex) buffer of every primitive
+    u32* lod_indices;  // Every level of every indexed primitive
+    MeshletData* meshlets;
+    PackagedMaterial* materials;
+    PackagedTexture* textures;
+    PackagedImage* images;
+    u8* image_data;  // Every mip level of every image, ready to upload
+    PrimitiveInstance* instances;
+    vec3* instance_world_bounds;  // 2 per instance (min, max)
+    u8* lights;  // The scene's own lights as a light rig, see extract_gltf_lights()
+    char* dependencies;  // Paths of the glTF file and every file it refers to, each null terminated
+
+    CacheMapping mapping;  // When the sections point into a mapped package file, otherwise each is malloc'd
+}
+ScenePackage;
+
+typedef struct ResidentTexture
+{
+    u64 content_key;  // See PackagedImage
+    u32 texture;
+    u32 ref_count;  // Scenes using it, deleted by delete_unused_resident_textures() once there are none
+    b32 is_uploaded;  // All its levels, until then every scene that gets it streams it in too
+    u64 size;  // Of all its levels
+}
+ResidentTexture;
+
+// Every scene's textures, so identical images in different scenes (or reloads of the same scene) share one texture
+static DynamicArray resident_textures = { 0 };
+
+#define STAGING_MAX_REGION_SIZE (4 * 1024 * 1024)
+#define STAGING_REGIONS_COUNT 4  // Filled round robin, a region is only reused once the GPU has copied out of it
+
+typedef struct StagingBuffer
+{  // Streams data into GPU buffers a chunk at a time without needing a full size copy anywhere in between
+    u32 buffer;
+    u8* mapped_pointer;
+    u32 region_size;
+    GLsync region_fences[STAGING_REGIONS_COUNT];
+    u32 region;
+    u64 uploaded_bytes;
+}
+StagingBuffer;
+
+#define GEOMETRY_STREAM_BUDGET (8 * 1024 * 1024)  // Bytes of vertices, indices and meshlets uploaded per frame
+#define GEOMETRY_STREAM_BUFFERS_COUNT 3
+
+typedef struct GeometryStream
+{  // Fills a scene's geometry buffers over several frames before it's drawn, see stream_scene_geometry()
+    b32 is_active;
+    ScenePackage package;  // Copied straight out of, handed on to the texture stream once everything is uploaded
+    b8* is_image_uploaded;  // Handed on with it, see TextureStream
+    s32* material_images;
+
+    u32 buffers[GEOMETRY_STREAM_BUFFERS_COUNT];  // Vertices, LOD indices and meshlets, in the package's order
+    u32 next_buffer;
+    u64 next_offset;
+    StagingBuffer staging;
+
+    // Stats, reported when it's done
+    f64 start_time;
+    u32 frames_count;
+}
+GeometryStream;
+
+#define TEXTURE_STREAM_BUDGET (4 * 1024 * 1024)  // Bytes of texture levels uploaded per frame
+#define TEXTURE_STREAM_FRAMES 3  // Regions in the pixel unpack ring, a region is reused once its frame's uploads are done
+
+typedef struct TextureStream
+{  // Uploads a scene's textures over several frames after it's loaded, see stream_scene_textures()
+    b32 is_active;
+    ScenePackage package;  // Levels are copied straight out of it, freed once everything is uploaded
+    b8* is_image_uploaded;  // Per image, already resident ones are skipped
+    s32* material_images;  // PBR_NUM_USED_TEXTURE_UNITS per material, the image shown once it's in (or SCENE_NO_TEXTURE)
+    u32 materials_count;
+
+    // Next rows to upload, in rows of 4x4 blocks for compressed formats
+    u32 next_image;
+    u32 next_level;
+    u32 next_row;
+
+    u32 pixel_unpack_buffer;
+    u8* mapped_pointer;
+    u32 region_size;  // TEXTURE_STREAM_BUDGET, or less when all the textures fit in one region
+    u32 regions_count;  // Up to TEXTURE_STREAM_FRAMES, no more than it takes to upload everything
+    u32 frame;
+    GLsync frame_fences[TEXTURE_STREAM_FRAMES];
+
+    // Stats, reported when it's done
+    f64 start_time;
+    u32 frames_count;
+    u32 uploaded_images_count;
+    u64 uploaded_bytes;
+    f64 max_upload_time;
+    f64 total_frame_time;
+    f64 max_frame_time;
+}
+TextureStream;
+
 typedef struct Scene
 {
     // NOTE:
     // - white_texture used for materials with no texture
     // - vao_range usage: first primitive for meshes[mesh_index] at vao_range[mesh_index].begin
 
-    cgltf_data* data;
-    u32* buffer_objects;
-    u32* texture_objects;
+    u32* texture_objects;  // One per image
+    u32 texture_objects_count;
+    u32* samplers;  // One per glTF texture, then the default for textures without one and the placeholders
+    u32 samplers_count;
+    GeometryStream geometry_stream;  // The scene can't be drawn until it's done, the texture stream starts after it
+    TextureStream texture_stream;  // Materials use white_texture or flat_normal_texture until their textures are in
     u32 white_texture;
     u32 flat_normal_texture;
+    PBRMaterial* materials;  // One per glTF material
     u32* vaos;
     u32 vaos_count;
     VAO_Attributes* vaos_attributes;  // Disable normal mapping when a vao has no tangents
     VAO_Range* vao_ranges;
+    u32* vaos_primitive_modes;  // One per vao, e.g. GL_TRIANGLES
+    u32* vaos_material_indices;  // One per vao, into materials (SCENE_NO_MATERIAL when it has none)
+    u32* vaos_vertex_counts;  // One per vao, what's drawn for primitives without indices
+    PrimitiveLODs* vaos_lods;  // One per vao
+    u32 lod_index_buffer;  // Element buffer of every vao that has LODs
+    u32 vertex_buffer;  // Every vao's interleaved vertices, see SCENE_VERTEX_SIZE
+    vec4* vaos_position_dequantization;  // One per vao, offset (xyz) and uniform scale (w) back to mesh space
+    MeshletRange* vaos_meshlets;  // One per vao, count is 0 for vaos that weren't split
+    u32 meshlets_count;
+    u32 meshlet_ssbo;  // Every vao's MeshletData
     u32 total_opaque_primitives;
     u32 total_transparent_primitives;
 
+    // Flattened node hierarchy, one instance per (node, primitive) pair, with a BVH over their world AABBs for frustum culling
+    PrimitiveInstance* instances;
+    u32 instances_count;
+    vec3* instance_world_bounds;  // 2 per instance (min, max), what the BVH is built over
+    BVH instance_bvh;
+    u32* visible_instances;  // Scratch buffer for culling results, has room for every instance
+    u32 instance_bounds_ssbo;  // instance_world_bounds as vec4s for the occlusion culling shader
+    u32 instance_visibility_ssbo;  // Occlusion culling result from last frame, 1 per instance
+
+    // From the glTF file's emissive materials and KHR_lights_punctual, added to the test scene's lights
+    DynamicArray imported_point_lights;
+    DynamicArray imported_area_lights;
+
     // Single Directional Light:
     vec3 sun_direction;
     f32 sun_intensity;
@@ -222,542 +560,2740 @@ typedef struct Scene
     float param_roughness;
     float param_min_intensity;
     float param_intensity_saturation;
+
+    f64 load_start_time;
+    b32 is_first_frame_drawn;
 }
 Scene;
 
-typedef struct PBRMaterialUniforms
+typedef struct PBRDrawCall
+{
+    u32 instance_index;  // Into scene->instances
+    u32 vao;
+    u32 primitive_mode;  // e.g. GL_TRIANGLES
+    u32 index_type;  // e.g. GL_UNSIGNED_SHORT, 0 when not indexed
+    u32 first_index;  // First index (or vertex) in the vao's element buffer
+    u32 index_count;  // Or vertex count when not indexed
+    u32 lod;
+    u64 sort_key;  // See build_opaque_sort_key()
+    MeshletRange meshlets;  // Only set at LOD 0
+    s32 meshlet_draw;  // Into this frame's meshlet draw slots, -1 when the primitive is drawn whole
+    u32 meshlet_first_command;  // Start of its range in each phase's half of the meshlet command buffer
+
+    // Uniform data
+    mat4 mvp;
+    mat4 model_view;
+    mat4 normal_matrix;
+    PBRMaterial* material;
+    s32 is_normal_mapping_enabled;  // Per primitive since it depends on the VAO having tangents
+}
+PBRDrawCall;
+
+typedef struct PBRDrawData
 {
+    // Matches DrawData in pbr.vert/pbr.frag (std430)
+    mat4 mvp;
+    mat4 model_view;
+    mat4 normal_matrix;
     vec4 base_color_factor;
-    f32 metallic_factor;
-    f32 roughness_factor;
     vec3 emissive_factor;
     f32 alpha_mask_cutoff;
+    f32 metallic_factor;
+    f32 roughness_factor;
     s32 is_normal_mapping_enabled;
     s32 is_alpha_blending_enabled;
 }
-PBRMaterialUniforms;
+PBRDrawData;
 
-typedef struct Loaded_Image
+typedef struct DrawBatch
 {
-    u8* pixels;
-    int width;
-    int height;
+    // Consecutive draws of the same primitive, drawn as one instanced draw
+    u32 first_draw;  // Into the frame's [opaques..., transparents...] draw list
+    u32 instance_count;
+}
+DrawBatch;
+
+typedef struct DrawIndirectCommand
+{  // glDrawElementsIndirect layout, glDrawArraysIndirect reads the first 4 u32s as (count, instance_count, first, base_instance)
+    u32 count;
+    u32 instance_count;
+    u32 first_index;
+    s32 base_vertex;
+    u32 base_instance;
+}
+DrawIndirectCommand;
+
+typedef struct OcclusionDrawSlot
+{  // Same as the std430 struct in occlusion_cull.comp
+    u32 instance_index;
+    u32 flags;
+    u32 batch_index;  // Indirect command the instance is appended to when drawn
+    u32 batch_first_draw;  // Start of the batch's range in each phase's half of the remap buffer
+    u32 draw_data_index;
 }
-Loaded_Image;
+OcclusionDrawSlot;
+#define DRAW_SLOT_LATE_ONLY 1
+
+typedef struct MeshletDrawSlot
+{  // Same as the std430 struct in meshlet_cull.comp
+    u32 draw_data_index;
+    u32 first_meshlet;
+    u32 first_command;
+    u32 flags;
+    u32 batch_index;  // Occlusion culling command that decides whether the draw happens in a phase
+}
+MeshletDrawSlot;
+#define MESHLET_DRAW_DOUBLE_SIDED 1  // No cone culling
+#define MESHLET_DRAW_KEEP_ORDER 2  // Blended, culled meshlets become empty commands instead of being compacted out
+#define MESHLET_DRAW_OCCLUSION_CULLED 4
+#define MESHLET_COUNT_HEADER_SIZE 2  // Meshlets and triangles drawn in total, before the per draw command counts
+
+typedef struct MeshletCullJob
+{  // Same as the std430 struct in meshlet_cull.comp
+    u32 meshlet_index;
+    u32 meshlet_draw;
+}
+MeshletCullJob;
 
-typedef struct PBRDrawCall
+char*
+resolve_gltf_uri_path(const char* filename, const char* uri)
 {
-    cgltf_primitive* prim;
-    u32 vao;
-    b32 double_sided;
-    u32 primitive_mode;  // e.g. GL_TRIANGLES
+    // The uri is relative to the glTF file so we must adjust it to get the actual path, returned malloc'd
+    // Get directory path to where image uri starts
+    char* dir_path;
+    const char* last_slash = strrchr(filename, '/');
+    if (last_slash == NULL)
+    {
+        dir_path = strdup("./");
+    }
+    else
+    {
+        // Get length of directory including last '/'
+        size_t dir_len = last_slash - filename + 1;
+        dir_path = calloc(1, dir_len + 1);
+        strncpy(dir_path, filename, dir_len);  // <- strncpy isn't null terminated but calloc means it ends in 0 automatically
+    }
 
-    // Uniform data
-    mat4 mvp;
-    mat4 model_view;
-    mat4 normal_matrix;
-    PBRMaterialUniforms uniforms;
+    char* path;
+    path = calloc(1, strlen(dir_path) + strlen(uri) + 1);
+    strcpy(path, dir_path);
+    strcat(path, uri);
+    free(dir_path);
 
-    // Textures
-    u32 texture_ids[PBR_NUM_USED_TEXTURE_UNITS];
+    return path;
+}
+
+cgltf_result
+map_gltf_file(const cgltf_memory_options* memory_options, const cgltf_file_options* file_options, const char* path, cgltf_size* size, void** data)
+{
+    /* cgltf file read callback that maps the .gltf/.glb and .bin files instead of reading them onto the heap, so the
+     * vertex data is paged in from the OS file cache as it's read and never copied. The mappings are kept in
+     * file_options->user_data (a DynamicArray of FileMapping) since the release callback only gets the pointer */
+    (void)memory_options;
+    FileMapping mapping;
+    if (!map_file(path, &mapping))
+    {
+        return cgltf_result_file_not_found;
+    }
+
+    // A buffer's byteLength may be shorter than its file but not longer
+    if (size && *size > mapping.size)
+    {
+        unmap_file(&mapping);
+        return cgltf_result_io_error;
+    }
+
+    if (size && *size == 0)
+    {
+        *size = mapping.size;
+    }
+    if (data)
+    {
+        *data = mapping.view;
+    }
+    push_element_copy(file_options->user_data, sizeof(FileMapping), &mapping);
+    return cgltf_result_success;
+}
+
+void
+unmap_gltf_file(const cgltf_memory_options* memory_options, const cgltf_file_options* file_options, void* data)
+{
+    (void)memory_options;
+    DynamicArray* mappings = file_options->user_data;
+    u32 mappings_count = array_length(mappings, sizeof(FileMapping));
+    for (u32 i = 0; i < mappings_count; ++i)
+    {
+        FileMapping* mapping = get_element(mappings, sizeof(FileMapping), i);
+        if (mapping->view == data)
+        {
+            unmap_file(mapping);
+            *mapping = *(FileMapping*)get_element(mappings, sizeof(FileMapping), mappings_count - 1);
+            mappings->used_size -= sizeof(FileMapping);
+            return;
+        }
+    }
+    assert(0 && "Releasing a glTF file that was never mapped");
 }
-PBRDrawCall;
 
-Loaded_Image
-load_image(const char* filename, cgltf_image* image)
+const u8*
+get_encoded_image(const char* filename, cgltf_image* image, size_t* out_size, void** out_allocation)
 {
-    Loaded_Image loaded = { 0 };
+    /* Finds the encoded image (PNG, JPG...) a glTF image refers to. Images in buffer views (as in .glb files) point
+     * straight into their loaded or mapped buffer, only separate image files and base64 data URIs need an allocation,
+     * which is returned in out_allocation to be freed once the image is decoded (NULL when there's nothing to free) */
+    *out_allocation = NULL;
 
     // We don't need the image->mime_type field since stb_image.h automatically determines the file type
     if (image->buffer_view)  // Image file stored in glTF buffer
     {
-        printf("Problem with %s, Currently not supporting image buffer views in glTF files soz.\n", filename);
-        exit(1);
+        const u8* view_data = cgltf_buffer_view_data(image->buffer_view);
+        if (view_data == NULL)
+        {
+            printf("Problem with %s, the buffer of image %s isn't loaded\n", filename, image->name ? image->name : "(unnamed)");
+            exit(1);
+        }
+
+        *out_size = image->buffer_view->size;
+        return view_data;
     }
-    else if (image->uri)
+    else if (image->uri && strncmp(image->uri, "data:", 5) == 0)  // Image embedded in the glTF file
     {
-        // Not supporting embedded images in glTF files
-        if (strncmp(image->uri, "data:", 5) == 0)
+        const char* comma = strchr(image->uri, ',');
+        if (comma == NULL || comma - image->uri < 7 || strncmp(comma - 7, ";base64", 7) != 0)
         {
-            printf("Problem with %s, Currently not supporting embedded images in glTF files soz.\n", filename);
-            // In future could add something similar to https://github.com/google/filament/blob/main/libs/gltfio/src/ResourceLoader.cpp#L133
+            printf("Problem with %s, embedded images must be base64 encoded\n", filename);
             exit(1);
         }
 
-        // The uri is relative to the glTF file so we must adjust it to get the actual path
-        // Get directory path to where image uri starts
-        char* dir_path;
-        const char* last_slash = strrchr(filename, '/');
-        if (last_slash == NULL)
+        // Every 4 characters encode 3 bytes, minus the padding at the end
+        const char* base64 = comma + 1;
+        size_t base64_length = strlen(base64);
+        size_t padding_length = 0;
+        while (padding_length < base64_length && padding_length < 2 && base64[base64_length - 1 - padding_length] == '=')
         {
-            dir_path = strdup("./");
+            ++padding_length;
         }
-        else
+        *out_size = base64_length * 3 / 4 - padding_length;
+
+        cgltf_options options = { 0 };
+        if (cgltf_load_buffer_base64(&options, *out_size, base64, out_allocation) != cgltf_result_success)
         {
-            // Get length of directory including last '/'
-            size_t dir_len = last_slash - filename + 1;
-            dir_path = calloc(1, dir_len + 1);
-            strncpy(dir_path, filename, dir_len);  // <- strncpy isn't null terminated but calloc means it ends in 0 automatically
+            printf("Problem with %s, failed to decode an embedded image\n", filename);
+            exit(1);
         }
-
-        char* image_path;
-        image_path = calloc(1, strlen(dir_path) + strlen(image->uri) + 1);
-        strcpy(image_path, dir_path);
-        strcat(image_path, image->uri);
-        free(dir_path);
+        return *out_allocation;
+    }
+    else if (image->uri)
+    {
+        char* image_path = resolve_gltf_uri_path(filename, image->uri);
 
         // printf("Loading image buffer from file: %s\n", image_path);
-        int comp;
-        loaded.pixels = stbi_load(image_path, &loaded.width, &loaded.height, &comp, 4);
-        if (loaded.pixels == NULL)
+        *out_allocation = load_binary_file(image_path, out_size);
+        if (*out_allocation == NULL)
         {
             printf("Error loading image %s, exiting\n", image_path);
             exit(1);
         }
 
         free(image_path);
+        return *out_allocation;
     }
     else
     {
         assert(0 && "Invalid glTF format encountered when loading image");  // Invalid glTF format.
+        exit(1);
     }
+}
 
-    return loaded;
+typedef struct ImageLoadJob
+{
+    const char* filename;  // Of the glTF file
+    cgltf_image* image;
+    u32 image_index;  // Into the package's images, images with the same content share one
+    int is_srgb;
+    TextureFormat format;  // Requested, BC1 comes back as BC3 for images with alpha
+    TextureMipFilter mip_filter;
+    size_t file_size;  // Of the encoded image, see get_encoded_image()
+    u64 cache_key;  // See texture_cache_key()
+    TextureLevels levels;
+    b32 was_cached;
+    f64 decode_time;  // Seconds spent in the worker, including block compression
 }
+ImageLoadJob;
 
 void
-free_loaded_image(Loaded_Image* image)
+hash_image_job(void* data)
 {
-    if (image->pixels)
-    {
-        free(image->pixels);
-        image->pixels = NULL;
-    }
+    /* Finds the encoded image and hashes it, so images with identical content are only decoded once. Only the hash is
+     * kept, holding every encoded image until it's decoded would need them all in memory at once */
+    ImageLoadJob* job = data;
+    f64 start_time = glfwGetTime();
+    void* file_allocation;
+    const u8* file_data = get_encoded_image(job->filename, job->image, &job->file_size, &file_allocation);
+    job->cache_key = texture_cache_key(file_data, job->file_size, job->format, job->mip_filter);
+    free(file_allocation);
+    job->decode_time = glfwGetTime() - start_time;
 }
 
-Scene
-load_gltf_scene(const char* filename)
+void
+load_image_job(void* data)
 {
-    // Load GLTF file with cgltf
-    cgltf_data* data = NULL;
+    /* Decodes a hashed image into the mip chain to upload, or reads it from the texture cache when it was built before.
+     * The encoded image is found again rather than kept from hashing, so only the images being decoded are in memory */
+    ImageLoadJob* job = data;
+    f64 start_time = glfwGetTime();
+
+    u64 cache_key = job->cache_key;
+    job->was_cached = read_cached_texture(cache_key, &job->levels);
+    if (!job->was_cached)
     {
-        cgltf_options options = { 0 };
-        cgltf_result result = cgltf_parse_file(&options, filename, &data);
-
-        if (result == cgltf_result_success)
-        {
-            result = cgltf_load_buffers(&options, data, filename);
-        }
+        size_t file_size;
+        void* file_allocation;
+        const u8* file_data = get_encoded_image(job->filename, job->image, &file_size, &file_allocation);
 
-        if (result != cgltf_result_success)
+        int width, height, comp;
+        u8* pixels = stbi_load_from_memory(file_data, (int)file_size, &width, &height, &comp, 4);
+        if (pixels == NULL)
         {
-            printf("Failed to load gltf file: %s\n", filename);
+            b32 is_image_file = job->image->uri && strncmp(job->image->uri, "data:", 5) != 0;
+            printf("Error decoding image %s, exiting\n", is_image_file ? job->image->uri : job->image->name ? job->image->name : "(unnamed)");
             exit(1);
         }
-    }
-    
-    // Create buffer objects
-    u32* buffers = calloc(data->buffers_count, sizeof(u32));
-    {
-        glCreateBuffers(data->buffers_count, buffers);
 
-        // Upload data to each created buffer
-        for (u32 i = 0; i < data->buffers_count; ++i)
-        {
-            cgltf_buffer* buffer = &data->buffers[i];
+        free(file_allocation);
 
-            glNamedBufferStorage(
-                buffers[i],
-                buffer->size,
-                buffer->data,
-                GL_MAP_WRITE_BIT
-            );
-        }
+        job->levels = build_texture_levels(pixels, width, height, job->format, job->mip_filter);
+        write_cached_texture(cache_key, &job->levels);
+        stbi_image_free(pixels);
     }
-    
-    // Create textures and load images from file
-    u32* textures = calloc(data->textures_count, sizeof(u32));
-    {
-        u32* image_textures = calloc(data->images_count, sizeof(u32));
-        for (u32 img_i = 0; img_i < data->images_count; ++img_i)
-        {
-            cgltf_image* image = &data->images[img_i];
-
-            // Load images used for base colors or emissives as sRGB instead of linear space
-            int is_srgb = 0;
-            for (u32 mat_i = 0; mat_i < data->materials_count; ++mat_i)
-            {
-                cgltf_material* material = &data->materials[mat_i];
-                if (material->pbr_metallic_roughness.base_color_texture.texture &&
-                    material->pbr_metallic_roughness.base_color_texture.texture->image == image)
-                {
-                    is_srgb = 1;
-                    break;
-                }
-
-                if (material->emissive_texture.texture &&
-                    material->emissive_texture.texture->image == image)
-                {
-                    is_srgb = 1;
-                    break;
-                }
-            }
 
-            Loaded_Image loaded_img = load_image(filename, image);
-            u32 tex;
-            u32 internal_format = is_srgb ? GL_SRGB8_ALPHA8 : GL_RGBA8;
-            
-            glCreateTextures(GL_TEXTURE_2D, 1, &tex);
-            glTextureStorage2D(tex, 1, internal_format, loaded_img.width, loaded_img.height);
-            glTextureSubImage2D(tex, 0, 0, 0, loaded_img.width, loaded_img.height, GL_RGBA, GL_UNSIGNED_BYTE, loaded_img.pixels);
+    job->decode_time += glfwGetTime() - start_time;
+}
 
-            // Default texture filtering
-            glTextureParameteri(tex, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-            glTextureParameteri(tex, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-            glTextureParameteri(tex, GL_TEXTURE_WRAP_S, GL_REPEAT);
-            glTextureParameteri(tex, GL_TEXTURE_WRAP_T, GL_REPEAT);
+b32
+is_gl_extension_supported(const char* name)
+{
+    GLint extension_count = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &extension_count);
+    for (GLint i = 0; i < extension_count; ++i)
+    {
+        if (strcmp((const char*)glGetStringi(GL_EXTENSIONS, i), name) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
 
-            glGenerateTextureMipmap(tex);
+u32
+get_texture_internal_format(TextureFormat format, int is_srgb)
+{
+    switch (format)
+    {
+        case TEXTURE_FORMAT_RGBA8: return is_srgb ? GL_SRGB8_ALPHA8 : GL_RGBA8;
+        case TEXTURE_FORMAT_BC1: return is_srgb ? GL_COMPRESSED_SRGB_S3TC_DXT1_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+        case TEXTURE_FORMAT_BC3: return is_srgb ? GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT : GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+        case TEXTURE_FORMAT_BC5: return GL_COMPRESSED_RG_RGTC2;
+        case TEXTURE_FORMAT_BC7: return is_srgb ? GL_COMPRESSED_SRGB_ALPHA_BPTC_UNORM : GL_COMPRESSED_RGBA_BPTC_UNORM;
+    }
+    assert(0 && "Unknown texture format");
+    return 0;
+}
 
-            image_textures[img_i] = tex;
+PackagedMaterial
+build_gltf_pbr_material(cgltf_data* data, cgltf_material* material)
+{
+    PackagedMaterial pbr_material = { 0 };
 
-            free_loaded_image(&loaded_img);
-        }
+    pbr_material.double_sided = material->double_sided;
+    pbr_material.is_blended = material->alpha_mode == cgltf_alpha_mode_blend;
 
-        // Map textures to images
-        for (u32 tex_i = 0; tex_i < data->textures_count; ++tex_i)
-        {
-            cgltf_texture* texture = &data->textures[tex_i];
-            textures[tex_i] = image_textures[texture->image - data->images];
+    // Set texture uniforms
+    cgltf_pbr_metallic_roughness* pbr_mr = &material->pbr_metallic_roughness;
+    u32 base_color_id = 0;
+    u32 metallic_roughness_id = 0;
+    u32 emissive_id = 0;
+    u32 occlusion_id = 0;
+    u32 normal_id = 0;
+    // u32 other texture; etc...
 
-            cgltf_sampler* sampler = texture->sampler;
-            if (sampler)
-            {
-                u32 tex = textures[tex_i];
-                glTextureParameteri(tex, GL_TEXTURE_MIN_FILTER, sampler->min_filter ? sampler->min_filter : GL_LINEAR);
-                glTextureParameteri(tex, GL_TEXTURE_MAG_FILTER, sampler->mag_filter ? sampler->mag_filter : GL_LINEAR);
-                glTextureParameteri(tex, GL_TEXTURE_WRAP_S, sampler->wrap_s ? sampler->wrap_s : GL_REPEAT);
-                glTextureParameteri(tex, GL_TEXTURE_WRAP_T, sampler->wrap_t ? sampler->wrap_t : GL_REPEAT);
-            }
-        }
+    // Find texture indices for materials textures
+    if (pbr_mr->base_color_texture.texture) base_color_id = pbr_mr->base_color_texture.texture - data->textures;
+    if (pbr_mr->metallic_roughness_texture.texture) metallic_roughness_id = pbr_mr->metallic_roughness_texture.texture - data->textures;
+    if (material->emissive_texture.texture) emissive_id = material->emissive_texture.texture - data->textures;
+    if (material->occlusion_texture.texture) occlusion_id = material->occlusion_texture.texture - data->textures;
+    if (material->normal_texture.texture) normal_id = material->normal_texture.texture - data->textures;
 
-        free(image_textures);
-    }
-    
-    // Create white texture for non-textured materials
-    u32 white_texture;
+    // Set base color texture
+    if (pbr_mr->base_color_texture.texture)
     {
-        u8 single_white_pixel_data[4] = { 255, 255, 255, 255 };
-        glCreateTextures(GL_TEXTURE_2D, 1, &white_texture);
-        glTextureParameteri(white_texture, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTextureParameteri(white_texture, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTextureParameteri(white_texture, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTextureParameteri(white_texture, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glTextureStorage2D(white_texture, 1, GL_RGBA8, 1, 1);
-        glTextureSubImage2D(white_texture, 0, 0, 0, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, single_white_pixel_data);
+        pbr_material.texture_indices[PBR_TEXUNIT_base_color_linear_space] = base_color_id;
     }
-
-    // Create flat normal map for materials with normal maps
-    u32 flat_normal_texture;
+    else
     {
-        u8 single_flat_normal_pixel_data[3] = { 128, 128, 255 };
-        glCreateTextures(GL_TEXTURE_2D, 1, &flat_normal_texture);
-        glTextureParameteri(flat_normal_texture, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTextureParameteri(flat_normal_texture, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTextureParameteri(flat_normal_texture, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTextureParameteri(flat_normal_texture, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glTextureStorage2D(flat_normal_texture, 1, GL_RGB8, 1, 1);
-        glTextureSubImage2D(flat_normal_texture, 0, 0, 0, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, single_flat_normal_pixel_data);
+        // Fallback to white texture
+        pbr_material.texture_indices[PBR_TEXUNIT_base_color_linear_space] = SCENE_NO_TEXTURE;
     }
-    
-    // Create vertex arrays
-    DynamicArray vaos = create_array(1 * sizeof(u32));
-    DynamicArray vaos_attributes = create_array(1 * sizeof(VAO_Attributes));
-    VAO_Range* vao_ranges = calloc(data->meshes_count, sizeof(VAO_Range));
-    u32 total_opaque_primitives = 0;
-    u32 total_transparent_primitives = 0;
 
-    for (u32 mesh_i = 0; mesh_i < data->meshes_count; ++mesh_i)
-    {
-        cgltf_mesh* mesh = &data->meshes[mesh_i];
+    // Set base color factor (cgltf defaults this to white if field not provided in gltf file)
+    pbr_material.uniforms.base_color_factor[0] = pbr_mr->base_color_factor[0];
+    pbr_material.uniforms.base_color_factor[1] = pbr_mr->base_color_factor[1];
+    pbr_material.uniforms.base_color_factor[2] = pbr_mr->base_color_factor[2];
+    pbr_material.uniforms.base_color_factor[3] = pbr_mr->base_color_factor[3];
 
-        // Keep track of the range of elements in vaos that this mesh uses
-        vao_ranges[mesh_i].begin = array_length(&vaos, sizeof(u32));  // Used for rendering
-        vao_ranges[mesh_i].count = mesh->primitives_count;                  // ..
+    // Set Alpha modes that apply to base color texture
+    float alpha_cutoff;
+    int is_alpha_blending_enabled;
+    if (material->alpha_mode == cgltf_alpha_mode_mask)
+    {
+        alpha_cutoff = material->alpha_cutoff;
+        // is_alpha_blending_enabled = 0;
+        is_alpha_blending_enabled = 1;  // TEMPORARY FIX: For early depth tests, masked objects go in transparent pass too
+    }
+    else if (material->alpha_mode == cgltf_alpha_mode_opaque)
+    {
+        alpha_cutoff = 0.0f;
+        is_alpha_blending_enabled = 0;
+    }
+    else if (material->alpha_mode == cgltf_alpha_mode_blend)
+    {
+        alpha_cutoff = 0.0f;
+        is_alpha_blending_enabled = 1;
+    }
+    else
+    {
+        assert(0 && "Impossible alpha mode unless cgltf.h bugged.");
+    }
+    pbr_material.uniforms.alpha_mask_cutoff = alpha_cutoff;
+    pbr_material.uniforms.is_alpha_blending_enabled = is_alpha_blending_enabled;
+
+    if (pbr_mr->metallic_roughness_texture.texture)
+    {
+        // Set metallic roughness texture
+        pbr_material.texture_indices[PBR_TEXUNIT_metallic_roughness_texture] = metallic_roughness_id;
+    }
+    else
+    {
+        // Fallback to default white texture
+        pbr_material.texture_indices[PBR_TEXUNIT_metallic_roughness_texture] = SCENE_NO_TEXTURE;
+    }
+
+    // Set metallic and roughness factors
+    pbr_material.uniforms.metallic_factor = pbr_mr->metallic_factor;
+    pbr_material.uniforms.roughness_factor = pbr_mr->roughness_factor;
+
+    if (material->emissive_texture.texture)
+    {
+        // Set emissive texture
+        pbr_material.texture_indices[PBR_TEXUNIT_emissive_texture] = emissive_id;
+    }
+    else
+    {
+        // Fallback to default white texture
+        pbr_material.texture_indices[PBR_TEXUNIT_emissive_texture] = SCENE_NO_TEXTURE;
+    }
+
+    // Set emissive factor
+    pbr_material.uniforms.emissive_factor[0] = material->emissive_factor[0];
+    pbr_material.uniforms.emissive_factor[1] = material->emissive_factor[1];
+    pbr_material.uniforms.emissive_factor[2] = material->emissive_factor[2];
+
+    if (material->occlusion_texture.texture)
+    {
+        // Set occlusion texture
+        pbr_material.texture_indices[PBR_TEXUNIT_occlusion_texture] = occlusion_id;
+    }
+    else
+    {
+        // Fallback to default white texture
+        pbr_material.texture_indices[PBR_TEXUNIT_occlusion_texture] = SCENE_NO_TEXTURE;
+    }
+
+    if (material->normal_texture.texture)
+    {
+        // Set normal texture
+        pbr_material.texture_indices[PBR_TEXUNIT_normal_texture] = normal_id;
+    }
+    else
+    {
+        // Fallback to flat normal map texture
+        pbr_material.texture_indices[PBR_TEXUNIT_normal_texture] = SCENE_NO_TEXTURE;
+    }
+
+    return pbr_material;
+}
+
+void
+gltf_node_world_matrix(cgltf_node* node, mat4 parent_matrix, mat4 out_model)
+{
+    // Compute model matrix = parent_matrix * node's matrix
+#if 0  // Turns out cgltf provides an implementation to get the node world transform but I already did it meself
+    cgltf_node_transform_world(node, (float*)out_model);
+#else
+    // glTF node transform either in matrix format matrix=T*R*S or T,R,S seperately (translation vector, rotation quaternion, scale vector)
 
-        // Create VAO for each primitive in this mesh:
-        u32* mesh_vaos = push_size(&vaos, sizeof(u32), mesh->primitives_count);
-        glCreateVertexArrays(mesh->primitives_count, mesh_vaos);
+    if (node->has_matrix)
+    {
+        mat4 node_matrix = {
+            { node->matrix[0],  node->matrix[1],  node->matrix[2],  node->matrix[3] },
+            { node->matrix[4],  node->matrix[5],  node->matrix[6],  node->matrix[7] },
+            { node->matrix[8],  node->matrix[9],  node->matrix[10], node->matrix[11] },
+            { node->matrix[12], node->matrix[13], node->matrix[14], node->matrix[15] }
+        };
+
+        glm_mat4_mul(parent_matrix, node_matrix, out_model);
+    }
+    else
+    {
+        mat4 node_matrix = GLM_MAT4_IDENTITY_INIT;
 
-        VAO_Attributes* mesh_vaos_attributes = push_size(&vaos_attributes, sizeof(VAO_Attributes), mesh->primitives_count);
-        memset(mesh_vaos_attributes, 0, sizeof(VAO_Attributes) * mesh->primitives_count);
+        if (node->has_translation)
+        {
+            vec3 translation_vector = { node->translation[0], node->translation[1], node->translation[2] };
+            glm_translate(node_matrix, translation_vector);
+        }
         
-        // Now loop over each primitive's vao and set attributes
+        if (node->has_rotation)
+        {
+            versor rotation_quaternion = { node->rotation[0], node->rotation[1], node->rotation[2], node->rotation[3] };
+            glm_quat_rotate(node_matrix, rotation_quaternion, node_matrix);
+        }
+
+        if (node->has_scale)
+        {
+            vec3 scale_vector = { node->scale[0], node->scale[1], node->scale[2] };
+            glm_scale(node_matrix, scale_vector);
+        }
+
+        glm_mat4_mul(parent_matrix, node_matrix, out_model);
+    }
+#endif
+}
+
+void
+gltf_primitive_local_bounds(cgltf_primitive* prim, vec3 out_bounds[2])
+{
+    cgltf_accessor* positions = NULL;
+    for (u32 attrib_i = 0; attrib_i < prim->attributes_count; ++attrib_i)
+    {
+        if (prim->attributes[attrib_i].type == cgltf_attribute_type_position)
+        {
+            positions = prim->attributes[attrib_i].data;
+        }
+    }
+
+    glm_vec3_zero(out_bounds[0]);
+    glm_vec3_zero(out_bounds[1]);
+    if (positions == NULL || positions->count == 0)
+    {
+        return;
+    }
+
+    // The glTF spec requires POSITION min and max, but fall back to reading the vertices for exporters that skip them
+    if (positions->has_min && positions->has_max)
+    {
+        glm_vec3_copy(positions->min, out_bounds[0]);
+        glm_vec3_copy(positions->max, out_bounds[1]);
+        return;
+    }
+
+    vec3 p;
+    cgltf_accessor_read_float(positions, 0, p, 3);
+    glm_vec3_copy(p, out_bounds[0]);
+    glm_vec3_copy(p, out_bounds[1]);
+    for (cgltf_size i = 1; i < positions->count; ++i)
+    {
+        cgltf_accessor_read_float(positions, i, p, 3);
+        glm_vec3_minv(out_bounds[0], p, out_bounds[0]);
+        glm_vec3_maxv(out_bounds[1], p, out_bounds[1]);
+    }
+}
+
+void
+collect_gltf_node_instances(cgltf_data* data, cgltf_node* node, mat4 parent_matrix, DynamicArray* instances)
+{
+    mat4 model = GLM_MAT4_IDENTITY_INIT;
+    gltf_node_world_matrix(node, parent_matrix, model);
+
+    if (node->mesh)
+    {
+        // Find node's mesh and get its index
+        cgltf_mesh* mesh = node->mesh;  // e.g. nodes->mesh = &scene->data->meshes[2];
+        s64 mesh_index = mesh - data->meshes;
+        assert(0 <= mesh_index && mesh_index < (s64)data->meshes_count);
+
+        PrimitiveInstance* mesh_instances = push_size(instances, sizeof(PrimitiveInstance), mesh->primitives_count);
         for (u32 prim_i = 0; prim_i < mesh->primitives_count; ++prim_i)
         {
-            cgltf_primitive* prim = &mesh->primitives[prim_i];
-            u32 vao = mesh_vaos[prim_i];
+            mesh_instances[prim_i].mesh_index = (u32)mesh_index;
+            mesh_instances[prim_i].prim_index = prim_i;
+            glm_mat4_copy(model, mesh_instances[prim_i].model);
+        }
+    }
 
-            // Keep track of transparent and opaque primitive counts for fast alpha blend sorting during rendering
-            if (prim->material)
+    // Add children nodes
+    for (u32 i = 0; i < node->children_count; ++i)
+    {
+        collect_gltf_node_instances(data, node->children[i], model, instances);
+    }
+}
+
+u32
+select_brightest_lights(const f32* flux, u32 count, f32 min_flux, u32 max_count, u32* out_indices)
+{
+    /* Indices of the lights with at least min_flux, brightest first and no more than max_count of them */
+    u64* keys = malloc(2 * sizeof(u64) * (count > 0 ? count : 1));
+    u32* values = malloc(2 * sizeof(u32) * (count > 0 ? count : 1));
+    u32 bright_count = 0;
+    for (u32 i = 0; i < count; ++i)
+    {
+        if (flux[i] >= min_flux)
+        {
+            // Non negative floats order like their bits, flipped so the brightest sort first
+            u32 bits;
+            memcpy(&bits, &flux[i], sizeof(bits));
+            keys[bright_count] = 0xffffffffu - bits;
+            values[bright_count++] = i;
+        }
+    }
+    radix_sort_u64(keys, values, bright_count, keys + count, values + count);
+
+    u32 kept_count = bright_count < max_count ? bright_count : max_count;
+    memcpy(out_indices, values, kept_count * sizeof(u32));
+    free(keys);
+    free(values);
+    return kept_count;
+}
+
+u8*
+extract_gltf_lights(cgltf_data* data, PrimitiveInstance* instances, u32 instances_count, size_t* out_size)
+{
+    /* The lights a glTF file brings along, as a light rig: every emissive triangle primitive is merged into convex
+     * polygonal area lights, and point and spot lights from KHR_lights_punctual become point lights (spots shine all
+     * ways). Emissive textures aren't sampled, a light's color and intensity come from the emissive factor and strength */
+    DynamicArray area_lights = create_array(64 * sizeof(AreaLight));
+    DynamicArray area_lights_flux = create_array(64 * sizeof(f32));
+    u32 emissive_triangles_count = 0;
+    for (u32 i = 0; i < instances_count; ++i)
+    {
+        PrimitiveInstance* instance = &instances[i];
+        cgltf_primitive* prim = &data->meshes[instance->mesh_index].primitives[instance->prim_index];
+        cgltf_material* material = prim->material;
+        if (!material || prim->type != cgltf_primitive_type_triangles)
+        {
+            continue;
+        }
+
+        vec3 emissive;
+        f32 emissive_strength = material->has_emissive_strength ? material->emissive_strength.emissive_strength : 1.0f;
+        glm_vec3_scale(material->emissive_factor, emissive_strength, emissive);
+        f32 intensity = glm_vec3_max(emissive);
+
+        cgltf_accessor* positions = NULL;
+        for (u32 attribute_i = 0; attribute_i < prim->attributes_count; ++attribute_i)
+        {
+            if (prim->attributes[attribute_i].type == cgltf_attribute_type_position)
             {
-                if (prim->material->alpha_mode == cgltf_alpha_mode_blend)
-                {
-                    ++total_transparent_primitives;
-                }
-                else
-                {
-                    ++total_opaque_primitives;
-                }
+                positions = prim->attributes[attribute_i].data;
             }
-            else
+        }
+        if (intensity <= 0.0f || !positions)
+        {
+            continue;
+        }
+
+        u32 vertex_count = (u32)positions->count;
+        f32* world_positions = malloc(3 * sizeof(f32) * (vertex_count > 0 ? vertex_count : 1));
+        for (u32 v = 0; v < vertex_count; ++v)
+        {
+            vec3 p;
+            cgltf_accessor_read_float(positions, v, p, 3);
+            glm_mat4_mulv3(instance->model, p, 1.0f, &world_positions[3 * v]);
+        }
+
+        u32 index_count = prim->indices ? (u32)prim->indices->count : vertex_count;
+        index_count -= index_count % 3;
+        u32* indices = malloc(sizeof(u32) * (index_count > 0 ? index_count : 1));
+        for (u32 j = 0; j < index_count; ++j)
+        {
+            indices[j] = prim->indices ? (u32)cgltf_accessor_read_index(prim->indices, j) : j;
+        }
+
+        // A mirroring transform flips the winding, and with it the side the area lights shine from
+        if (glm_mat4_det(instance->model) < 0.0f)
+        {
+            for (u32 j = 0; j < index_count; j += 3)
             {
-                ++total_opaque_primitives;
+                u32 temp = indices[j + 1];
+                indices[j + 1] = indices[j + 2];
+                indices[j + 2] = temp;
             }
+        }
 
-            // Find the attributes POSITION, NORMAL, and TEXCOORD_0
-            cgltf_attribute* POSITION = NULL;
-            cgltf_attribute* NORMAL = NULL;
-            cgltf_attribute* TEXCOORD_0 = NULL;
-            cgltf_attribute* TANGENT = NULL;
-            for (u32 attrib_i = 0; attrib_i < prim->attributes_count; ++attrib_i)
+        u32* polygon_sizes = malloc(sizeof(u32) * (index_count / 3 + 1));
+        f32* points = malloc(3 * sizeof(f32) * (index_count + 1));
+        // One point short of MAX_UNCLIPPED_NGON, upload_area_light_polygons() draws every 10 point light as a star
+        u32 polygons_count = merge_coplanar_triangles(polygon_sizes, points, indices, index_count, world_positions,
+                                                      vertex_count, MAX_UNCLIPPED_NGON - 1);
+        emissive_triangles_count += index_count / 3;
+
+        const f32* polygon_points = points;
+        for (u32 polygon = 0; polygon < polygons_count; ++polygon)
+        {
+            AreaLight* light = push_size(&area_lights, sizeof(AreaLight), 1);
+            memset(light, 0, sizeof(AreaLight));
+            glm_vec3_divs(emissive, intensity, light->color_rgb_intensity_a);
+            light->color_rgb_intensity_a[3] = intensity;
+            light->n = (int)polygon_sizes[polygon];
+            light->is_double_sided = material->double_sided;
+            for (int point = 0; point < MAX_UNCLIPPED_NGON; ++point)
             {
-                cgltf_attribute* attrib = &prim->attributes[attrib_i];
-                switch (attrib->type)
+                if (point < light->n)
                 {
-                    case cgltf_attribute_type_position:
-                        POSITION = attrib;
-                        break;
-
-                    case cgltf_attribute_type_normal:
-                        NORMAL = attrib;
-                        break;
-                    
-                    case cgltf_attribute_type_texcoord:
-                        if (attrib->index == 0)  // GLTF can have multiple texcoords
-                        {
-                            TEXCOORD_0 = attrib;
-                        }
-                        break;
-                    
-                    case cgltf_attribute_type_tangent:
-                        TANGENT = attrib;
-                        break;
-                    
-                    default:
-                        continue;
+                    glm_vec3_copy((f32*)&polygon_points[3 * point], light->points_worldspace[point]);
                 }
+                light->points_worldspace[point][3] = 1.0f;
             }
-            
-            if (POSITION == NULL)
-            {
-                printf("Error: POSITION attribute required but missing in %s\n", filename);
-                exit(1);
-            }
+            polygon_points += 3 * light->n;
 
-            // Find the index of each attribute buffer in data->buffers
-            // This index also corresponds to the vbo in the u32* buffers array.
-            int POSITION_vbo_index = -1;
-            int NORMAL_vbo_index = -1;
-            int TEXCOORD_0_vbo_index = -1;
-            int TANGENT_vbo_index = -1;
+            f32 color_sum = light->color_rgb_intensity_a[0] + light->color_rgb_intensity_a[1] + light->color_rgb_intensity_a[2];
+            f32 flux = polygon_area(light) * color_sum * intensity;
+            push_element_copy(&area_lights_flux, sizeof(f32), &flux);
+        }
 
-            for (u32 buffer_i = 0; buffer_i < data->buffers_count; ++buffer_i)
-            {
-                // Remember multiple attributes can have the same buffer
-                cgltf_buffer* buffer = &data->buffers[buffer_i];
+        free(world_positions);
+        free(indices);
+        free(polygon_sizes);
+        free(points);
+    }
 
-                if (POSITION && buffer == POSITION->data->buffer_view->buffer)
-                {
-                    POSITION_vbo_index = buffer_i;
-                    mesh_vaos_attributes[prim_i].has_position = 1;
-                }
+    DynamicArray point_lights = create_array(64 * sizeof(PointLight));
+    DynamicArray point_lights_flux = create_array(64 * sizeof(f32));
+    u32 directional_lights_count = 0;
+    for (u32 i = 0; i < data->nodes_count; ++i)
+    {
+        cgltf_node* node = &data->nodes[i];
+        if (!node->light)
+        {
+            continue;
+        }
+        if (node->light->type == cgltf_light_type_directional)
+        {
+            ++directional_lights_count;
+            continue;
+        }
 
-                if (NORMAL && buffer == NORMAL->data->buffer_view->buffer)
-                {
-                    NORMAL_vbo_index = buffer_i;
-                    mesh_vaos_attributes[prim_i].has_normal = 1;
-                }
+        mat4 world;
+        cgltf_node_transform_world(node, (f32*)world);
 
-                if (TEXCOORD_0 && buffer == TEXCOORD_0->data->buffer_view->buffer)
-                {
-                    TEXCOORD_0_vbo_index = buffer_i;
-                    mesh_vaos_attributes[prim_i].has_texcoord_0 = 1;
-                }
+        PointLight* light = push_size(&point_lights, sizeof(PointLight), 1);
+        memset(light, 0, sizeof(PointLight));
+        glm_vec3_copy(world[3], light->position);
+        glm_vec3_copy(node->light->color, light->color);
+        light->intensity = node->light->intensity;
 
-                if (TANGENT && buffer == TANGENT->data->buffer_view->buffer)
-                {
-                    TANGENT_vbo_index = buffer_i;
-                    mesh_vaos_attributes[prim_i].has_tangent = 1;
-                }
-            }
-            
-            // Make sure if the attribute exists we found the buffer for it
-            assert((POSITION   && POSITION_vbo_index   != -1) || !POSITION);
-            assert((NORMAL     && NORMAL_vbo_index     != -1) || !NORMAL);
-            assert((TEXCOORD_0 && TEXCOORD_0_vbo_index != -1) || !TEXCOORD_0);
-            assert((TANGENT    && TANGENT_vbo_index    != -1) || !TANGENT);
-
-            // Assign seperate binding points for each attribute.
-            // Some glTF files use the same buffer for multiple attributes, but it's still fine in OpenGL to bind the same buffer to multiple binding points.
-            const u32 POSITION_binding_point = 0;
-            const u32 NORMAL_binding_point = 1;
-            const u32 TEXCOORD_0_binding_point = 2;
-            const u32 TANGENT_binding_point = 3;
-
-            // Enable OpenGL vertex attributes and set attribute binding points and formats
-            // Then Assign the VBO of the attribute to the to the VAO
-            //  NOTE: Vertex format issues helped a little with this post: https://community.khronos.org/t/clarity-of-accessor-offset-and-glvertexarrayattribformat/106240
-
-            // Tangents stored as vec4s, the w component should be the bitangent sign: https://blender.stackexchange.com/questions/220756/why-does-blender-output-vec4-tangents-for-gltf
-
-            const u32 POSITION_attrib_index   = 0;  // layout (location = 0) in vec3 v_position;
-            const u32 NORMAL_attrib_index     = 1;  // layout (location = 1) in vec3 v_normal;
-            const u32 TEXCOORD_0_attrib_index = 2;  // layout (location = 2) in vec2 v_texcoord_0;
-            const u32 TANGENT_attrib_index    = 3;  // layout (location = 3) in vec4 v_tangent;
-
-            if (POSITION && POSITION->data->type == cgltf_type_vec3)// && POSITION->data->component_type == cgltf_component_type_r_32f)
-            {
-                u32 vbo_POSITION = buffers[POSITION_vbo_index];
-                u32 POSITION_buffer_offset = POSITION->data->offset + POSITION->data->buffer_view->offset;
-                u32 POSITION_component_type = gl_component_type_from_cgltf(POSITION->data->component_type);
-
-                glEnableVertexArrayAttrib(vao, POSITION_attrib_index);
-                glVertexArrayAttribBinding(vao, POSITION_attrib_index, POSITION_binding_point);
-                glVertexArrayAttribFormat(vao, POSITION_attrib_index, 3, POSITION_component_type, GL_FALSE, 0);
-                glVertexArrayVertexBuffer(vao, POSITION_binding_point, vbo_POSITION, POSITION_buffer_offset, POSITION->data->stride);
-                // NOTE: cgltf's accessor stride isn't just copied from buffer view stride,
-                // if buffer_view stride is zero (meaning tightly packed), accessor stride is calculated by cgltf based on types instead.
-                // This is useful because glVertexArrayVertexBuffer doesn't support stride of 0 to mean tight packing.
-
-                // TODO: Also works, maybe a better idea?
-                // glVertexArrayAttribFormat(
-                //     vao,
-                //     POSITION_attrib_index,
-                //     3,
-                //     POSITION_component_type,
-                //     GL_FALSE,
-                //     POSITION->data->offset
-                // );
-                // glVertexArrayVertexBuffer(
-                //     vao,
-                //     POSITION_binding_point,
-                //     vbo_POSITION,
-                //     POSITION->data->buffer_view->offset,
-                //     POSITION->data->stride
-                // );
-            }
-            else if (POSITION)
-            {
-                printf("Error loading %s\nPOSITION attribute: Unsupported attribute format", filename);
-                exit(1);
-            }
+        f32 flux = (light->color[0] + light->color[1] + light->color[2]) * light->intensity;
+        push_element_copy(&point_lights_flux, sizeof(f32), &flux);
+    }
 
-            if (NORMAL && NORMAL->data->type == cgltf_type_vec3)// && NORMAL->data->component_type == cgltf_component_type_r_32f)
-            {
-                u32 vbo_NORMAL = buffers[NORMAL_vbo_index];
-                u32 NORMAL_buffer_offset = NORMAL->data->offset + NORMAL->data->buffer_view->offset;
-                u32 NORMAL_component_type = gl_component_type_from_cgltf(NORMAL->data->component_type);
-
-                glEnableVertexArrayAttrib(vao, NORMAL_attrib_index);
-                glVertexArrayAttribBinding(vao, NORMAL_attrib_index, NORMAL_binding_point);
-                glVertexArrayAttribFormat(vao, NORMAL_attrib_index, 3, NORMAL_component_type, GL_FALSE, 0);
-                glVertexArrayVertexBuffer(vao, NORMAL_binding_point, vbo_NORMAL, NORMAL_buffer_offset, NORMAL->data->stride);
-            }
-            else if (NORMAL)
+    // Cull emitters too small or dim to matter next to the brightest one, then keep the brightest up to the limits
+    u32 area_lights_count = (u32)array_length(&area_lights, sizeof(AreaLight));
+    f32* area_flux = area_lights_flux.data_buffer;
+    f32 max_area_flux = 0.0f;
+    u32 dim_area_lights_count = 0;
+    for (u32 i = 0; i < area_lights_count; ++i)
+    {
+        max_area_flux = area_flux[i] > max_area_flux ? area_flux[i] : max_area_flux;
+    }
+    for (u32 i = 0; i < area_lights_count; ++i)
+    {
+        dim_area_lights_count += area_flux[i] < EMISSIVE_MIN_RELATIVE_FLUX * max_area_flux;
+    }
+    u32* kept_area_lights = malloc(sizeof(u32) * (area_lights_count > 0 ? area_lights_count : 1));
+    u32 kept_area_lights_count = select_brightest_lights(area_flux, area_lights_count, EMISSIVE_MIN_RELATIVE_FLUX * max_area_flux,
+                                                         MAX_IMPORTED_AREA_LIGHTS, kept_area_lights);
+
+    u32 point_lights_count = (u32)array_length(&point_lights, sizeof(PointLight));
+    u32* kept_point_lights = malloc(sizeof(u32) * (point_lights_count > 0 ? point_lights_count : 1));
+    u32 kept_point_lights_count = select_brightest_lights(point_lights_flux.data_buffer, point_lights_count, 0.0f,
+                                                          MAX_IMPORTED_POINT_LIGHTS, kept_point_lights);
+
+    AreaLight* selected_area_lights = malloc(sizeof(AreaLight) * (kept_area_lights_count > 0 ? kept_area_lights_count : 1));
+    for (u32 i = 0; i < kept_area_lights_count; ++i)
+    {
+        selected_area_lights[i] = *(AreaLight*)get_element(&area_lights, sizeof(AreaLight), kept_area_lights[i]);
+    }
+    PointLight* selected_point_lights = malloc(sizeof(PointLight) * (kept_point_lights_count > 0 ? kept_point_lights_count : 1));
+    for (u32 i = 0; i < kept_point_lights_count; ++i)
+    {
+        selected_point_lights[i] = *(PointLight*)get_element(&point_lights, sizeof(PointLight), kept_point_lights[i]);
+    }
+
+    if (emissive_triangles_count > 0 || point_lights_count + directional_lights_count > 0)
+    {
+        printf("Imported %d area lights from %d emissive triangles (%d polygons too dim, %d over the limit of %d)\n",
+               (int)kept_area_lights_count, (int)emissive_triangles_count, (int)dim_area_lights_count,
+               (int)(area_lights_count - dim_area_lights_count - kept_area_lights_count), MAX_IMPORTED_AREA_LIGHTS);
+        printf("Imported %d point lights from KHR_lights_punctual (%d over the limit of %d, %d directional lights skipped)\n",
+               (int)kept_point_lights_count, (int)(point_lights_count - kept_point_lights_count), MAX_IMPORTED_POINT_LIGHTS,
+               (int)directional_lights_count);
+    }
+
+    u8* rig = write_light_rig(selected_point_lights, kept_point_lights_count, selected_area_lights, kept_area_lights_count, out_size);
+    free_array(&area_lights);
+    free_array(&area_lights_flux);
+    free_array(&point_lights);
+    free_array(&point_lights_flux);
+    free(kept_area_lights);
+    free(kept_point_lights);
+    free(selected_area_lights);
+    free(selected_point_lights);
+    return rig;
+}
+
+void
+build_primitive_vertices(const char* filename, cgltf_attribute* POSITION, cgltf_attribute* NORMAL, cgltf_attribute* TEXCOORD_0,
+                         cgltf_attribute* TANGENT, const u32* vertex_remap, DynamicArray* vertices, PackagedPrimitive* out_primitive)
+{
+    /* Packs the primitive's attributes into interleaved QuantizedVertex (or FloatVertex) vertices appended to vertices,
+     * vertex v goes at vertex_remap[v] (or v if it's NULL). Positions share one scale across the axes so the
+     * dequantization keeps angles, which lets it fold into the draw's matrices (see build_gltf_primitive_draw_call)
+     * without touching the normal matrix or the meshlet cones */
+    if (POSITION->data->type != cgltf_type_vec3)
+    {
+        printf("Error loading %s\nPOSITION attribute: Unsupported attribute format", filename);
+        exit(1);
+    }
+    if (NORMAL && NORMAL->data->type != cgltf_type_vec3)
+    {
+        printf("Error loading %s\nNORMAL attribute: Unsupported attribute format", filename);
+        exit(1);
+    }
+    if (TEXCOORD_0 && TEXCOORD_0->data->type != cgltf_type_vec2)
+    {
+        printf("Error loading %s\nTEXCOORD_0 attribute: Unsupported attribute format", filename);
+        exit(1);
+    }
+    if (TANGENT && TANGENT->data->type != cgltf_type_vec4)
+    {
+        printf("Error loading %s\nTANGENT attribute: Unsupported attribute format: %d, %d\n", filename, TANGENT->data->type, TANGENT->data->component_type);
+        exit(1);
+    }
+
+    u32 vertex_count = POSITION->data->count;
+    out_primitive->attributes.has_position = 1;
+    out_primitive->attributes.has_normal = NORMAL != NULL;
+    out_primitive->attributes.has_texcoord_0 = TEXCOORD_0 != NULL;
+    out_primitive->attributes.has_tangent = TANGENT != NULL;
+    out_primitive->first_vertex = array_length(vertices, SCENE_VERTEX_SIZE);
+    out_primitive->vertex_count = vertex_count;
+    out_primitive->is_texcoord_half = 0;
+    glm_vec4_copy(GLM_VEC4_BLACK, out_primitive->position_dequantization);  // No offset, scale of 1
+
+    u8* unordered_vertices = calloc(vertex_count > 0 ? vertex_count : 1, SCENE_VERTEX_SIZE);
+    f32* unpacked = malloc(4 * (vertex_count > 0 ? vertex_count : 1) * sizeof(f32));  // Room for any one attribute
+
+    #if QUANTIZE_VERTICES
+    {
+        QuantizedVertex* quantized = (QuantizedVertex*)unordered_vertices;
+
+        // Bounds from the vertices themselves, accessor min/max can be missing or loose
+        cgltf_accessor_unpack_floats(POSITION->data, unpacked, 3 * vertex_count);
+        vec3 bounds[2] = { { 0.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, 0.0f } };
+        if (vertex_count > 0)
+        {
+            glm_vec3_copy(&unpacked[0], bounds[0]);
+            glm_vec3_copy(&unpacked[0], bounds[1]);
+        }
+        for (u32 v = 1; v < vertex_count; ++v)
+        {
+            glm_vec3_minv(bounds[0], &unpacked[3 * v], bounds[0]);
+            glm_vec3_maxv(bounds[1], &unpacked[3 * v], bounds[1]);
+        }
+        vec3 extent;
+        glm_vec3_sub(bounds[1], bounds[0], extent);
+        f32 scale = glm_vec3_max(extent);
+        if (scale <= 0.0f)
+        {
+            scale = 1.0f;
+        }
+        glm_vec4(bounds[0], scale, out_primitive->position_dequantization);
+
+        for (u32 v = 0; v < vertex_count; ++v)
+        {
+            for (u32 c = 0; c < 3; ++c)
+            {
+                quantized[v].position[c] = quantize_unorm16((unpacked[3 * v + c] - bounds[0][c]) / scale);
+            }
+        }
+
+        if (NORMAL)
+        {
+            cgltf_accessor_unpack_floats(NORMAL->data, unpacked, 3 * vertex_count);
+            for (u32 v = 0; v < vertex_count; ++v)
+            {
+                encode_octahedral_snorm16(&unpacked[3 * v], quantized[v].normal);
+            }
+        }
+
+        if (TANGENT)
+        {
+            cgltf_accessor_unpack_floats(TANGENT->data, unpacked, 4 * vertex_count);
+            for (u32 v = 0; v < vertex_count; ++v)
+            {
+                encode_octahedral_snorm16(&unpacked[4 * v], quantized[v].tangent);
+                quantized[v].position[3] = unpacked[4 * v + 3] < 0.0f ? 0 : 65535;
+            }
+        }
+
+        // unorm16 is more precise over [0, 1], but tiling texcoords need the range of half floats
+        if (TEXCOORD_0)
+        {
+            cgltf_accessor_unpack_floats(TEXCOORD_0->data, unpacked, 2 * vertex_count);
+            for (u32 i = 0; i < 2 * vertex_count; ++i)
+            {
+                if (unpacked[i] < 0.0f || unpacked[i] > 1.0f)
+                {
+                    out_primitive->is_texcoord_half = 1;
+                    break;
+                }
+            }
+            for (u32 i = 0; i < 2 * vertex_count; ++i)
+            {
+                quantized[i / 2].texcoord_0[i % 2] = out_primitive->is_texcoord_half ? quantize_half(unpacked[i]) : quantize_unorm16(unpacked[i]);
+            }
+        }
+    }
+    #else
+    {
+        FloatVertex* floats = (FloatVertex*)unordered_vertices;
+
+        cgltf_accessor_unpack_floats(POSITION->data, unpacked, 3 * vertex_count);
+        for (u32 v = 0; v < vertex_count; ++v)
+        {
+            memcpy(floats[v].position, &unpacked[3 * v], sizeof(floats[v].position));
+        }
+
+        if (NORMAL)
+        {
+            cgltf_accessor_unpack_floats(NORMAL->data, unpacked, 3 * vertex_count);
+            for (u32 v = 0; v < vertex_count; ++v)
+            {
+                memcpy(floats[v].normal, &unpacked[3 * v], sizeof(floats[v].normal));
+            }
+        }
+
+        if (TEXCOORD_0)
+        {
+            cgltf_accessor_unpack_floats(TEXCOORD_0->data, unpacked, 2 * vertex_count);
+            for (u32 v = 0; v < vertex_count; ++v)
+            {
+                memcpy(floats[v].texcoord_0, &unpacked[2 * v], sizeof(floats[v].texcoord_0));
+            }
+        }
+
+        if (TANGENT)
+        {
+            cgltf_accessor_unpack_floats(TANGENT->data, unpacked, 4 * vertex_count);
+            for (u32 v = 0; v < vertex_count; ++v)
+            {
+                memcpy(floats[v].tangent, &unpacked[4 * v], sizeof(floats[v].tangent));
+            }
+        }
+    }
+    #endif
+
+    u8* out_vertices = push_size(vertices, SCENE_VERTEX_SIZE, vertex_count);
+    if (vertex_remap)
+    {
+        for (u32 v = 0; v < vertex_count; ++v)
+        {
+            memcpy(out_vertices + vertex_remap[v] * SCENE_VERTEX_SIZE, unordered_vertices + v * SCENE_VERTEX_SIZE, SCENE_VERTEX_SIZE);
+        }
+    }
+    else
+    {
+        memcpy(out_vertices, unordered_vertices, vertex_count * SCENE_VERTEX_SIZE);
+    }
+
+    free(unordered_vertices);
+    free(unpacked);
+}
+
+void
+set_primitive_vertex_format(u32 vao, u32 vertex_buffer, PackagedPrimitive* primitive)
+{
+    // Same attribute locations for both vertex layouts, all read through binding point 0 at the primitive's vertices
+    glVertexArrayVertexBuffer(vao, 0, vertex_buffer, (GLintptr)primitive->first_vertex * SCENE_VERTEX_SIZE, SCENE_VERTEX_SIZE);
+
+    #if QUANTIZE_VERTICES
+    u32 position_size = 4, normal_size = 2, tangent_size = 2;
+    u32 position_type = GL_UNSIGNED_SHORT, normal_type = GL_SHORT, texcoord_type = GL_UNSIGNED_SHORT;
+    b32 is_normalized = 1;
+    if (primitive->is_texcoord_half)
+    {
+        texcoord_type = GL_HALF_FLOAT;
+    }
+    u32 position_offset = offsetof(QuantizedVertex, position);
+    u32 normal_offset = offsetof(QuantizedVertex, normal);
+    u32 texcoord_offset = offsetof(QuantizedVertex, texcoord_0);
+    u32 tangent_offset = offsetof(QuantizedVertex, tangent);
+    #else
+    u32 position_size = 3, normal_size = 3, tangent_size = 4;
+    u32 position_type = GL_FLOAT, normal_type = GL_FLOAT, texcoord_type = GL_FLOAT;
+    b32 is_normalized = 0;
+    u32 position_offset = offsetof(FloatVertex, position);
+    u32 normal_offset = offsetof(FloatVertex, normal);
+    u32 texcoord_offset = offsetof(FloatVertex, texcoord_0);
+    u32 tangent_offset = offsetof(FloatVertex, tangent);
+    #endif
+
+    glEnableVertexArrayAttrib(vao, 0);
+    glVertexArrayAttribBinding(vao, 0, 0);
+    glVertexArrayAttribFormat(vao, 0, position_size, position_type, is_normalized, position_offset);
+    if (primitive->attributes.has_normal)
+    {
+        glEnableVertexArrayAttrib(vao, 1);
+        glVertexArrayAttribBinding(vao, 1, 0);
+        glVertexArrayAttribFormat(vao, 1, normal_size, normal_type, is_normalized, normal_offset);
+    }
+    if (primitive->attributes.has_texcoord_0)
+    {
+        glEnableVertexArrayAttrib(vao, 2);
+        glVertexArrayAttribBinding(vao, 2, 0);
+        glVertexArrayAttribFormat(vao, 2, 2, texcoord_type, is_normalized && texcoord_type != GL_HALF_FLOAT, texcoord_offset);
+    }
+    if (primitive->attributes.has_tangent)
+    {
+        glEnableVertexArrayAttrib(vao, 3);
+        glVertexArrayAttribBinding(vao, 3, 0);
+        glVertexArrayAttribFormat(vao, 3, tangent_size, normal_type, is_normalized, tangent_offset);
+    }
+}
+
+void
+copy_primitive_indices(const u32* indices, u32 index_count, DynamicArray* lod_indices, PrimitiveLODs* out_lods)
+{
+    // Just level 0, for primitives too small to simplify
+    memset(out_lods, 0, sizeof(*out_lods));
+    out_lods->count = 1;
+    out_lods->first_index[0] = array_length(lod_indices, sizeof(u32));
+    out_lods->index_count[0] = index_count;
+    memcpy(push_size(lod_indices, sizeof(u32), index_count), indices, index_count * sizeof(u32));
+}
+
+u32*
+optimize_primitive_triangle_order(u32* indices, u32 index_count, f32* positions, u32 vertex_count)
+{
+    /* Reorders a triangle list in place for the post-transform vertex cache, then its clusters of triangles against
+     * overdraw. With QUANTIZE_VERTICES the vertices get renumbered in the order the indices first use them: positions
+     * are moved in place and the returned remap (old to new vertex index) is how the other attributes follow.
+     * Returns NULL when the vertices keep their order. Cached on disk by a hash of the input */
+    u32 reorder_vertices = QUANTIZE_VERTICES;
+    u64 key = hash_fnv1a_64(indices, index_count * sizeof(u32), FNV1A_64_OFFSET_BASIS);
+    key = hash_fnv1a_64(positions, 3 * vertex_count * sizeof(f32), key);
+    key = hash_fnv1a_64(&reorder_vertices, sizeof(reorder_vertices), key);
+
+    // Cache layout: the reordered indices, then the vertex remap if there is one
+    u32* vertex_remap = reorder_vertices ? malloc(vertex_count * sizeof(u32)) : NULL;
+    size_t expected_size = (index_count + (reorder_vertices ? vertex_count : 0)) * sizeof(u32);
+    size_t cached_size = 0;
+    u32* cached = cache_read("triangle_order", key, TRIANGLE_ORDER_CACHE_VERSION, &cached_size);
+    b32 is_cache_valid = cached && cached_size == expected_size;
+    for (u32 i = 0; is_cache_valid && i < index_count; ++i)
+    {
+        is_cache_valid = cached[i] < vertex_count;
+    }
+    if (is_cache_valid && vertex_remap)
+    {
+        // Positions and attributes are scattered through the remap, so it has to be a permutation of the vertices
+        b8* is_remapped = calloc(vertex_count > 0 ? vertex_count : 1, sizeof(b8));
+        for (u32 v = 0; is_cache_valid && v < vertex_count; ++v)
+        {
+            u32 new_v = cached[index_count + v];
+            is_cache_valid = new_v < vertex_count && !is_remapped[new_v];
+            is_remapped[is_cache_valid ? new_v : 0] = 1;
+        }
+        free(is_remapped);
+    }
+
+    if (is_cache_valid)
+    {
+        memcpy(indices, cached, index_count * sizeof(u32));
+        if (vertex_remap)
+        {
+            memcpy(vertex_remap, &cached[index_count], vertex_count * sizeof(u32));
+        }
+    }
+    else
+    {
+        u32* vertex_cache_order = malloc(index_count * sizeof(u32));
+        optimize_vertex_cache(vertex_cache_order, indices, index_count, vertex_count);
+        optimize_overdraw(indices, vertex_cache_order, index_count, positions, vertex_count, OVERDRAW_CACHE_MISS_THRESHOLD);
+        free(vertex_cache_order);
+        if (vertex_remap)
+        {
+            optimize_vertex_fetch_remap(vertex_remap, indices, index_count, vertex_count);
+        }
+
+        u32* cache_data = malloc(expected_size > 0 ? expected_size : sizeof(u32));
+        memcpy(cache_data, indices, index_count * sizeof(u32));
+        if (vertex_remap)
+        {
+            memcpy(&cache_data[index_count], vertex_remap, vertex_count * sizeof(u32));
+        }
+        cache_write("triangle_order", key, TRIANGLE_ORDER_CACHE_VERSION, cache_data, expected_size);
+        free(cache_data);
+    }
+    free(cached);
+
+    if (vertex_remap)
+    {
+        f32* unordered_positions = malloc(3 * vertex_count * sizeof(f32));
+        memcpy(unordered_positions, positions, 3 * vertex_count * sizeof(f32));
+        for (u32 v = 0; v < vertex_count; ++v)
+        {
+            memcpy(&positions[3 * vertex_remap[v]], &unordered_positions[3 * v], 3 * sizeof(f32));
+        }
+        free(unordered_positions);
+    }
+
+    return vertex_remap;
+}
+
+void
+build_primitive_lods(u32* indices, u32 index_count, f32* positions, u32 vertex_count, DynamicArray* lod_indices, PrimitiveLODs* out_lods)
+{
+    /* Level 0 is a copy of the indices, each level after it simplifies the previous one to about half the triangles
+     * and is reordered for the vertex cache. Levels are cached on disk by a hash of the indices and positions they were
+     * built from */
+    u64 key = hash_fnv1a_64(indices, index_count * sizeof(u32), FNV1A_64_OFFSET_BASIS);
+    key = hash_fnv1a_64(positions, 3 * vertex_count * sizeof(f32), key);
+
+    // Cache layout: level count, index counts, errors, then the indices of levels 1 and up
+    memset(out_lods, 0, sizeof(*out_lods));
+    size_t cached_size = 0;
+    u32* cached = cache_read("lods", key, LOD_CACHE_VERSION, &cached_size);
+    size_t cache_header_size = (1 + 2 * MAX_PRIMITIVE_LODS) * sizeof(u32);
+    b32 is_cache_valid = cached && cached_size >= cache_header_size && cached[0] >= 1 && cached[0] <= MAX_PRIMITIVE_LODS
+        && cached[1] == index_count;
+    if (is_cache_valid)
+    {
+        // A truncated or corrupt entry is rebuilt rather than trusted
+        size_t cached_index_count = 0;
+        for (u32 lod = 1; lod < cached[0]; ++lod)
+        {
+            cached_index_count += cached[1 + lod];
+        }
+        is_cache_valid = cached_size == cache_header_size + cached_index_count * sizeof(u32);
+
+        u32* cached_indices = &cached[1 + 2 * MAX_PRIMITIVE_LODS];
+        for (size_t i = 0; is_cache_valid && i < cached_index_count; ++i)
+        {
+            is_cache_valid = cached_indices[i] < vertex_count;
+        }
+    }
+
+    if (is_cache_valid)
+    {
+        out_lods->count = cached[0];
+        memcpy(out_lods->index_count, &cached[1], MAX_PRIMITIVE_LODS * sizeof(u32));
+        memcpy(out_lods->error, &cached[1 + MAX_PRIMITIVE_LODS], MAX_PRIMITIVE_LODS * sizeof(f32));
+
+        out_lods->first_index[0] = array_length(lod_indices, sizeof(u32));
+        memcpy(push_size(lod_indices, sizeof(u32), index_count), indices, index_count * sizeof(u32));
+
+        u32* cached_indices = &cached[1 + 2 * MAX_PRIMITIVE_LODS];
+        for (u32 lod = 1; lod < out_lods->count; ++lod)
+        {
+            out_lods->first_index[lod] = array_length(lod_indices, sizeof(u32));
+            memcpy(push_size(lod_indices, sizeof(u32), out_lods->index_count[lod]), cached_indices, out_lods->index_count[lod] * sizeof(u32));
+            cached_indices += out_lods->index_count[lod];
+        }
+    }
+    else
+    {
+        vec3 bounds[2];
+        glm_vec3_copy(&positions[0], bounds[0]);
+        glm_vec3_copy(&positions[0], bounds[1]);
+        for (u32 v = 1; v < vertex_count; ++v)
+        {
+            glm_vec3_minv(bounds[0], &positions[3 * v], bounds[0]);
+            glm_vec3_maxv(bounds[1], &positions[3 * v], bounds[1]);
+        }
+        f32 max_error = LOD_MAX_ERROR_RATIO * glm_vec3_distance(bounds[0], bounds[1]);
+
+        out_lods->count = 1;
+        out_lods->first_index[0] = array_length(lod_indices, sizeof(u32));
+        out_lods->index_count[0] = index_count;
+        memcpy(push_size(lod_indices, sizeof(u32), index_count), indices, index_count * sizeof(u32));
+
+        DynamicArray generated = create_array(index_count * sizeof(u32));
+        u32* previous = indices;
+        u32 previous_count = index_count;
+        u32* simplified = malloc(index_count * sizeof(u32));
+        u32* reordered = malloc(index_count * sizeof(u32));
+        while (out_lods->count < MAX_PRIMITIVE_LODS)
+        {
+            f32 error;
+            u32 target_count = (previous_count / 2) / 3 * 3;
+            u32 simplified_count = simplify_mesh(simplified, previous, previous_count, positions, vertex_count, target_count, max_error, &error);
+
+            // Stop once the simplifier can't make meaningful progress without going over the error limit
+            if (simplified_count == 0 || simplified_count > previous_count * 3 / 4)
+            {
+                break;
+            }
+
+            // Collapses leave gaps in the previous level's triangle order, so each level is reordered for the vertex cache too
+            optimize_vertex_cache(reordered, simplified, simplified_count, vertex_count);
+            memcpy(simplified, reordered, simplified_count * sizeof(u32));
+
+            u32 lod = out_lods->count++;
+            out_lods->index_count[lod] = simplified_count;
+            out_lods->error[lod] = out_lods->error[lod - 1] + error;  // Each level builds on the previous level's error
+            out_lods->first_index[lod] = array_length(lod_indices, sizeof(u32));
+
+            memcpy(push_size(lod_indices, sizeof(u32), simplified_count), simplified, simplified_count * sizeof(u32));
+            previous = push_size(&generated, sizeof(u32), simplified_count);
+            memcpy(previous, simplified, simplified_count * sizeof(u32));
+            previous_count = simplified_count;
+        }
+        free(reordered);
+        free(simplified);
+
+        // Write the levels out to the cache
+        size_t cache_size = cache_header_size + generated.used_size;
+        u32* cache_data = malloc(cache_size);
+        cache_data[0] = out_lods->count;
+        memcpy(&cache_data[1], out_lods->index_count, MAX_PRIMITIVE_LODS * sizeof(u32));
+        memcpy(&cache_data[1 + MAX_PRIMITIVE_LODS], out_lods->error, MAX_PRIMITIVE_LODS * sizeof(f32));
+        memcpy(&cache_data[1 + 2 * MAX_PRIMITIVE_LODS], generated.data_buffer, generated.used_size);
+        cache_write("lods", key, LOD_CACHE_VERSION, cache_data, cache_size);
+        free(cache_data);
+        free_array(&generated);
+    }
+
+    free(cached);
+}
+
+void
+build_primitive_meshlets(f32* positions, u32 vertex_count, DynamicArray* lod_indices, PrimitiveLODs* lods, vec4 position_dequantization,
+                         DynamicArray* meshlets, MeshletRange* out_range)
+{
+    // Splits the primitive's LOD 0 into meshlets, reordering its indices in place so each meshlet is a contiguous range of the LOD index buffer.
+    // Their spheres are moved into the space of the (possibly quantized) vertex positions the draw's matrices expect
+    u32 index_count = lods->index_count[0];
+    u32* indices = get_element(lod_indices, sizeof(u32), lods->first_index[0]);
+
+    u32* source_indices = malloc(index_count * sizeof(u32));
+    memcpy(source_indices, indices, index_count * sizeof(u32));
+    Meshlet* built = malloc(meshlet_count_bound(index_count) * sizeof(Meshlet));
+    u32 built_count = build_meshlets(built, indices, source_indices, index_count, positions, vertex_count);
+
+    out_range->first = array_length(meshlets, sizeof(MeshletData));
+    out_range->count = built_count;
+    for (u32 i = 0; i < built_count; ++i)
+    {
+        MeshletData meshlet = { 0 };
+        vec3 center;
+        glm_vec3_sub(built[i].center, position_dequantization, center);
+        glm_vec3_divs(center, position_dequantization[3], center);
+        glm_vec4(center, built[i].radius / position_dequantization[3], meshlet.bounding_sphere);
+        glm_vec4(built[i].cone_axis, built[i].cone_cutoff, meshlet.cone);
+        meshlet.first_index = lods->first_index[0] + built[i].first_index;
+        meshlet.index_count = built[i].index_count;
+        push_element_copy(meshlets, sizeof(MeshletData), &meshlet);
+    }
+
+    free(built);
+    free(source_indices);
+}
+
+u64
+hash_scene_package_dependencies(const char* dependencies, u64 dependencies_size)
+{
+    // Changes when any of the files is modified, see file_stamp()
+    u64 hash = FNV1A_64_OFFSET_BASIS;
+    for (u64 offset = 0; offset < dependencies_size; offset += strlen(&dependencies[offset]) + 1)
+    {
+        u64 stamp = file_stamp(&dependencies[offset]);
+        hash = hash_fnv1a_64(&stamp, sizeof(stamp), hash);
+    }
+    return hash;
+}
+
+void
+build_gltf_scene_package(const char* filename, b32 is_s3tc_supported, ScenePackage* out_package)
+{
+    /* Does all the CPU side work of loading a glTF file: decoding and compressing its images, packing the vertices,
+     * reordering triangles, building LODs and meshlets, and flattening the node hierarchy. No GL calls */
+    ScenePackage package = { 0 };
+    ScenePackageHeader* header = &package.header;
+
+    // Load GLTF file with cgltf, mapping its files rather than reading them
+    cgltf_data* data = NULL;
+    DynamicArray file_mappings = create_array(8 * sizeof(FileMapping));
+    {
+        cgltf_options options = { 0 };
+        options.file.read = map_gltf_file;
+        options.file.release = unmap_gltf_file;
+        options.file.user_data = &file_mappings;
+        cgltf_result result = cgltf_parse_file(&options, filename, &data);
+
+        if (result == cgltf_result_success)
+        {
+            result = cgltf_load_buffers(&options, data, filename);
+        }
+
+        if (result != cgltf_result_success)
+        {
+            printf("Failed to load gltf file: %s\n", filename);
+            exit(1);
+        }
+    }
+
+    // Every file the package is built from, it's rebuilt when any of them changes
+    DynamicArray dependencies = create_array(256);
+    {
+        memcpy(push_size(&dependencies, 1, strlen(filename) + 1), filename, strlen(filename) + 1);
+        for (u32 i = 0; i < data->buffers_count + data->images_count; ++i)
+        {
+            const char* uri = i < data->buffers_count ? data->buffers[i].uri : data->images[i - data->buffers_count].uri;
+            if (uri && strncmp(uri, "data:", 5) != 0)
+            {
+                char* path = resolve_gltf_uri_path(filename, uri);
+                memcpy(push_size(&dependencies, 1, strlen(path) + 1), path, strlen(path) + 1);
+                free(path);
+            }
+        }
+    }
+
+    // Load images, from their own files or from the glTF's buffers
+    PackagedImage* images = calloc(data->images_count > 0 ? data->images_count : 1, sizeof(PackagedImage));
+    u32 packaged_images_count = 0;
+    u32* image_remap = calloc(data->images_count > 0 ? data->images_count : 1, sizeof(u32));  // glTF image to packaged image
+    DynamicArray image_data = create_array(1024);
+    {
+        // Images are hashed and then decoded and their mip chains built on the job system's workers, then copied into
+        // the package here as they finish in whatever order that is. Both are cached on disk so later builds only read
+        // the finished levels
+        f64 images_start_time = glfwGetTime();
+        ImageLoadJob* load_jobs = calloc(data->images_count, sizeof(ImageLoadJob));
+        for (u32 img_i = 0; img_i < data->images_count; ++img_i)
+        {
+            cgltf_image* image = &data->images[img_i];
+
+            // Load images used for base colors or emissives as sRGB instead of linear space
+            int is_srgb = 0;
+            int is_normal_map = 0;
+            for (u32 mat_i = 0; mat_i < data->materials_count; ++mat_i)
+            {
+                cgltf_material* material = &data->materials[mat_i];
+                if (material->pbr_metallic_roughness.base_color_texture.texture &&
+                    material->pbr_metallic_roughness.base_color_texture.texture->image == image)
+                {
+                    is_srgb = 1;
+                    break;
+                }
+
+                if (material->emissive_texture.texture &&
+                    material->emissive_texture.texture->image == image)
+                {
+                    is_srgb = 1;
+                    break;
+                }
+
+                if (material->normal_texture.texture &&
+                    material->normal_texture.texture->image == image)
+                {
+                    is_normal_map = 1;
+                }
+            }
+
+            ImageLoadJob* job = &load_jobs[img_i];
+            job->filename = filename;
+            job->image = image;
+            job->image_index = img_i;
+            job->is_srgb = is_srgb;
+            job->mip_filter = is_srgb ? TEXTURE_MIP_FILTER_SRGB : (is_normal_map ? TEXTURE_MIP_FILTER_NORMAL : TEXTURE_MIP_FILTER_LINEAR);
+            // Colors keep their alpha in BC7, data textures make do with BC1 when the driver has S3TC
+            if (!TEXTURE_COMPRESSION)
+                job->format = TEXTURE_FORMAT_RGBA8;
+            else if (is_srgb)
+                job->format = TEXTURE_FORMAT_BC7;
+            else if (is_normal_map)
+                job->format = TEXTURE_FORMAT_BC5;
+            else
+                job->format = is_s3tc_supported ? TEXTURE_FORMAT_BC1 : TEXTURE_FORMAT_BC7;
+            submit_job(hash_image_job, job);
+        }
+
+        for (u32 completed_i = 0; completed_i < data->images_count; ++completed_i)
+        {
+            wait_for_completed_job();
+        }
+
+        // Exported scenes often have the same image under several URIs, only the first of them is decoded and the
+        // rest share its packaged image
+        u32 duplicates_count = 0;
+        u64 duplicate_bytes = 0;
+        f64 decode_time = 0.0;
+        for (u32 img_i = 0; img_i < data->images_count; ++img_i)
+        {
+            ImageLoadJob* job = &load_jobs[img_i];
+            u32 original_i = 0;
+            while (original_i < img_i && (load_jobs[original_i].cache_key != job->cache_key || load_jobs[original_i].is_srgb != job->is_srgb))
+            {
+                ++original_i;
+            }
+
+            if (original_i < img_i)
+            {
+                image_remap[img_i] = image_remap[original_i];
+                ++duplicates_count;
+                duplicate_bytes += job->file_size;
+                decode_time += job->decode_time;
+                continue;
+            }
+
+            image_remap[img_i] = packaged_images_count++;
+            job->image_index = image_remap[img_i];
+            submit_job(load_image_job, job);
+        }
+
+        u32 cached_count = 0;
+
+        for (u32 completed_i = 0; completed_i < packaged_images_count; ++completed_i)
+        {
+            ImageLoadJob* job = wait_for_completed_job();
+            TextureLevels* levels = &job->levels;
+
+            PackagedImage* packaged_image = &images[job->image_index];
+            packaged_image->format = levels->format;
+            packaged_image->is_srgb = job->is_srgb;
+            packaged_image->width = levels->width;
+            packaged_image->height = levels->height;
+            packaged_image->level_count = levels->level_count;
+            packaged_image->content_key = hash_fnv1a_64(&job->is_srgb, sizeof(job->is_srgb), job->cache_key);
+            for (u32 level = 0; level < levels->level_count; ++level)
+            {
+                packaged_image->level_sizes[level] = levels->level_sizes[level];
+                packaged_image->level_offsets[level] = image_data.used_size;
+                memcpy(push_size(&image_data, 1, levels->level_sizes[level]), levels->data + levels->level_offsets[level], levels->level_sizes[level]);
+            }
+
+            decode_time += job->decode_time;
+            cached_count += job->was_cached;
+            free_texture_levels(levels);
+        }
+        free(load_jobs);
+
+        if (data->images_count > 0)
+        {
+            printf("Loaded %d images (%d from the texture cache) in %.1f ms: %.1f ms decoding over %d workers\n",
+                (int)packaged_images_count, (int)cached_count, (glfwGetTime() - images_start_time) * 1000.0,
+                decode_time * 1000.0, (int)get_job_worker_count());
+        }
+        if (duplicates_count > 0)
+        {
+            printf("   - Deduplicated %d images with identical content (%.1f MB of encoded image data)\n",
+                (int)duplicates_count, duplicate_bytes / (1024.0 * 1024.0));
+        }
+    }
+
+    // Map textures to images
+    PackagedTexture* textures = calloc(data->textures_count > 0 ? data->textures_count : 1, sizeof(PackagedTexture));
+    for (u32 tex_i = 0; tex_i < data->textures_count; ++tex_i)
+    {
+        cgltf_texture* texture = &data->textures[tex_i];
+        textures[tex_i].image_index = image_remap[texture->image - data->images];
+
+        cgltf_sampler* sampler = texture->sampler;
+        if (sampler)
+        {
+            textures[tex_i].has_sampler = 1;
+            textures[tex_i].min_filter = sampler->min_filter ? sampler->min_filter : GL_LINEAR;
+            textures[tex_i].mag_filter = sampler->mag_filter ? sampler->mag_filter : GL_LINEAR;
+            textures[tex_i].wrap_s = sampler->wrap_s ? sampler->wrap_s : GL_REPEAT;
+            textures[tex_i].wrap_t = sampler->wrap_t ? sampler->wrap_t : GL_REPEAT;
+        }
+    }
+    free(image_remap);
+
+    // Material table, so draw calls don't have to look up textures every frame
+    PackagedMaterial* materials = calloc(data->materials_count > 0 ? data->materials_count : 1, sizeof(PackagedMaterial));
+    for (u32 mat_i = 0; mat_i < data->materials_count; ++mat_i)
+    {
+        materials[mat_i] = build_gltf_pbr_material(data, &data->materials[mat_i]);
+    }
+
+    // One packaged primitive (and later vao) per glTF primitive
+    VAO_Range* vao_ranges = calloc(data->meshes_count > 0 ? data->meshes_count : 1, sizeof(VAO_Range));
+    DynamicArray primitives = create_array(1 * sizeof(PackagedPrimitive));
+    DynamicArray vertices = create_array(1024);
+    DynamicArray lod_indices = create_array(1 * sizeof(u32));
+    DynamicArray meshlets = create_array(1 * sizeof(MeshletData));
+    u64 reordered_misses_before = 0;
+    u64 reordered_misses_after = 0;
+    u64 reordered_triangles = 0;
+    u64 float_vertex_bytes = 0;
+
+    for (u32 mesh_i = 0; mesh_i < data->meshes_count; ++mesh_i)
+    {
+        cgltf_mesh* mesh = &data->meshes[mesh_i];
+
+        // Keep track of the range of elements in vaos that this mesh uses
+        vao_ranges[mesh_i].begin = array_length(&primitives, sizeof(PackagedPrimitive));  // Used for rendering
+        vao_ranges[mesh_i].count = mesh->primitives_count;                                 // ..
+
+        PackagedPrimitive* mesh_primitives = push_size(&primitives, sizeof(PackagedPrimitive), mesh->primitives_count);
+        memset(mesh_primitives, 0, sizeof(PackagedPrimitive) * mesh->primitives_count);
+
+        // Now loop over each primitive and pack its vertices and indices
+        for (u32 prim_i = 0; prim_i < mesh->primitives_count; ++prim_i)
+        {
+            cgltf_primitive* prim = &mesh->primitives[prim_i];
+            PackagedPrimitive* primitive = &mesh_primitives[prim_i];
+            primitive->primitive_mode = gl_primitive_mode_from_cgltf(prim->type);
+            primitive->material_index = prim->material ? (u32)(prim->material - data->materials) : SCENE_NO_MATERIAL;
+
+            // Keep track of transparent and opaque primitive counts for fast alpha blend sorting during rendering
+            if (prim->material)
+            {
+                if (prim->material->alpha_mode == cgltf_alpha_mode_blend)
+                {
+                    ++header->total_transparent_primitives;
+                }
+                else
+                {
+                    ++header->total_opaque_primitives;
+                }
+            }
+            else
+            {
+                ++header->total_opaque_primitives;
+            }
+
+            // Find the attributes POSITION, NORMAL, and TEXCOORD_0
+            cgltf_attribute* POSITION = NULL;
+            cgltf_attribute* NORMAL = NULL;
+            cgltf_attribute* TEXCOORD_0 = NULL;
+            cgltf_attribute* TANGENT = NULL;
+            for (u32 attrib_i = 0; attrib_i < prim->attributes_count; ++attrib_i)
+            {
+                cgltf_attribute* attrib = &prim->attributes[attrib_i];
+                switch (attrib->type)
+                {
+                    case cgltf_attribute_type_position:
+                        POSITION = attrib;
+                        break;
+
+                    case cgltf_attribute_type_normal:
+                        NORMAL = attrib;
+                        break;
+                    
+                    case cgltf_attribute_type_texcoord:
+                        if (attrib->index == 0)  // GLTF can have multiple texcoords
+                        {
+                            TEXCOORD_0 = attrib;
+                        }
+                        break;
+                    
+                    case cgltf_attribute_type_tangent:
+                        TANGENT = attrib;
+                        break;
+                    
+                    default:
+                        continue;
+                }
+            }
+            
+            if (POSITION == NULL)
+            {
+                printf("Error: POSITION attribute required but missing in %s\n", filename);
+                exit(1);
+            }
+
+            // The load time mesh processing works on u32 indices and float positions
+            u32 vertex_count = POSITION->data->count;
+            u32 index_count = prim->indices ? prim->indices->count : 0;
+            f32* positions = malloc(3 * (vertex_count > 0 ? vertex_count : 1) * sizeof(f32));
+            u32* indices = malloc((index_count > 0 ? index_count : 1) * sizeof(u32));
+            cgltf_accessor_unpack_floats(POSITION->data, positions, 3 * vertex_count);
+            for (u32 i = 0; i < index_count; ++i)
+            {
+                indices[i] = (u32)cgltf_accessor_read_index(prim->indices, i);
+            }
+
+            // Triangle lists are reordered for the vertex cache and overdraw, and with QUANTIZE_VERTICES their vertices for fetch locality
+            u32* vertex_remap = NULL;
+            if (prim->indices != NULL && prim->type == cgltf_primitive_type_triangles)
+            {
+                reordered_misses_before += count_vertex_cache_misses(indices, index_count, vertex_count);
+                vertex_remap = optimize_primitive_triangle_order(indices, index_count, positions, vertex_count);
+                reordered_misses_after += count_vertex_cache_misses(indices, index_count, vertex_count);
+                reordered_triangles += index_count / 3;
+            }
+
+            build_primitive_vertices(filename, POSITION, NORMAL, TEXCOORD_0, TANGENT, vertex_remap, &vertices, primitive);
+            float_vertex_bytes += vertex_count * (3 + (NORMAL ? 3 : 0) + (TEXCOORD_0 ? 2 : 0) + (TANGENT ? 4 : 0)) * sizeof(f32);
+
+            // Indexed primitives draw from a u32 copy of their (reordered) indices, with levels of detail if they're big enough
+            if (prim->indices != NULL)
+            {
+                if (prim->type == cgltf_primitive_type_triangles && index_count / 3 >= LOD_MIN_TRIANGLES)
+                {
+                    build_primitive_lods(indices, index_count, positions, vertex_count, &lod_indices, &primitive->lods);
+
+                    if (index_count / 3 >= MESHLET_MIN_TRIANGLES)
+                    {
+                        build_primitive_meshlets(positions, vertex_count, &lod_indices, &primitive->lods, primitive->position_dequantization,
+                                                 &meshlets, &primitive->meshlets);
+                    }
+                }
+                else
+                {
+                    copy_primitive_indices(indices, index_count, &lod_indices, &primitive->lods);
+                }
+            }
+
+            free(vertex_remap);
+            free(indices);
+            free(positions);
+        }
+    }
+
+    u32 lod_primitives = 0;
+    u32 meshlet_primitives = 0;
+    for (u32 prim_i = 0; prim_i < array_length(&primitives, sizeof(PackagedPrimitive)); ++prim_i)
+    {
+        PackagedPrimitive* primitive = get_element(&primitives, sizeof(PackagedPrimitive), prim_i);
+        lod_primitives += primitive->lods.count > 1;
+        meshlet_primitives += primitive->meshlets.count > 0;
+    }
+    printf("Built LODs for %d primitives (%d KB of indices)\n", (int)lod_primitives, (int)(lod_indices.used_size / 1024));
+    if (reordered_triangles > 0)
+    {
+        printf("Reordered triangles for the vertex cache, %.3f -> %.3f vertices per triangle\n",
+               (f64)reordered_misses_before / reordered_triangles, (f64)reordered_misses_after / reordered_triangles);
+    }
+    printf("Split %d primitives into %d meshlets\n", (int)meshlet_primitives, (int)array_length(&meshlets, sizeof(MeshletData)));
+    #if QUANTIZE_VERTICES
+    printf("Quantized vertices into %d KB (%d KB as floats)\n", (int)(vertices.used_size / 1024), (int)(float_vertex_bytes / 1024));
+    #endif
+
+    // Flatten the node hierarchy into primitive instances with world space bounds
+    DynamicArray instances = create_array(data->nodes_count * sizeof(PrimitiveInstance));
+    if (data->scene)
+    {
+        for (u32 i = 0; i < data->scene->nodes_count; ++i)
+        {
+            collect_gltf_node_instances(data, data->scene->nodes[i], GLM_MAT4_IDENTITY, &instances);
+        }
+    }
+    else
+    {
+        // No default scene given, so draw every root node
+        for (u32 i = 0; i < data->nodes_count; ++i)
+        {
+            if (data->nodes[i].parent == NULL)
+            {
+                collect_gltf_node_instances(data, &data->nodes[i], GLM_MAT4_IDENTITY, &instances);
+            }
+        }
+    }
+
+    u32 instances_count = (u32)array_length(&instances, sizeof(PrimitiveInstance));
+    vec3* instance_world_bounds = malloc(2 * sizeof(vec3) * (instances_count > 0 ? instances_count : 1));
+    for (u32 i = 0; i < instances_count; ++i)
+    {
+        PrimitiveInstance* instance = get_element(&instances, sizeof(PrimitiveInstance), i);
+        cgltf_primitive* prim = &data->meshes[instance->mesh_index].primitives[instance->prim_index];
+
+        vec3 local_bounds[2];
+        gltf_primitive_local_bounds(prim, local_bounds);
+        glm_aabb_transform(local_bounds, instance->model, &instance_world_bounds[2 * i]);
+    }
+
+    size_t lights_size;
+    u8* lights = extract_gltf_lights(data, instances.data_buffer, instances_count, &lights_size);
+
+    header->meshes_count = data->meshes_count;
+    header->primitives_count = array_length(&primitives, sizeof(PackagedPrimitive));
+    header->lod_indices_count = array_length(&lod_indices, sizeof(u32));
+    header->meshlets_count = array_length(&meshlets, sizeof(MeshletData));
+    header->materials_count = data->materials_count;
+    header->textures_count = data->textures_count;
+    header->images_count = packaged_images_count;
+    header->instances_count = instances_count;
+    header->vertices_size = vertices.used_size;
+    header->image_data_size = image_data.used_size;
+    header->lights_size = lights_size;
+    header->dependencies_size = dependencies.used_size;
+    header->dependencies_stamp = hash_scene_package_dependencies(dependencies.data_buffer, dependencies.used_size);
+
+    package.vao_ranges = vao_ranges;
+    package.primitives = primitives.data_buffer;
+    package.vertices = vertices.data_buffer;
+    package.lod_indices = lod_indices.data_buffer;
+    package.meshlets = meshlets.data_buffer;
+    package.materials = materials;
+    package.textures = textures;
+    package.images = images;
+    package.image_data = image_data.data_buffer;
+    package.instances = instances.data_buffer;
+    package.instance_world_bounds = instance_world_bounds;
+    package.lights = lights;
+    package.dependencies = dependencies.data_buffer;
+
+    cgltf_free(data);
+    assert(file_mappings.used_size == 0 && "cgltf_free() should have released every mapped file");
+    free_array(&file_mappings);
+    *out_package = package;
+}
+
+#define SCENE_PACKAGE_SECTION_COUNT 13
+#define SCENE_PACKAGE_ALIGNMENT 16  // Of each section in the package file, for the vec4s
+
+void
+get_scene_package_sections(ScenePackage* package, void** out_sections[SCENE_PACKAGE_SECTION_COUNT], u64 out_sizes[SCENE_PACKAGE_SECTION_COUNT])
+{
+    /* The package's arrays in the order they're stored after its header, and their sizes */
+    ScenePackageHeader* header = &package->header;
+    void** sections[SCENE_PACKAGE_SECTION_COUNT] = {
+        (void**)&package->vao_ranges,
+        (void**)&package->primitives,
+        (void**)&package->vertices,
+        (void**)&package->lod_indices,
+        (void**)&package->meshlets,
+        (void**)&package->materials,
+        (void**)&package->textures,
+        (void**)&package->images,
+        (void**)&package->image_data,
+        (void**)&package->instances,
+        (void**)&package->instance_world_bounds,
+        (void**)&package->lights,
+        (void**)&package->dependencies,
+    };
+    u64 sizes[SCENE_PACKAGE_SECTION_COUNT] = {
+        header->meshes_count * sizeof(VAO_Range),
+        header->primitives_count * sizeof(PackagedPrimitive),
+        header->vertices_size,
+        header->lod_indices_count * sizeof(u32),
+        header->meshlets_count * sizeof(MeshletData),
+        header->materials_count * sizeof(PackagedMaterial),
+        header->textures_count * sizeof(PackagedTexture),
+        header->images_count * sizeof(PackagedImage),
+        header->image_data_size,
+        header->instances_count * sizeof(PrimitiveInstance),
+        2 * header->instances_count * sizeof(vec3),
+        header->lights_size,
+        header->dependencies_size,
+    };
+    memcpy(out_sections, sections, sizeof(sections));
+    memcpy(out_sizes, sizes, sizeof(sizes));
+}
+
+u64
+align_scene_package_offset(u64 offset)
+{
+    return (offset + SCENE_PACKAGE_ALIGNMENT - 1) & ~(u64)(SCENE_PACKAGE_ALIGNMENT - 1);
+}
+
+b32
+is_scene_package_valid(const ScenePackage* package)
+{
+    /* Checks every offset, count and index a package holds against the sections they point into, so a corrupt or
+     * stale cache file is rebuilt instead of read out of bounds */
+    const ScenePackageHeader* header = &package->header;
+    b32 is_valid = 1;
+
+    for (u32 i = 0; is_valid && i < header->meshes_count; ++i)
+    {
+        VAO_Range range = package->vao_ranges[i];
+        is_valid = range.begin <= header->primitives_count && range.count <= header->primitives_count - range.begin;
+    }
+
+    u64 package_vertex_count = header->vertices_size / SCENE_VERTEX_SIZE;
+    for (u32 i = 0; is_valid && i < header->primitives_count; ++i)
+    {
+        const PackagedPrimitive* primitive = &package->primitives[i];
+        const PrimitiveLODs* lods = &primitive->lods;
+        is_valid = (u64)primitive->first_vertex + primitive->vertex_count <= package_vertex_count
+            && (primitive->material_index == SCENE_NO_MATERIAL || primitive->material_index < header->materials_count)
+            && lods->count <= MAX_PRIMITIVE_LODS
+            && (u64)primitive->meshlets.first + primitive->meshlets.count <= header->meshlets_count;
+
+        for (u32 lod = 0; is_valid && lod < lods->count; ++lod)
+        {
+            is_valid = (u64)lods->first_index[lod] + lods->index_count[lod] <= header->lod_indices_count;
+            const u32* indices = &package->lod_indices[is_valid ? lods->first_index[lod] : 0];
+            for (u32 index = 0; is_valid && index < lods->index_count[lod]; ++index)
+            {
+                is_valid = indices[index] < primitive->vertex_count;
+            }
+        }
+    }
+
+    for (u32 i = 0; is_valid && i < header->meshlets_count; ++i)
+    {
+        is_valid = (u64)package->meshlets[i].first_index + package->meshlets[i].index_count <= header->lod_indices_count;
+    }
+
+    for (u32 i = 0; is_valid && i < header->materials_count; ++i)
+    {
+        for (u32 unit = 0; is_valid && unit < PBR_NUM_USED_TEXTURE_UNITS; ++unit)
+        {
+            s32 texture_index = package->materials[i].texture_indices[unit];
+            is_valid = texture_index == SCENE_NO_TEXTURE || (texture_index >= 0 && (u32)texture_index < header->textures_count);
+        }
+    }
+
+    for (u32 i = 0; is_valid && i < header->textures_count; ++i)
+    {
+        is_valid = package->textures[i].image_index < header->images_count;
+    }
+
+    for (u32 i = 0; is_valid && i < header->images_count; ++i)
+    {
+        // Levels are streamed in rows worked out from the format and dimensions, so their sizes have to agree
+        const PackagedImage* image = &package->images[i];
+        is_valid = image->width > 0 && image->width <= TEXTURE_MAX_SIZE && image->height > 0 && image->height <= TEXTURE_MAX_SIZE
+            && image->level_count >= 1 && image->level_count <= texture_level_count(image->width, image->height);
+        for (u32 level = 0; is_valid && level < image->level_count; ++level)
+        {
+            u32 level_size = texture_level_size(image->format, image->width, image->height, level);
+            is_valid = level_size != 0 && image->level_sizes[level] == level_size
+                && image->level_offsets[level] <= header->image_data_size
+                && level_size <= header->image_data_size - image->level_offsets[level];
+        }
+    }
+
+    for (u32 i = 0; is_valid && i < header->instances_count; ++i)
+    {
+        const PrimitiveInstance* instance = &package->instances[i];
+        is_valid = instance->mesh_index < header->meshes_count && instance->prim_index < package->vao_ranges[instance->mesh_index].count;
+    }
+
+    // Read with read_light_rig() when the scene is created
+    is_valid = is_valid && is_light_rig_valid(package->lights, header->lights_size);
+
+    // Always holds at least the glTF file's path, and the paths are read with strlen()
+    return is_valid && header->dependencies_size > 0 && package->dependencies[header->dependencies_size - 1] == '\0';
+}
+
+b32
+map_scene_package(u64 key, ScenePackage* out_package)
+{
+    /* Points the package's arrays into its mapped cache file, returns 0 when there isn't one or it's out of date */
+    ScenePackage package = { 0 };
+    if (!cache_map("scene", key, SCENE_PACKAGE_VERSION, &package.mapping))
+    {
+        return 0;
+    }
+
+    u8* data = (u8*)package.mapping.data;
+    u64 offset = align_scene_package_offset(sizeof(ScenePackageHeader));
+    b32 is_valid = package.mapping.size >= offset;
+    if (is_valid)
+    {
+        memcpy(&package.header, data, sizeof(ScenePackageHeader));
+
+        void** sections[SCENE_PACKAGE_SECTION_COUNT];
+        u64 sizes[SCENE_PACKAGE_SECTION_COUNT];
+        get_scene_package_sections(&package, sections, sizes);
+        for (u32 i = 0; is_valid && i < SCENE_PACKAGE_SECTION_COUNT; ++i)
+        {
+            // Sizes come from the file, compared this way round so a huge one can't wrap the offset
+            is_valid = sizes[i] <= package.mapping.size - offset;
+            *sections[i] = data + offset;
+            offset = is_valid ? align_scene_package_offset(offset + sizes[i]) : offset;
+        }
+        is_valid = is_valid && offset == package.mapping.size && is_scene_package_valid(&package);
+    }
+
+    // Rebuild when the file is truncated or corrupt, or the glTF file or anything it refers to changed since it was written
+    if (!is_valid ||
+        hash_scene_package_dependencies(package.dependencies, package.header.dependencies_size) != package.header.dependencies_stamp)
+    {
+        cache_unmap(&package.mapping);
+        return 0;
+    }
+
+    *out_package = package;
+    return 1;
+}
+
+void
+write_scene_package(u64 key, ScenePackage* package)
+{
+    static const u8 padding[SCENE_PACKAGE_ALIGNMENT] = { 0 };
+
+    void** sections[SCENE_PACKAGE_SECTION_COUNT];
+    u64 sizes[SCENE_PACKAGE_SECTION_COUNT];
+    get_scene_package_sections(package, sections, sizes);
+
+    // Header, then each section padded to the alignment
+    const void* parts[2 * (SCENE_PACKAGE_SECTION_COUNT + 1)];
+    size_t part_sizes[2 * (SCENE_PACKAGE_SECTION_COUNT + 1)];
+    u32 part_count = 0;
+    for (u32 i = 0; i <= SCENE_PACKAGE_SECTION_COUNT; ++i)
+    {
+        const void* section = i == 0 ? &package->header : *sections[i - 1];
+        u64 size = i == 0 ? sizeof(ScenePackageHeader) : sizes[i - 1];
+        parts[part_count] = section;
+        part_sizes[part_count++] = size;
+        parts[part_count] = padding;
+        part_sizes[part_count++] = align_scene_package_offset(size) - size;
+    }
+
+    cache_write_parts("scene", key, SCENE_PACKAGE_VERSION, parts, part_sizes, part_count);
+}
+
+void
+free_scene_package(ScenePackage* package)
+{
+    if (package->mapping.file.view)
+    {
+        cache_unmap(&package->mapping);
+    }
+    else
+    {
+        void** sections[SCENE_PACKAGE_SECTION_COUNT];
+        u64 sizes[SCENE_PACKAGE_SECTION_COUNT];
+        get_scene_package_sections(package, sections, sizes);
+        for (u32 i = 0; i < SCENE_PACKAGE_SECTION_COUNT; ++i)
+        {
+            free(*sections[i]);
+        }
+    }
+    memset(package, 0, sizeof(*package));
+}
+
+StagingBuffer
+create_staging_buffer(u64 total_upload_size)
+{
+    // Small scenes fit in one region, no point allocating more than that
+    StagingBuffer staging = { 0 };
+    u64 aligned_upload_size = (total_upload_size + 255) & ~(u64)255;
+    staging.region_size = aligned_upload_size < STAGING_MAX_REGION_SIZE ? (u32)aligned_upload_size : STAGING_MAX_REGION_SIZE;
+    staging.region_size = staging.region_size > 0 ? staging.region_size : 256;
+    u32 size = STAGING_REGIONS_COUNT * staging.region_size;
+    glCreateBuffers(1, &staging.buffer);
+    glNamedBufferStorage(staging.buffer, size, NULL, GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+    staging.mapped_pointer = glMapNamedBufferRange(staging.buffer, 0, size, GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+    return staging;
+}
+
+void
+staged_buffer_upload(StagingBuffer* staging, u32 buffer, u64 offset, const void* data, u64 size)
+{
+    /* Copies size bytes of data to buffer at offset through the staging regions */
+    for (u64 uploaded = 0; uploaded < size; uploaded += staging->region_size)
+    {
+        u64 chunk_size = size - uploaded < staging->region_size ? size - uploaded : staging->region_size;
+        u32 region = staging->region;
+        staging->region = (staging->region + 1) % STAGING_REGIONS_COUNT;
+        if (staging->region_fences[region])
+        {
+            glClientWaitSync(staging->region_fences[region], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+            glDeleteSync(staging->region_fences[region]);
+        }
+
+        memcpy(staging->mapped_pointer + region * staging->region_size, (const u8*)data + uploaded, chunk_size);
+        glCopyNamedBufferSubData(staging->buffer, buffer, region * staging->region_size, offset + uploaded, chunk_size);
+        staging->region_fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+    staging->uploaded_bytes += size;
+}
+
+void
+free_staging_buffer(StagingBuffer* staging)
+{
+    // Deleting the buffer is fine with copies still in flight, GL keeps it alive until they're done
+    for (u32 i = 0; i < STAGING_REGIONS_COUNT; ++i)
+    {
+        if (staging->region_fences[i])
+        {
+            glDeleteSync(staging->region_fences[i]);
+        }
+    }
+    glUnmapNamedBuffer(staging->buffer);
+    glDeleteBuffers(1, &staging->buffer);
+    memset(staging, 0, sizeof(*staging));
+}
+
+u32
+create_geometry_buffer(u64 size, u64 min_size)
+{
+    // Filled with staged_buffer_upload()
+    u32 buffer;
+    glCreateBuffers(1, &buffer);
+    glNamedBufferStorage(buffer, size > min_size ? size : min_size, NULL, 0);
+    return buffer;
+}
+
+ResidentTexture*
+find_resident_texture(u64 content_key, u32 texture)
+{
+    // By content_key, or by texture when it's 0
+    u32 count = resident_textures.data_buffer ? array_length(&resident_textures, sizeof(ResidentTexture)) : 0;
+    for (u32 i = 0; i < count; ++i)
+    {
+        ResidentTexture* resident = get_element(&resident_textures, sizeof(ResidentTexture), i);
+        if (content_key ? resident->content_key == content_key : resident->texture == texture)
+        {
+            return resident;
+        }
+    }
+    return NULL;
+}
+
+u32
+acquire_resident_texture(u64 content_key, u64 size, b32* out_is_new, b32* out_is_uploaded)
+{
+    /* Returns the texture for an image's content, a new one without storage when there isn't one yet */
+    ResidentTexture* resident = find_resident_texture(content_key, 0);
+    *out_is_new = resident == NULL;
+    if (resident == NULL)
+    {
+        if (resident_textures.data_buffer == NULL)
+        {
+            resident_textures = create_array(64 * sizeof(ResidentTexture));
+        }
+
+        resident = push_size(&resident_textures, sizeof(ResidentTexture), 1);
+        memset(resident, 0, sizeof(*resident));
+        resident->content_key = content_key;
+        resident->size = size;
+        glCreateTextures(GL_TEXTURE_2D, 1, &resident->texture);
+    }
+
+    ++resident->ref_count;
+    *out_is_uploaded = resident->is_uploaded;
+    return resident->texture;
+}
+
+void
+mark_resident_texture_uploaded(u32 texture)
+{
+    ResidentTexture* resident = find_resident_texture(0, texture);
+    assert(resident && "Not a resident texture");
+    resident->is_uploaded = 1;
+}
+
+void
+release_resident_texture(u32 texture)
+{
+    // Kept until delete_unused_resident_textures() so a scene loaded right after can still take it
+    ResidentTexture* resident = find_resident_texture(0, texture);
+    assert(resident && resident->ref_count > 0 && "Releasing a texture that wasn't acquired");
+    --resident->ref_count;
+}
+
+void
+delete_unused_resident_textures()
+{
+    u32 deleted_count = 0;
+    u64 deleted_bytes = 0;
+    u32 count = resident_textures.data_buffer ? array_length(&resident_textures, sizeof(ResidentTexture)) : 0;
+    for (u32 i = 0; i < count;)
+    {
+        ResidentTexture* resident = get_element(&resident_textures, sizeof(ResidentTexture), i);
+        if (resident->ref_count > 0)
+        {
+            ++i;
+            continue;
+        }
+
+        glDeleteTextures(1, &resident->texture);
+        ++deleted_count;
+        deleted_bytes += resident->size;
+        *resident = *(ResidentTexture*)get_element(&resident_textures, sizeof(ResidentTexture), --count);
+        resident_textures.used_size -= sizeof(ResidentTexture);
+    }
+
+    if (deleted_count > 0)
+    {
+        printf("Deleted %d textures no scene uses anymore (%.1f MB)\n", (int)deleted_count, deleted_bytes / (1024.0 * 1024.0));
+    }
+}
+
+void
+end_texture_stream(TextureStream* stream)
+{
+    // Fine to call with uploads still in flight, GL keeps the buffer alive until they're done
+    for (u32 i = 0; i < TEXTURE_STREAM_FRAMES; ++i)
+    {
+        if (stream->frame_fences[i])
+        {
+            glDeleteSync(stream->frame_fences[i]);
+        }
+    }
+    if (stream->pixel_unpack_buffer)
+    {
+        glUnmapNamedBuffer(stream->pixel_unpack_buffer);
+        glDeleteBuffers(1, &stream->pixel_unpack_buffer);
+    }
+    free_scene_package(&stream->package);
+    free(stream->is_image_uploaded);
+    free(stream->material_images);
+    memset(stream, 0, sizeof(*stream));
+}
+
+TextureStream
+begin_texture_stream(ScenePackage* package, b8* is_image_uploaded, s32* material_images, u32 materials_count)
+{
+    /* Takes the package (and the arrays), the caller's copy is cleared */
+    TextureStream stream = { 0 };
+    stream.package = *package;
+    stream.is_image_uploaded = is_image_uploaded;
+    stream.material_images = material_images;
+    stream.materials_count = materials_count;
+    stream.start_time = glfwGetTime();
+    memset(package, 0, sizeof(*package));
+
+    u64 texture_bytes = 0;
+    for (u32 img_i = 0; img_i < stream.package.header.images_count; ++img_i)
+    {
+        for (u32 level = 0; level < stream.package.images[img_i].level_count && !is_image_uploaded[img_i]; ++level)
+        {
+            texture_bytes += stream.package.images[img_i].level_sizes[level];
+        }
+    }
+    if (texture_bytes == 0)
+    {
+        end_texture_stream(&stream);
+        return stream;
+    }
+
+    stream.region_size = texture_bytes < TEXTURE_STREAM_BUDGET ? (u32)(texture_bytes + 255) & ~255u : TEXTURE_STREAM_BUDGET;
+    u64 frames_needed = (texture_bytes + TEXTURE_STREAM_BUDGET - 1) / TEXTURE_STREAM_BUDGET;
+    stream.regions_count = frames_needed < TEXTURE_STREAM_FRAMES ? (u32)frames_needed : TEXTURE_STREAM_FRAMES;
+    stream.is_active = 1;
+    return stream;
+}
+
+void
+stream_scene_textures(Scene* scene, f32 last_frame_time)
+{
+    /* Uploads up to TEXTURE_STREAM_BUDGET bytes of the scene's texture levels, in order, through this frame's region
+     * of the pixel unpack ring. Materials switch from the placeholders to a texture once its whole mip chain is in.
+     * Called once a frame before drawing */
+    TextureStream* stream = &scene->texture_stream;
+    if (!stream->is_active)
+    {
+        return;
+    }
+
+    f64 start_time = glfwGetTime();
+    if (stream->pixel_unpack_buffer == 0)
+    {
+        // Created here rather than when the scene is loaded, so loading returns as soon as the geometry is ready
+        u32 size = stream->regions_count * stream->region_size;
+        glCreateBuffers(1, &stream->pixel_unpack_buffer);
+        glNamedBufferStorage(stream->pixel_unpack_buffer, size, NULL, GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+        stream->mapped_pointer = glMapNamedBufferRange(stream->pixel_unpack_buffer, 0, size, GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+    }
+
+    if (stream->frames_count > 0)
+    {
+        // The previous frame did the previous upload
+        stream->total_frame_time += last_frame_time;
+        stream->max_frame_time = last_frame_time > stream->max_frame_time ? last_frame_time : stream->max_frame_time;
+    }
+
+    u32 region = stream->frame;
+    stream->frame = (stream->frame + 1) % stream->regions_count;
+    if (stream->frame_fences[region])
+    {
+        glClientWaitSync(stream->frame_fences[region], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+        glDeleteSync(stream->frame_fences[region]);
+        stream->frame_fences[region] = 0;
+    }
+
+    ScenePackage* package = &stream->package;
+    u32 region_offset = region * stream->region_size;
+    u32 region_used = 0;
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, stream->pixel_unpack_buffer);
+    while (stream->next_image < package->header.images_count)
+    {
+        if (stream->is_image_uploaded[stream->next_image])
+        {
+            ++stream->next_image;
+            continue;
+        }
+
+        PackagedImage* image = &package->images[stream->next_image];
+        u32 tex = scene->texture_objects[stream->next_image];
+        u32 level = stream->next_level;
+        u32 level_width = max(1, image->width >> level);
+        u32 level_height = max(1, image->height >> level);
+
+        // Upload as many whole rows as fit in what's left of the budget
+        u32 row_height = image->format == TEXTURE_FORMAT_RGBA8 ? 1 : 4;
+        u32 rows_count = (level_height + row_height - 1) / row_height;
+        u32 row_size = image->level_sizes[level] / rows_count;
+        assert(row_size <= stream->region_size && "A row of a texture doesn't fit in the streaming budget");
+        u32 rows = (stream->region_size - region_used) / row_size;
+        rows = rows < rows_count - stream->next_row ? rows : rows_count - stream->next_row;
+        if (rows == 0)
+        {
+            break;
+        }
+
+        u32 y = stream->next_row * row_height;
+        u32 height = rows * row_height < level_height - y ? rows * row_height : level_height - y;
+        u32 size = rows * row_size;
+        memcpy(stream->mapped_pointer + region_offset + region_used, package->image_data + image->level_offsets[level] + stream->next_row * row_size, size);
+        void* offset = (void*)(uintptr_t)(region_offset + region_used);
+        if (image->format == TEXTURE_FORMAT_RGBA8)
+        {
+            glTextureSubImage2D(tex, level, 0, y, level_width, height, GL_RGBA, GL_UNSIGNED_BYTE, offset);
+        }
+        else
+        {
+            u32 internal_format = get_texture_internal_format(image->format, image->is_srgb);
+            glCompressedTextureSubImage2D(tex, level, 0, y, level_width, height, internal_format, size, offset);
+        }
+        region_used += size;
+
+        stream->next_row += rows;
+        if (stream->next_row < rows_count)
+        {
+            continue;
+        }
+        stream->next_row = 0;
+        if (++stream->next_level < image->level_count)
+        {
+            continue;
+        }
+
+        // The whole mip chain is in, swap it in for the placeholders
+        mark_resident_texture_uploaded(tex);
+        ++stream->uploaded_images_count;
+        for (u32 i = 0; i < stream->materials_count * PBR_NUM_USED_TEXTURE_UNITS; ++i)
+        {
+            if (stream->material_images[i] == (s32)stream->next_image)
+            {
+                scene->materials[i / PBR_NUM_USED_TEXTURE_UNITS].texture_ids[i % PBR_NUM_USED_TEXTURE_UNITS] = tex;
+            }
+        }
+        stream->next_level = 0;
+        ++stream->next_image;
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    if (region_used > 0)
+    {
+        stream->frame_fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+    stream->uploaded_bytes += region_used;
+    ++stream->frames_count;
+    f64 upload_time = glfwGetTime() - start_time;
+    stream->max_upload_time = upload_time > stream->max_upload_time ? upload_time : stream->max_upload_time;
+
+    if (stream->next_image == package->header.images_count)
+    {
+        printf("Streamed %d textures (%.1f MB) over %d frames in %.1f ms, at most %.1f ms uploading per frame\n",
+            (int)stream->uploaded_images_count, stream->uploaded_bytes / (1024.0 * 1024.0), (int)stream->frames_count,
+            (glfwGetTime() - stream->start_time) * 1000.0, stream->max_upload_time * 1000.0);
+        if (stream->frames_count > 1)
+        {
+            printf("   - Frames while streaming took %.1f ms on average and %.1f ms at most\n",
+                stream->total_frame_time / (stream->frames_count - 1) * 1000.0, stream->max_frame_time * 1000.0);
+        }
+        end_texture_stream(stream);
+    }
+}
+
+void
+end_geometry_stream(GeometryStream* stream)
+{
+    // Only called early when the scene is freed before it was ever drawn, so the package goes with it
+    if (stream->staging.buffer)
+    {
+        free_staging_buffer(&stream->staging);
+    }
+    free_scene_package(&stream->package);
+    free(stream->is_image_uploaded);
+    free(stream->material_images);
+    memset(stream, 0, sizeof(*stream));
+}
+
+GeometryStream
+begin_geometry_stream(ScenePackage* package, u32 buffers[GEOMETRY_STREAM_BUFFERS_COUNT], b8* is_image_uploaded, s32* material_images)
+{
+    /* Takes the package (and the arrays), the caller's copy is cleared */
+    GeometryStream stream = { 0 };
+    stream.is_active = 1;
+    stream.package = *package;
+    stream.is_image_uploaded = is_image_uploaded;
+    stream.material_images = material_images;
+    memcpy(stream.buffers, buffers, sizeof(stream.buffers));
+    stream.start_time = glfwGetTime();
+    memset(package, 0, sizeof(*package));
+
+    ScenePackageHeader* header = &stream.package.header;
+    u64 geometry_size = header->vertices_size + header->lod_indices_count * sizeof(u32) + header->meshlets_count * sizeof(MeshletData);
+    stream.staging = create_staging_buffer(geometry_size < GEOMETRY_STREAM_BUDGET ? geometry_size : GEOMETRY_STREAM_BUDGET);
+    return stream;
+}
+
+void
+stream_scene_geometry(Scene* scene, u64 budget)
+{
+    /* Uploads up to budget bytes of the scene's vertices, LOD indices and meshlets through its staging buffer, then
+     * starts streaming its textures once they're all in. Called once a frame before a new scene is swapped in */
+    GeometryStream* stream = &scene->geometry_stream;
+    if (!stream->is_active)
+    {
+        return;
+    }
+
+    ScenePackage* package = &stream->package;
+    ScenePackageHeader* header = &package->header;
+    const u8* data[GEOMETRY_STREAM_BUFFERS_COUNT] = { package->vertices, (const u8*)package->lod_indices, (const u8*)package->meshlets };
+    u64 sizes[GEOMETRY_STREAM_BUFFERS_COUNT] = {
+        header->vertices_size, header->lod_indices_count * sizeof(u32), header->meshlets_count * sizeof(MeshletData)
+    };
+
+    u64 uploaded = 0;
+    while (stream->next_buffer < GEOMETRY_STREAM_BUFFERS_COUNT && uploaded < budget)
+    {
+        u64 left = sizes[stream->next_buffer] - stream->next_offset;
+        u64 size = left < budget - uploaded ? left : budget - uploaded;
+        staged_buffer_upload(&stream->staging, stream->buffers[stream->next_buffer], stream->next_offset, data[stream->next_buffer] + stream->next_offset, size);
+        uploaded += size;
+
+        stream->next_offset += size;
+        if (stream->next_offset == sizes[stream->next_buffer])
+        {
+            stream->next_offset = 0;
+            ++stream->next_buffer;
+        }
+    }
+    ++stream->frames_count;
+
+    if (stream->next_buffer == GEOMETRY_STREAM_BUFFERS_COUNT)
+    {
+        printf("Streamed %.1f MB of geometry through a %.1f MB staging buffer over %d frames in %.1f ms\n",
+            stream->staging.uploaded_bytes / (1024.0 * 1024.0), STAGING_REGIONS_COUNT * stream->staging.region_size / (1024.0 * 1024.0),
+            (int)stream->frames_count, (glfwGetTime() - stream->start_time) * 1000.0);
+        free_staging_buffer(&stream->staging);
+
+        // Takes the package and the arrays, which is everything left in the stream
+        scene->texture_stream = begin_texture_stream(package, stream->is_image_uploaded, stream->material_images, header->materials_count);
+        memset(stream, 0, sizeof(*stream));
+    }
+}
+
+Scene
+create_scene_from_package(ScenePackage* package, BVH instance_bvh)
+{
+    /* Creates the scene's GL objects, the geometry buffers are filled over the next frames from the package's arrays
+     * (see stream_scene_geometry()) and then the textures (see stream_scene_textures()). Takes the package, which is
+     * freed once the textures have streamed in, and the instance BVH built with it */
+    ScenePackageHeader* header = &package->header;
+    Scene scene = { 0 };
+
+    // Create a texture per image, their mip chains are streamed in over the next frames (see stream_scene_textures())
+    scene.texture_objects = calloc(header->images_count > 0 ? header->images_count : 1, sizeof(u32));
+    scene.texture_objects_count = header->images_count;
+    b8* is_image_uploaded = calloc(header->images_count > 0 ? header->images_count : 1, sizeof(b8));
+    {
+        u64 texture_bytes = 0;
+        u64 uncompressed_bytes = 0;  // What the same textures would take as RGBA8 with full mip chains
+        u32 reused_count = 0;
+        u64 reused_bytes = 0;
+        for (u32 img_i = 0; img_i < header->images_count; ++img_i)
+        {
+            PackagedImage* image = &package->images[img_i];
+            u64 image_bytes = 0;
+            for (u32 level = 0; level < image->level_count; ++level)
             {
-                printf("Error loading %s\nNORMAL attribute: Unsupported attribute format", filename);
-                exit(1);
+                u32 level_width = max(1, image->width >> level);
+                u32 level_height = max(1, image->height >> level);
+                image_bytes += image->level_sizes[level];
+                uncompressed_bytes += 4 * level_width * level_height;
             }
-
-            if (TEXCOORD_0 && TEXCOORD_0->data->type == cgltf_type_vec2)// && TEXCOORD_0->data->component_type == cgltf_component_type_r_32f)
+            texture_bytes += image_bytes;
+
+            // Textures still resident from another scene (or this one before a reload) are shared instead
+            b32 is_new;
+            b32 is_uploaded;
+            u32 tex = acquire_resident_texture(image->content_key, image_bytes, &is_new, &is_uploaded);
+            scene.texture_objects[img_i] = tex;
+            is_image_uploaded[img_i] = (b8)is_uploaded;
+            if (is_new)
             {
-                u32 vbo_TEXCOORD_0 = buffers[TEXCOORD_0_vbo_index];
-                u32 TEXCOORD_0_buffer_offset = TEXCOORD_0->data->offset + TEXCOORD_0->data->buffer_view->offset;
-                u32 TEXCOORD_0_component_type = gl_component_type_from_cgltf(TEXCOORD_0->data->component_type);
-
-                glEnableVertexArrayAttrib(vao, TEXCOORD_0_attrib_index);
-                glVertexArrayAttribBinding(vao, TEXCOORD_0_attrib_index, TEXCOORD_0_binding_point);
-                glVertexArrayAttribFormat(vao, TEXCOORD_0_attrib_index, 2, TEXCOORD_0_component_type, GL_FALSE, 0);
-                glVertexArrayVertexBuffer(vao, TEXCOORD_0_binding_point, vbo_TEXCOORD_0, TEXCOORD_0_buffer_offset, TEXCOORD_0->data->stride);
+                u32 internal_format = get_texture_internal_format(image->format, image->is_srgb);
+                glTextureStorage2D(tex, image->level_count, internal_format, image->width, image->height);
             }
-            else if (TEXCOORD_0)
+            else
             {
-                printf("Error loading %s\nTEXCOORD_0 attribute: Unsupported attribute format", filename);
-                exit(1);
+                ++reused_count;
+                reused_bytes += image_bytes;
             }
+        }
 
-            if (TANGENT && TANGENT->data->type == cgltf_type_vec4)// && TANGENT->data->component_type == cgltf_component_type_r_32f)
-            {
-                u32 vbo_TANGENT = buffers[TANGENT_vbo_index];
-                u32 TANGENT_buffer_offset = TANGENT->data->offset + TANGENT->data->buffer_view->offset;
-                u32 TANGENT_component_type = gl_component_type_from_cgltf(TANGENT->data->component_type);
-
-                glEnableVertexArrayAttrib(vao, TANGENT_attrib_index);
-                glVertexArrayAttribBinding(vao, TANGENT_attrib_index, TANGENT_binding_point);
-                glVertexArrayAttribFormat(vao, TANGENT_attrib_index, 4, TANGENT_component_type, GL_FALSE, 0);
-                glVertexArrayVertexBuffer(vao, TANGENT_binding_point, vbo_TANGENT, TANGENT_buffer_offset, TANGENT->data->stride);
-            }
-            else if (TANGENT)
-            {
-                printf("Error loading %s\nTANGENT attribute: Unsupported attribute format: %d, %d\n", filename, TANGENT->data->type, TANGENT->data->component_type);
-                exit(1);
-            }
+        if (header->images_count > 0)
+        {
+            printf("Streaming %d images, textures take %.1f MB (%.1f MB as RGBA8)\n", (int)header->images_count,
+                texture_bytes / (1024.0 * 1024.0), uncompressed_bytes / (1024.0 * 1024.0));
+        }
+        if (reused_count > 0)
+        {
+            printf("   - Reused %d resident textures (%.1f MB)\n", (int)reused_count, reused_bytes / (1024.0 * 1024.0));
+        }
+    }
 
-            // Get the primitive's indices if it has them
-            if (prim->indices != NULL)
-            {
-                int ebo_index = -1;
-                for (u32 buffer_i = 0; buffer_i < data->buffers_count; ++buffer_i)
-                {
-                    if (&data->buffers[buffer_i] == prim->indices->buffer_view->buffer)
-                    {
-                        ebo_index = buffer_i;
-                        break;
-                    }
-                }
+    // A sampler object per glTF texture rather than parameters on the GL textures, which are shared by every texture
+    // (in this scene or another) whose image has the same content
+    u32 samplers_count = header->textures_count + 1;
+    u32* samplers = calloc(samplers_count, sizeof(u32));
+    glCreateSamplers(samplers_count, samplers);
+    for (u32 sampler_i = 0; sampler_i < samplers_count; ++sampler_i)
+    {
+        b32 has_sampler = sampler_i < header->textures_count && package->textures[sampler_i].has_sampler;
+        PackagedTexture* texture = &package->textures[has_sampler ? sampler_i : 0];
+        glSamplerParameteri(samplers[sampler_i], GL_TEXTURE_MIN_FILTER, has_sampler ? texture->min_filter : GL_LINEAR);
+        glSamplerParameteri(samplers[sampler_i], GL_TEXTURE_MAG_FILTER, has_sampler ? texture->mag_filter : GL_LINEAR);
+        glSamplerParameteri(samplers[sampler_i], GL_TEXTURE_WRAP_S, has_sampler ? texture->wrap_s : GL_REPEAT);
+        glSamplerParameteri(samplers[sampler_i], GL_TEXTURE_WRAP_T, has_sampler ? texture->wrap_t : GL_REPEAT);
+    }
+    u32 default_sampler = samplers[header->textures_count];
 
-                assert(ebo_index >= 0);  // Make sure we found the buffer
-                u32 ebo = buffers[ebo_index];
-                glVertexArrayElementBuffer(vao, ebo);
-            }
+    // Create white texture for non-textured materials
+    u32 white_texture;
+    {
+        u8 single_white_pixel_data[4] = { 255, 255, 255, 255 };
+        glCreateTextures(GL_TEXTURE_2D, 1, &white_texture);
+        glTextureParameteri(white_texture, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTextureParameteri(white_texture, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTextureParameteri(white_texture, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTextureParameteri(white_texture, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTextureStorage2D(white_texture, 1, GL_RGBA8, 1, 1);
+        glTextureSubImage2D(white_texture, 0, 0, 0, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, single_white_pixel_data);
+    }
+
+    // Create flat normal map for materials with normal maps
+    u32 flat_normal_texture;
+    {
+        u8 single_flat_normal_pixel_data[3] = { 128, 128, 255 };
+        glCreateTextures(GL_TEXTURE_2D, 1, &flat_normal_texture);
+        glTextureParameteri(flat_normal_texture, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTextureParameteri(flat_normal_texture, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTextureParameteri(flat_normal_texture, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTextureParameteri(flat_normal_texture, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTextureStorage2D(flat_normal_texture, 1, GL_RGB8, 1, 1);
+        glTextureSubImage2D(flat_normal_texture, 0, 0, 0, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, single_flat_normal_pixel_data);
+    }
 
-            // printf("Loaded the following attributes: ");
-            // if (POSITION)
-            //     printf("positions");
-            // if (TEXCOORD_0)
-            //     printf(", texcoord_0s");
-            // if (NORMAL)
-            //     printf(", normals");
-            // if (TANGENT)
-            //     printf(", tangents");
-            // printf("\n");
+    // Material table, starting out with the fallback textures for everything not resident yet. Each texture is
+    // switched in once its image has streamed in
+    PBRMaterial* materials = calloc(header->materials_count > 0 ? header->materials_count : 1, sizeof(PBRMaterial));
+    s32* material_images = malloc((header->materials_count > 0 ? header->materials_count : 1) * PBR_NUM_USED_TEXTURE_UNITS * sizeof(s32));
+    for (u32 mat_i = 0; mat_i < header->materials_count; ++mat_i)
+    {
+        PackagedMaterial* packaged_material = &package->materials[mat_i];
+        materials[mat_i].uniforms = packaged_material->uniforms;
+        materials[mat_i].double_sided = packaged_material->double_sided;
+        materials[mat_i].is_blended = packaged_material->is_blended;
+        for (u32 unit = 0; unit < PBR_NUM_USED_TEXTURE_UNITS; ++unit)
+        {
+            s32 texture_index = packaged_material->texture_indices[unit];
+            s32 image_index = texture_index != SCENE_NO_TEXTURE ? (s32)package->textures[texture_index].image_index : SCENE_NO_TEXTURE;
+            material_images[mat_i * PBR_NUM_USED_TEXTURE_UNITS + unit] = image_index;
+            materials[mat_i].sampler_ids[unit] = texture_index != SCENE_NO_TEXTURE ? samplers[texture_index] : default_sampler;
+            if (image_index != SCENE_NO_TEXTURE && is_image_uploaded[image_index])
+                materials[mat_i].texture_ids[unit] = scene.texture_objects[image_index];
+            else
+                materials[mat_i].texture_ids[unit] = unit == PBR_TEXUNIT_normal_texture ? flat_normal_texture : white_texture;
         }
     }
 
-    Scene scene;
-    scene.data = data;
-    scene.buffer_objects = buffers;
-    scene.texture_objects = textures;
+    // Every primitive's vertices, indices and meshlets each go in one buffer, filled in chunks straight out of the
+    // package over the next frames so neither the driver nor the frame that finishes the load copies all of it
+    u32 vertex_buffer = create_geometry_buffer(header->vertices_size, SCENE_VERTEX_SIZE);
+    u32 lod_index_buffer = create_geometry_buffer(header->lod_indices_count * sizeof(u32), sizeof(u32));
+    u32 meshlet_ssbo = create_geometry_buffer(header->meshlets_count * sizeof(MeshletData), sizeof(MeshletData));
+
+    // Create a vertex array for each primitive
+    u32 vaos_count = header->primitives_count;
+    u32 gpu_vaos_count = vaos_count > 0 ? vaos_count : 1;
+    u32* vaos = calloc(gpu_vaos_count, sizeof(u32));
+    VAO_Attributes* vaos_attributes = calloc(gpu_vaos_count, sizeof(VAO_Attributes));
+    u32* vaos_primitive_modes = calloc(gpu_vaos_count, sizeof(u32));
+    u32* vaos_material_indices = calloc(gpu_vaos_count, sizeof(u32));
+    u32* vaos_vertex_counts = calloc(gpu_vaos_count, sizeof(u32));
+    PrimitiveLODs* vaos_lods = calloc(gpu_vaos_count, sizeof(PrimitiveLODs));
+    vec4* vaos_position_dequantization = calloc(gpu_vaos_count, sizeof(vec4));
+    MeshletRange* vaos_meshlets = calloc(gpu_vaos_count, sizeof(MeshletRange));
+    if (vaos_count > 0)
+    {
+        glCreateVertexArrays(vaos_count, vaos);
+    }
+
+    for (u32 vao_i = 0; vao_i < vaos_count; ++vao_i)
+    {
+        PackagedPrimitive* primitive = &package->primitives[vao_i];
+        set_primitive_vertex_format(vaos[vao_i], vertex_buffer, primitive);
+        if (primitive->lods.count > 0)
+        {
+            glVertexArrayElementBuffer(vaos[vao_i], lod_index_buffer);
+        }
+
+        vaos_attributes[vao_i] = primitive->attributes;
+        vaos_primitive_modes[vao_i] = primitive->primitive_mode;
+        vaos_material_indices[vao_i] = primitive->material_index;
+        vaos_vertex_counts[vao_i] = primitive->vertex_count;
+        vaos_lods[vao_i] = primitive->lods;
+        glm_vec4_copy(primitive->position_dequantization, vaos_position_dequantization[vao_i]);
+        vaos_meshlets[vao_i] = primitive->meshlets;
+    }
+
+    VAO_Range* vao_ranges = calloc(header->meshes_count > 0 ? header->meshes_count : 1, sizeof(VAO_Range));
+    memcpy(vao_ranges, package->vao_ranges, header->meshes_count * sizeof(VAO_Range));
+
+    // The primitive instances, with a BVH over their world AABBs for frustum culling
+    u32 instances_count = header->instances_count;
+    u32 gpu_instances_count = instances_count > 0 ? instances_count : 1;
+    PrimitiveInstance* instances = malloc(gpu_instances_count * sizeof(PrimitiveInstance));
+    memcpy(instances, package->instances, instances_count * sizeof(PrimitiveInstance));
+    vec3* instance_world_bounds = malloc(2 * sizeof(vec3) * gpu_instances_count);
+    memcpy(instance_world_bounds, package->instance_world_bounds, 2 * sizeof(vec3) * instances_count);
+
+    // GPU copies of the instance bounds for occlusion culling, and the visibility from the previous frame.
+    // Everything starts as visible so the first frame draws all of it in the first phase.
+    u32 instance_bounds_ssbo;
+    u32 instance_visibility_ssbo;
+    {
+        vec4* bounds = calloc(2 * gpu_instances_count, sizeof(vec4));
+        u32* visibility = malloc(gpu_instances_count * sizeof(u32));
+        for (u32 i = 0; i < instances_count; ++i)
+        {
+            glm_vec4(instance_world_bounds[2 * i + 0], 1.0f, bounds[2 * i + 0]);
+            glm_vec4(instance_world_bounds[2 * i + 1], 1.0f, bounds[2 * i + 1]);
+        }
+        for (u32 i = 0; i < gpu_instances_count; ++i)
+        {
+            visibility[i] = 1;
+        }
+
+        glCreateBuffers(1, &instance_bounds_ssbo);
+        glNamedBufferStorage(instance_bounds_ssbo, 2 * gpu_instances_count * sizeof(vec4), bounds, 0);
+        glCreateBuffers(1, &instance_visibility_ssbo);
+        glNamedBufferStorage(instance_visibility_ssbo, gpu_instances_count * sizeof(u32), visibility, 0);
+
+        free(bounds);
+        free(visibility);
+    }
+
+    scene.samplers = samplers;
+    scene.samplers_count = samplers_count;
     scene.white_texture = white_texture;
     scene.flat_normal_texture = flat_normal_texture;
-    scene.vaos = vaos.data_buffer;
-    scene.vaos_count = vaos.used_size / sizeof(u32);
-    scene.vaos_attributes = vaos_attributes.data_buffer;
+    scene.materials = materials;
+    scene.vaos = vaos;
+    scene.vaos_count = vaos_count;
+    scene.vaos_attributes = vaos_attributes;
     scene.vao_ranges = vao_ranges;
-    scene.total_opaque_primitives = total_opaque_primitives;
-    scene.total_transparent_primitives = total_transparent_primitives;
+    scene.vaos_primitive_modes = vaos_primitive_modes;
+    scene.vaos_material_indices = vaos_material_indices;
+    scene.vaos_vertex_counts = vaos_vertex_counts;
+    scene.vaos_lods = vaos_lods;
+    scene.lod_index_buffer = lod_index_buffer;
+    scene.vertex_buffer = vertex_buffer;
+    scene.vaos_position_dequantization = vaos_position_dequantization;
+    scene.vaos_meshlets = vaos_meshlets;
+    scene.meshlets_count = header->meshlets_count;
+    scene.meshlet_ssbo = meshlet_ssbo;
+    scene.total_opaque_primitives = header->total_opaque_primitives;
+    scene.total_transparent_primitives = header->total_transparent_primitives;
+    scene.instances = instances;
+    scene.instances_count = instances_count;
+    scene.instance_world_bounds = instance_world_bounds;
+    scene.instance_bvh = instance_bvh;
+    scene.visible_instances = malloc(sizeof(u32) * gpu_instances_count);
+    scene.instance_bounds_ssbo = instance_bounds_ssbo;
+    scene.instance_visibility_ssbo = instance_visibility_ssbo;
+
+    scene.imported_point_lights = create_array(1 * sizeof(PointLight));
+    scene.imported_area_lights = create_array(1 * sizeof(AreaLight));
+    b32 are_lights_read = read_light_rig(package->lights, header->lights_size, &scene.imported_point_lights, &scene.imported_area_lights);
+    assert(are_lights_read && "The package's lights are written by write_light_rig()");
+    (void)are_lights_read;
 
     scene.attenuation_constant   = ATTENUATION_CONSTANT_DEFAULT;
     scene.attenuation_linear     = ATTENUATION_LINEAR_DEFAULT;
     scene.attenuation_quadratic  = ATTENUATION_QUADRATIC_DEFAULT;
     scene.minimum_perceivable_intensity = MINIMUM_PERCEIVABLE_INTENSITY_DEFAULT;
-    
-    printf("Loaded glTF scene \"%s\"\n   - Number of VAOS: %d\n   - Number of textures: %d\n\n", filename, (int)array_length(&vaos, sizeof(u32)), (int)data->textures_count);
 
+    // Last since it takes the package, which is kept until the geometry and then the textures are in
+    u32 geometry_buffers[GEOMETRY_STREAM_BUFFERS_COUNT] = { vertex_buffer, lod_index_buffer, meshlet_ssbo };
+    scene.geometry_stream = begin_geometry_stream(package, geometry_buffers, is_image_uploaded, material_images);
+
+    return scene;
+}
+
+typedef struct SceneLoad
+{  // The CPU side of loading a glTF scene, which doesn't touch GL so it can run on a background thread
+    const char* filename;
+    b32 is_s3tc_supported;  // Asked on the main thread, which has the GL context
+    f64 start_time;
+
+    ScenePackage package;  // Results
+    BVH instance_bvh;  // Over the package's instance bounds
+    b32 was_packaged;
+    f64 package_time;
+}
+SceneLoad;
+
+void
+prepare_scene_package(void* data)
+{
+    /* The first load of a glTF file builds its scene package and writes it to the cache, later loads map the package
+     * so there's nothing left but creating the GL objects. The key covers the path and every setting the package is
+     * built with, the package itself checks that the files it was built from haven't changed */
+    SceneLoad* load = data;
+    u32 settings[] = {
+        QUANTIZE_VERTICES, TEXTURE_COMPRESSION, load->is_s3tc_supported, MAX_PRIMITIVE_LODS, LOD_MIN_TRIANGLES, LOD_CACHE_VERSION,
+        TRIANGLE_ORDER_CACHE_VERSION, MESHLET_MIN_TRIANGLES, MAX_IMPORTED_AREA_LIGHTS, MAX_IMPORTED_POINT_LIGHTS,
+        LIGHT_RIG_VERSION, TEXTURE_CACHE_VERSION,
+    };
+    f32 float_settings[] = { LOD_MAX_ERROR_RATIO, OVERDRAW_CACHE_MISS_THRESHOLD, EMISSIVE_MIN_RELATIVE_FLUX };
+    u64 package_key = hash_fnv1a_64(load->filename, strlen(load->filename), FNV1A_64_OFFSET_BASIS);
+    package_key = hash_fnv1a_64(settings, sizeof(settings), package_key);
+    package_key = hash_fnv1a_64(float_settings, sizeof(float_settings), package_key);
+
+    load->was_packaged = map_scene_package(package_key, &load->package);
+    if (!load->was_packaged)
+    {
+        build_gltf_scene_package(load->filename, load->is_s3tc_supported, &load->package);
+        write_scene_package(package_key, &load->package);
+    }
+    load->instance_bvh = build_bvh(load->package.instance_world_bounds, load->package.header.instances_count);
+    load->package_time = glfwGetTime() - load->start_time;
+}
+
+SceneLoad
+begin_scene_load(const char* filename)
+{
+    SceneLoad load = { 0 };
+    load.filename = filename;
+    load.is_s3tc_supported = is_gl_extension_supported("GL_EXT_texture_compression_s3tc");
+    load.start_time = glfwGetTime();
+    return load;
+}
+
+Scene
+finish_scene_load(SceneLoad* load)
+{
+    /* Creates the GL objects once prepare_scene_package() is done, the geometry and textures stream in after this */
+    f64 create_start_time = glfwGetTime();
+    Scene scene = create_scene_from_package(&load->package, load->instance_bvh);
+    memset(&load->instance_bvh, 0, sizeof(load->instance_bvh));
+    scene.load_start_time = load->start_time;
+
+    printf("Loaded glTF scene \"%s\" in %.1f ms (%s %.1f ms, creating GL objects %.1f ms)\n"
+           "   - Number of VAOS: %d\n   - Number of textures: %d\n   - Number of primitive instances: %d (BVH nodes: %d)\n\n",
+        load->filename, (glfwGetTime() - load->start_time) * 1000.0,
+        load->was_packaged ? "mapping its scene package" : "building its scene package", load->package_time * 1000.0,
+        (glfwGetTime() - create_start_time) * 1000.0,
+        (int)scene.vaos_count, (int)scene.texture_objects_count, (int)scene.instances_count, (int)scene.instance_bvh.nodes_count);
+
+    return scene;
+}
+
+Scene
+load_gltf_scene(const char* filename)
+{
+    SceneLoad load = begin_scene_load(filename);
+    prepare_scene_package(&load);
+    Scene scene = finish_scene_load(&load);
+    stream_scene_geometry(&scene, UINT64_MAX);  // Nothing to draw in the meantime
+    delete_unused_resident_textures();  // Whatever the previous scene had that this one didn't take
     return scene;
 }
 
+typedef struct PBRStateCache
+{
+    // What the PBR pass last bound, so draws only change what differs from the previous draw
+    u32 texture_ids[PBR_NUM_USED_TEXTURE_UNITS];
+    u32 sampler_ids[PBR_NUM_USED_TEXTURE_UNITS];
+    u32 vao;
+    s32 is_cull_face_enabled;  // -1 when unknown
+    u32 indirect_buffer;  // Occlusion or meshlet commands
+}
+PBRStateCache;
+
+typedef struct PBRPassCounters
+{
+    u32 draw_calls;
+    u32 instances;
+    u32 texture_binds;
+    u32 vao_binds;
+    u32 cull_face_changes;
+    u32 triangles;  // Submitted, occlusion culling may still skip some. Meshlet draws add those left after meshlet culling
+}
+PBRPassCounters;
+
+// GPU work timed with timestamp queries, in the order it runs each frame
+typedef enum GPUPass
+{
+    GPU_PASS_LIGHTS,  // Light upload or animation
+    GPU_PASS_CLUSTER_BUILD,
+    GPU_PASS_LIGHT_ASSIGNMENT,
+    GPU_PASS_OPAQUE,  // Including occlusion and meshlet culling
+    GPU_PASS_TRANSPARENT,
+    GPU_PASS_AREA_LIGHTS,  // The area light polygons
+    GPU_PASS_GUI,
+    GPU_PASS_COUNT
+}
+GPUPass;
+
+static const char* gpu_pass_names[GPU_PASS_COUNT] = {
+    "Lights", "Cluster build", "Light assignment", "Opaque", "Transparent", "Area lights", "GUI",
+};
+
+#define GPU_TIMER_FRAMES 4  // Frames of queries in flight, each is read back once the GPU is done with it
+
+typedef struct GPUTimers
+{  // A timestamp at the start of every pass and one at the end of the frame, for a ring of frames. See mark_gpu_pass()
+    u32 queries[GPU_TIMER_FRAMES][GPU_PASS_COUNT + 1];
+    b32 is_pending[GPU_TIMER_FRAMES];  // Issued and not read back yet
+    u32 next_frame;  // Ring slot to time next, the oldest one
+    s32 frame;  // Ring slot timed this frame, -1 when every slot is still pending and the frame goes untimed
+    u64 pass_times[GPU_PASS_COUNT];  // Nanoseconds, of the newest frame read back
+}
+GPUTimers;
+
+#define BENCHMARK_DEFAULT_FRAMES 300
+#define BENCHMARK_WARMUP_FRAMES 10  // Drawn but not recorded once the scene's textures are in, while caches and drivers settle
+#define BENCHMARK_TIMESTEP (1.0f / 60.0f)  // Time that passes per frame for light animation and camera paths, so runs are repeatable
+
+typedef struct Benchmark
+{  // Headless run of a fixed number of frames with per-frame timings written to a CSV file, see record_benchmark_frame()
+    u32 frames_count;  // To record
+    u32 warmup_frames_left;
+    u32 recorded_frames_count;
+    const char* csv_path;
+    FILE* csv;
+    u32 framebuffer;  // Rendered into instead of the window
+    u32 renderbuffers[2];  // Color and depth
+    f64 frame_start_time;
+
+    // Milliseconds over every recorded frame, for the summary
+    f64 total_cpu_time;
+    f64 total_frame_time;
+    f64 total_compute_time;
+    f64 total_shading_time;
+    f64 total_pass_times[GPU_PASS_COUNT];
+    f64 max_frame_time;
+}
+Benchmark;
 
 typedef struct Program
 {
@@ -775,10 +3311,25 @@ typedef struct Program
     struct nk_context* gui_context;
     struct nk_font_atlas* gui_font_atlas;
 
+    // Scene loading in the background while the current one keeps rendering, see update_scene_switch()
+    b32 is_switching_scene;
+    int next_scene_id;
+    SceneLoad next_scene_load;
+    BackgroundTask* next_scene_task;  // NULL once the package is ready
+    Scene next_scene;  // Swapped in once its geometry and textures are in
+
     b32 render_as_wireframe;  // F1 to toggle
     b32 render_just_normals;  // F2 to toggle
     b32 is_clustered_shading_enabled;  // F3 to toggle
     u32 max_lights_per_cluster;
+    b32 is_frustum_culling_enabled;  // F5 to toggle
+    u32 visible_instances_last_frame;
+    b32 is_occlusion_culling_enabled;  // F6 to toggle
+    b32 is_state_sorting_enabled;  // F7 to toggle
+    b32 is_instancing_enabled;  // F8 to toggle
+    b32 is_lod_enabled;  // F9 to toggle
+    b32 is_meshlet_culling_enabled;  // F10 to toggle
+    b32 is_light_animation_enabled;  // F12 to toggle
 
     b32 keydown_forward;
     b32 keydown_backward;
@@ -799,6 +3350,10 @@ typedef struct Program
     // u32 shader_pbr_transparent;
     u32 shader_compute_clusters;
     u32 shader_light_assignment;
+    u32 shader_hiz_build;
+    u32 shader_occlusion_cull;
+    u32 shader_meshlet_cull;
+    u32 shader_animate_lights;
 
     // LTC1 and LTC2 contain matrices for transforming the clamped cosine distribution
     // to linearly transformed cosine distributions
@@ -820,11 +3375,74 @@ typedef struct Program
     u32 area_light_ssbo_max;
     #define SSBO_DEFAULT_MAX_AREA_LIGHTS 3000
 
+    // Area light polygons, triangulated into one vertex and index buffer that's only rebuilt when the lights change
+    u32 area_light_polygon_vao;
+    u32 area_light_polygon_vbo;
+    u32 area_light_polygon_ebo;
+    u32 area_light_polygon_vertex_max;
+    u32 area_light_polygon_index_max;
+    u32 area_light_polygon_index_count;
+    b32 are_area_light_polygons_dirty;  // Set whenever program.area_lights is changed
+
+    // GPU light animation, the lights' rest poses and animation parameters are only uploaded when they change
+    u32 animated_point_light_ssbo;
+    u32 animated_area_light_ssbo;
+    b32 are_lights_dirty;  // Set whenever program.point_lights or program.area_lights is changed
+    f64 light_animation_time;
+
     // Cluster grid SSBO
     u32 cluster_grid_ssbo;
     u32 cluster_normals_cubemap;  // get the quantized normal using a cubemap lookup.
     u32 representative_normals_1dtexure;  // the inverse of the cubemap (go from normal index to vector)
 
+    // Two-phase occlusion culling
+    u32 hiz_depth_texture;  // Depth buffer copied after the first phase
+    u32 hiz_texture;  // R32F max depth pyramid
+    u32 hiz_width;
+    u32 hiz_height;
+    u32 hiz_levels;
+    u32 occlusion_draw_slot_ssbo;
+    u32 occlusion_command_buffer;  // Used as both SSBO and GL_DRAW_INDIRECT_BUFFER
+    u32 occlusion_instance_remap_ssbo;
+    u32 occlusion_buffers_max_draws;
+    u32 occlusion_stats_ssbo;
+    u32 occlusion_stats_readback_buffer;
+    u32* occlusion_stats_mapped_pointer;
+    GLsync occlusion_stats_fence;
+    u32 occlusion_early_drawn_last_frame;
+    u32 occlusion_late_drawn_last_frame;
+    u32 occlusion_occluded_last_frame;
+
+    // Meshlet culling, commands are split into a half per occlusion culling phase like the occlusion commands
+    u32 meshlet_job_ssbo;
+    u32 meshlet_draw_slot_ssbo;
+    u32 meshlet_command_buffer;  // Used as both SSBO and GL_DRAW_INDIRECT_BUFFER
+    u32 meshlet_count_buffer;  // Meshlets and triangles drawn in total, then per draw per phase. Also the draws' GL_PARAMETER_BUFFER
+    u32 meshlet_buffers_max_jobs;
+    u32 meshlet_buffers_max_draws;
+    u32 meshlet_jobs_this_frame;
+    u32 meshlet_draws_this_frame;
+    u32 meshlet_stats_readback_buffer;
+    u32* meshlet_stats_mapped_pointer;
+    GLsync meshlet_stats_fence;
+    u32 meshlets_tested_last_frame;
+    u32 meshlets_drawn_last_frame;
+    u32 meshlet_triangles_drawn_last_frame;
+
+    // Per-draw data ring, persistently mapped. Each frame writes its own region so the CPU never
+    // overwrites data the GPU may still be reading, fenced in case the GPU falls more than a few frames behind
+    #define DRAW_DATA_RING_FRAMES 3
+    u32 draw_data_ring_buffer;
+    PBRDrawData* draw_data_mapped_pointer;
+    u32 draw_data_ring_frame_capacity;  // Draws per region
+    u32 draw_data_ring_frame;
+    GLsync draw_data_ring_fences[DRAW_DATA_RING_FRAMES];
+
+    // PBR pass redundant state filtering
+    PBRStateCache pbr_state_cache;
+    PBRPassCounters pbr_counters_this_frame;
+    PBRPassCounters pbr_counters_last_frame;
+
     // Atomic buffers
     b32 is_light_op_counting_enabled;
     u32 light_ops_atomic_counter_buffer;
@@ -832,16 +3450,26 @@ typedef struct Program
     u32 last_light_ops_value;
 
     // Time query objects
-    u32 compute_time_query;
-    u32 shading_time_query;
-    u64 compute_time_last_frame;
-    u64 shading_time_last_frame;
+    GPUTimers gpu_timers;
+    u64 compute_time_last_frame;  // Cluster build and light assignment, from the GPU timers
+    u64 shading_time_last_frame;  // Opaque, transparent and area lights
     double arealight_precomp_time_last_frame;
     double arealight_precomp_time_this_frame;
 
     // Dynamically add/change point lights in scene here
     DynamicArray point_lights;
     DynamicArray area_lights;
+    const char* light_rig_spec;  // --lights, replaces the test scene lights when set (see apply_light_rig())
+    const char* scene_path;  // --scene, loaded in place of test scene 3's glTF file
+
+    b32 is_benchmark;  // --frames or --out, renders offscreen without the GUI and exits when done
+    Benchmark benchmark;
+
+    DynamicArray camera_path;  // CameraKeyframes, played back from --camera-path or being recorded (P to toggle)
+    b32 is_playing_camera_path;
+    b32 is_recording_camera_path;
+    u32 camera_path_frame;  // Frames played so far, each BENCHMARK_TIMESTEP further along the path
+    f64 camera_path_record_start_time;
 }
 Program;
 
@@ -1051,323 +3679,503 @@ init_global_renderer_buffers()
         printf("Failed to persistantly map atomic counter buffer\n");
         exit(1);
     }
-}
 
-void
-execute_pbr_draw_call(u32 shader_program, PBRDrawCall* draw_call)
-{
-    // Set matrix uniforms
-    glProgramUniformMatrix4fv(shader_program, PBR_LOC_mvp, 1, GL_FALSE, (f32*)draw_call->mvp);
-    glProgramUniformMatrix4fv(shader_program, PBR_LOC_model_view, 1, GL_FALSE, (f32*)draw_call->model_view);
-    glProgramUniformMatrix4fv(shader_program, PBR_LOC_normal_matrix, 1, GL_FALSE, (f32*)draw_call->normal_matrix);
-
-    // Set material uniforms
+    // Occlusion culling counters (early drawn, late drawn, occluded), copied into a mapped buffer and read a frame or so later
+    if (program.occlusion_stats_ssbo)
     {
-        glProgramUniform4fv(shader_program, PBR_LOC_base_color_factor, 1, (f32*)draw_call->uniforms.base_color_factor);
-        glProgramUniform1f(shader_program, PBR_LOC_metallic_factor, draw_call->uniforms.metallic_factor);
-        glProgramUniform1f(shader_program, PBR_LOC_roughness_factor, draw_call->uniforms.roughness_factor);
-        glProgramUniform3fv(shader_program, PBR_LOC_emissive_factor, 1, (f32*)draw_call->uniforms.emissive_factor);
-        glProgramUniform1f(shader_program, PBR_LOC_alpha_mask_cutoff, draw_call->uniforms.alpha_mask_cutoff);
-        glProgramUniform1i(shader_program, PBR_LOC_is_normal_mapping_enabled, draw_call->uniforms.is_normal_mapping_enabled);
-        glProgramUniform1i(shader_program, PBR_LOC_is_alpha_blending_enabled, draw_call->uniforms.is_alpha_blending_enabled);
+        glDeleteBuffers(1, &program.occlusion_stats_ssbo);
+        glDeleteBuffers(1, &program.occlusion_stats_readback_buffer);
+        program.occlusion_stats_mapped_pointer = NULL;
     }
-
-    if (draw_call->double_sided)
+    if (program.occlusion_stats_fence)
     {
-        glDisable(GL_CULL_FACE);
+        glDeleteSync(program.occlusion_stats_fence);
+        program.occlusion_stats_fence = 0;
     }
-    else
+    glCreateBuffers(1, &program.occlusion_stats_ssbo);
+    glNamedBufferStorage(program.occlusion_stats_ssbo, 3 * sizeof(u32), NULL, GL_DYNAMIC_STORAGE_BIT);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, GLOBAL_SSBO_INDEX_OCCLUSION_STATS, program.occlusion_stats_ssbo);
+
+    glCreateBuffers(1, &program.occlusion_stats_readback_buffer);
+    glNamedBufferStorage(program.occlusion_stats_readback_buffer, 3 * sizeof(u32), NULL, GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+    program.occlusion_stats_mapped_pointer = (u32*)glMapNamedBufferRange(program.occlusion_stats_readback_buffer, 0, 3 * sizeof(u32), GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+    if (!program.occlusion_stats_mapped_pointer)
     {
-        glEnable(GL_CULL_FACE);
+        printf("Failed to persistantly map occlusion stats buffer\n");
+        exit(1);
     }
 
-    // Bind material textures
-    glBindTextureUnit(PBR_TEXUNIT_base_color_linear_space, draw_call->texture_ids[PBR_TEXUNIT_base_color_linear_space]);
-    glBindTextureUnit(PBR_TEXUNIT_metallic_roughness_texture, draw_call->texture_ids[PBR_TEXUNIT_metallic_roughness_texture]);
-    glBindTextureUnit(PBR_TEXUNIT_emissive_texture, draw_call->texture_ids[PBR_TEXUNIT_emissive_texture]);
-    glBindTextureUnit(PBR_TEXUNIT_occlusion_texture, draw_call->texture_ids[PBR_TEXUNIT_occlusion_texture]);
-    glBindTextureUnit(PBR_TEXUNIT_normal_texture, draw_call->texture_ids[PBR_TEXUNIT_normal_texture]);
-
-    // Bind LTC textures
-    glBindTextureUnit(TEXUNIT_LTC1_texture, program.LTC1_texture);
-    glBindTextureUnit(TEXUNIT_LTC2_texture, program.LTC2_texture);
-
-    // Bind clustered shading normal cubemap and texture
-    if (program.is_clustered_shading_enabled)
+    // Meshlets and triangles drawn, copied out of the meshlet count buffer the same way
+    if (program.meshlet_stats_readback_buffer)
     {
-        glBindTextureUnit(TEXUNIT_cluster_normals_cubemap, program.cluster_normals_cubemap);
-        glBindTextureUnit(TEXUNIT_representative_normals_texture, program.representative_normals_1dtexure);
+        glDeleteBuffers(1, &program.meshlet_stats_readback_buffer);
+        program.meshlet_stats_mapped_pointer = NULL;
     }
-    
-    glBindVertexArray(draw_call->vao);
-    
-    cgltf_primitive* prim = draw_call->prim;
-    if (prim->indices != NULL)
+    if (program.meshlet_stats_fence)
+    {
+        glDeleteSync(program.meshlet_stats_fence);
+        program.meshlet_stats_fence = 0;
+    }
+    glCreateBuffers(1, &program.meshlet_stats_readback_buffer);
+    glNamedBufferStorage(program.meshlet_stats_readback_buffer, MESHLET_COUNT_HEADER_SIZE * sizeof(u32), NULL, GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+    program.meshlet_stats_mapped_pointer = (u32*)glMapNamedBufferRange(program.meshlet_stats_readback_buffer, 0, MESHLET_COUNT_HEADER_SIZE * sizeof(u32), GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+    if (!program.meshlet_stats_mapped_pointer)
     {
-        assert(prim->indices->type == cgltf_type_scalar && "Indices glTF accessor must be use SCALAR types.");
+        printf("Failed to persistantly map meshlet stats buffer\n");
+        exit(1);
+    }
+}
 
-        // Get indices OpenGL component type from cgltf component type
-        u32 indices_component_type = gl_component_type_from_cgltf(prim->indices->component_type);
-        if (indices_component_type != GL_UNSIGNED_BYTE &&
-            indices_component_type != GL_UNSIGNED_SHORT &&
-            indices_component_type != GL_UNSIGNED_INT)
+void
+bind_pbr_draw_state(PBRDrawCall* draw_call)
+{
+    // Cull mode, material textures and VAO for the draw, skipping whatever is already bound when state sorting is on
+    PBRStateCache* cache = &program.pbr_state_cache;
+    PBRPassCounters* counters = &program.pbr_counters_this_frame;
+    b32 skip_redundant = program.is_state_sorting_enabled;
+    PBRMaterial* material = draw_call->material;
+
+    s32 enable_cull_face = material->double_sided ? 0 : 1;
+    if (!skip_redundant || cache->is_cull_face_enabled != enable_cull_face)
+    {
+        if (enable_cull_face)
         {
-            assert(0 && "glDrawElements documentation: Must be one of GL_UNSIGNED_BYTE, GL_UNSIGNED_SHORT, or GL_UNSIGNED_INT.");
+            glEnable(GL_CULL_FACE);
+        }
+        else
+        {
+            glDisable(GL_CULL_FACE);
         }
+        cache->is_cull_face_enabled = enable_cull_face;
+        ++counters->cull_face_changes;
+    }
 
-        // Find offset that indices start within ebo
-        size_t offset = prim->indices->offset + prim->indices->buffer_view->offset;
-        glDrawElements(draw_call->primitive_mode, prim->indices->count, indices_component_type, (const void*)offset);
+    // Bind material textures
+    for (u32 unit = 0; unit < PBR_NUM_USED_TEXTURE_UNITS; ++unit)
+    {
+        if (!skip_redundant || cache->texture_ids[unit] != material->texture_ids[unit])
+        {
+            glBindTextureUnit(unit, material->texture_ids[unit]);
+            cache->texture_ids[unit] = material->texture_ids[unit];
+            ++counters->texture_binds;
+        }
+        if (!skip_redundant || cache->sampler_ids[unit] != material->sampler_ids[unit])
+        {
+            glBindSampler(unit, material->sampler_ids[unit]);
+            cache->sampler_ids[unit] = material->sampler_ids[unit];
+        }
     }
-    else
+
+    if (!skip_redundant || cache->vao != draw_call->vao)
     {
-        // The glTF specification lets us get the vertex count using an arbitrary attribute
-        assert(prim->attributes_count > 0);
-        u32 vertex_count = prim->attributes[0].data->count;
-        
-        glDrawArrays(draw_call->primitive_mode, 0, vertex_count);
+        glBindVertexArray(draw_call->vao);
+        cache->vao = draw_call->vao;
+        ++counters->vao_binds;
     }
 }
 
-PBRDrawCall
-build_gltf_primitive_draw_call(Scene* scene, cgltf_mesh* mesh,
-    VAO_Range mesh_vao_range, int prim_index,
-    mat4 mv_matrix, mat4 mvp_matrix, mat4 normal_matrix)
+void
+bind_pbr_indirect_buffer(u32 indirect_buffer)
 {
-    PBRDrawCall draw_call = { 0 };
-    glm_mat4_copy(mv_matrix, draw_call.model_view);
-    glm_mat4_copy(mvp_matrix, draw_call.mvp);
-    glm_mat4_copy(normal_matrix, draw_call.normal_matrix);
-
-    draw_call.vao = scene->vaos[mesh_vao_range.begin + prim_index];
-    VAO_Attributes vao_attributes = scene->vaos_attributes[mesh_vao_range.begin + prim_index];
- 
-    cgltf_primitive* prim = &mesh->primitives[prim_index];
-    draw_call.prim = prim;
-    draw_call.primitive_mode = gl_primitive_mode_from_cgltf(prim->type);
-
-    // Bind material
-    cgltf_material* material = prim->material;
-    if (!material)
+    PBRStateCache* cache = &program.pbr_state_cache;
+    if (cache->indirect_buffer != indirect_buffer)
     {
-        printf("draw_gltf_node: Only supporting glTF files with materials because lazy :). Exiting");
-        exit(1);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect_buffer);
+        cache->indirect_buffer = indirect_buffer;
     }
+}
 
-    draw_call.double_sided = material->double_sided;
+void
+execute_pbr_draw_call(PBRDrawCall* draw_call, u32 instance_count, u32 draw_data_index, s64 indirect_command_offset)
+{
+    // Draws instance_count instances of the draw call's primitive. draw_data_index is where the first instance's
+    // PBRDrawData is in the ring buffer (the rest follow it), passed to the shaders as the base instance.
+    // indirect_command_offset is a byte offset into the occlusion command buffer (which already has the
+    // instance count and base instance in it), or -1 to draw directly
+
+    PBRPassCounters* counters = &program.pbr_counters_this_frame;
+    bind_pbr_draw_state(draw_call);
+    if (indirect_command_offset >= 0)
+    {
+        bind_pbr_indirect_buffer(program.occlusion_command_buffer);
+    }
 
-    // Can only use normal mapping for vaos with tangents
-    draw_call.uniforms.is_normal_mapping_enabled = vao_attributes.has_tangent;
+    ++counters->draw_calls;
+    counters->instances += instance_count;
     
-    // Set texture uniforms
-    cgltf_pbr_metallic_roughness* pbr_mr = &material->pbr_metallic_roughness;
-    u32 base_color_id = 0;
-    u32 metallic_roughness_id = 0;
-    u32 emissive_id = 0;
-    u32 occlusion_id = 0;
-    u32 normal_id = 0;
-    // u32 other texture; etc...
+    counters->triangles += instance_count * (draw_call->index_count / 3);
+
+    if (draw_call->index_type != 0)
+    {
+        if (indirect_command_offset >= 0)
+        {
+            glDrawElementsIndirect(draw_call->primitive_mode, draw_call->index_type, (const void*)indirect_command_offset);
+            return;
+        }
 
-    // Find texture ids for materials textures
-    for (u32 tex_i = 0; tex_i < scene->data->textures_count; ++tex_i)
+        size_t offset = draw_call->first_index * gl_index_type_size(draw_call->index_type);
+        glDrawElementsInstancedBaseVertexBaseInstance(draw_call->primitive_mode, draw_call->index_count, draw_call->index_type, (const void*)offset, instance_count, 0, draw_data_index);
+    }
+    else
     {
-        cgltf_texture* texture = &scene->data->textures[tex_i];
+        if (indirect_command_offset >= 0)
+        {
+            glDrawArraysIndirect(draw_call->primitive_mode, (const void*)indirect_command_offset);
+            return;
+        }
 
-        if (texture == pbr_mr->base_color_texture.texture) base_color_id = tex_i;
-        if (texture == pbr_mr->metallic_roughness_texture.texture) metallic_roughness_id = tex_i;
-        if (texture == material->emissive_texture.texture) emissive_id = tex_i;
-        if (texture == material->occlusion_texture.texture) occlusion_id = tex_i;
-        if (texture == material->normal_texture.texture) normal_id = tex_i;
+        glDrawArraysInstancedBaseInstance(draw_call->primitive_mode, draw_call->first_index, draw_call->index_count, instance_count, draw_data_index);
     }
+}
 
-    // Set base color texture
-    if (pbr_mr->base_color_texture.texture)
+void
+execute_meshlet_draw_call(PBRDrawCall* draw_call, u32 phase)
+{
+    // Draws the meshlets meshlet_cull.comp let through in this phase, one indirect command each. Meshlet draws are
+    // never instanced, and their commands already point at the draw data (or the remap slot occlusion culling picked)
+    PBRPassCounters* counters = &program.pbr_counters_this_frame;
+    bind_pbr_draw_state(draw_call);
+    bind_pbr_indirect_buffer(program.meshlet_command_buffer);
+
+    ++counters->draw_calls;
+    ++counters->instances;
+    // Triangles are counted from the meshlets meshlet_cull.comp let through, see meshlet_triangles_drawn_last_frame
+
+    u32 first_command = phase * program.meshlet_jobs_this_frame + draw_call->meshlet_first_command;
+    const void* command_offset = (const void*)(first_command * sizeof(DrawIndirectCommand));
+    if (draw_call->material->is_blended)
     {
-        draw_call.texture_ids[PBR_TEXUNIT_base_color_linear_space] = scene->texture_objects[base_color_id];
+        // MESHLET_DRAW_KEEP_ORDER, every meshlet has a command (culled ones are empty) so the triangle order doesn't change
+        glMultiDrawElementsIndirect(draw_call->primitive_mode, GL_UNSIGNED_INT, command_offset, draw_call->meshlets.count, sizeof(DrawIndirectCommand));
     }
     else
     {
-        // Fallback to white texture
-        draw_call.texture_ids[PBR_TEXUNIT_base_color_linear_space] = scene->white_texture;
+        GLintptr count_offset = (MESHLET_COUNT_HEADER_SIZE + phase * program.meshlet_draws_this_frame + draw_call->meshlet_draw) * sizeof(u32);
+        // Only bound around the draw, Mesa takes plain indirect draws for count draws while a parameter buffer is bound
+        glBindBuffer(GL_PARAMETER_BUFFER, program.meshlet_count_buffer);
+        glMultiDrawElementsIndirectCount(draw_call->primitive_mode, GL_UNSIGNED_INT, command_offset, count_offset, draw_call->meshlets.count, sizeof(DrawIndirectCommand));
+        glBindBuffer(GL_PARAMETER_BUFFER, 0);
     }
+}
 
-    // Set base color factor (cgltf defaults this to white if field not provided in gltf file)
-    draw_call.uniforms.base_color_factor[0] = pbr_mr->base_color_factor[0];
-    draw_call.uniforms.base_color_factor[1] = pbr_mr->base_color_factor[1];
-    draw_call.uniforms.base_color_factor[2] = pbr_mr->base_color_factor[2];
-    draw_call.uniforms.base_color_factor[3] = pbr_mr->base_color_factor[3];
+void
+reserve_draw_data_ring(u32 draws_per_frame)
+{
+    if (draws_per_frame <= program.draw_data_ring_frame_capacity)
+    {
+        return;
+    }
 
-    // Set Alpha modes that apply to base color texture
-    float alpha_cutoff;
-    int is_alpha_blending_enabled;
-    if (material->alpha_mode == cgltf_alpha_mode_mask)
+    // Growing replaces the buffer, so wait for the GPU to be done with all of the old one
+    if (program.draw_data_ring_buffer)
     {
-        alpha_cutoff = material->alpha_cutoff;
-        // is_alpha_blending_enabled = 0;
-        is_alpha_blending_enabled = 1;  // TEMPORARY FIX: For early depth tests, masked objects go in transparent pass too
+        for (u32 i = 0; i < DRAW_DATA_RING_FRAMES; ++i)
+        {
+            if (program.draw_data_ring_fences[i])
+            {
+                glClientWaitSync(program.draw_data_ring_fences[i], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+                glDeleteSync(program.draw_data_ring_fences[i]);
+                program.draw_data_ring_fences[i] = 0;
+            }
+        }
+        glUnmapNamedBuffer(program.draw_data_ring_buffer);
+        glDeleteBuffers(1, &program.draw_data_ring_buffer);
     }
-    else if (material->alpha_mode == cgltf_alpha_mode_opaque)
+
+    program.draw_data_ring_frame_capacity = max(draws_per_frame, 2 * program.draw_data_ring_frame_capacity);
+    GLsizeiptr size = (GLsizeiptr)DRAW_DATA_RING_FRAMES * program.draw_data_ring_frame_capacity * sizeof(PBRDrawData);
+
+    glCreateBuffers(1, &program.draw_data_ring_buffer);
+    glNamedBufferStorage(program.draw_data_ring_buffer, size, NULL, GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+    program.draw_data_mapped_pointer = (PBRDrawData*)glMapNamedBufferRange(program.draw_data_ring_buffer, 0, size, GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+    if (!program.draw_data_mapped_pointer)
     {
-        alpha_cutoff = 0.0f;
-        is_alpha_blending_enabled = 0;
+        printf("Failed to persistantly map draw data ring buffer\n");
+        exit(1);
     }
-    else if (material->alpha_mode == cgltf_alpha_mode_blend)
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, GLOBAL_SSBO_INDEX_DRAW_DATA, program.draw_data_ring_buffer);
+}
+
+u32
+write_draw_data(DynamicArray* opaque_draw_calls, DynamicArray* transparent_draw_calls)
+{
+    /* Writes every draw's data into the next ring region in one pass, laid out as [opaques..., transparents...]
+     * (the same as the occlusion culling draw slots). Returns the index of the first one */
+    u32 num_opaques = array_length(opaque_draw_calls, sizeof(PBRDrawCall));
+    u32 num_transparents = array_length(transparent_draw_calls, sizeof(PBRDrawCall));
+    u32 draw_count = num_opaques + num_transparents;
+
+    reserve_draw_data_ring(draw_count);
+
+    program.draw_data_ring_frame = (program.draw_data_ring_frame + 1) % DRAW_DATA_RING_FRAMES;
+    u32 frame = program.draw_data_ring_frame;
+
+    // Should only ever block if the GPU is DRAW_DATA_RING_FRAMES frames behind
+    if (program.draw_data_ring_fences[frame])
     {
-        alpha_cutoff = 0.0f;
-        is_alpha_blending_enabled = 1;
+        glClientWaitSync(program.draw_data_ring_fences[frame], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+        glDeleteSync(program.draw_data_ring_fences[frame]);
+        program.draw_data_ring_fences[frame] = 0;
     }
-    else
+
+    u32 first_index = frame * program.draw_data_ring_frame_capacity;
+    PBRDrawData* draw_data = program.draw_data_mapped_pointer + first_index;
+    for (u32 i = 0; i < draw_count; ++i)
     {
-        assert(0 && "Impossible alpha mode unless cgltf.h bugged.");
+        PBRDrawCall* draw_call = i < num_opaques
+            ? get_element(opaque_draw_calls, sizeof(PBRDrawCall), i)
+            : get_element(transparent_draw_calls, sizeof(PBRDrawCall), i - num_opaques);
+        PBRMaterialUniforms* material_uniforms = &draw_call->material->uniforms;
+
+        PBRDrawData data;
+        glm_mat4_copy(draw_call->mvp, data.mvp);
+        glm_mat4_copy(draw_call->model_view, data.model_view);
+        glm_mat4_copy(draw_call->normal_matrix, data.normal_matrix);
+        glm_vec4_copy(material_uniforms->base_color_factor, data.base_color_factor);
+        glm_vec3_copy(material_uniforms->emissive_factor, data.emissive_factor);
+        data.alpha_mask_cutoff = material_uniforms->alpha_mask_cutoff;
+        data.metallic_factor = material_uniforms->metallic_factor;
+        data.roughness_factor = material_uniforms->roughness_factor;
+        data.is_normal_mapping_enabled = draw_call->is_normal_mapping_enabled;
+        data.is_alpha_blending_enabled = material_uniforms->is_alpha_blending_enabled;
+
+        // Mapped memory may be write combined, so write each draw out whole rather than field by field
+        memcpy(&draw_data[i], &data, sizeof(data));
+    }
+
+    return first_index;
+}
+
+void
+end_draw_data_frame()
+{
+    u32 frame = program.draw_data_ring_frame;
+    assert(program.draw_data_ring_fences[frame] == 0);
+    program.draw_data_ring_fences[frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+void
+begin_pbr_pass()
+{
+    // Called whenever other passes may have changed bindings, forgets the cached state and binds the per-frame textures
+    PBRStateCache* cache = &program.pbr_state_cache;
+    memset(cache, 0, sizeof(*cache));
+    cache->is_cull_face_enabled = -1;
+
+    glUseProgram(program.shader_pbr_opaque);
+
+    // Bind LTC textures
+    glBindTextureUnit(TEXUNIT_LTC1_texture, program.LTC1_texture);
+    glBindTextureUnit(TEXUNIT_LTC2_texture, program.LTC2_texture);
+
+    // Bind clustered shading normal cubemap and texture
+    if (program.is_clustered_shading_enabled)
+    {
+        glBindTextureUnit(TEXUNIT_cluster_normals_cubemap, program.cluster_normals_cubemap);
+        glBindTextureUnit(TEXUNIT_representative_normals_texture, program.representative_normals_1dtexure);
     }
-    draw_call.uniforms.alpha_mask_cutoff = alpha_cutoff;
-    draw_call.uniforms.is_alpha_blending_enabled = is_alpha_blending_enabled;
+}
 
-    if (pbr_mr->metallic_roughness_texture.texture)
+void
+end_pbr_pass()
+{
+    // The material samplers would otherwise override the filtering of whatever later passes bind to the same units
+    glBindSamplers(0, PBR_NUM_USED_TEXTURE_UNITS, NULL);
+}
+
+DrawIndirectCommand
+build_indirect_command(PBRDrawCall* draw_call, u32 first_remap_index)
+{
+    // instance_count is left at 0, the occlusion culling shader appends the instances that should be drawn
+    // to the instance remap buffer starting at base_instance
+    DrawIndirectCommand command = { 0 };
+    command.count = draw_call->index_count;
+    command.first_index = draw_call->first_index;
+    if (draw_call->index_type != 0)
     {
-        // Set metallic roughness texture
-        draw_call.texture_ids[PBR_TEXUNIT_metallic_roughness_texture] = scene->texture_objects[metallic_roughness_id];
+        command.base_instance = first_remap_index;
     }
     else
     {
-        // Fallback to default white texture
-        draw_call.texture_ids[PBR_TEXUNIT_metallic_roughness_texture] = scene->white_texture;
+        // glDrawArraysIndirect's command has no base vertex, base instance comes right after the first vertex
+        command.base_vertex = (s32)first_remap_index;
     }
 
-    // Set metallic and roughness factors
-    draw_call.uniforms.metallic_factor = pbr_mr->metallic_factor;
-    draw_call.uniforms.roughness_factor = pbr_mr->roughness_factor;
+    return command;
+}
 
-    if (material->emissive_texture.texture)
-    {
-        // Set emissive texture
-        draw_call.texture_ids[PBR_TEXUNIT_emissive_texture] = scene->texture_objects[emissive_id];
-    }
-    else
+u64
+build_opaque_sort_key(b32 double_sided, VAO_Attributes vao_attributes, u32 material_index, u32 vao_index, u32 lod, f32 view_z)
+{
+    /* Sorted ascending, so the most expensive state to change goes in the highest bits:
+     *     [63]      cull mode (double sided materials disable GL_CULL_FACE)
+     *     [62..59]  VAO attribute layout
+     *     [58..40]  material, which decides the bound textures
+     *     [39..16]  primitive (VAO) and LOD, so instances of the same primitive end up next to each other and can be batched
+     *     [15..0]   view depth, front to back so early depth testing rejects more of the light loop. The float's exponent
+     *               and top 7 mantissa bits, under 1% apart, which is all the ordering needs
+     * There is only one PBR program so it doesn't need any bits.
+     */
+    u64 layout_bits = (u64)vao_attributes.has_position
+        | ((u64)vao_attributes.has_normal << 1)
+        | ((u64)vao_attributes.has_texcoord_0 << 2)
+        | ((u64)vao_attributes.has_tangent << 3);
+
+    // Positive floats sort the same as their bit patterns. The view looks down -z
+    f32 depth = max(0.0f, -view_z);
+    u32 depth_bits;
+    memcpy(&depth_bits, &depth, sizeof(depth_bits));
+
+    // Wider indices would alias other primitives and split up their instances
+    assert(vao_index < (1u << 22) && lod < 4 && "Primitive doesn't fit in the sort key");
+    return ((u64)(double_sided ? 1 : 0) << 63)
+        | (layout_bits << 59)
+        | ((u64)(material_index & 0x7FFFF) << 40)
+        | ((u64)((vao_index << 2) | lod) << 16)
+        | (u64)(depth_bits >> 16);
+}
+
+PBRDrawCall
+build_gltf_primitive_draw_call(Scene* scene,
+    VAO_Range mesh_vao_range, int prim_index, u32 lod,
+    mat4 mv_matrix, mat4 mvp_matrix, mat4 normal_matrix)
+{
+    PBRDrawCall draw_call = { 0 };
+    draw_call.meshlet_draw = -1;
+    glm_mat4_copy(mv_matrix, draw_call.model_view);
+    glm_mat4_copy(mvp_matrix, draw_call.mvp);
+    glm_mat4_copy(normal_matrix, draw_call.normal_matrix);
+
+    u32 vao_index = mesh_vao_range.begin + prim_index;
+
+    #if QUANTIZE_VERTICES
     {
-        // Fallback to default white texture
-        draw_call.texture_ids[PBR_TEXUNIT_emissive_texture] = scene->white_texture;
+        // Positions are unorm16 within the primitive's bounds, scale them back to mesh space along with the rest of
+        // the transform. The normal matrix is left alone, the scale is uniform and normals aren't stored that way
+        float* dequantization = scene->vaos_position_dequantization[vao_index];
+        mat4 dequantize;
+        glm_translate_make(dequantize, dequantization);
+        glm_scale_uni(dequantize, dequantization[3]);
+        glm_mat4_mul(draw_call.model_view, dequantize, draw_call.model_view);
+        glm_mat4_mul(draw_call.mvp, dequantize, draw_call.mvp);
     }
+    #endif
+    draw_call.vao = scene->vaos[vao_index];
+    VAO_Attributes vao_attributes = scene->vaos_attributes[vao_index];
+    draw_call.primitive_mode = scene->vaos_primitive_modes[vao_index];
 
-    // Set emissive factor
-    draw_call.uniforms.emissive_factor[0] = material->emissive_factor[0];
-    draw_call.uniforms.emissive_factor[1] = material->emissive_factor[1];
-    draw_call.uniforms.emissive_factor[2] = material->emissive_factor[2];
-
-    if (material->occlusion_texture.texture)
+    // Range of indices (or vertices) to draw
+    PrimitiveLODs* lods = &scene->vaos_lods[vao_index];
+    if (lods->count > 0)
     {
-        // Set occlusion texture
-        draw_call.texture_ids[PBR_TEXUNIT_occlusion_texture] = scene->texture_objects[occlusion_id];
+        assert(lod < lods->count);
+        draw_call.lod = lod;
+        draw_call.index_type = GL_UNSIGNED_INT;
+        draw_call.first_index = lods->first_index[lod];
+        draw_call.index_count = lods->index_count[lod];
+        if (lod == 0)
+        {
+            draw_call.meshlets = scene->vaos_meshlets[vao_index];
+        }
     }
     else
     {
-        // Fallback to default white texture
-        draw_call.texture_ids[PBR_TEXUNIT_occlusion_texture] = scene->white_texture;
+        draw_call.index_count = scene->vaos_vertex_counts[vao_index];
     }
 
-    if (material->normal_texture.texture)
-    {
-        // Set normal texture
-        draw_call.texture_ids[PBR_TEXUNIT_normal_texture] =  scene->texture_objects[normal_id];
-    }
-    else
+    // Bind material
+    u32 material_index = scene->vaos_material_indices[vao_index];
+    if (material_index == SCENE_NO_MATERIAL)
     {
-        // Fallback to flat normal map texture
-        draw_call.texture_ids[PBR_TEXUNIT_normal_texture] = scene->flat_normal_texture;
+        printf("draw_gltf_node: Only supporting glTF files with materials because lazy :). Exiting");
+        exit(1);
     }
 
+    draw_call.material = &scene->materials[material_index];
+
+    // Can only use normal mapping for vaos with tangents
+    draw_call.is_normal_mapping_enabled = vao_attributes.has_tangent;
+
+    draw_call.sort_key = build_opaque_sort_key(draw_call.material->double_sided, vao_attributes, material_index, vao_index, draw_call.lod, mv_matrix[3][2]);
+
     return draw_call;
 }
 
-void
-add_gltf_node_draw_calls(Scene* scene, FreeCamera* camera, u32 opaque_program, cgltf_node* node, mat4 parent_matrix, DynamicArray* opaque_draw_calls, DynamicArray* transparent_draw_calls)
+u32
+select_primitive_lod(PrimitiveLODs* lods, mat4 model, vec3* world_bounds, FreeCamera* camera)
 {
-    // Compute model matrix = parent_matrix * node's matrix   
-    mat4 model = GLM_MAT4_IDENTITY_INIT;
+    // Coarsest level whose simplification error, scaled to world units and projected at the closest point of the
+    // instance's bounds, covers at most LOD_PIXEL_ERROR_THRESHOLD pixels
+    if (lods->count <= 1)
     {
-#if 0  // Turns out cgltf provides an implementation to get the node world transform but I already did it meself
-        cgltf_node_transform_world(node, (float*)model);
-#else
-        // glTF node transform either in matrix format matrix=T*R*S or T,R,S seperately (translation vector, rotation quaternion, scale vector)
-
-        if (node->has_matrix)
-        {
-            mat4 node_matrix = {
-                { node->matrix[0],  node->matrix[1],  node->matrix[2],  node->matrix[3] },
-                { node->matrix[4],  node->matrix[5],  node->matrix[6],  node->matrix[7] },
-                { node->matrix[8],  node->matrix[9],  node->matrix[10], node->matrix[11] },
-                { node->matrix[12], node->matrix[13], node->matrix[14], node->matrix[15] }
-            };
-
-            glm_mat4_mul(parent_matrix, node_matrix, model);
-        }
-        else
-        {
-            mat4 node_matrix = GLM_MAT4_IDENTITY_INIT;
+        return 0;
+    }
 
-            if (node->has_translation)
-            {
-                vec3 translation_vector = { node->translation[0], node->translation[1], node->translation[2] };
-                glm_translate(node_matrix, translation_vector);
-            }
-            
-            if (node->has_rotation)
-            {
-                versor rotation_quaternion = { node->rotation[0], node->rotation[1], node->rotation[2], node->rotation[3] };
-                glm_quat_rotate(node_matrix, rotation_quaternion, node_matrix);
-            }
+    vec3 closest_point;
+    glm_vec3_maxv(world_bounds[0], camera->pos, closest_point);
+    glm_vec3_minv(world_bounds[1], closest_point, closest_point);
+    f32 distance = glm_vec3_distance(closest_point, camera->pos);
+    if (distance <= camera->near_plane)
+    {
+        return 0;
+    }
 
-            if (node->has_scale)
-            {
-                vec3 scale_vector = { node->scale[0], node->scale[1], node->scale[2] };
-                glm_scale(node_matrix, scale_vector);
-            }
+    f32 scale = max(glm_vec3_norm(model[0]), max(glm_vec3_norm(model[1]), glm_vec3_norm(model[2])));
+    f32 pixels_per_world_unit_at_distance = (f32)camera->height / (2.0f * tanf(0.5f * camera->fov_y) * distance);
 
-            glm_mat4_mul(parent_matrix, node_matrix, model);
+    u32 lod = 0;
+    for (u32 i = 1; i < lods->count; ++i)
+    {
+        if (lods->error[i] * scale * pixels_per_world_unit_at_distance > LOD_PIXEL_ERROR_THRESHOLD)
+        {
+            break;
         }
-#endif
+        lod = i;
     }
-    
-    if (node->mesh)
-    {
-        // Compute and upload our vertex shader matrices
-        mat4 mv_matrix; glm_mat4_mul(camera->view_matrix, model, mv_matrix);
-        mat4 mvp_matrix; glm_mat4_mul(camera->camera_matrix, model, mvp_matrix);
-        mat4 normal_matrix; glm_mat4_inv(mv_matrix, normal_matrix); glm_mat4_transpose(normal_matrix);
-
-        // Find node's mesh and get its index
-        cgltf_mesh* mesh = node->mesh;  // e.g. nodes->mesh = &scene->data->meshes[2];
-        s64 mesh_index = mesh - scene->data->meshes;
-        assert(0 <= mesh_index && mesh_index < (s64)scene->data->meshes_count);
+    return lod;
+}
 
-        VAO_Range mesh_vao_range = scene->vao_ranges[mesh_index];
+void
+add_primitive_instance_draw_call(Scene* scene, FreeCamera* camera, PrimitiveInstance* instance, DynamicArray* opaque_draw_calls, DynamicArray* transparent_draw_calls)
+{
+    // Compute and upload our vertex shader matrices
+    mat4 mv_matrix; glm_mat4_mul(camera->view_matrix, instance->model, mv_matrix);
+    mat4 mvp_matrix; glm_mat4_mul(camera->camera_matrix, instance->model, mvp_matrix);
+    mat4 normal_matrix; glm_mat4_inv(mv_matrix, normal_matrix); glm_mat4_transpose(normal_matrix);
 
-        // Iterate over the mesh's primitives and draw each primitives VAO
-        for (u32 prim_i = 0; prim_i < mesh->primitives_count; ++prim_i)
-        {
-            PBRDrawCall draw_call = build_gltf_primitive_draw_call(scene, mesh, mesh_vao_range, prim_i, mv_matrix, mvp_matrix, normal_matrix);
+    VAO_Range mesh_vao_range = scene->vao_ranges[instance->mesh_index];
+    u32 instance_index = (u32)(instance - scene->instances);
 
-            if (draw_call.uniforms.is_alpha_blending_enabled)
-            {
-                // Add to transparent draw calls
-                push_element_copy(transparent_draw_calls, sizeof(PBRDrawCall), &draw_call);
-            }
-            else
-            {
-                // Add to opaque draw calls
-                push_element_copy(opaque_draw_calls, sizeof(PBRDrawCall), &draw_call);
-            }
-        }
+    u32 lod = 0;
+    if (program.is_lod_enabled)
+    {
+        PrimitiveLODs* lods = &scene->vaos_lods[mesh_vao_range.begin + instance->prim_index];
+        lod = select_primitive_lod(lods, instance->model, &scene->instance_world_bounds[2 * instance_index], camera);
     }
 
-    // Draw children nodes
-    for (u32 i = 0; i < node->children_count; ++i)
+    PBRDrawCall draw_call = build_gltf_primitive_draw_call(scene, mesh_vao_range, instance->prim_index, lod, mv_matrix, mvp_matrix, normal_matrix);
+    draw_call.instance_index = instance_index;
+
+    if (draw_call.material->uniforms.is_alpha_blending_enabled)
+    {
+        // Add to transparent draw calls
+        push_element_copy(transparent_draw_calls, sizeof(PBRDrawCall), &draw_call);
+    }
+    else
     {
-        cgltf_node* child = node->children[i];
-        add_gltf_node_draw_calls(scene, camera, opaque_program, child, model, opaque_draw_calls, transparent_draw_calls);
+        // Add to opaque draw calls
+        push_element_copy(opaque_draw_calls, sizeof(PBRDrawCall), &draw_call);
     }
 }
 
+int
+compare_u32(const void* a, const void* b)
+{
+    u32 x = *(const u32*)a;
+    u32 y = *(const u32*)b;
+    return (x > y) - (x < y);
+}
+
 // int
 // compare_draw_call_depths(const void* draw_call_a, const void* draw_call_b)
 // {
@@ -1408,93 +4216,581 @@ load_ltc_matrix_texture(const float* matrix_table)
     return tex;
 }
 
+typedef struct AreaLightPolygonVertex
+{
+    f32 position[3];  // World space
+    f32 color[3];
+}
+AreaLightPolygonVertex;
+
+void
+upload_area_light_polygons(int light_count, AreaLight* arealights)
+{
+    /* Triangulates every area light polygon into the persistent polygon buffers so they draw with one call */
+
+    u32 vertex_count = 0;
+    u32 index_count = 0;
+    for (int i = 0; i < light_count; i++)
+    {
+        vertex_count += arealights[i].n;
+        index_count += 3 * (arealights[i].n - 2);  // The star's 8 triangles are as many as a fan over its 10 points
+    }
+
+    if (!program.area_light_polygon_vao)
+    {
+        glCreateVertexArrays(1, &program.area_light_polygon_vao);
+        glEnableVertexArrayAttrib(program.area_light_polygon_vao, 0);  // Position
+        glVertexArrayAttribFormat(program.area_light_polygon_vao, 0, 3, GL_FLOAT, GL_FALSE, offsetof(AreaLightPolygonVertex, position));
+        glVertexArrayAttribBinding(program.area_light_polygon_vao, 0, 0);
+        glEnableVertexArrayAttrib(program.area_light_polygon_vao, 1);  // Color
+        glVertexArrayAttribFormat(program.area_light_polygon_vao, 1, 3, GL_FLOAT, GL_FALSE, offsetof(AreaLightPolygonVertex, color));
+        glVertexArrayAttribBinding(program.area_light_polygon_vao, 1, 0);
+    }
+
+    // Grow by doubling so lights spawned one at a time don't reallocate every time
+    if (!program.area_light_polygon_vbo || vertex_count > program.area_light_polygon_vertex_max)
+    {
+        glDeleteBuffers(1, &program.area_light_polygon_vbo);
+        program.area_light_polygon_vertex_max = max(max(64, vertex_count), 2 * program.area_light_polygon_vertex_max);
+        glCreateBuffers(1, &program.area_light_polygon_vbo);
+        glNamedBufferData(program.area_light_polygon_vbo, program.area_light_polygon_vertex_max * sizeof(AreaLightPolygonVertex), NULL, GL_DYNAMIC_DRAW);
+        glVertexArrayVertexBuffer(program.area_light_polygon_vao, 0, program.area_light_polygon_vbo, 0, sizeof(AreaLightPolygonVertex));
+    }
+    if (!program.area_light_polygon_ebo || index_count > program.area_light_polygon_index_max)
+    {
+        glDeleteBuffers(1, &program.area_light_polygon_ebo);
+        program.area_light_polygon_index_max = max(max(192, index_count), 2 * program.area_light_polygon_index_max);
+        glCreateBuffers(1, &program.area_light_polygon_ebo);
+        glNamedBufferData(program.area_light_polygon_ebo, program.area_light_polygon_index_max * sizeof(u32), NULL, GL_DYNAMIC_DRAW);
+        glVertexArrayElementBuffer(program.area_light_polygon_vao, program.area_light_polygon_ebo);
+    }
+
+    program.area_light_polygon_index_count = index_count;
+    if (index_count == 0)
+    {
+        return;
+    }
+
+    AreaLightPolygonVertex* vertices = malloc(vertex_count * sizeof(AreaLightPolygonVertex));
+    u32* indices = malloc(index_count * sizeof(u32));
+
+    u32 first_vertex = 0;
+    u32 index = 0;
+    for (int i = 0; i < light_count; i++)
+    {
+        AreaLight* al = &arealights[i];
+
+        for (int j = 0; j < al->n; j++)
+        {
+            AreaLightPolygonVertex* vertex = &vertices[first_vertex + j];
+            glm_vec3_copy(al->points_worldspace[j], vertex->position);
+            glm_vec3_copy(al->color_rgb_intensity_a, vertex->color);
+        }
+
+        // Stars are concave so they have their own triangulation, everything else is convex and drawn as a fan
+        if (al->n == 10)
+        {
+            for (u32 j = 0; j < sizeof(star_indices) / sizeof(star_indices[0]); j++)
+            {
+                indices[index++] = first_vertex + star_indices[j];
+            }
+        }
+        else
+        {
+            for (int j = 1; j < al->n - 1; j++)
+            {
+                indices[index++] = first_vertex;
+                indices[index++] = first_vertex + j;
+                indices[index++] = first_vertex + j + 1;
+            }
+        }
+
+        first_vertex += al->n;
+    }
+    assert(index == index_count);
+
+    glNamedBufferSubData(program.area_light_polygon_vbo, 0, vertex_count * sizeof(AreaLightPolygonVertex), vertices);
+    glNamedBufferSubData(program.area_light_polygon_ebo, 0, index_count * sizeof(u32), indices);
+
+    free(vertices);
+    free(indices);
+}
+
 void
 render_area_lights(int light_count, AreaLight* arealights)
 {
     /* Renders the area light's polygon with a simple polygon shader (polygon.vert/frag) */
 
-    // Create a temporary VAO/VBO each frame
-    GLuint vao, vbo, ebo;
-    glGenVertexArrays(1, &vao);
-    glBindVertexArray(vao);
-    
-    glGenBuffers(1, &vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    if (program.are_area_light_polygons_dirty)
+    {
+        upload_area_light_polygons(light_count, arealights);
+        program.are_area_light_polygons_dirty = 0;
+    }
+
+    if (program.area_light_polygon_index_count == 0)
+    {
+        return;
+    }
+
+    glUseProgram(program.shader_area_light_polygons);
+    glProgramUniformMatrix4fv(program.shader_area_light_polygons, 0, 1, GL_FALSE, (f32*)program.cam.camera_matrix);
+
+    glBindVertexArray(program.area_light_polygon_vao);
+    glDrawElements(GL_TRIANGLES, program.area_light_polygon_index_count, GL_UNSIGNED_INT, 0);
+}
+
+typedef struct AnimatedPointLight
+{  // Same as the std430 struct in animate_lights.comp
+    vec4 position;  // World space rest position
+    vec4 color_rgb_intensity_a;
+    vec4 orbit;  // Radius, angular speed, phase, bob amplitude
+    vec4 motion;  // Bob speed, flicker amount, flicker speed, spin speed
+}
+AnimatedPointLight;
+
+typedef struct AnimatedAreaLight
+{  // Same as the std430 struct in animate_lights.comp
+    vec4 color_rgb_intensity_a;
+    s32 n;
+    s32 is_double_sided;
+    u32 first_polygon_vertex;  // In the area light polygon vertex buffer
+    f32 area;
+    vec4 orbit;
+    vec4 motion;
+    vec4 points_worldspace[MAX_UNCLIPPED_NGON];  // Rest pose
+}
+AnimatedAreaLight;
+
+void
+make_light_animation(u32 light_id, vec4 out_orbit, vec4 out_motion)
+{
+    /* Animation parameters of a light, the same for the same light_id every run */
+    u32 state = light_id * 2654435761u + 1u;
+    f32 random[8];
+    for (int i = 0; i < 8; ++i)
+    {
+        random[i] = next_random(&state);
+    }
+
+    out_orbit[0] = 0.2f + 0.8f * random[0];  // Orbit radius
+    out_orbit[1] = -2.0f + 4.0f * random[1];  // Orbit angular speed, either way round
+    out_orbit[2] = 2.0f * PI * random[2];  // Phase
+    out_orbit[3] = 0.05f + 0.25f * random[3];  // Bob amplitude
+    out_motion[0] = 1.0f + 2.0f * random[4];  // Bob speed
+    out_motion[1] = 0.5f * random[5];  // Flicker amount
+    out_motion[2] = 5.0f + 10.0f * random[6];  // Flicker speed
+    out_motion[3] = -1.0f + 2.0f * random[7];  // Spin speed
+}
+
+void
+upload_animated_lights()
+{
+    /* Uploads every light's rest pose and animation parameters, animate_lights() moves them from there on the GPU */
+    u32 num_point_lights = (u32)array_length(&program.point_lights, sizeof(PointLight));
+    u32 num_area_lights = (u32)array_length(&program.area_lights, sizeof(AreaLight));
+
+    // The polygon buffers have to be big enough before the animation writes into them
+    upload_area_light_polygons(num_area_lights, program.area_lights.data_buffer);
+    program.are_area_light_polygons_dirty = 0;
+
+    u32 point_lights_capacity = num_point_lights > 0 ? num_point_lights : 1;
+    AnimatedPointLight* point_lights = calloc(point_lights_capacity, sizeof(AnimatedPointLight));
+    for (u32 i = 0; i < num_point_lights; ++i)
+    {
+        PointLight* light = get_element(&program.point_lights, sizeof(PointLight), i);
+        AnimatedPointLight* animated = &point_lights[i];
+        glm_vec3_copy(light->position, animated->position);
+        glm_vec3_copy(light->color, animated->color_rgb_intensity_a);
+        animated->color_rgb_intensity_a[3] = light->intensity;
+        make_light_animation(i, animated->orbit, animated->motion);
+    }
+
+    u32 area_lights_capacity = num_area_lights > 0 ? num_area_lights : 1;
+    AnimatedAreaLight* area_lights = calloc(area_lights_capacity, sizeof(AnimatedAreaLight));
+    u32 first_polygon_vertex = 0;
+    for (u32 i = 0; i < num_area_lights; ++i)
+    {
+        AreaLight* light = get_element(&program.area_lights, sizeof(AreaLight), i);
+        AnimatedAreaLight* animated = &area_lights[i];
+        glm_vec4_copy(light->color_rgb_intensity_a, animated->color_rgb_intensity_a);
+        animated->n = light->n;
+        animated->is_double_sided = light->is_double_sided;
+        animated->first_polygon_vertex = first_polygon_vertex;
+        animated->area = polygon_area(light);
+        make_light_animation(num_point_lights + i, animated->orbit, animated->motion);
+        memcpy(animated->points_worldspace, light->points_worldspace, light->n * sizeof(vec4));
+        first_polygon_vertex += light->n;
+    }
+
+    if (!program.animated_point_light_ssbo)
+    {
+        glCreateBuffers(1, &program.animated_point_light_ssbo);
+        glCreateBuffers(1, &program.animated_area_light_ssbo);
+    }
+    glNamedBufferData(program.animated_point_light_ssbo, point_lights_capacity * sizeof(AnimatedPointLight), point_lights, GL_STATIC_DRAW);
+    glNamedBufferData(program.animated_area_light_ssbo, area_lights_capacity * sizeof(AnimatedAreaLight), area_lights, GL_STATIC_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, GLOBAL_SSBO_INDEX_ANIMATED_POINT_LIGHTS, program.animated_point_light_ssbo);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, GLOBAL_SSBO_INDEX_ANIMATED_AREA_LIGHTS, program.animated_area_light_ssbo);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, GLOBAL_SSBO_INDEX_AREA_LIGHT_POLYGON_VERTICES, program.area_light_polygon_vbo);
+
+    free(point_lights);
+    free(area_lights);
+    program.are_lights_dirty = 0;
+}
+
+void
+init_gpu_timers()
+{
+    GPUTimers* timers = &program.gpu_timers;
+    glGenQueries(GPU_TIMER_FRAMES * (GPU_PASS_COUNT + 1), &timers->queries[0][0]);
+    timers->frame = -1;
+}
+
+void
+read_gpu_timers()
+{
+    /* Reads back every frame the GPU has finished, oldest first, without waiting on the ones it hasn't */
+    GPUTimers* timers = &program.gpu_timers;
+    for (u32 i = 0; i < GPU_TIMER_FRAMES; ++i)
+    {
+        u32 frame = (timers->next_frame + i) % GPU_TIMER_FRAMES;
+        if (!timers->is_pending[frame])
+        {
+            continue;
+        }
+
+        // Timestamps are written in order, so when the last one is available they all are
+        int available = 0;
+        glGetQueryObjectiv(timers->queries[frame][GPU_PASS_COUNT], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+        {
+            break;
+        }
+
+        u64 timestamps[GPU_PASS_COUNT + 1];
+        for (u32 mark = 0; mark <= GPU_PASS_COUNT; ++mark)
+        {
+            glGetQueryObjectui64v(timers->queries[frame][mark], GL_QUERY_RESULT, &timestamps[mark]);
+        }
+        for (u32 pass = 0; pass < GPU_PASS_COUNT; ++pass)
+        {
+            timers->pass_times[pass] = timestamps[pass + 1] - timestamps[pass];
+        }
+        timers->is_pending[frame] = 0;
+    }
+
+    program.compute_time_last_frame = timers->pass_times[GPU_PASS_CLUSTER_BUILD] + timers->pass_times[GPU_PASS_LIGHT_ASSIGNMENT];
+    program.shading_time_last_frame = timers->pass_times[GPU_PASS_OPAQUE] + timers->pass_times[GPU_PASS_TRANSPARENT]
+        + timers->pass_times[GPU_PASS_AREA_LIGHTS];
+}
+
+void
+begin_gpu_timer_frame()
+{
+    GPUTimers* timers = &program.gpu_timers;
+    read_gpu_timers();
+
+    // Reusing a query the GPU hasn't finished with would make the driver wait for it, so skip timing instead
+    timers->frame = timers->is_pending[timers->next_frame] ? -1 : (s32)timers->next_frame;
+}
+
+void
+mark_gpu_pass(GPUPass pass)
+{
+    /* Timestamps the start of a pass, which is also the end of the one before. Every pass is marked each frame, in
+     * order, even when it has nothing to do */
+    GPUTimers* timers = &program.gpu_timers;
+    if (timers->frame >= 0)
+    {
+        glQueryCounter(timers->queries[timers->frame][pass], GL_TIMESTAMP);
+    }
+}
+
+void
+end_gpu_timer_frame()
+{
+    GPUTimers* timers = &program.gpu_timers;
+    if (timers->frame >= 0)
+    {
+        glQueryCounter(timers->queries[timers->frame][GPU_PASS_COUNT], GL_TIMESTAMP);
+        timers->is_pending[timers->frame] = 1;
+        timers->next_frame = (timers->next_frame + 1) % GPU_TIMER_FRAMES;
+        timers->frame = -1;
+    }
+}
+
+void
+animate_lights(FreeCamera* camera, Scene* scene, u32 num_point_lights, u32 num_area_lights)
+{
+    /* Writes this frame's view space lights straight into the light SSBOs with animate_lights.comp, in place of the
+     * CPU upload */
+    if (program.are_lights_dirty)
+    {
+        upload_animated_lights();
+    }
+
+    if (num_point_lights + num_area_lights == 0)
+    {
+        return;
+    }
+
+    u32 shader = program.shader_animate_lights;
+    glUseProgram(shader);
+    glProgramUniformMatrix4fv(shader, 0, 1, GL_FALSE, (f32*)camera->view_matrix);
+    glProgramUniform1f(shader, 1, (f32)program.light_animation_time);
+    glProgramUniform1ui(shader, 2, num_point_lights);
+    glProgramUniform1ui(shader, 3, num_area_lights);
+    glProgramUniform3f(shader, 4, scene->attenuation_quadratic, scene->attenuation_linear, scene->attenuation_constant);
+    glProgramUniform1f(shader, 5, scene->minimum_perceivable_intensity);
+
+    glDispatchCompute((num_point_lights + num_area_lights + 63) / 64, 1, 1);
+
+    // Read by light assignment and shading, and drawn from as the area light polygons' vertices
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+}
+
+void
+resize_hiz_pyramid(u32 width, u32 height)
+{
+    if (program.hiz_texture && program.hiz_width == width && program.hiz_height == height)
+    {
+        return;
+    }
+
+    if (program.hiz_texture)
+    {
+        glDeleteTextures(1, &program.hiz_depth_texture);
+        glDeleteTextures(1, &program.hiz_texture);
+    }
+
+    program.hiz_width = width;
+    program.hiz_height = height;
+    program.hiz_levels = 1 + (u32)floor(log2((double)max(width, height)));
+
+    glCreateTextures(GL_TEXTURE_2D, 1, &program.hiz_depth_texture);
+    glTextureStorage2D(program.hiz_depth_texture, 1, GL_DEPTH_COMPONENT24, width, height);
+    glTextureParameteri(program.hiz_depth_texture, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTextureParameteri(program.hiz_depth_texture, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    // Only ever read with texelFetch, the mipmap filter just keeps every level accessible
+    glCreateTextures(GL_TEXTURE_2D, 1, &program.hiz_texture);
+    glTextureStorage2D(program.hiz_texture, program.hiz_levels, GL_R32F, width, height);
+    glTextureParameteri(program.hiz_texture, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTextureParameteri(program.hiz_texture, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTextureParameteri(program.hiz_texture, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTextureParameteri(program.hiz_texture, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+}
+
+void
+build_hiz_pyramid()
+{
+    // Copy the depth buffer of what has been drawn so far, then downsample it level by level
+    glCopyTextureSubImage2D(program.hiz_depth_texture, 0, 0, 0, 0, 0, program.hiz_width, program.hiz_height);
+
+    glUseProgram(program.shader_hiz_build);  // hiz_build.comp
+    glBindTextureUnit(0, program.hiz_depth_texture);
+
+    for (u32 level = 0; level < program.hiz_levels; ++level)
+    {
+        u32 level_width = max(1, program.hiz_width >> level);
+        u32 level_height = max(1, program.hiz_height >> level);
 
-    // Create ebo for star since its concave so we can't use GL_TRIANGLE_FAN
-    glGenBuffers(1, &ebo);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(star_indices), star_indices, GL_STATIC_DRAW);
+        glBindImageTexture(0, program.hiz_texture, level > 0 ? level - 1 : 0, GL_FALSE, 0, GL_READ_ONLY, GL_R32F);
+        glBindImageTexture(1, program.hiz_texture, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+        glProgramUniform1i(program.shader_hiz_build, 0, (int)level);
+        glDispatchCompute((level_width + 7) / 8, (level_height + 7) / 8, 1);
 
+        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+    }
 
-    // Build Vertex Data
-    int total_vertices = 0;
-    for (int i = 0; i < light_count; i++)
-        total_vertices += arealights[i].n; // Total vertices needed
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+}
 
-    float* vertex_data = malloc(total_vertices * sizeof(vec3));
-    float* color_data = malloc(total_vertices * sizeof(vec3));
-    
-    int index = 0;
-    for (int i = 0; i < light_count; i++)
+void
+upload_occlusion_draw_list(Scene* scene, DynamicArray* opaque_draw_calls, DynamicArray* transparent_draw_calls, DynamicArray* batches, u32 first_draw_data_index)
+{
+    /* Draw slots are laid out as [opaques..., transparents...] (one per instance), with a command for each batch
+     * in each phase: [phase 0 batches..., phase 1 batches...]. Each phase appends to its own half of the remap buffer */
+    u32 num_opaques = array_length(opaque_draw_calls, sizeof(PBRDrawCall));
+    u32 num_transparents = array_length(transparent_draw_calls, sizeof(PBRDrawCall));
+    u32 draw_count = num_opaques + num_transparents;
+    u32 batch_count = array_length(batches, sizeof(DrawBatch));
+
+    if (draw_count > program.occlusion_buffers_max_draws)
     {
-        AreaLight* al = &arealights[i];
-
-        for (int j = 0; j < al->n; j++)
+        if (!program.occlusion_draw_slot_ssbo)
         {
-            // glm_vec3_copy((vec3){ al->points_worldspace[j][0], al->points_worldspace[j][1], al->points_worldspace[j][2] },
-                // &vertex_data[index * 3]);
-            vertex_data[index * 3 + 0] = al->points_worldspace[j][0];
-            vertex_data[index * 3 + 1] = al->points_worldspace[j][1];
-            vertex_data[index * 3 + 2] = al->points_worldspace[j][2];
-            
-            // glm_vec3_copy((vec3){ al->color_rgb_intensity_a[0], al->color_rgb_intensity_a[1], al->color_rgb_intensity_a[2] },
-            //     &color_data[index * 3]);
-            color_data[index * 3 + 0] = al->color_rgb_intensity_a[0];
-            color_data[index * 3 + 1] = al->color_rgb_intensity_a[1];
-            color_data[index * 3 + 2] = al->color_rgb_intensity_a[2];
-
-            index++;
+            glCreateBuffers(1, &program.occlusion_draw_slot_ssbo);
+            glCreateBuffers(1, &program.occlusion_command_buffer);
+            glCreateBuffers(1, &program.occlusion_instance_remap_ssbo);
         }
+
+        // There are never more batches than draws
+        program.occlusion_buffers_max_draws = max(draw_count, 2 * program.occlusion_buffers_max_draws);
+        glNamedBufferData(program.occlusion_draw_slot_ssbo, program.occlusion_buffers_max_draws * sizeof(OcclusionDrawSlot), NULL, GL_DYNAMIC_DRAW);
+        glNamedBufferData(program.occlusion_command_buffer, 2 * program.occlusion_buffers_max_draws * sizeof(DrawIndirectCommand), NULL, GL_DYNAMIC_DRAW);
+        glNamedBufferData(program.occlusion_instance_remap_ssbo, 2 * program.occlusion_buffers_max_draws * sizeof(u32), NULL, GL_DYNAMIC_DRAW);
     }
 
-    // Upload Data
-    glBufferData(GL_ARRAY_BUFFER, total_vertices * (sizeof(vec3) * 2), NULL, GL_DYNAMIC_DRAW);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, total_vertices * sizeof(vec3), vertex_data);
-    glBufferSubData(GL_ARRAY_BUFFER, total_vertices * sizeof(vec3), total_vertices * sizeof(vec3), color_data);
+    OcclusionDrawSlot* slots = malloc(draw_count * sizeof(OcclusionDrawSlot));
+    DrawIndirectCommand* commands = malloc(2 * batch_count * sizeof(DrawIndirectCommand));
+    for (u32 batch_i = 0; batch_i < batch_count; ++batch_i)
+    {
+        DrawBatch* batch = get_element(batches, sizeof(DrawBatch), batch_i);
+        PBRDrawCall* draw_call = batch->first_draw < num_opaques
+            ? get_element(opaque_draw_calls, sizeof(PBRDrawCall), batch->first_draw)
+            : get_element(transparent_draw_calls, sizeof(PBRDrawCall), batch->first_draw - num_opaques);
 
-    free(vertex_data);
-    free(color_data);
+        commands[batch_i] = build_indirect_command(draw_call, batch->first_draw);
+        commands[batch_count + batch_i] = build_indirect_command(draw_call, draw_count + batch->first_draw);
 
-    // Setup Vertex Attributes
-    glEnableVertexAttribArray(0); // Position
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(vec3), (void*)0);
-    
-    glEnableVertexAttribArray(1); // Color
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(vec3), (void*)(total_vertices * sizeof(vec3)));
+        for (u32 i = batch->first_draw; i < batch->first_draw + batch->instance_count; ++i)
+        {
+            draw_call = i < num_opaques
+                ? get_element(opaque_draw_calls, sizeof(PBRDrawCall), i)
+                : get_element(transparent_draw_calls, sizeof(PBRDrawCall), i - num_opaques);
+
+            slots[i].instance_index = draw_call->instance_index;
+            slots[i].flags = i < num_opaques ? 0 : DRAW_SLOT_LATE_ONLY;
+            slots[i].batch_index = batch_i;
+            slots[i].batch_first_draw = batch->first_draw;
+            slots[i].draw_data_index = first_draw_data_index + i;
+        }
+    }
+    glNamedBufferSubData(program.occlusion_draw_slot_ssbo, 0, draw_count * sizeof(OcclusionDrawSlot), slots);
+    glNamedBufferSubData(program.occlusion_command_buffer, 0, 2 * batch_count * sizeof(DrawIndirectCommand), commands);
+    free(slots);
+    free(commands);
+
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, GLOBAL_SSBO_INDEX_INSTANCE_BOUNDS, scene->instance_bounds_ssbo);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, GLOBAL_SSBO_INDEX_INSTANCE_VISIBILITY, scene->instance_visibility_ssbo);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, GLOBAL_SSBO_INDEX_OCCLUSION_DRAWS, program.occlusion_draw_slot_ssbo);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, GLOBAL_SSBO_INDEX_OCCLUSION_COMMANDS, program.occlusion_command_buffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, GLOBAL_SSBO_INDEX_INSTANCE_REMAP, program.occlusion_instance_remap_ssbo);
+}
 
-    // Render
-    glUseProgram(program.shader_area_light_polygons);
-    glProgramUniformMatrix4fv(program.shader_area_light_polygons, 0, 1, GL_FALSE, (f32*)program.cam.camera_matrix);
+void
+dispatch_occlusion_cull(u32 draw_count, u32 batch_count, u32 phase)
+{
+    u32 cull_shader = program.shader_occlusion_cull;  // occlusion_cull.comp
+    glUseProgram(cull_shader);
+    glProgramUniform1ui(cull_shader, 0, draw_count);
+    glProgramUniform1ui(cull_shader, 1, phase);
+    glProgramUniformMatrix4fv(cull_shader, 2, 1, GL_FALSE, (f32*)program.cam.camera_matrix);
+    glProgramUniform1ui(cull_shader, 3, batch_count);
+    glBindTextureUnit(0, program.hiz_texture);
+
+    glDispatchCompute((draw_count + 63) / 64, 1, 1);
+
+    // Commands are read by the indirect draws, and the phase 0 results by phase 1
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+}
 
-    int offset = 0;
-    for (int i = 0; i < light_count; i++)
+void
+upload_meshlet_draw_list(Scene* scene, DynamicArray* opaque_draw_calls, DynamicArray* transparent_draw_calls, DynamicArray* batches,
+    u32 first_draw_data_index, b32 is_occlusion_culling_enabled)
+{
+    /* Every batch that draws a single instance of a primitive with meshlets is drawn meshlet by meshlet instead. Each of
+     * those draws gets a slot, and each of its meshlets a cull job and an indirect command in both phases' halves of the
+     * command buffer. Marks the draw calls with their slot, and sets program.meshlet_jobs/draws_this_frame */
+    u32 num_opaques = array_length(opaque_draw_calls, sizeof(PBRDrawCall));
+    u32 batch_count = array_length(batches, sizeof(DrawBatch));
+
+    DynamicArray draw_slots = create_array(1 * sizeof(MeshletDrawSlot));
+    DynamicArray jobs = create_array(scene->meshlets_count * sizeof(MeshletCullJob));
+    for (u32 batch_i = 0; batch_i < batch_count; ++batch_i)
     {
-        if (arealights[i].n == 10)
+        DrawBatch* batch = get_element(batches, sizeof(DrawBatch), batch_i);
+        PBRDrawCall* draw_call = batch->first_draw < num_opaques
+            ? get_element(opaque_draw_calls, sizeof(PBRDrawCall), batch->first_draw)
+            : get_element(transparent_draw_calls, sizeof(PBRDrawCall), batch->first_draw - num_opaques);
+        if (batch->instance_count != 1 || draw_call->meshlets.count == 0)
         {
-            glDrawElementsBaseVertex(GL_TRIANGLES, sizeof(star_indices) / sizeof(star_indices[0]), GL_UNSIGNED_INT, 0, offset);
+            continue;
         }
-        else
+
+        MeshletDrawSlot slot = { 0 };
+        slot.draw_data_index = first_draw_data_index + batch->first_draw;
+        slot.first_meshlet = draw_call->meshlets.first;
+        slot.first_command = array_length(&jobs, sizeof(MeshletCullJob));
+        slot.flags = (draw_call->material->double_sided ? MESHLET_DRAW_DOUBLE_SIDED : 0)
+            | (draw_call->material->is_blended ? MESHLET_DRAW_KEEP_ORDER : 0)
+            | (is_occlusion_culling_enabled ? MESHLET_DRAW_OCCLUSION_CULLED : 0);
+        slot.batch_index = batch_i;
+
+        draw_call->meshlet_draw = array_length(&draw_slots, sizeof(MeshletDrawSlot));
+        draw_call->meshlet_first_command = slot.first_command;
+        push_element_copy(&draw_slots, sizeof(MeshletDrawSlot), &slot);
+
+        MeshletCullJob* draw_jobs = push_size(&jobs, sizeof(MeshletCullJob), draw_call->meshlets.count);
+        for (u32 i = 0; i < draw_call->meshlets.count; ++i)
         {
-            glDrawArrays(GL_TRIANGLE_FAN, offset, arealights[i].n);
+            draw_jobs[i].meshlet_index = draw_call->meshlets.first + i;
+            draw_jobs[i].meshlet_draw = draw_call->meshlet_draw;
         }
-        offset += arealights[i].n;
     }
 
-    // Cleanup
-    glDeleteBuffers(1, &vbo);
-    glDeleteBuffers(1, &ebo);
-    glDeleteVertexArrays(1, &vao);
+    u32 job_count = array_length(&jobs, sizeof(MeshletCullJob));
+    u32 draw_count = array_length(&draw_slots, sizeof(MeshletDrawSlot));
+    program.meshlet_jobs_this_frame = job_count;
+    program.meshlet_draws_this_frame = draw_count;
+
+    if (job_count > program.meshlet_buffers_max_jobs || draw_count > program.meshlet_buffers_max_draws)
+    {
+        if (!program.meshlet_job_ssbo)
+        {
+            glCreateBuffers(1, &program.meshlet_job_ssbo);
+            glCreateBuffers(1, &program.meshlet_draw_slot_ssbo);
+            glCreateBuffers(1, &program.meshlet_command_buffer);
+            glCreateBuffers(1, &program.meshlet_count_buffer);
+        }
+
+        program.meshlet_buffers_max_jobs = max(job_count, 2 * program.meshlet_buffers_max_jobs);
+        program.meshlet_buffers_max_draws = max(draw_count, 2 * program.meshlet_buffers_max_draws);
+        glNamedBufferData(program.meshlet_job_ssbo, program.meshlet_buffers_max_jobs * sizeof(MeshletCullJob), NULL, GL_DYNAMIC_DRAW);
+        glNamedBufferData(program.meshlet_draw_slot_ssbo, program.meshlet_buffers_max_draws * sizeof(MeshletDrawSlot), NULL, GL_DYNAMIC_DRAW);
+        glNamedBufferData(program.meshlet_command_buffer, 2 * program.meshlet_buffers_max_jobs * sizeof(DrawIndirectCommand), NULL, GL_DYNAMIC_DRAW);
+        glNamedBufferData(program.meshlet_count_buffer, (MESHLET_COUNT_HEADER_SIZE + 2 * program.meshlet_buffers_max_draws) * sizeof(u32), NULL, GL_DYNAMIC_DRAW);
+    }
+
+    if (job_count > 0)
+    {
+        glNamedBufferSubData(program.meshlet_job_ssbo, 0, job_count * sizeof(MeshletCullJob), jobs.data_buffer);
+        glNamedBufferSubData(program.meshlet_draw_slot_ssbo, 0, draw_count * sizeof(MeshletDrawSlot), draw_slots.data_buffer);
+        glClearNamedBufferSubData(program.meshlet_count_buffer, GL_R32UI, 0, (MESHLET_COUNT_HEADER_SIZE + 2 * draw_count) * sizeof(u32), GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, GLOBAL_SSBO_INDEX_MESHLETS, scene->meshlet_ssbo);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, GLOBAL_SSBO_INDEX_MESHLET_JOBS, program.meshlet_job_ssbo);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, GLOBAL_SSBO_INDEX_MESHLET_DRAWS, program.meshlet_draw_slot_ssbo);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, GLOBAL_SSBO_INDEX_MESHLET_COMMANDS, program.meshlet_command_buffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, GLOBAL_SSBO_INDEX_MESHLET_COUNTS, program.meshlet_count_buffer);
+    }
+
+    free_array(&draw_slots);
+    free_array(&jobs);
+}
+
+void
+dispatch_meshlet_cull(u32 batch_count, u32 phase)
+{
+    // Run after the phase's occlusion culling dispatch, whose commands decide which meshlet draws happen in the phase
+    u32 cull_shader = program.shader_meshlet_cull;  // meshlet_cull.comp
+    FreeCamera* camera = &program.cam;
+
+    // View space planes, meshlets are tested in view space where the camera is at the origin
+    vec4 frustum_planes[6];
+    glm_frustum_planes(camera->projection_matrix, frustum_planes);
+
+    glUseProgram(cull_shader);
+    glProgramUniform1ui(cull_shader, 0, program.meshlet_jobs_this_frame);
+    glProgramUniform1ui(cull_shader, 1, phase);
+    glProgramUniform1ui(cull_shader, 2, program.meshlet_draws_this_frame);
+    glProgramUniform1ui(cull_shader, 3, batch_count);
+    glProgramUniform4fv(cull_shader, 4, 6, (f32*)frustum_planes);
+
+    glDispatchCompute((program.meshlet_jobs_this_frame + 63) / 64, 1, 1);
+
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT);
 }
 
 void
@@ -1521,7 +4817,9 @@ draw_gltf_scene(Scene* scene)
     u32 num_point_lights = array_length(&program.point_lights, sizeof(PointLight));
     u32 num_area_lights = array_length(&program.area_lights, sizeof(AreaLight));
 
-    // Upload lights in viewspace from program.point_lights to the light SSBOs
+    mark_gpu_pass(GPU_PASS_LIGHTS);
+
+    // Upload lights in viewspace from program.point_lights to the light SSBOs, or animate them there on the GPU
     {
         // Resize point and area light SSBOs
 
@@ -1539,161 +4837,158 @@ draw_gltf_scene(Scene* scene)
             glNamedBufferData(program.area_light_ssbo, new_size, NULL, GL_DYNAMIC_DRAW);
         }
 
-        // Update point lights SSBO:
-        f32* mapped_pl_ssbo = (float*)glMapNamedBuffer(program.point_light_ssbo, GL_WRITE_ONLY);
-        for (u32 point_id = 0; point_id < num_point_lights; ++point_id)
+        if (program.is_light_animation_enabled)
         {
-            PointLight* point_light = get_element(&program.point_lights, sizeof(PointLight), point_id);
+            animate_lights(camera, scene, num_point_lights, num_area_lights);
+            program.arealight_precomp_time_last_frame = program.arealight_precomp_time_this_frame;
+            program.arealight_precomp_time_this_frame = 0.0;
+        }
+        else
+        {
+            // Update point lights SSBO:
+            f32* mapped_pl_ssbo = (float*)glMapNamedBuffer(program.point_light_ssbo, GL_WRITE_ONLY);
+            for (u32 point_id = 0; point_id < num_point_lights; ++point_id)
+            {
+                PointLight* point_light = get_element(&program.point_lights, sizeof(PointLight), point_id);
             
-            // Transform point light position to view space
-            vec4 viewpos = { point_light->position[0], point_light->position[1], point_light->position[2], 1.0f };
-            glm_mat4_mulv(camera->view_matrix, viewpos, viewpos);
-
-            // Compute range for point light
-            float point_light_range = calculate_point_light_range(
-                point_light->intensity, scene->minimum_perceivable_intensity,
-                scene->attenuation_quadratic,
-                scene->attenuation_linear,
-                scene->attenuation_constant
-            );
-
-            float* mapped_pl = &mapped_pl_ssbo[point_id * sizeof(PointLight) / sizeof(f32)];
-
-            // Set mapped vec4 position_xyz_range_w
-            mapped_pl[0] = viewpos[0];
-            mapped_pl[1] = viewpos[1];
-            mapped_pl[2] = viewpos[2];
-            mapped_pl[3] = point_light_range;
-
-            // Set mapped vec4 color_rgb_intensity_a
-            mapped_pl[4] = point_light->color[0];
-            mapped_pl[5] = point_light->color[1];
-            mapped_pl[6] = point_light->color[2];
-            mapped_pl[7] = point_light->intensity;
-        }
-        glUnmapNamedBuffer(program.point_light_ssbo);
+                // Transform point light position to view space
+                vec4 viewpos = { point_light->position[0], point_light->position[1], point_light->position[2], 1.0f };
+                glm_mat4_mulv(camera->view_matrix, viewpos, viewpos);
+
+                // Compute range for point light
+                float point_light_range = calculate_point_light_range(
+                    point_light->intensity, scene->minimum_perceivable_intensity,
+                    scene->attenuation_quadratic,
+                    scene->attenuation_linear,
+                    scene->attenuation_constant
+                );
+
+                float* mapped_pl = &mapped_pl_ssbo[point_id * sizeof(PointLight) / sizeof(f32)];
+
+                // Set mapped vec4 position_xyz_range_w
+                mapped_pl[0] = viewpos[0];
+                mapped_pl[1] = viewpos[1];
+                mapped_pl[2] = viewpos[2];
+                mapped_pl[3] = point_light_range;
+
+                // Set mapped vec4 color_rgb_intensity_a
+                mapped_pl[4] = point_light->color[0];
+                mapped_pl[5] = point_light->color[1];
+                mapped_pl[6] = point_light->color[2];
+                mapped_pl[7] = point_light->intensity;
+            }
+            glUnmapNamedBuffer(program.point_light_ssbo);
         
-        // Start timer for arealight precomputation
-        double arealight_precomp_timer_start = glfwGetTime();
+            // Start timer for arealight precomputation
+            double arealight_precomp_timer_start = glfwGetTime();
 
-        // Update area lights SSBO:
-        f32* mapped_arealight_ssbo = (float*)glMapNamedBuffer(program.area_light_ssbo, GL_WRITE_ONLY);
-        for (u32 area_id = 0; area_id < num_area_lights; ++area_id)
-        {
-            AreaLight* area_light = get_element(&program.area_lights, sizeof(AreaLight), area_id);
-            
-            // Transform area light polygon from world to view space
-            vec4 points_viewspace[MAX_UNCLIPPED_NGON];
-            for (int vertex = 0; vertex < MAX_UNCLIPPED_NGON; ++vertex)
+            // Update area lights SSBO:
+            f32* mapped_arealight_ssbo = (float*)glMapNamedBuffer(program.area_light_ssbo, GL_WRITE_ONLY);
+            for (u32 area_id = 0; area_id < num_area_lights; ++area_id)
             {
-                glm_mat4_mulv(camera->view_matrix, area_light->points_worldspace[vertex], points_viewspace[vertex]);
-            }
+                AreaLight* area_light = get_element(&program.area_lights, sizeof(AreaLight), area_id);
             
-            // Clustered shading CPU side before light assignment: precompute bounding box and sphere:
-            vec4 aabb_min;
-            vec4 aabb_max;
-            vec4 sphere_of_influence;
-            {
-                float area = polygon_area(area_light);
-                float influence_radius = calculate_area_light_influence_radius(area_light, area, scene->minimum_perceivable_intensity);
-                
-                // AABB by getting polygon aabb and expanding by influence radius
-                glm_vec4_copy(points_viewspace[0], aabb_min);
-                glm_vec4_copy(points_viewspace[0], aabb_max);
-                for (int i = 1; i < area_light->n; ++i)
+                // Transform area light polygon from world to view space
+                vec4 points_viewspace[MAX_UNCLIPPED_NGON];
+                for (int vertex = 0; vertex < MAX_UNCLIPPED_NGON; ++vertex)
                 {
-                    glm_vec4_minv(aabb_min, points_viewspace[i], aabb_min);
-                    glm_vec4_maxv(aabb_max, points_viewspace[i], aabb_max);
+                    glm_mat4_mulv(camera->view_matrix, area_light->points_worldspace[vertex], points_viewspace[vertex]);
                 }
-                glm_vec4_sub(aabb_min, (vec4){influence_radius, influence_radius, influence_radius, 0.0f}, aabb_min);
-                glm_vec4_add(aabb_max, (vec4){influence_radius, influence_radius, influence_radius, 0.0f}, aabb_max);
-
-                // Lambertian bounding sphere:
-                //  - sphere center = polygon centroid
-                //  - sphere radius = polygon geo_radius + influence radius
-                vec3 centroid = {0.0f, 0.0f, 0.0f};
-                for (int i = 0; i < area_light->n; ++i)
+            
+                // Clustered shading CPU side before light assignment: precompute bounding box and sphere:
+                vec4 aabb_min;
+                vec4 aabb_max;
+                vec4 sphere_of_influence;
                 {
-                    glm_vec3_add(centroid, points_viewspace[i], centroid);
-                }
-                glm_vec3_scale(centroid, 1.0f / (float)area_light->n, centroid);
-
-                float max_dist_sq = 0.0f;
-                for (int i = 0; i < area_light->n; ++i) {
-                    vec3 delta;
-                    glm_vec3_sub(points_viewspace[i], centroid, delta);
-                    float dist_sq = glm_vec3_dot(delta, delta);
-                    if (dist_sq > max_dist_sq) max_dist_sq = dist_sq;
-                }
+                    float area = polygon_area(area_light);
+                    float influence_radius = calculate_area_light_influence_radius(area_light, area, scene->minimum_perceivable_intensity);
+                
+                    // AABB by getting polygon aabb and expanding by influence radius
+                    glm_vec4_copy(points_viewspace[0], aabb_min);
+                    glm_vec4_copy(points_viewspace[0], aabb_max);
+                    for (int i = 1; i < area_light->n; ++i)
+                    {
+                        glm_vec4_minv(aabb_min, points_viewspace[i], aabb_min);
+                        glm_vec4_maxv(aabb_max, points_viewspace[i], aabb_max);
+                    }
+                    glm_vec4_sub(aabb_min, (vec4){influence_radius, influence_radius, influence_radius, 0.0f}, aabb_min);
+                    glm_vec4_add(aabb_max, (vec4){influence_radius, influence_radius, influence_radius, 0.0f}, aabb_max);
+
+                    // Lambertian bounding sphere:
+                    //  - sphere center = polygon centroid
+                    //  - sphere radius = polygon geo_radius + influence radius
+                    vec3 centroid = {0.0f, 0.0f, 0.0f};
+                    for (int i = 0; i < area_light->n; ++i)
+                    {
+                        glm_vec3_add(centroid, points_viewspace[i], centroid);
+                    }
+                    glm_vec3_scale(centroid, 1.0f / (float)area_light->n, centroid);
+
+                    float max_dist_sq = 0.0f;
+                    for (int i = 0; i < area_light->n; ++i) {
+                        vec3 delta;
+                        glm_vec3_sub(points_viewspace[i], centroid, delta);
+                        float dist_sq = glm_vec3_dot(delta, delta);
+                        if (dist_sq > max_dist_sq) max_dist_sq = dist_sq;
+                    }
 
-                float geo_radius = sqrtf(max_dist_sq);
+                    float geo_radius = sqrtf(max_dist_sq);
                 
-                sphere_of_influence[0] = centroid[0];
-                sphere_of_influence[1] = centroid[1];
-                sphere_of_influence[2] = centroid[2];
-                sphere_of_influence[3] = geo_radius + influence_radius;
-            }
+                    sphere_of_influence[0] = centroid[0];
+                    sphere_of_influence[1] = centroid[1];
+                    sphere_of_influence[2] = centroid[2];
+                    sphere_of_influence[3] = geo_radius + influence_radius;
+                }
 
-            float* mapped_arealight = &mapped_arealight_ssbo[area_id * sizeof(AreaLight) / sizeof(f32)];
+                float* mapped_arealight = &mapped_arealight_ssbo[area_id * sizeof(AreaLight) / sizeof(f32)];
 
-            // Set mapped color and intensity
-            mapped_arealight[0] = area_light->color_rgb_intensity_a[0];
-            mapped_arealight[1] = area_light->color_rgb_intensity_a[1];
-            mapped_arealight[2] = area_light->color_rgb_intensity_a[2];
-            mapped_arealight[3] = area_light->color_rgb_intensity_a[3];
+                // Set mapped color and intensity
+                mapped_arealight[0] = area_light->color_rgb_intensity_a[0];
+                mapped_arealight[1] = area_light->color_rgb_intensity_a[1];
+                mapped_arealight[2] = area_light->color_rgb_intensity_a[2];
+                mapped_arealight[3] = area_light->color_rgb_intensity_a[3];
             
-            ((int*)mapped_arealight)[4] = area_light->n;
-            ((int*)mapped_arealight)[5] = area_light->is_double_sided;
-            mapped_arealight[6] = area_light->_packing0;
-            mapped_arealight[7] = area_light->_packing1;
+                ((int*)mapped_arealight)[4] = area_light->n;
+                ((int*)mapped_arealight)[5] = area_light->is_double_sided;
+                mapped_arealight[6] = area_light->_packing0;
+                mapped_arealight[7] = area_light->_packing1;
             
-            // Set mapped cluster parameters
-            mapped_arealight[8]  = aabb_min[0];
-            mapped_arealight[9]  = aabb_min[1];
-            mapped_arealight[10] = aabb_min[2];
-            mapped_arealight[11] = aabb_min[3];
-
-            mapped_arealight[12] = aabb_max[0];
-            mapped_arealight[13] = aabb_max[1];
-            mapped_arealight[14] = aabb_max[2];
-            mapped_arealight[15] = aabb_max[3];
-
-            mapped_arealight[16] = sphere_of_influence[0];
-            mapped_arealight[17] = sphere_of_influence[1];
-            mapped_arealight[18] = sphere_of_influence[2];
-            mapped_arealight[19] = sphere_of_influence[3];
-
-            // Set mapped area light points
-            for (int vertex = 0; vertex < MAX_UNCLIPPED_NGON; ++vertex)
-            {
-                mapped_arealight[20 + vertex*4 + 0] = points_viewspace[vertex][0];
-                mapped_arealight[20 + vertex*4 + 1] = points_viewspace[vertex][1];
-                mapped_arealight[20 + vertex*4 + 2] = points_viewspace[vertex][2];
-                mapped_arealight[20 + vertex*4 + 3] = points_viewspace[vertex][3];
+                // Set mapped cluster parameters
+                mapped_arealight[8]  = aabb_min[0];
+                mapped_arealight[9]  = aabb_min[1];
+                mapped_arealight[10] = aabb_min[2];
+                mapped_arealight[11] = aabb_min[3];
+
+                mapped_arealight[12] = aabb_max[0];
+                mapped_arealight[13] = aabb_max[1];
+                mapped_arealight[14] = aabb_max[2];
+                mapped_arealight[15] = aabb_max[3];
+
+                mapped_arealight[16] = sphere_of_influence[0];
+                mapped_arealight[17] = sphere_of_influence[1];
+                mapped_arealight[18] = sphere_of_influence[2];
+                mapped_arealight[19] = sphere_of_influence[3];
+
+                // Set mapped area light points
+                for (int vertex = 0; vertex < MAX_UNCLIPPED_NGON; ++vertex)
+                {
+                    mapped_arealight[20 + vertex*4 + 0] = points_viewspace[vertex][0];
+                    mapped_arealight[20 + vertex*4 + 1] = points_viewspace[vertex][1];
+                    mapped_arealight[20 + vertex*4 + 2] = points_viewspace[vertex][2];
+                    mapped_arealight[20 + vertex*4 + 3] = points_viewspace[vertex][3];
+                }
             }
-        }
-        glUnmapNamedBuffer(program.area_light_ssbo);
+            glUnmapNamedBuffer(program.area_light_ssbo);
 
-        double arealight_precomp_timer_end = glfwGetTime();
-        program.arealight_precomp_time_last_frame = program.arealight_precomp_time_this_frame;
-        program.arealight_precomp_time_this_frame = arealight_precomp_timer_end - arealight_precomp_timer_start;
+            double arealight_precomp_timer_end = glfwGetTime();
+            program.arealight_precomp_time_last_frame = program.arealight_precomp_time_this_frame;
+            program.arealight_precomp_time_this_frame = arealight_precomp_timer_end - arealight_precomp_timer_start;
+        }
     }
 
+    mark_gpu_pass(GPU_PASS_CLUSTER_BUILD);
     if (enable_clustered_shading)
     {
-        // Ensure query has been used at least once before fetching compute time
-        if (program.compute_time_query && program.frame_counter > 0)
-        {
-            int available = 0;
-            glGetQueryObjectiv(program.compute_time_query, GL_QUERY_RESULT_AVAILABLE, &available);
-            if (available)
-            {
-                glGetQueryObjectui64v(program.compute_time_query, GL_QUERY_RESULT, &program.compute_time_last_frame);
-            }
-        }
-
-        glBeginQuery(GL_TIME_ELAPSED, program.compute_time_query);
-
         // TODO: Also implement froxel clusters for comparison?
 
         // Compute viewspace cluster AABBs with a compute shader
@@ -1717,6 +5012,8 @@ draw_gltf_scene(Scene* scene)
         // Make sure the writes to the cluster SSBO happen before the next shader
         glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
 
+        mark_gpu_pass(GPU_PASS_LIGHT_ASSIGNMENT);
+
         // Assign lights to clusters with a second compute shader
         glUseProgram(light_assignment_shader);  // lights_to_clusters.comp
 
@@ -1746,21 +5043,13 @@ draw_gltf_scene(Scene* scene)
         glDispatchCompute(dispatched_workgroups, 1, 1);
     #endif
         glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
-
-        glEndQuery(GL_TIME_ELAPSED);
     }
-
-    // Start shading timer
-    if (program.shading_time_query && program.frame_counter > 0)
+    else
     {
-        int available = 0;
-        glGetQueryObjectiv(program.shading_time_query, GL_QUERY_RESULT_AVAILABLE, &available);
-        if (available)
-        {
-            glGetQueryObjectui64v(program.shading_time_query, GL_QUERY_RESULT, &program.shading_time_last_frame);
-        }
+        mark_gpu_pass(GPU_PASS_LIGHT_ASSIGNMENT);
     }
-    glBeginQuery(GL_TIME_ELAPSED, program.shading_time_query);
+
+    mark_gpu_pass(GPU_PASS_OPAQUE);
 
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
@@ -1809,46 +5098,247 @@ draw_gltf_scene(Scene* scene)
     DynamicArray opaque_draw_calls = create_array(scene->total_opaque_primitives * sizeof(PBRDrawCall));
     DynamicArray transparent_draw_calls = create_array(scene->total_transparent_primitives * sizeof(PBRDrawCall));
 
-    // Draw the scene specified by gltf file
-    if (scene->data->scene)
+    // Find which primitive instances are inside the view frustum
+    u32 visible_instances_count = scene->instances_count;
+    if (program.is_frustum_culling_enabled)
+    {
+        vec4 frustum_planes[6];
+        glm_frustum_planes(camera->camera_matrix, frustum_planes);
+        visible_instances_count = bvh_frustum_cull(&scene->instance_bvh, scene->instance_world_bounds, frustum_planes, scene->visible_instances, NULL);
+
+        // BVH traversal order is spatial, sort back into node order so transparent primitives keep the order they had in the file
+        qsort(scene->visible_instances, visible_instances_count, sizeof(u32), compare_u32);
+    }
+    else
     {
-        // Add draw calls to either opaque or transparent
-        for (u32 i = 0; i < scene->data->nodes_count; ++i)
+        for (u32 i = 0; i < scene->instances_count; ++i)
         {
-            cgltf_node* node = &scene->data->nodes[i];
-            add_gltf_node_draw_calls(scene, camera, shader_program, node, GLM_MAT4_IDENTITY, &opaque_draw_calls, &transparent_draw_calls);
+            scene->visible_instances[i] = i;
         }
     }
+    program.visible_instances_last_frame = visible_instances_count;
+
+    // Add draw calls to either opaque or transparent
+    for (u32 i = 0; i < visible_instances_count; ++i)
+    {
+        PrimitiveInstance* instance = &scene->instances[scene->visible_instances[i]];
+        add_primitive_instance_draw_call(scene, camera, instance, &opaque_draw_calls, &transparent_draw_calls);
+    }
 
-    // Opaque render pass
     u32 num_opaques = array_length(&opaque_draw_calls, sizeof(PBRDrawCall));
-    for (u32 opaque_id = 0; opaque_id < num_opaques; ++opaque_id)
+    u32 num_transparents = array_length(&transparent_draw_calls, sizeof(PBRDrawCall));
+
+    // Order opaque draws by their sort key so consecutive draws share as much state as possible
+    if (program.is_state_sorting_enabled && num_opaques > 1)
+    {
+        u64* sort_keys = malloc(2 * num_opaques * sizeof(u64));
+        u32* draw_order = malloc(2 * num_opaques * sizeof(u32));
+        for (u32 i = 0; i < num_opaques; ++i)
+        {
+            PBRDrawCall* draw_call = get_element(&opaque_draw_calls, sizeof(PBRDrawCall), i);
+            sort_keys[i] = draw_call->sort_key;
+            draw_order[i] = i;
+        }
+        radix_sort_u64(sort_keys, draw_order, num_opaques, sort_keys + num_opaques, draw_order + num_opaques);
+
+        DynamicArray sorted_draw_calls = create_array(num_opaques * sizeof(PBRDrawCall));
+        for (u32 i = 0; i < num_opaques; ++i)
+        {
+            push_element_copy(&sorted_draw_calls, sizeof(PBRDrawCall), get_element(&opaque_draw_calls, sizeof(PBRDrawCall), draw_order[i]));
+        }
+        free_array(&opaque_draw_calls);
+        opaque_draw_calls = sorted_draw_calls;
+
+        free(sort_keys);
+        free(draw_order);
+    }
+
+    // Batch consecutive opaque draws of the same primitive (and LOD) into instanced draws (sorting puts them next to each other).
+    // Transparent draws keep their order and are never batched
+    DynamicArray batches = create_array((num_opaques + num_transparents) * sizeof(DrawBatch));
+    for (u32 i = 0; i < num_opaques; ++i)
+    {
+        PBRDrawCall* draw_call = get_element(&opaque_draw_calls, sizeof(PBRDrawCall), i);
+        u32 batch_count = array_length(&batches, sizeof(DrawBatch));
+        if (program.is_instancing_enabled && batch_count > 0)
+        {
+            DrawBatch* last_batch = get_element(&batches, sizeof(DrawBatch), batch_count - 1);
+            PBRDrawCall* last_draw_call = get_element(&opaque_draw_calls, sizeof(PBRDrawCall), last_batch->first_draw);
+            if (last_draw_call->vao == draw_call->vao && last_draw_call->lod == draw_call->lod)
+            {
+                ++last_batch->instance_count;
+                continue;
+            }
+        }
+
+        DrawBatch batch = { i, 1 };
+        push_element_copy(&batches, sizeof(DrawBatch), &batch);
+    }
+    u32 num_opaque_batches = array_length(&batches, sizeof(DrawBatch));
+    for (u32 i = 0; i < num_transparents; ++i)
+    {
+        DrawBatch batch = { num_opaques + i, 1 };
+        push_element_copy(&batches, sizeof(DrawBatch), &batch);
+    }
+    u32 num_batches = array_length(&batches, sizeof(DrawBatch));
+
+    // Per-draw uniforms for the whole frame, each batch's instances are consecutive
+    u32 first_draw_data_index = write_draw_data(&opaque_draw_calls, &transparent_draw_calls);
+
+    // Two-phase occlusion culling: the first phase draws last frame's visible set, a depth pyramid is built from that,
+    // then the second phase tests everything against it and draws what was missed. Every batch goes through an indirect
+    // command so the GPU decides which instances get drawn. (Needs the depth buffer copied to a texture, so not with MSAA)
+    b32 enable_occlusion_culling = program.is_occlusion_culling_enabled && !program.is_msaa_enabled && (num_opaques + num_transparents > 0);
+    if (enable_occlusion_culling)
+    {
+        // Read back counters from a previous frame without stalling
+        if (program.occlusion_stats_fence)
+        {
+            GLenum wait_result = glClientWaitSync(program.occlusion_stats_fence, 0, 0);
+            if (wait_result == GL_ALREADY_SIGNALED || wait_result == GL_CONDITION_SATISFIED)
+            {
+                program.occlusion_early_drawn_last_frame = program.occlusion_stats_mapped_pointer[0];
+                program.occlusion_late_drawn_last_frame = program.occlusion_stats_mapped_pointer[1];
+                program.occlusion_occluded_last_frame = program.occlusion_stats_mapped_pointer[2];
+                glDeleteSync(program.occlusion_stats_fence);
+                program.occlusion_stats_fence = 0;
+            }
+        }
+        glClearNamedBufferData(program.occlusion_stats_ssbo, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+
+        resize_hiz_pyramid(camera->width, camera->height);
+        upload_occlusion_draw_list(scene, &opaque_draw_calls, &transparent_draw_calls, &batches, first_draw_data_index);
+        dispatch_occlusion_cull(num_opaques + num_transparents, num_batches, 0);
+    }
+    // Instances come from the remap buffer when occlusion culling picks them, otherwise straight from the base instance
+    glProgramUniform1i(shader_program, PBR_LOC_is_instance_remap_enabled, enable_occlusion_culling);
+
+    // Big primitives drawn once are culled meshlet by meshlet on the GPU, after occlusion culling decides if they're drawn at all
+    program.meshlet_jobs_this_frame = 0;
+    program.meshlet_draws_this_frame = 0;
+    if (program.is_meshlet_culling_enabled && scene->meshlets_count > 0)
+    {
+        upload_meshlet_draw_list(scene, &opaque_draw_calls, &transparent_draw_calls, &batches, first_draw_data_index, enable_occlusion_culling);
+    }
+    b32 enable_meshlet_culling = program.meshlet_jobs_this_frame > 0;
+    if (enable_meshlet_culling)
+    {
+        // Read back the drawn counts from a previous frame without stalling
+        if (program.meshlet_stats_fence)
+        {
+            GLenum wait_result = glClientWaitSync(program.meshlet_stats_fence, 0, 0);
+            if (wait_result == GL_ALREADY_SIGNALED || wait_result == GL_CONDITION_SATISFIED)
+            {
+                program.meshlets_drawn_last_frame = program.meshlet_stats_mapped_pointer[0];
+                program.meshlet_triangles_drawn_last_frame = program.meshlet_stats_mapped_pointer[1];
+                glDeleteSync(program.meshlet_stats_fence);
+                program.meshlet_stats_fence = 0;
+            }
+        }
+        dispatch_meshlet_cull(num_batches, 0);
+    }
+    program.meshlets_tested_last_frame = program.meshlet_jobs_this_frame;
+
+    memset(&program.pbr_counters_this_frame, 0, sizeof(program.pbr_counters_this_frame));
+    begin_pbr_pass();
+
+    // Opaque render pass
+    for (u32 batch_id = 0; batch_id < num_opaque_batches; ++batch_id)
+    {
+        DrawBatch* batch = get_element(&batches, sizeof(DrawBatch), batch_id);
+        PBRDrawCall* draw_call = get_element(&opaque_draw_calls, sizeof(PBRDrawCall), batch->first_draw);
+        if (draw_call->meshlet_draw >= 0)
+        {
+            execute_meshlet_draw_call(draw_call, 0);
+            continue;
+        }
+        execute_pbr_draw_call(draw_call, batch->instance_count, first_draw_data_index + batch->first_draw,
+            enable_occlusion_culling ? (s64)(batch_id * sizeof(DrawIndirectCommand)) : -1);
+    }
+
+    if (enable_occlusion_culling)
     {
-        PBRDrawCall* draw_call = get_element(&opaque_draw_calls, sizeof(PBRDrawCall), opaque_id);
-        execute_pbr_draw_call(shader_program, draw_call);
+        // Second phase opaque render pass
+        end_pbr_pass();
+        build_hiz_pyramid();
+        dispatch_occlusion_cull(num_opaques + num_transparents, num_batches, 1);
+        if (enable_meshlet_culling)
+        {
+            dispatch_meshlet_cull(num_batches, 1);
+        }
+        begin_pbr_pass();
+
+        for (u32 batch_id = 0; batch_id < num_opaque_batches; ++batch_id)
+        {
+            DrawBatch* batch = get_element(&batches, sizeof(DrawBatch), batch_id);
+            PBRDrawCall* draw_call = get_element(&opaque_draw_calls, sizeof(PBRDrawCall), batch->first_draw);
+            if (draw_call->meshlet_draw >= 0)
+            {
+                execute_meshlet_draw_call(draw_call, 1);
+                continue;
+            }
+            execute_pbr_draw_call(draw_call, batch->instance_count, first_draw_data_index + batch->first_draw,
+                (s64)((num_batches + batch_id) * sizeof(DrawIndirectCommand)));
+        }
+
+        if (!program.occlusion_stats_fence)
+        {
+            glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+            glCopyNamedBufferSubData(program.occlusion_stats_ssbo, program.occlusion_stats_readback_buffer, 0, 0, 3 * sizeof(u32));
+            program.occlusion_stats_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        }
     }
     
+    mark_gpu_pass(GPU_PASS_TRANSPARENT);
+
     // Transparent render pass (had to include alphamasked objects for now as well because using early fragment tests feature)
-    u32 num_transparents = array_length(&transparent_draw_calls, sizeof(PBRDrawCall));
     // OLD: qsort won't work for suntemple due to seperate trees being stored in one primitive so they are in the same draw call, order independant method required
     // qsort(transparent_draw_calls.data_buffer, transparent_draw_calls.used_size / sizeof(PBRDrawCall), sizeof(PBRDrawCall), compare_draw_call_depths);
     for (u32 transparent_id = 0; transparent_id < num_transparents; ++transparent_id)
     {
         PBRDrawCall* draw_call = get_element(&transparent_draw_calls, sizeof(PBRDrawCall), transparent_id);
-        execute_pbr_draw_call(shader_program, draw_call);
+        if (draw_call->meshlet_draw >= 0)
+        {
+            execute_meshlet_draw_call(draw_call, enable_occlusion_culling ? 1 : 0);
+            continue;
+        }
+
+        // Transparent draws are only occlusion tested in the second phase (after all opaques are in the pyramid)
+        s64 indirect_command_offset = -1;
+        if (enable_occlusion_culling)
+        {
+            indirect_command_offset = (s64)((num_batches + num_opaque_batches + transparent_id) * sizeof(DrawIndirectCommand));
+        }
+        execute_pbr_draw_call(draw_call, 1, first_draw_data_index + num_opaques + transparent_id, indirect_command_offset);
     }
     
+    if (enable_meshlet_culling && !program.meshlet_stats_fence)
+    {
+        glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+        glCopyNamedBufferSubData(program.meshlet_count_buffer, program.meshlet_stats_readback_buffer, 0, 0, MESHLET_COUNT_HEADER_SIZE * sizeof(u32));
+        program.meshlet_stats_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+
+    end_pbr_pass();
+
     // Render area lights
+    mark_gpu_pass(GPU_PASS_AREA_LIGHTS);
     glDisable(GL_CULL_FACE);
     render_area_lights(num_area_lights, program.area_lights.data_buffer);
 
-    glEndQuery(GL_TIME_ELAPSED);  // End of shading time
+    end_draw_data_frame();
+    if (enable_meshlet_culling)
+    {
+        program.pbr_counters_this_frame.triangles += program.meshlet_triangles_drawn_last_frame;
+    }
+    program.pbr_counters_last_frame = program.pbr_counters_this_frame;
 
+    free_array(&batches);
     free_array(&opaque_draw_calls);
     free_array(&transparent_draw_calls);
 
-    // Check number of light ops by reading from mapped memory buffer
-    if (program.is_light_op_counting_enabled)
+    // Check number of light ops by reading from mapped memory buffer (benchmarks wait for the GPU anyway, after timing the CPU)
+    if (program.is_light_op_counting_enabled && !program.is_benchmark)
     {
         glFinish();
         program.last_light_ops_value = *program.light_ops_mapped_pointer;
@@ -1858,32 +5348,154 @@ draw_gltf_scene(Scene* scene)
 void
 free_scene(Scene scene)
 {
-    glDeleteBuffers(scene.data->buffers_count, scene.buffer_objects);
-    glDeleteTextures(scene.data->textures_count, scene.texture_objects);
+    end_geometry_stream(&scene.geometry_stream);
+    end_texture_stream(&scene.texture_stream);
+    for (u32 i = 0; i < scene.texture_objects_count; ++i)
+    {
+        release_resident_texture(scene.texture_objects[i]);
+    }
+    glDeleteSamplers(scene.samplers_count, scene.samplers);
     glDeleteTextures(1, &scene.white_texture);
     glDeleteTextures(1, &scene.flat_normal_texture);
     glDeleteVertexArrays(scene.vaos_count, scene.vaos);
+    glDeleteBuffers(1, &scene.instance_bounds_ssbo);
+    glDeleteBuffers(1, &scene.instance_visibility_ssbo);
+    glDeleteBuffers(1, &scene.lod_index_buffer);
+    glDeleteBuffers(1, &scene.vertex_buffer);
+    glDeleteBuffers(1, &scene.meshlet_ssbo);
     glDeleteBuffers(1, &program.point_light_ssbo);
     glDeleteBuffers(1, &program.cluster_grid_ssbo);
 
-    if (scene.data) cgltf_free(scene.data);
-    if (scene.buffer_objects) free(scene.buffer_objects);
     if (scene.texture_objects) free(scene.texture_objects);
+    if (scene.samplers) free(scene.samplers);
+    if (scene.materials) free(scene.materials);
+    if (scene.vaos_lods) free(scene.vaos_lods);
+    if (scene.vaos_primitive_modes) free(scene.vaos_primitive_modes);
+    if (scene.vaos_material_indices) free(scene.vaos_material_indices);
+    if (scene.vaos_vertex_counts) free(scene.vaos_vertex_counts);
+    if (scene.vaos_position_dequantization) free(scene.vaos_position_dequantization);
+    if (scene.vaos_meshlets) free(scene.vaos_meshlets);
     if (scene.vaos) free(scene.vaos);
     if (scene.vaos_attributes) free(scene.vaos_attributes);
     if (scene.vao_ranges) free(scene.vao_ranges);
+    if (scene.instances) free(scene.instances);
+    if (scene.instance_world_bounds) free(scene.instance_world_bounds);
+    if (scene.visible_instances) free(scene.visible_instances);
+    free_bvh(&scene.instance_bvh);
+    free_array(&scene.imported_point_lights);
+    free_array(&scene.imported_area_lights);
+    free_array(&program.point_lights);
+}
+
+const char*
+get_test_scene_filename(int scene_id)
+{
+    if (scene_id == 0)
+    {
+        return "data/sponza-glTF/Sponza.gltf";
+    }
+    else if (scene_id == 1)
+    {
+#define USE_MIRRORED_SUNTEMPLE
+#ifndef USE_MIRRORED_SUNTEMPLE
+        return "data/suntemple/suntemplegltf.gltf";
+#else
+        return "data/suntemple/mirroredsuntemple/mirroredsuntemple.gltf";
+#endif  // USE_MIRRORED_SUNTEMPLE
+    }
+    else if (scene_id == 2)
+    {
+        return "data/lost-empire/lostempireblenderexport.gltf";
+    }
+    else if (scene_id == 3)
+    {
+        if (program.scene_path)
+        {
+            return program.scene_path;
+        }
+
+        // All other scenes:
+        // return "data/Xbox - Halo 2 - Coagulation/Coagulation/glTF/untitled.gltf";
+        // return "data/Wii U - Mario Kart 8 - Wii Warios Gold Mine/glTF/untitled.gltf";
+        // return "data/uploads_files_3363978_BackStreet2/Building/gltf/exportfromfbx.gltf";
+        // return "data/blenderflattest/myflattest.gltf";
+        return "data/blenderflattest/myflattestsmooth.gltf";
+
+        // Working scenes:
+        // return "data/sponza-glTF/Sponza.gltf";
+        // return "data/suntemple/suntemplegltf.gltf";
+        // return "data/lost-empire/lostempireblenderexport.gltf";
+
+        // Other working scenes but not worth using for project
+        // return "data/damagedHemlet-glTF/DamagedHelmet.gltf";
+        // return "data/scifi-helmet-glTF/SciFiHelmet.gltf";
+        // return "data/AlphaBlendModeTestglTF/AlphaBlendModeTest.gltf";
+        // return "data/blendersponza/sponzaexport.gltf";  // <--Normal mapping gone in export?
+        // return "data/blendercube/cube.gltf";  // <- random blender project to test instancing
+        // return "data/3DS - The Legend of Zelda Majoras Mask 3D - Snowhead Temple/exported2/snowhead-shrunk.gltf";  // <- Obviously can't include this
+        // return "data/EmissiveStrengthTest-glTF/EmissiveStrengthTest.gltf";
+        // return "data/AntiqueCameraglTF/AntiqueCamera.gltf";
+
+        // These intel sponza files are humungous:
+        // return "data/main1_sponza/NewSponza_Main_glTF_003.gltf";
+        // return "data/pkg_a_curtains/NewSponza_Curtains_glTF.gltf";
+        // return "data/pkg_c1_trees/NewSponza_CypressTree_glTF.gltf";
+
+
+        // Not working scenes
+        // return "data/simple-instancing-glTF/SimpleInstancing.gltf";  // I don't support files without materials
+        // return "data/fox-glTF/Fox.gltf";  // I don't support vertex colors
+    }
+
+    assert(0 && "Invalid test scene id");
+    return NULL;
+}
+
+void
+apply_light_rig(const char* spec, Scene* scene)
+{
+    /* Replaces the current lights with a light rig file, or with lights generated over the scene's instance bounds
+     * when spec is a generator spec (see parse_light_rig_generator()) */
+    f64 start_time = glfwGetTime();
+
+    DynamicArray point_lights = create_array(1 * sizeof(PointLight));
+    DynamicArray area_lights = create_array(1 * sizeof(AreaLight));
+    LightRigGenerator generator;
+    if (parse_light_rig_generator(spec, &generator))
+    {
+        if (scene->instances_count == 0)
+        {
+            printf("Can't generate a light rig over a scene without instances\n");
+            exit(1);
+        }
+        generate_light_rig(&generator, (const vec3*)scene->instance_world_bounds, scene->instances_count,
+            &point_lights, &area_lights);
+    }
+    else if (!load_light_rig(spec, &point_lights, &area_lights))
+    {
+        exit(1);
+    }
+
     free_array(&program.point_lights);
+    free_array(&program.area_lights);
+    program.point_lights = point_lights;
+    program.area_lights = area_lights;
+    program.are_area_light_polygons_dirty = 1;
+    program.are_lights_dirty = 1;
+
+    printf("Light rig \"%s\": %d point lights and %d area lights in %.1f ms\n", spec,
+        (int)array_length(&program.point_lights, sizeof(PointLight)),
+        (int)array_length(&program.area_lights, sizeof(AreaLight)), 1000.0 * (glfwGetTime() - start_time));
 }
 
 void
-load_test_scene(int scene_id, Scene* out_loaded_scene)
+setup_test_scene(int scene_id, Scene* out_loaded_scene)
 {
+    /* Lights, camera and shading parameters for a test scene that was just loaded */
     u32 num_point_lights;
     vec3* point_light_positions;
     if (scene_id == 0)
     {
-        *out_loaded_scene = load_gltf_scene("data/sponza-glTF/Sponza.gltf");
-
         num_point_lights = sizeof(sponza_pointlight_positions) / sizeof(vec3);
         point_light_positions = sponza_pointlight_positions;
 
@@ -1896,16 +5508,15 @@ load_test_scene(int scene_id, Scene* out_loaded_scene)
         out_loaded_scene->param_roughness = 1.0f;
         out_loaded_scene->param_min_intensity = 0.01f;
         out_loaded_scene->param_intensity_saturation = 100.0f;
+
+        program.cam.pos[0] = 0.0f;
+        program.cam.pos[1] = 1.0f;
+        program.cam.pos[2] = 0.0f;
+        program.cam.pitch = 0.0f;
+        program.cam.yaw = PI/2.0f;
     }
     else if (scene_id == 1)
     {
-#define USE_MIRRORED_SUNTEMPLE
-#ifndef USE_MIRRORED_SUNTEMPLE
-        *out_loaded_scene = load_gltf_scene("data/suntemple/suntemplegltf.gltf");
-#else
-        *out_loaded_scene = load_gltf_scene("data/suntemple/mirroredsuntemple/mirroredsuntemple.gltf");
-#endif  // USE_MIRRORED_SUNTEMPLE
-
         num_point_lights = sizeof(suntemple_pointlight_positions) / sizeof(vec3);
         point_light_positions = suntemple_pointlight_positions;
 
@@ -1918,11 +5529,17 @@ load_test_scene(int scene_id, Scene* out_loaded_scene)
         out_loaded_scene->param_roughness = 0.7;
         out_loaded_scene->param_min_intensity = 0.01f;
         out_loaded_scene->param_intensity_saturation = 10.0f;
+
+        // glm_vec3_copy((vec3){ 0.577642f, -0.921296f, -28.718777f }, program.cam.pos);
+        // program.cam.pitch = 0.0f;
+        // program.cam.yaw = PI;
+
+        glm_vec3_copy((vec3){ 3.123726, 0.563292, -53.807980 }, program.cam.pos);
+        program.cam.pitch = 0.095518f;
+        program.cam.yaw = 3.582217f;
     }
     else if (scene_id == 2)
     {
-        *out_loaded_scene = load_gltf_scene("data/lost-empire/lostempireblenderexport.gltf");
-
         num_point_lights = sizeof(lostempire_pointlight_positions) / sizeof(vec3);
         point_light_positions = lostempire_pointlight_positions;
 
@@ -1933,44 +5550,15 @@ load_test_scene(int scene_id, Scene* out_loaded_scene)
 
         // Lost empire is similar to suntemple roughness wise
         out_loaded_scene->param_roughness = 1.0f;
-        out_loaded_scene->param_min_intensity = 0.01f;
-        out_loaded_scene->param_intensity_saturation = 10.0f;
-    }
-    else if (scene_id == 3)
-    {
-        // All other scenes:
-        // NOTE: Currently not supporting image buffer views which is why I'm not using .glb files.
-        // *out_loaded_scene = load_gltf_scene("data/Xbox - Halo 2 - Coagulation/Coagulation/glTF/untitled.gltf");
-        // *out_loaded_scene = load_gltf_scene("data/Wii U - Mario Kart 8 - Wii Warios Gold Mine/glTF/untitled.gltf");
-        // *out_loaded_scene = load_gltf_scene("data/uploads_files_3363978_BackStreet2/Building/gltf/exportfromfbx.gltf");
-        // *out_loaded_scene = load_gltf_scene("data/blenderflattest/myflattest.gltf");
-        *out_loaded_scene = load_gltf_scene("data/blenderflattest/myflattestsmooth.gltf");
-
-        // Working scenes:
-        // *out_loaded_scene = load_gltf_scene("data/sponza-glTF/Sponza.gltf");
-        // *out_loaded_scene = load_gltf_scene("data/suntemple/suntemplegltf.gltf");
-        // *out_loaded_scene = load_gltf_scene("data/lost-empire/lostempireblenderexport.gltf");
-
-        // Other working scenes but not worth using for project
-        // *out_loaded_scene = load_gltf_scene("data/damagedHemlet-glTF/DamagedHelmet.gltf");
-        // *out_loaded_scene = load_gltf_scene("data/scifi-helmet-glTF/SciFiHelmet.gltf");
-        // *out_loaded_scene = load_gltf_scene("data/AlphaBlendModeTestglTF/AlphaBlendModeTest.gltf");
-        // *out_loaded_scene = load_gltf_scene("data/blendersponza/sponzaexport.gltf");  // <--Normal mapping gone in export?
-        // *out_loaded_scene = load_gltf_scene("data/blendercube/cube.gltf");  // <- random blender project to test instancing
-        // *out_loaded_scene = load_gltf_scene("data/3DS - The Legend of Zelda Majoras Mask 3D - Snowhead Temple/exported2/snowhead-shrunk.gltf");  // <- Obviously can't include this
-        // *out_loaded_scene = load_gltf_scene("data/EmissiveStrengthTest-glTF/EmissiveStrengthTest.gltf");
-        // *out_loaded_scene = load_gltf_scene("data/AntiqueCameraglTF/AntiqueCamera.gltf");
-
-        // These intel sponza files are humungous:
-        // *out_loaded_scene = load_gltf_scene("data/main1_sponza/NewSponza_Main_glTF_003.gltf");
-        // *out_loaded_scene = load_gltf_scene("data/pkg_a_curtains/NewSponza_Curtains_glTF.gltf");
-        // *out_loaded_scene = load_gltf_scene("data/pkg_c1_trees/NewSponza_CypressTree_glTF.gltf");
-
-
-        // Not working scenes
-        // *out_loaded_scene = load_gltf_scene("data/simple-instancing-glTF/SimpleInstancing.gltf");  // I don't support files without materials
-        // *out_loaded_scene = load_gltf_scene("data/fox-glTF/Fox.gltf");  // I don't support vertex colors
+        out_loaded_scene->param_min_intensity = 0.01f;
+        out_loaded_scene->param_intensity_saturation = 10.0f;
 
+        glm_vec3_copy((vec3){ -13.135565f, 20.071218f, -68.319450f }, program.cam.pos);
+        program.cam.pitch = 0.0f;
+        program.cam.yaw = PI/2.0f;
+    }
+    else if (scene_id == 3)
+    {
         num_point_lights = 0;
         point_light_positions = NULL;
 
@@ -2215,6 +5803,8 @@ load_test_scene(int scene_id, Scene* out_loaded_scene)
         al = make_area_light((vec3){-3.481347,10.381870,-110.580444}, (vec3){-0.246875,-0.681156,0.689259}, 0, 3, 0.4f, 10.0f, 1.0f, 4.0f);push_element_copy(&program.area_lights, sizeof(AreaLight), &al);
     }
 
+    program.are_area_light_polygons_dirty = 1;
+
     size_t len_pl = array_length(&program.point_lights, sizeof(PointLight));
     size_t len_al = array_length(&program.area_lights, sizeof(AreaLight));
     printf("Point Light Array len: %d\n", (int)len_pl);
@@ -2249,10 +5839,91 @@ load_test_scene(int scene_id, Scene* out_loaded_scene)
     printf("TEMP: Deleting point lights for now\n");
     free_array(&program.point_lights);
     program.point_lights = create_array(1 * sizeof(PointLight));
+    program.are_lights_dirty = 1;
+
+    // Lights that came with the glTF file
+    u32 imported_point_lights_count = (u32)array_length(&out_loaded_scene->imported_point_lights, sizeof(PointLight));
+    u32 imported_area_lights_count = (u32)array_length(&out_loaded_scene->imported_area_lights, sizeof(AreaLight));
+    if (imported_point_lights_count + imported_area_lights_count > 0)
+    {
+        memcpy(push_size(&program.point_lights, sizeof(PointLight), imported_point_lights_count),
+            out_loaded_scene->imported_point_lights.data_buffer, out_loaded_scene->imported_point_lights.used_size);
+        memcpy(push_size(&program.area_lights, sizeof(AreaLight), imported_area_lights_count),
+            out_loaded_scene->imported_area_lights.data_buffer, out_loaded_scene->imported_area_lights.used_size);
+        printf("Added the scene's own %d point lights and %d area lights\n", (int)imported_point_lights_count,
+            (int)imported_area_lights_count);
+        program.are_area_light_polygons_dirty = 1;
+    }
+
+    if (program.light_rig_spec)
+    {
+        apply_light_rig(program.light_rig_spec, out_loaded_scene);
+    }
 
     init_global_renderer_buffers();
 }
 
+void
+load_test_scene(int scene_id, Scene* out_loaded_scene)
+{
+    *out_loaded_scene = load_gltf_scene(get_test_scene_filename(scene_id));
+    setup_test_scene(scene_id, out_loaded_scene);
+}
+
+void
+begin_scene_switch(int scene_id)
+{
+    /* Starts loading a test scene on a background thread, the current scene keeps rendering until it's ready */
+    if (program.is_switching_scene)
+    {
+        printf("Already loading \"%s\", wait for it to finish first\n", program.next_scene_load.filename);
+        return;
+    }
+
+    program.is_switching_scene = 1;
+    program.next_scene_id = scene_id;
+    program.next_scene_load = begin_scene_load(get_test_scene_filename(scene_id));
+    printf("Loading \"%s\" in the background\n", program.next_scene_load.filename);
+    program.next_scene_task = start_background_task(prepare_scene_package, &program.next_scene_load);
+}
+
+void
+update_scene_switch()
+{
+    /* Called once a frame while switching scenes. Creates the next scene's GL objects once its package is ready on
+     * the background thread, streams its geometry and then its textures in over the following frames, then swaps it in
+     * for the current scene all at once */
+    if (!program.is_switching_scene)
+    {
+        return;
+    }
+
+    if (program.next_scene_task)
+    {
+        if (!finish_background_task_if_done(program.next_scene_task))
+        {
+            return;
+        }
+        program.next_scene_task = NULL;
+        program.next_scene = finish_scene_load(&program.next_scene_load);
+    }
+
+    stream_scene_geometry(&program.next_scene, GEOMETRY_STREAM_BUDGET);
+    stream_scene_textures(&program.next_scene, program.dt);
+    if (program.next_scene.geometry_stream.is_active || program.next_scene.texture_stream.is_active)
+    {
+        return;
+    }
+
+    free_scene(program.scene);
+    program.scene = program.next_scene;
+    setup_test_scene(program.next_scene_id, &program.scene);
+    delete_unused_resident_textures();  // Whatever the old scene had that the new one didn't take
+
+    memset(&program.next_scene, 0, sizeof(program.next_scene));
+    program.is_switching_scene = 0;
+}
+
 u32
 compile_shader_type(GLenum gl_shader_type, const char* shader_src, const char* opengl_debug_name)
 {
@@ -2483,7 +6154,26 @@ update_free_camera(FreeCamera* cam)
         cam->fov_y = glm_rad(60.0f);
     }
 
-    if (program.mouse_capture_on)
+    if (program.is_playing_camera_path)
+    {
+        // The path replaces the mouse and keys. Benchmarks hold its first pose until they start recording, so
+        // recorded frame n always sees the same view
+        u32 frame = program.is_benchmark ? program.benchmark.recorded_frames_count : program.camera_path_frame++;
+        u32 keyframes_count = (u32)array_length(&program.camera_path, sizeof(CameraKeyframe));
+        const CameraKeyframe* keyframes = program.camera_path.data_buffer;
+        CameraKeyframe pose = sample_camera_path(keyframes, keyframes_count, (f32)frame * BENCHMARK_TIMESTEP);
+        glm_vec3_copy(pose.position, cam->pos);
+        cam->pitch = pose.pitch;
+        cam->yaw = pose.yaw;
+        cam->fov_y = pose.fov_y;
+
+        if (!program.is_benchmark && (f32)frame * BENCHMARK_TIMESTEP >= keyframes[keyframes_count - 1].time)
+        {
+            printf("Camera path finished\n");
+            program.is_playing_camera_path = 0;
+        }
+    }
+    else if (program.mouse_capture_on)
     {
         // Look around with mouse:
         const f32 sensitivity = 2.0f;
@@ -2624,6 +6314,8 @@ reload_shaders(b32 only_reload_pbr_shaders)
             "\n#define CLUSTER_GRID_SIZE_Y " xstr(CLUSTER_GRID_SIZE_Y)
             "\n#define CLUSTER_GRID_SIZE_Z " xstr(CLUSTER_GRID_SIZE_Z)
             "\n#define CLUSTER_NORMALS_COUNT " xstr(CLUSTER_NORMALS_COUNT)
+            "\n#define QUANTIZE_VERTICES " xstr(QUANTIZE_VERTICES)
+            "\n#define TEXTURE_COMPRESSION " xstr(TEXTURE_COMPRESSION)
             "\n#define CLUSTER_MAX_LIGHTS %d"
             "\n%c%c#define COUNT_LIGHT_OPS"  // Stupid way to comment out this line according to a boolean
             "\n#define MAX_UNCLIPPED_NGON %d"
@@ -2642,6 +6334,10 @@ reload_shaders(b32 only_reload_pbr_shaders)
         if (program.shader_area_light_polygons) glDeleteProgram(program.shader_area_light_polygons);
         if (program.shader_compute_clusters) glDeleteProgram(program.shader_compute_clusters);
         if (program.shader_light_assignment) glDeleteProgram(program.shader_light_assignment);
+        if (program.shader_hiz_build) glDeleteProgram(program.shader_hiz_build);
+        if (program.shader_occlusion_cull) glDeleteProgram(program.shader_occlusion_cull);
+        if (program.shader_meshlet_cull) glDeleteProgram(program.shader_meshlet_cull);
+        if (program.shader_animate_lights) glDeleteProgram(program.shader_animate_lights);
 
         program.shader_area_light_polygons = load_shader_from_files("shader_src/polygon.vert", "shader_src/polygon.frag", "polygon_shader");
         program.shader_compute_clusters = load_compute_shader_from_file_with_header("shader_src/voxel_clusters_viewspace.comp", "compute_clusters_shader", header_text);
@@ -2651,6 +6347,11 @@ reload_shaders(b32 only_reload_pbr_shaders)
         #else
         program.shader_light_assignment = load_compute_shader_from_file_with_header("shader_src/lights_to_clusters.comp", "light_assignment_shader", header_text);
         #endif
+
+        program.shader_hiz_build = load_compute_shader_from_file_with_header("shader_src/hiz_build.comp", "hiz_build_shader", header_text);
+        program.shader_occlusion_cull = load_compute_shader_from_file_with_header("shader_src/occlusion_cull.comp", "occlusion_cull_shader", header_text);
+        program.shader_meshlet_cull = load_compute_shader_from_file_with_header("shader_src/meshlet_cull.comp", "meshlet_cull_shader", header_text);
+        program.shader_animate_lights = load_compute_shader_from_file_with_header("shader_src/animate_lights.comp", "animate_lights_shader", header_text);
     }
 
     printf("  ...Complete.\n");
@@ -2677,6 +6378,34 @@ window_size_callback(GLFWwindow* window, int width, int height)
     glViewport(0, 0, width, height);
 }
 
+void
+toggle_camera_path_recording()
+{
+    if (program.is_recording_camera_path)
+    {
+        // Play it back with --camera-path
+        u32 keyframes_count = (u32)array_length(&program.camera_path, sizeof(CameraKeyframe));
+        if (keyframes_count > 0 && save_camera_path("camera.cpath", program.camera_path.data_buffer, keyframes_count))
+        {
+            printf("Saved a %.1f s camera path (%u keyframes) to camera.cpath\n",
+                ((CameraKeyframe*)program.camera_path.data_buffer)[keyframes_count - 1].time, keyframes_count);
+        }
+        program.is_recording_camera_path = 0;
+        return;
+    }
+
+    // Recording takes over from any path being played
+    if (program.camera_path.data_buffer)
+    {
+        free_array(&program.camera_path);
+    }
+    program.camera_path = create_array(1024 * sizeof(CameraKeyframe));
+    program.is_playing_camera_path = 0;
+    program.is_recording_camera_path = 1;
+    program.camera_path_record_start_time = program.time;
+    printf("Recording a camera path, press P again to stop\n");
+}
+
 void
 key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
@@ -2691,7 +6420,12 @@ key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
      *      C      - Zoom In
      *      F1     - Toggle wireframe mode
      *      F2     - Toggle cluster visualisation
+     *      F3     - Toggle clustered shading
+     *      F4     - Toggle light op counting
+     *      F5     - Toggle frustum culling
+     *      F6     - Toggle occlusion culling
      *      B      - Toggle GUI for nicer screenshots
+     *      P      - Toggle camera path recording
      *      
      *      Enter     - Spawn area light
      *      Alt+Enter - Spawn point light
@@ -2721,6 +6455,7 @@ key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
             pl.intensity = 10.0f / glm_vec3_norm(pl.color);
 
             push_element_copy(&program.point_lights, sizeof(PointLight), &pl);
+            program.are_lights_dirty = 1;
         }
         else
         {
@@ -2738,6 +6473,8 @@ key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
             int double_sided = 0;
             AreaLight al = make_area_light(program.cam.pos, true_forward, double_sided, n, -1.0f, -1.0f, -1.0f, -1.0f);
             push_element_copy(&program.area_lights, sizeof(AreaLight), &al);
+            program.are_area_light_polygons_dirty = 1;
+            program.are_lights_dirty = 1;
             
             // Output code snippet to regenerate the lights
             printf("AreaLight al = make_area_light((vec3){%f,%f,%f}, (vec3){%f,%f,%f}, %d, %d, -1.0f, -1.0f, -1.0f, -1.0f);",
@@ -2812,6 +6549,55 @@ key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
         reload_shaders(0);
     }
 
+    if (key == GLFW_KEY_F5 && action == GLFW_PRESS)
+    {
+        program.is_frustum_culling_enabled = !program.is_frustum_culling_enabled;
+    }
+
+    if (key == GLFW_KEY_F6 && action == GLFW_PRESS)
+    {
+        program.is_occlusion_culling_enabled = !program.is_occlusion_culling_enabled;
+    }
+
+    if (key == GLFW_KEY_F7 && action == GLFW_PRESS)
+    {
+        program.is_state_sorting_enabled = !program.is_state_sorting_enabled;
+    }
+
+    if (key == GLFW_KEY_F8 && action == GLFW_PRESS)
+    {
+        program.is_instancing_enabled = !program.is_instancing_enabled;
+    }
+
+    if (key == GLFW_KEY_F9 && action == GLFW_PRESS)
+    {
+        program.is_lod_enabled = !program.is_lod_enabled;
+    }
+
+    if (key == GLFW_KEY_F10 && action == GLFW_PRESS)
+    {
+        program.is_meshlet_culling_enabled = !program.is_meshlet_culling_enabled;
+    }
+
+    if (key == GLFW_KEY_F12 && action == GLFW_PRESS)
+    {
+        program.is_light_animation_enabled = !program.is_light_animation_enabled;
+        program.are_lights_dirty = 1;
+        program.are_area_light_polygons_dirty = 1;  // Still where the animation left them otherwise
+    }
+
+    if (key == GLFW_KEY_F11 && action == GLFW_PRESS)
+    {
+        // Export the current lights, load them back with --lights
+        u32 point_lights_count = (u32)array_length(&program.point_lights, sizeof(PointLight));
+        u32 area_lights_count = (u32)array_length(&program.area_lights, sizeof(AreaLight));
+        if (save_light_rig("lights.lrig", program.point_lights.data_buffer, point_lights_count,
+            program.area_lights.data_buffer, area_lights_count))
+        {
+            printf("Saved %u point lights and %u area lights to lights.lrig\n", point_lights_count, area_lights_count);
+        }
+    }
+
     if (action == GLFW_PRESS)
     {
         switch (key)
@@ -2846,6 +6632,10 @@ key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
             case GLFW_KEY_B:
                 program.keytoggle_disable_gui = !program.keytoggle_disable_gui;
                 break;
+
+            case GLFW_KEY_P:
+                toggle_camera_path_recording();
+                break;
         }
     }
     else if (action == GLFW_RELEASE)
@@ -2896,29 +6686,206 @@ reset_opengl_render_state()
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);  // Ordered transparency
     // glBlendFunc(GL_ONE, GL_ONE);
     glDepthMask(GL_TRUE);
-    glReadBuffer(GL_BACK);  // Make sure this is set for glCopyTextureSubImage2D after the opaque render pass
+    glReadBuffer(program.benchmark.framebuffer ? GL_COLOR_ATTACHMENT0 : GL_BACK);  // Make sure this is set for glCopyTextureSubImage2D after the opaque render pass
 
     glFrontFace(GL_CCW);  // Counter-clockwise is the default, but I've forgetten this before so I prefer being explicit
     // glClearColor(0.6f, 0.8f, 0.9f, 0.0f);  // Cornflower blue
     glClearColor(0.3f, 0.4f, 0.5f, 0.0f);  // Dark blue
 }
 
+void
+begin_benchmark(u32 frames_count, const char* csv_path)
+{
+    /* Renders into an offscreen framebuffer of the window's size from now on and opens the CSV file the frames are
+     * recorded to, see record_benchmark_frame() */
+    Benchmark* benchmark = &program.benchmark;
+    benchmark->frames_count = frames_count;
+    benchmark->warmup_frames_left = BENCHMARK_WARMUP_FRAMES;
+    benchmark->csv_path = csv_path;
+    benchmark->csv = fopen(csv_path, "w");
+    if (!benchmark->csv)
+    {
+        printf("Failed to open %s for the benchmark results\n", csv_path);
+        exit(1);
+    }
+    fprintf(benchmark->csv, "frame,cpu_ms,frame_ms,compute_ms,shading_ms,arealight_precomp_ms,light_ops,point_lights,area_lights,"
+        "lights_ms,cluster_build_ms,light_assignment_ms,opaque_ms,transparent_ms,area_lights_ms,gui_ms\n");  // Per pass, in GPUPass order
+
+    glCreateRenderbuffers(2, benchmark->renderbuffers);
+    glNamedRenderbufferStorage(benchmark->renderbuffers[0], GL_RGBA8, program.w, program.h);
+    glNamedRenderbufferStorage(benchmark->renderbuffers[1], GL_DEPTH_COMPONENT24, program.w, program.h);
+
+    glCreateFramebuffers(1, &benchmark->framebuffer);
+    glNamedFramebufferRenderbuffer(benchmark->framebuffer, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, benchmark->renderbuffers[0]);
+    glNamedFramebufferRenderbuffer(benchmark->framebuffer, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, benchmark->renderbuffers[1]);
+    if (glCheckNamedFramebufferStatus(benchmark->framebuffer, GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+        printf("Failed to create the %dx%d benchmark framebuffer\n", (int)program.w, (int)program.h);
+        exit(1);
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, benchmark->framebuffer);
+    glViewport(0, 0, program.w, program.h);
+    reset_opengl_render_state();
+
+    printf("Benchmarking %d frames at %dx%d into %s\n", (int)frames_count, (int)program.w, (int)program.h, csv_path);
+}
+
+void
+record_benchmark_frame()
+{
+    /* Called after each frame is drawn. Waits for the GPU so the frame's own timer queries can be read, then writes
+     * its timings to the CSV file. Frames aren't recorded until the scene's textures are in and it has warmed up */
+    Benchmark* benchmark = &program.benchmark;
+    f64 cpu_time = 1000.0 * (glfwGetTime() - benchmark->frame_start_time);
+
+    glFinish();
+    program.last_light_ops_value = *program.light_ops_mapped_pointer;
+    if (program.scene.texture_stream.is_active || program.is_switching_scene)
+    {
+        return;
+    }
+    if (benchmark->warmup_frames_left > 0)
+    {
+        --benchmark->warmup_frames_left;
+        return;
+    }
+
+    // After glFinish() this frame's timestamps are in
+    read_gpu_timers();
+    f64 frame_time = 1000.0 * (glfwGetTime() - benchmark->frame_start_time);
+    f64 compute_time = program.compute_time_last_frame / 1e6;
+    f64 shading_time = program.shading_time_last_frame / 1e6;
+
+    fprintf(benchmark->csv, "%d,%.4f,%.4f,%.4f,%.4f,%.4f,%u,%d,%d", (int)benchmark->recorded_frames_count, cpu_time,
+        frame_time, compute_time, shading_time, 1000.0 * program.arealight_precomp_time_this_frame, program.last_light_ops_value,
+        (int)array_length(&program.point_lights, sizeof(PointLight)), (int)array_length(&program.area_lights, sizeof(AreaLight)));
+    for (u32 pass = 0; pass < GPU_PASS_COUNT; ++pass)
+    {
+        f64 pass_time = program.gpu_timers.pass_times[pass] / 1e6;
+        fprintf(benchmark->csv, ",%.4f", pass_time);
+        benchmark->total_pass_times[pass] += pass_time;
+    }
+    fprintf(benchmark->csv, "\n");
+
+    benchmark->total_cpu_time += cpu_time;
+    benchmark->total_frame_time += frame_time;
+    benchmark->total_compute_time += compute_time;
+    benchmark->total_shading_time += shading_time;
+    benchmark->max_frame_time = frame_time > benchmark->max_frame_time ? frame_time : benchmark->max_frame_time;
+
+    if (++benchmark->recorded_frames_count == benchmark->frames_count)
+    {
+        glfwSetWindowShouldClose(program.window, GLFW_TRUE);
+    }
+}
+
+void
+end_benchmark()
+{
+    Benchmark* benchmark = &program.benchmark;
+    fclose(benchmark->csv);
+
+    f64 frames_count = benchmark->recorded_frames_count > 0 ? (f64)benchmark->recorded_frames_count : 1.0;
+    printf("Benchmark: %d frames, mean %.2f ms (max %.2f ms), CPU %.2f ms, compute %.2f ms, shading %.2f ms. Written to %s\n",
+        (int)benchmark->recorded_frames_count, benchmark->total_frame_time / frames_count, benchmark->max_frame_time,
+        benchmark->total_cpu_time / frames_count, benchmark->total_compute_time / frames_count,
+        benchmark->total_shading_time / frames_count, benchmark->csv_path);
+    for (u32 pass = 0; pass < GPU_PASS_COUNT; ++pass)
+    {
+        printf("  %-17s %.3f ms\n", gpu_pass_names[pass], benchmark->total_pass_times[pass] / frames_count);
+    }
+
+    glDeleteFramebuffers(1, &benchmark->framebuffer);
+    glDeleteRenderbuffers(2, benchmark->renderbuffers);
+}
+
 int
 main(int argc, char** argv)
 {
-    (void)argc;
-    (void)argv;
-
     const char window_title[] = "COMP3931";
     program.w = 1280;
     program.h = 720;
+
+    u32 benchmark_frames = 0;  // BENCHMARK_DEFAULT_FRAMES, or as long as the camera path, unless --frames is given
+    const char* benchmark_csv_path = "results.csv";
+    const char* camera_path_file = NULL;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--lights") == 0 && i + 1 < argc)
+        {
+            program.light_rig_spec = argv[++i];
+        }
+        else if (strcmp(argv[i], "--animate-lights") == 0)
+        {
+            program.is_light_animation_enabled = 1;
+        }
+        else if (strcmp(argv[i], "--scene") == 0 && i + 1 < argc)
+        {
+            program.scene_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--resolution") == 0 && i + 1 < argc
+            && sscanf(argv[++i], "%ux%u", &program.w, &program.h) == 2 && program.w > 0 && program.h > 0)
+        {
+        }
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc && sscanf(argv[++i], "%u", &benchmark_frames) == 1 && benchmark_frames > 0)
+        {
+            program.is_benchmark = 1;
+        }
+        else if (strcmp(argv[i], "--camera-path") == 0 && i + 1 < argc)
+        {
+            camera_path_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+        {
+            benchmark_csv_path = argv[++i];
+            program.is_benchmark = 1;
+        }
+        else
+        {
+            printf("Usage: %s [--scene <file.gltf>] [--lights <rig.lrig | points=N,areas=N,volume|surfaces,seed=N>] [--animate-lights]\n"
+                   "          [--camera-path <file.cpath>] [--resolution WxH] [--frames N] [--out results.csv]\n"
+                   "--frames or --out runs a headless benchmark\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    if (camera_path_file)
+    {
+        program.camera_path = create_array(1024 * sizeof(CameraKeyframe));
+        if (!load_camera_path(camera_path_file, &program.camera_path))
+        {
+            exit(1);
+        }
+        program.is_playing_camera_path = 1;
+
+        // Benchmark the whole path once by default
+        u32 keyframes_count = (u32)array_length(&program.camera_path, sizeof(CameraKeyframe));
+        f32 duration = ((CameraKeyframe*)program.camera_path.data_buffer)[keyframes_count - 1].time;
+        if (benchmark_frames == 0)
+        {
+            benchmark_frames = (u32)ceilf(duration / BENCHMARK_TIMESTEP) + 1;
+        }
+    }
+    if (benchmark_frames == 0)
+    {
+        benchmark_frames = BENCHMARK_DEFAULT_FRAMES;
+    }
     program.aspect_ratio = (f32)program.w / (f32)program.h;
     program.frame_counter = 0;
     // program.is_hdr_enabled = 0;  // <- Removed because my laptop only supports r10g10b10a2 instead of rgba16 it so can't work on it rn.
     program.is_msaa_enabled = 0;
     program.is_minimized = 0;
     program.is_clustered_shading_enabled = 1;
+    program.is_frustum_culling_enabled = 1;
+    program.is_occlusion_culling_enabled = 1;
+    program.is_state_sorting_enabled = 1;
+    program.is_instancing_enabled = 1;
+    program.is_lod_enabled = 1;
+    program.is_meshlet_culling_enabled = 1;
     program.max_lights_per_cluster = CLUSTER_DEFAULT_MAX_LIGHTS;
+    program.is_light_op_counting_enabled = program.is_benchmark;  // Adds an atomic per light evaluated, but they're recorded
+    program.keytoggle_disable_gui = program.is_benchmark;
 
     program.render_as_wireframe = 0;
     program.render_just_normals = 0;
@@ -2929,30 +6896,52 @@ main(int argc, char** argv)
 
     // Init GLFW, load OpenGL 4.6, and setup nuklear GUI library
     {
-        if (!glfwInit())
-            exit(-1);
-        
-        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
-        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 6);
-        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-        
-        glfwWindowHint(GLFW_DOUBLEBUFFER, GLFW_TRUE);
-        glfwWindowHint(GLFW_DEPTH_BITS, 24);
+        // Benchmarks don't need a display: GLFW's null platform gives a surfaceless EGL context where it can,
+        // otherwise they fall back on an invisible window
+        b32 is_null_platform = program.is_benchmark && glfwPlatformSupported(GLFW_PLATFORM_NULL);
+        for (;;)
+        {
+            glfwInitHint(GLFW_PLATFORM, is_null_platform ? GLFW_PLATFORM_NULL : GLFW_ANY_PLATFORM);
+            if (glfwInit())
+            {
+                glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+                glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 6);
+                glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+
+                glfwWindowHint(GLFW_DOUBLEBUFFER, GLFW_TRUE);
+                glfwWindowHint(GLFW_DEPTH_BITS, 24);
+
+                // if (program.is_hdr_enabled)
+                // {
+                //     glfwWindowHint(GLFW_RED_BITS, 16);
+                //     glfwWindowHint(GLFW_GREEN_BITS, 16);
+                //     glfwWindowHint(GLFW_BLUE_BITS, 16);
+                //     glfwWindowHint(GLFW_ALPHA_BITS, 16);
+                // }
+
+                if (program.is_msaa_enabled)
+                {
+                    glfwWindowHint(GLFW_SAMPLES, 4);  // For MSAA with GL_MULTISAMPLE
+                }
 
-        // if (program.is_hdr_enabled)
-        // {
-        //     glfwWindowHint(GLFW_RED_BITS, 16);
-        //     glfwWindowHint(GLFW_GREEN_BITS, 16);
-        //     glfwWindowHint(GLFW_BLUE_BITS, 16);
-        //     glfwWindowHint(GLFW_ALPHA_BITS, 16);
-        // }
+                if (program.is_benchmark)
+                {
+                    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+                    glfwWindowHint(GLFW_CONTEXT_CREATION_API, is_null_platform ? GLFW_EGL_CONTEXT_API : GLFW_NATIVE_CONTEXT_API);
+                }
 
-        if (program.is_msaa_enabled)
-        {
-            glfwWindowHint(GLFW_SAMPLES, 4);  // For MSAA with GL_MULTISAMPLE
+                program.window = glfwCreateWindow(program.w, program.h, window_title, NULL, NULL);
+            }
+
+            if (program.window || !is_null_platform)
+            {
+                break;
+            }
+            printf("No surfaceless context, benchmarking in an invisible window instead\n");
+            glfwTerminate();
+            is_null_platform = 0;
         }
 
-        program.window = glfwCreateWindow(program.w, program.h, window_title, NULL, NULL);
         if (!program.window)
         {
             glfwTerminate();
@@ -3012,8 +7001,12 @@ main(int argc, char** argv)
     }
 
     init_global_renderer_buffers();
-    glGenQueries(1, &program.compute_time_query);
-    glGenQueries(1, &program.shading_time_query);
+    init_gpu_timers();
+
+    if (program.is_benchmark)
+    {
+        begin_benchmark(benchmark_frames, benchmark_csv_path);
+    }
 
     // Compiler shaders
     {
@@ -3029,6 +7022,9 @@ main(int argc, char** argv)
         program.LTC2_texture = load_ltc_matrix_texture(LTC2);
     }
 
+    // Worker threads for decoding images while loading scenes
+    init_job_system(0);
+
     // Load scene
     {
         // Init camera
@@ -3064,8 +7060,9 @@ main(int argc, char** argv)
         // Update time
         {
             f64 new_time = glfwGetTime();
-            program.dt = (f32)(new_time - program.time);
+            program.dt = program.is_benchmark ? BENCHMARK_TIMESTEP : (f32)(new_time - program.time);
             program.time = new_time;
+            program.benchmark.frame_start_time = new_time;
         }
 
         glfwPollEvents();
@@ -3080,6 +7077,7 @@ main(int argc, char** argv)
         static double displayed_precomp_time = 0.0;
         static double displayed_compute_time = 0.0;
         static double displayed_shading_time = 0.0;
+        static double displayed_pass_times[GPU_PASS_COUNT] = { 0 };
         {
             static int num_frames = 0;
             static double num_seconds = 0.0;
@@ -3095,12 +7093,23 @@ main(int argc, char** argv)
             static double shading_total = 0.0;
             shading_total += program.shading_time_last_frame / 1e6;
 
+            static double pass_totals[GPU_PASS_COUNT] = { 0 };
+            for (u32 pass = 0; pass < GPU_PASS_COUNT; ++pass)
+            {
+                pass_totals[pass] += program.gpu_timers.pass_times[pass] / 1e6;
+            }
+
             if (num_seconds > 0.5)
             {
                 displayed_fps = (double)num_frames / num_seconds;
                 displayed_precomp_time = precomp_total / (double)num_frames;
                 displayed_compute_time = compute_total / (double)num_frames;
                 displayed_shading_time = shading_total / (double)num_frames;
+                for (u32 pass = 0; pass < GPU_PASS_COUNT; ++pass)
+                {
+                    displayed_pass_times[pass] = pass_totals[pass] / (double)num_frames;
+                    pass_totals[pass] = 0.0;
+                }
                 num_frames = 0;
                 num_seconds = 0.0;
                 precomp_total = 0.0;
@@ -3108,8 +7117,15 @@ main(int argc, char** argv)
                 shading_total = 0.0;
             }
         }
+#ifdef DISABLE_GUI
+        (void)displayed_precomp_time;
+        (void)displayed_compute_time;
+        (void)displayed_shading_time;
+        (void)displayed_pass_times;
+#endif
 
         // Display driver and framerate in window title
+        if (!program.is_benchmark)
         {
             char title[512] = { 0 };
             sprintf(title, "%s (res:%dx%d) Hardware: %s FPS: %f (NO VSYNC) Light Ops: %d", window_title, program.w, program.h, program.driver_name, displayed_fps, program.last_light_ops_value);
@@ -3141,21 +7157,22 @@ main(int argc, char** argv)
         }
         
         update_free_camera(&program.cam);
+
+        if (program.is_recording_camera_path)
+        {
+            CameraKeyframe keyframe;
+            keyframe.time = (f32)(program.time - program.camera_path_record_start_time);
+            glm_vec3_copy(program.cam.pos, keyframe.position);
+            keyframe.pitch = program.cam.pitch;
+            keyframe.yaw = program.cam.yaw;
+            keyframe.fov_y = program.cam.fov_y;
+            push_element_copy(&program.camera_path, sizeof(CameraKeyframe), &keyframe);
+        }
         
-        // // Animate area light intensity
-        // for (int i = 0; i < array_length(&program.area_lights, sizeof(AreaLight)); ++i)
-        // {
-        //     AreaLight* al = get_element(&program.area_lights, sizeof(AreaLight), i);
-            
-        //     float max_intensity = 50.0f;
-        //     static float intensity_velocity = 10.0f;
-            
-        //     al->color_rgb_intensity_a[3] += intensity_velocity * program.dt;
-        //     if (al->color_rgb_intensity_a[3] >= max_intensity || al->color_rgb_intensity_a[3] <= 0.0f)
-        //     {
-        //         intensity_velocity = -intensity_velocity;
-        //     }
-        // }
+        if (program.is_light_animation_enabled)
+        {
+            program.light_animation_time += program.dt;
+        }
 
 #ifndef DISABLE_GUI
         // Create GUI
@@ -3166,7 +7183,7 @@ main(int argc, char** argv)
             int nk_flags = 0;  // NK_WINDOW_BORDER|NK_WINDOW_TITLE|NK_WINDOW_MINIMIZABLE|NK_WINDOW_MOVABLE|NK_WINDOW_SCALABLE
             
             // Display compute time query in top left:
-            if (nk_begin(program.gui_context, "Performance Stats", nk_rect(10, 10, 270, 100), NK_WINDOW_NO_SCROLLBAR))
+            if (nk_begin(program.gui_context, "Performance Stats", nk_rect(10, 10, 270, 185), NK_WINDOW_NO_SCROLLBAR))
             {
                 nk_layout_row_dynamic(program.gui_context, 10, 1);
                 nk_label(program.gui_context, program.driver_name, NK_TEXT_LEFT);
@@ -3200,6 +7217,99 @@ main(int argc, char** argv)
                 snprintf(num_area_lights_str, sizeof(num_area_lights_str), "Num Area lights: %d", (int)array_length(&program.area_lights, sizeof(AreaLight)));
                 nk_layout_row_dynamic(program.gui_context, 10, 1);
                 nk_label(program.gui_context, num_area_lights_str, NK_TEXT_LEFT);
+
+                char culling_str[64];
+                snprintf(culling_str, sizeof(culling_str), "Frustum culling: %d / %d drawn%s", (int)program.visible_instances_last_frame, (int)program.scene.instances_count, program.is_frustum_culling_enabled ? "" : " (off)");
+                nk_layout_row_dynamic(program.gui_context, 10, 1);
+                nk_label(program.gui_context, culling_str, NK_TEXT_LEFT);
+
+                char occlusion_str[64];
+                if (program.is_occlusion_culling_enabled)
+                {
+                    snprintf(occlusion_str, sizeof(occlusion_str), "Occlusion: %d early, %d late, %d hidden",
+                        (int)program.occlusion_early_drawn_last_frame, (int)program.occlusion_late_drawn_last_frame, (int)program.occlusion_occluded_last_frame);
+                }
+                else
+                {
+                    snprintf(occlusion_str, sizeof(occlusion_str), "Occlusion culling: off");
+                }
+                nk_layout_row_dynamic(program.gui_context, 10, 1);
+                nk_label(program.gui_context, occlusion_str, NK_TEXT_LEFT);
+
+                PBRPassCounters* counters = &program.pbr_counters_last_frame;
+                char draws_str[64];
+                snprintf(draws_str, sizeof(draws_str), "Draws: %d (%d inst)%s%s",
+                    (int)counters->draw_calls, (int)counters->instances,
+                    program.is_state_sorting_enabled ? "" : " unsorted", program.is_instancing_enabled ? "" : " uninstanced");
+                nk_layout_row_dynamic(program.gui_context, 10, 1);
+                nk_label(program.gui_context, draws_str, NK_TEXT_LEFT);
+
+                char state_changes_str[64];
+                snprintf(state_changes_str, sizeof(state_changes_str), "Binds: %d tex, %d VAO, %d cull, draw data: %d KB",
+                    (int)counters->texture_binds, (int)counters->vao_binds, (int)counters->cull_face_changes,
+                    (int)((counters->instances * sizeof(PBRDrawData) + 1023) / 1024));
+                nk_layout_row_dynamic(program.gui_context, 10, 1);
+                nk_label(program.gui_context, state_changes_str, NK_TEXT_LEFT);
+
+                char lod_str[64];
+                snprintf(lod_str, sizeof(lod_str), "Triangles: %.1fk%s", counters->triangles / 1000.0f, program.is_lod_enabled ? "" : " (LOD off)");
+                nk_layout_row_dynamic(program.gui_context, 10, 1);
+                nk_label(program.gui_context, lod_str, NK_TEXT_LEFT);
+
+                char meshlet_str[64];
+                if (program.is_meshlet_culling_enabled)
+                {
+                    snprintf(meshlet_str, sizeof(meshlet_str), "Meshlets: %d / %d drawn", (int)program.meshlets_drawn_last_frame, (int)program.meshlets_tested_last_frame);
+                }
+                else
+                {
+                    snprintf(meshlet_str, sizeof(meshlet_str), "Meshlet culling: off");
+                }
+                nk_layout_row_dynamic(program.gui_context, 10, 1);
+                nk_label(program.gui_context, meshlet_str, NK_TEXT_LEFT);
+            }
+            nk_end(program.gui_context);
+
+            // GPU time of each pass, stacked into one bar of the whole frame
+            if (nk_begin(program.gui_context, "GPU Passes", nk_rect(10, 200, 270, 135), NK_WINDOW_NO_SCROLLBAR))
+            {
+                static const struct nk_color pass_colors[GPU_PASS_COUNT] = {
+                    { 230, 200, 60, 255 }, { 80, 160, 230, 255 }, { 60, 200, 200, 255 }, { 90, 200, 90, 255 },
+                    { 200, 120, 220, 255 }, { 240, 130, 60, 255 }, { 170, 170, 170, 255 },
+                };
+
+                double total_time = 0.0;
+                for (u32 pass = 0; pass < GPU_PASS_COUNT; ++pass)
+                {
+                    total_time += displayed_pass_times[pass];
+                }
+
+                char total_str[64];
+                snprintf(total_str, sizeof(total_str), "GPU frame: %.2f ms", total_time);
+                nk_layout_row_dynamic(program.gui_context, 10, 1);
+                nk_label(program.gui_context, total_str, NK_TEXT_LEFT);
+
+                nk_layout_row_dynamic(program.gui_context, 12, 1);
+                struct nk_rect bar;
+                if (nk_widget(&bar, program.gui_context) != NK_WIDGET_INVALID && total_time > 0.0)
+                {
+                    struct nk_command_buffer* canvas = nk_window_get_canvas(program.gui_context);
+                    float x = bar.x;
+                    for (u32 pass = 0; pass < GPU_PASS_COUNT; ++pass)
+                    {
+                        float width = bar.w * (float)(displayed_pass_times[pass] / total_time);
+                        nk_fill_rect(canvas, nk_rect(x, bar.y, width, bar.h), 0.0f, pass_colors[pass]);
+                        x += width;
+                    }
+                }
+
+                for (u32 pass = 0; pass < GPU_PASS_COUNT; ++pass)
+                {
+                    char pass_str[64];
+                    snprintf(pass_str, sizeof(pass_str), "%s: %.2f ms", gpu_pass_names[pass], displayed_pass_times[pass]);
+                    nk_layout_row_dynamic(program.gui_context, 10, 1);
+                    nk_label_colored(program.gui_context, pass_str, NK_TEXT_LEFT, pass_colors[pass]);
+                }
             }
             nk_end(program.gui_context);
 
@@ -3208,38 +7318,20 @@ main(int argc, char** argv)
                 {
                     nk_layout_row_dynamic(program.gui_context, 0, 3);
 
+                    // Loaded in the background, the camera moves when the scene is swapped in
                     if (nk_button_label(program.gui_context, "Load Sponza"))
                     {
-                        free_scene(program.scene);
-                        load_test_scene(0, &program.scene);
-                        program.cam.pos[0] = 0.0f;
-                        program.cam.pos[1] = 1.0f;
-                        program.cam.pos[2] = 0.0f;
-                        program.cam.pitch = 0.0f;
-                        program.cam.yaw = PI/2.0f;
+                        begin_scene_switch(0);
                     }
 
                     if (nk_button_label(program.gui_context, "Load Suntemple"))
                     {
-                        free_scene(program.scene);
-                        load_test_scene(1, &program.scene);
-
-                        // glm_vec3_copy((vec3){ 0.577642f, -0.921296f, -28.718777f }, program.cam.pos);
-                        // program.cam.pitch = 0.0f;
-                        // program.cam.yaw = PI;
-
-                        glm_vec3_copy((vec3){ 3.123726, 0.563292, -53.807980 }, program.cam.pos);
-                        program.cam.pitch = 0.095518f;
-                        program.cam.yaw = 3.582217f;
+                        begin_scene_switch(1);
                     }
 
                     if (nk_button_label(program.gui_context, "Load Lost Empire"))
                     {
-                        free_scene(program.scene);
-                        load_test_scene(2, &program.scene);
-                        glm_vec3_copy((vec3){ -13.135565f, 20.071218f, -68.319450f }, program.cam.pos);
-                        program.cam.pitch = 0.0f;
-                        program.cam.yaw = PI/2.0f;
+                        begin_scene_switch(2);
                     }
                     
                     nk_layout_row_dynamic(program.gui_context, 0, 4);
@@ -3249,6 +7341,7 @@ main(int argc, char** argv)
 
                         // Create new empty array
                         program.point_lights = create_array(10 * sizeof(PointLight));
+                        program.are_lights_dirty = 1;
                     }
 
                     if (nk_button_label(program.gui_context, "Delete all area lights"))
@@ -3257,6 +7350,8 @@ main(int argc, char** argv)
 
                         // Create new empty array
                         program.area_lights = create_array(10 * sizeof(AreaLight));
+                        program.are_area_light_polygons_dirty = 1;
+                        program.are_lights_dirty = 1;
                     }
 
                     if (program.is_clustered_shading_enabled)
@@ -3299,24 +7394,60 @@ main(int argc, char** argv)
 #endif
         // Render Scene
         {
+            update_scene_switch();
+            stream_scene_textures(&program.scene, program.dt);
+            begin_gpu_timer_frame();
             draw_gltf_scene(&program.scene);
 
+            mark_gpu_pass(GPU_PASS_GUI);
 #ifndef DISABLE_GUI
-            // Render Nuklear GUI
-            nk_glfw3_render(&program.gui_glfw, NK_ANTI_ALIASING_ON, NUKLEAR_MAX_VERTEX_BUFFER, NUKLEAR_MAX_ELEMENT_BUFFER);
+            if (!program.is_benchmark)
+            {
+                // Render Nuklear GUI
+                nk_glfw3_render(&program.gui_glfw, NK_ANTI_ALIASING_ON, NUKLEAR_MAX_VERTEX_BUFFER, NUKLEAR_MAX_ELEMENT_BUFFER);
 
-            // Reset OpenGL state since nuklear fucks it up
-            reset_opengl_render_state();
+                // Reset OpenGL state since nuklear fucks it up
+                reset_opengl_render_state();
+            }
 #endif
+            end_gpu_timer_frame();
         }
 
-        glfwSwapBuffers(program.window);
+        if (program.is_benchmark)
+        {
+            record_benchmark_frame();  // Nothing is presented
+        }
+        else
+        {
+            glfwSwapBuffers(program.window);
+        }
         program.frame_counter++;
+
+        if (!program.scene.is_first_frame_drawn)
+        {
+            printf("First frame of the scene after %.1f ms (%d of %d textures still streaming)\n",
+                (glfwGetTime() - program.scene.load_start_time) * 1000.0,
+                program.scene.texture_stream.is_active ? (int)(program.scene.texture_objects_count - program.scene.texture_stream.next_image) : 0,
+                (int)program.scene.texture_objects_count);
+            program.scene.is_first_frame_drawn = 1;
+        }
         
     }
 
     // TODO: Prolly should clean up the buffers for no reason if I want to....
-    
+
+    // The loading thread uses the job system, so it has to finish first
+    if (program.next_scene_task)
+    {
+        finish_background_task(program.next_scene_task);
+        free_scene_package(&program.next_scene_load.package);
+        free_bvh(&program.next_scene_load.instance_bvh);
+    }
+    shutdown_job_system();
+    if (program.is_benchmark)
+    {
+        end_benchmark();
+    }
     nk_glfw3_shutdown(&program.gui_glfw);
     glfwDestroyWindow(program.window);
     glfwTerminate();
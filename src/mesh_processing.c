@@ -0,0 +1,1375 @@
+#include "mesh_processing.h"
+#include "radix_sort.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct Quadric
+{
+    // Symmetric 4x4 matrix (upper triangle), error of a point is p^T A p with p = (x, y, z, 1)
+    f64 a00, a01, a02, a03;
+    f64 a11, a12, a13;
+    f64 a22, a23;
+    f64 a33;
+    f64 weight;  // Total area of the planes added, dividing by it makes the error a squared distance
+}
+Quadric;
+
+typedef struct Collapse
+{
+    u32 from;  // Position group that moves
+    u32 to;    // Position group it moves onto
+}
+Collapse;
+
+static void
+quadric_add_plane(Quadric* q, f64 nx, f64 ny, f64 nz, f64 d, f64 weight)
+{
+    q->a00 += weight * nx * nx;
+    q->a01 += weight * nx * ny;
+    q->a02 += weight * nx * nz;
+    q->a03 += weight * nx * d;
+    q->a11 += weight * ny * ny;
+    q->a12 += weight * ny * nz;
+    q->a13 += weight * ny * d;
+    q->a22 += weight * nz * nz;
+    q->a23 += weight * nz * d;
+    q->a33 += weight * d * d;
+    q->weight += weight;
+}
+
+static void
+quadric_add(Quadric* q, const Quadric* other)
+{
+    q->a00 += other->a00; q->a01 += other->a01; q->a02 += other->a02; q->a03 += other->a03;
+    q->a11 += other->a11; q->a12 += other->a12; q->a13 += other->a13;
+    q->a22 += other->a22; q->a23 += other->a23;
+    q->a33 += other->a33;
+    q->weight += other->weight;
+}
+
+static f64
+quadric_error(const Quadric* q, const f32* p)
+{
+    f64 x = p[0];
+    f64 y = p[1];
+    f64 z = p[2];
+    f64 error = q->a00 * x * x + 2.0 * q->a01 * x * y + 2.0 * q->a02 * x * z + 2.0 * q->a03 * x
+              + q->a11 * y * y + 2.0 * q->a12 * y * z + 2.0 * q->a13 * y
+              + q->a22 * z * z + 2.0 * q->a23 * z
+              + q->a33;
+
+    return q->weight > 0.0 ? fabs(error) / q->weight : 0.0;
+}
+
+static void
+triangle_normal(const f32* p0, const f32* p1, const f32* p2, f64* out_normal)
+{
+    f64 e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+    f64 e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+    out_normal[0] = e1[1] * e2[2] - e1[2] * e2[1];
+    out_normal[1] = e1[2] * e2[0] - e1[0] * e2[2];
+    out_normal[2] = e1[0] * e2[1] - e1[1] * e2[0];
+}
+
+static u32
+hash_u32(u32 h)
+{
+    // Murmur3 finalizer
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static u32
+table_size_for(u32 count)
+{
+    // Power of two at least twice the count, so linear probing stays short
+    u32 size = 16;
+    while (size < 2 * count)
+    {
+        size *= 2;
+    }
+    return size;
+}
+
+static u32
+build_position_groups(const f32* positions, u32 vertex_count, u32* group_of)
+{
+    // Vertices with bit identical positions are the same point on the surface, split only because their attributes differ
+    u32 table_size = table_size_for(vertex_count);
+    u32* table = calloc(table_size, sizeof(u32));  // Vertex index + 1, 0 is empty
+    u32 group_count = 0;
+
+    for (u32 v = 0; v < vertex_count; ++v)
+    {
+        u32 bits[3];
+        memcpy(bits, &positions[3 * v], sizeof(bits));
+        u32 slot = hash_u32(bits[0] ^ hash_u32(bits[1] ^ hash_u32(bits[2]))) & (table_size - 1);
+
+        while (table[slot] != 0 && memcmp(&positions[3 * (table[slot] - 1)], &positions[3 * v], 3 * sizeof(f32)) != 0)
+        {
+            slot = (slot + 1) & (table_size - 1);
+        }
+
+        if (table[slot] == 0)
+        {
+            table[slot] = v + 1;
+            group_of[v] = group_count++;
+        }
+        else
+        {
+            group_of[v] = group_of[table[slot] - 1];
+        }
+    }
+
+    free(table);
+    return group_count;
+}
+
+static void
+lock_border_groups(const u32* indices, u32 index_count, const u32* group_of, u8* locked)
+{
+    // Count the triangles on every edge between position groups (so seams don't count as borders).
+    // Groups on an edge with one triangle are on an open border, more than two is non-manifold. Neither can move
+    u32 table_size = table_size_for(index_count);
+    u64* keys = calloc(table_size, sizeof(u64));  // 0 is empty, an edge between different groups is never 0
+    u32* counts = calloc(table_size, sizeof(u32));
+
+    for (u32 i = 0; i < index_count; ++i)
+    {
+        u32 a = group_of[indices[i]];
+        u32 b = group_of[indices[i - i % 3 + (i + 1) % 3]];
+        if (a == b)
+        {
+            continue;
+        }
+
+        u64 key = a < b ? ((u64)a << 32) | b : ((u64)b << 32) | a;
+        u32 slot = hash_u32((u32)key ^ hash_u32((u32)(key >> 32))) & (table_size - 1);
+        while (keys[slot] != 0 && keys[slot] != key)
+        {
+            slot = (slot + 1) & (table_size - 1);
+        }
+        keys[slot] = key;
+        ++counts[slot];
+    }
+
+    for (u32 slot = 0; slot < table_size; ++slot)
+    {
+        if (keys[slot] != 0 && counts[slot] != 2)
+        {
+            locked[keys[slot] >> 32] = 1;
+            locked[keys[slot] & 0xFFFFFFFF] = 1;
+        }
+    }
+
+    free(keys);
+    free(counts);
+}
+
+u32
+simplify_mesh(u32* out_indices, const u32* indices, u32 index_count, const f32* positions, u32 vertex_count,
+              u32 target_index_count, f32 max_error, f32* out_error)
+{
+    memcpy(out_indices, indices, index_count * sizeof(u32));
+    *out_error = 0.0f;
+    if (index_count < 3 || vertex_count == 0)
+    {
+        return index_count;
+    }
+
+    // Position groups, and the vertices (wedges) in each one
+    u32* group_of = malloc(vertex_count * sizeof(u32));
+    u32 group_count = build_position_groups(positions, vertex_count, group_of);
+
+    u32* group_wedges_first = calloc(group_count + 1, sizeof(u32));
+    u32* group_wedges = malloc(vertex_count * sizeof(u32));
+    const f32** group_position = malloc(group_count * sizeof(f32*));
+    for (u32 v = 0; v < vertex_count; ++v)
+    {
+        ++group_wedges_first[group_of[v] + 1];
+    }
+    for (u32 g = 0; g < group_count; ++g)
+    {
+        group_wedges_first[g + 1] += group_wedges_first[g];
+    }
+    {
+        u32* fill = malloc(group_count * sizeof(u32));
+        memcpy(fill, group_wedges_first, group_count * sizeof(u32));
+        for (u32 v = 0; v < vertex_count; ++v)
+        {
+            group_wedges[fill[group_of[v]]++] = v;
+            group_position[group_of[v]] = &positions[3 * v];
+        }
+        free(fill);
+    }
+
+    u8* locked = calloc(group_count, sizeof(u8));
+    lock_border_groups(indices, index_count, group_of, locked);
+
+    // Area weighted plane quadrics of the triangles around each group
+    Quadric* quadrics = calloc(group_count, sizeof(Quadric));
+    for (u32 i = 0; i < index_count; i += 3)
+    {
+        f64 n[3];
+        triangle_normal(&positions[3 * indices[i]], &positions[3 * indices[i + 1]], &positions[3 * indices[i + 2]], n);
+        f64 length = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+        if (length == 0.0)
+        {
+            continue;
+        }
+        n[0] /= length; n[1] /= length; n[2] /= length;
+
+        const f32* p0 = &positions[3 * indices[i]];
+        f64 d = -(n[0] * p0[0] + n[1] * p0[1] + n[2] * p0[2]);
+        for (u32 k = 0; k < 3; ++k)
+        {
+            quadric_add_plane(&quadrics[group_of[indices[i + k]]], n[0], n[1], n[2], d, 0.5 * length);
+        }
+    }
+
+    u32* remap = malloc(vertex_count * sizeof(u32));
+    u32* group_tris_first = malloc((group_count + 1) * sizeof(u32));
+    u32* group_tris = malloc(index_count * sizeof(u32));
+    u8* touched = malloc(group_count * sizeof(u8));
+    Collapse* collapses = malloc(2 * index_count * sizeof(Collapse));
+    u64* collapse_keys = malloc(2 * 2 * index_count * sizeof(u64));
+    u32* collapse_order = malloc(2 * 2 * index_count * sizeof(u32));
+
+    f64 max_error_squared = (f64)max_error * (f64)max_error;
+    f64 largest_error = 0.0;
+
+    // Each pass collapses as many independent edges as it can, cheapest first. A collapse locks the groups around it
+    // for the rest of the pass so every triangle it looks at is still unchanged, then the index list is rewritten
+    while (index_count > target_index_count)
+    {
+        u32 triangle_count = index_count / 3;
+
+        // Triangles around each group
+        memset(group_tris_first, 0, (group_count + 1) * sizeof(u32));
+        for (u32 i = 0; i < index_count; ++i)
+        {
+            ++group_tris_first[group_of[out_indices[i]] + 1];
+        }
+        for (u32 g = 0; g < group_count; ++g)
+        {
+            group_tris_first[g + 1] += group_tris_first[g];
+        }
+        {
+            u32* fill = malloc(group_count * sizeof(u32));
+            memcpy(fill, group_tris_first, group_count * sizeof(u32));
+            for (u32 i = 0; i < index_count; ++i)
+            {
+                group_tris[fill[group_of[out_indices[i]]]++] = i / 3;
+            }
+            free(fill);
+        }
+
+        // Both directions of every edge are candidates
+        u32 collapse_count = 0;
+        for (u32 i = 0; i < index_count; ++i)
+        {
+            u32 a = group_of[out_indices[i]];
+            u32 b = group_of[out_indices[i - i % 3 + (i + 1) % 3]];
+            if (a == b)
+            {
+                continue;
+            }
+
+            for (u32 dir = 0; dir < 2; ++dir)
+            {
+                u32 from = dir == 0 ? a : b;
+                u32 to = dir == 0 ? b : a;
+                if (locked[from])
+                {
+                    continue;
+                }
+
+                // Non-negative floats sort the same as their bits
+                f32 cost = (f32)quadric_error(&quadrics[from], group_position[to]);
+                u32 cost_bits;
+                memcpy(&cost_bits, &cost, sizeof(cost_bits));
+
+                collapses[collapse_count].from = from;
+                collapses[collapse_count].to = to;
+                collapse_keys[collapse_count] = cost_bits;
+                collapse_order[collapse_count] = collapse_count;
+                ++collapse_count;
+            }
+        }
+        radix_sort_u64(collapse_keys, collapse_order, collapse_count, collapse_keys + collapse_count, collapse_order + collapse_count);
+
+        for (u32 v = 0; v < vertex_count; ++v)
+        {
+            remap[v] = v;
+        }
+        memset(touched, 0, group_count * sizeof(u8));
+
+        u32 collapsed = 0;
+        for (u32 c = 0; c < collapse_count && triangle_count * 3 > target_index_count; ++c)
+        {
+            f32 cost;
+            u32 cost_bits = (u32)collapse_keys[c];
+            memcpy(&cost, &cost_bits, sizeof(cost));
+            if (cost > max_error_squared)
+            {
+                break;
+            }
+
+            Collapse collapse = collapses[collapse_order[c]];
+            if (touched[collapse.from] || touched[collapse.to])
+            {
+                continue;
+            }
+
+            // Every wedge of the moving group needs an edge to a wedge of the target, which it takes the attributes of.
+            // That only allows seams to collapse along the seam, never across it
+            b32 valid = 1;
+            for (u32 w = group_wedges_first[collapse.from]; w < group_wedges_first[collapse.from + 1] && valid; ++w)
+            {
+                u32 wedge = group_wedges[w];
+                b32 is_used = 0;
+                u32 partner = wedge;
+                for (u32 t = group_tris_first[collapse.from]; t < group_tris_first[collapse.from + 1]; ++t)
+                {
+                    const u32* tri = &out_indices[3 * group_tris[t]];
+                    for (u32 k = 0; k < 3; ++k)
+                    {
+                        if (tri[k] != wedge)
+                        {
+                            continue;
+                        }
+                        is_used = 1;
+                        if (group_of[tri[(k + 1) % 3]] == collapse.to) partner = tri[(k + 1) % 3];
+                        if (group_of[tri[(k + 2) % 3]] == collapse.to) partner = tri[(k + 2) % 3];
+                    }
+                }
+                if (is_used && partner == wedge)
+                {
+                    valid = 0;
+                }
+                remap[wedge] = partner;
+            }
+
+            // Triangles that stay must not flip over
+            for (u32 t = group_tris_first[collapse.from]; t < group_tris_first[collapse.from + 1] && valid; ++t)
+            {
+                const u32* tri = &out_indices[3 * group_tris[t]];
+                const f32* p[3];
+                const f32* moved[3];
+                b32 has_target = 0;
+                for (u32 k = 0; k < 3; ++k)
+                {
+                    u32 g = group_of[tri[k]];
+                    has_target |= g == collapse.to;
+                    p[k] = &positions[3 * tri[k]];
+                    moved[k] = g == collapse.from ? group_position[collapse.to] : p[k];
+                }
+                if (has_target)
+                {
+                    continue;  // Becomes degenerate and is removed
+                }
+
+                f64 before[3];
+                f64 after[3];
+                triangle_normal(p[0], p[1], p[2], before);
+                triangle_normal(moved[0], moved[1], moved[2], after);
+                if (before[0] * after[0] + before[1] * after[1] + before[2] * after[2] <= 0.0)
+                {
+                    valid = 0;
+                }
+            }
+
+            if (!valid)
+            {
+                for (u32 w = group_wedges_first[collapse.from]; w < group_wedges_first[collapse.from + 1]; ++w)
+                {
+                    remap[group_wedges[w]] = group_wedges[w];
+                }
+                continue;
+            }
+
+            // Lock the one ring around the collapse for the rest of this pass, and count the triangles that disappear
+            for (u32 t = group_tris_first[collapse.from]; t < group_tris_first[collapse.from + 1]; ++t)
+            {
+                const u32* tri = &out_indices[3 * group_tris[t]];
+                b32 has_target = 0;
+                for (u32 k = 0; k < 3; ++k)
+                {
+                    touched[group_of[tri[k]]] = 1;
+                    has_target |= group_of[tri[k]] == collapse.to;
+                }
+                triangle_count -= has_target ? 1 : 0;
+            }
+
+            quadric_add(&quadrics[collapse.to], &quadrics[collapse.from]);
+            largest_error = cost > largest_error ? cost : largest_error;
+            ++collapsed;
+        }
+
+        if (collapsed == 0)
+        {
+            break;
+        }
+
+        // Apply the collapses and drop triangles that became degenerate
+        u32 write = 0;
+        for (u32 i = 0; i < index_count; i += 3)
+        {
+            u32 a = remap[out_indices[i + 0]];
+            u32 b = remap[out_indices[i + 1]];
+            u32 c = remap[out_indices[i + 2]];
+            if (group_of[a] == group_of[b] || group_of[b] == group_of[c] || group_of[a] == group_of[c])
+            {
+                continue;
+            }
+            out_indices[write++] = a;
+            out_indices[write++] = b;
+            out_indices[write++] = c;
+        }
+        index_count = write;
+    }
+
+    *out_error = (f32)sqrt(largest_error);
+
+    free(group_of);
+    free(group_wedges_first);
+    free(group_wedges);
+    free(group_position);
+    free(locked);
+    free(quadrics);
+    free(remap);
+    free(group_tris_first);
+    free(group_tris);
+    free(touched);
+    free(collapses);
+    free(collapse_keys);
+    free(collapse_order);
+
+    return index_count;
+}
+
+u32
+meshlet_count_bound(u32 index_count)
+{
+    // A meshlet only closes once the next triangle doesn't fit, so every meshlet but the last has either
+    // MESHLET_MAX_TRIANGLES triangles or more than MESHLET_MAX_VERTICES - 3 vertices (3 per triangle at most)
+    u32 min_triangles = (MESHLET_MAX_VERTICES - 2 + 2) / 3;
+    return (index_count / 3 + min_triangles - 1) / min_triangles + 1;
+}
+
+static u64
+spread_bits_21(u64 x)
+{
+    // Puts two zero bits between each of the low 21 bits, for interleaving into a 63 bit Morton code
+    x &= 0x1FFFFF;
+    x = (x | (x << 32)) & 0x1F00000000FFFFull;
+    x = (x | (x << 16)) & 0x1F0000FF0000FFull;
+    x = (x | (x << 8)) & 0x100F00F00F00F00Full;
+    x = (x | (x << 4)) & 0x10C30C30C30C30C3ull;
+    x = (x | (x << 2)) & 0x1249249249249249ull;
+    return x;
+}
+
+static void
+compute_meshlet_bounds(Meshlet* meshlet, const u32* meshlet_indices, const u32* meshlet_vertices, u32 vertex_count, const f32* positions)
+{
+    // Bounding sphere around the center of the vertices' AABB
+    f32 box_min[3] = { positions[3 * meshlet_vertices[0] + 0], positions[3 * meshlet_vertices[0] + 1], positions[3 * meshlet_vertices[0] + 2] };
+    f32 box_max[3] = { box_min[0], box_min[1], box_min[2] };
+    for (u32 i = 1; i < vertex_count; ++i)
+    {
+        const f32* p = &positions[3 * meshlet_vertices[i]];
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            box_min[axis] = min(box_min[axis], p[axis]);
+            box_max[axis] = max(box_max[axis], p[axis]);
+        }
+    }
+
+    f32 radius_squared = 0.0f;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        meshlet->center[axis] = 0.5f * (box_min[axis] + box_max[axis]);
+    }
+    for (u32 i = 0; i < vertex_count; ++i)
+    {
+        const f32* p = &positions[3 * meshlet_vertices[i]];
+        f32 dx = p[0] - meshlet->center[0];
+        f32 dy = p[1] - meshlet->center[1];
+        f32 dz = p[2] - meshlet->center[2];
+        radius_squared = max(radius_squared, dx * dx + dy * dy + dz * dz);
+    }
+    meshlet->radius = sqrtf(radius_squared);
+
+    // Normal cone: axis is the average triangle normal, the cutoff comes from the normal furthest from it
+    f64 axis[3] = { 0.0, 0.0, 0.0 };
+    for (u32 i = 0; i < meshlet->index_count; i += 3)
+    {
+        f64 normal[3];
+        triangle_normal(&positions[3 * meshlet_indices[i]], &positions[3 * meshlet_indices[i + 1]], &positions[3 * meshlet_indices[i + 2]], normal);
+        f64 length = sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+        if (length > 0.0)
+        {
+            axis[0] += normal[0] / length;
+            axis[1] += normal[1] / length;
+            axis[2] += normal[2] / length;
+        }
+    }
+
+    f64 axis_length = sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+    meshlet->cone_axis[0] = 0.0f;
+    meshlet->cone_axis[1] = 0.0f;
+    meshlet->cone_axis[2] = 1.0f;
+    meshlet->cone_cutoff = 1.0f;
+    if (axis_length == 0.0)
+    {
+        return;
+    }
+
+    f64 min_dot = 1.0;
+    for (u32 i = 0; i < meshlet->index_count; i += 3)
+    {
+        f64 normal[3];
+        triangle_normal(&positions[3 * meshlet_indices[i]], &positions[3 * meshlet_indices[i + 1]], &positions[3 * meshlet_indices[i + 2]], normal);
+        f64 length = sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+        if (length > 0.0)
+        {
+            f64 dot = (normal[0] * axis[0] + normal[1] * axis[1] + normal[2] * axis[2]) / (length * axis_length);
+            min_dot = min(min_dot, dot);
+        }
+    }
+
+    meshlet->cone_axis[0] = (f32)(axis[0] / axis_length);
+    meshlet->cone_axis[1] = (f32)(axis[1] / axis_length);
+    meshlet->cone_axis[2] = (f32)(axis[2] / axis_length);
+
+    // Normals more than ~84 degrees off the axis leave too little of the view sphere for the cone test to cull anything
+    if (min_dot > 0.1)
+    {
+        meshlet->cone_cutoff = (f32)sqrt(1.0 - min_dot * min_dot);
+    }
+}
+
+u32
+build_meshlets(Meshlet* out_meshlets, u32* out_indices, const u32* indices, u32 index_count, const f32* positions, u32 vertex_count)
+{
+    u32 triangle_count = index_count / 3;
+    if (triangle_count == 0)
+    {
+        return 0;
+    }
+
+    // Order triangles along a Morton curve of their centroids, the fallback when a meshlet has no unused neighbours left
+    u64* morton_keys = malloc(2 * triangle_count * sizeof(u64));
+    u32* morton_order = malloc(2 * triangle_count * sizeof(u32));
+    {
+        f32 box_min[3] = { positions[0], positions[1], positions[2] };
+        f32 box_max[3] = { positions[0], positions[1], positions[2] };
+        for (u32 v = 1; v < vertex_count; ++v)
+        {
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                box_min[axis] = min(box_min[axis], positions[3 * v + axis]);
+                box_max[axis] = max(box_max[axis], positions[3 * v + axis]);
+            }
+        }
+
+        f32 extent = max(box_max[0] - box_min[0], max(box_max[1] - box_min[1], box_max[2] - box_min[2]));
+        f32 scale = extent > 0.0f ? (f32)0x1FFFFF / extent : 0.0f;
+        for (u32 t = 0; t < triangle_count; ++t)
+        {
+            u64 key = 0;
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                f32 centroid = (positions[3 * indices[3 * t] + axis] + positions[3 * indices[3 * t + 1] + axis] + positions[3 * indices[3 * t + 2] + axis]) / 3.0f;
+                f32 quantized = min(max((centroid - box_min[axis]) * scale, 0.0f), (f32)0x1FFFFF);
+                key |= spread_bits_21((u64)quantized) << axis;
+            }
+            morton_keys[t] = key;
+            morton_order[t] = t;
+        }
+        radix_sort_u64(morton_keys, morton_order, triangle_count, morton_keys + triangle_count, morton_order + triangle_count);
+    }
+
+    // Vertex to triangle adjacency, live_triangles counts the ones that aren't in a meshlet yet
+    u32* live_triangles = calloc(vertex_count, sizeof(u32));
+    u32* adjacency_first = malloc((vertex_count + 1) * sizeof(u32));
+    u32* adjacency_fill = malloc(vertex_count * sizeof(u32));
+    u32* adjacency = malloc(index_count * sizeof(u32));
+    for (u32 i = 0; i < 3 * triangle_count; ++i)
+    {
+        ++live_triangles[indices[i]];
+    }
+    adjacency_first[0] = 0;
+    for (u32 v = 0; v < vertex_count; ++v)
+    {
+        adjacency_first[v + 1] = adjacency_first[v] + live_triangles[v];
+        adjacency_fill[v] = adjacency_first[v];
+    }
+    for (u32 i = 0; i < 3 * triangle_count; ++i)
+    {
+        adjacency[adjacency_fill[indices[i]]++] = i / 3;
+    }
+
+    u8* emitted = calloc(triangle_count, sizeof(u8));
+    u32* vertex_meshlet = malloc(vertex_count * sizeof(u32));  // Meshlet each vertex was last added to
+    memset(vertex_meshlet, 0xFF, vertex_count * sizeof(u32));
+
+    u32 meshlet_vertices[MESHLET_MAX_VERTICES];
+    u32 meshlet_vertex_count = 0;
+    u32 meshlet_count = 0;
+    u32 written_indices = 0;
+    u32 morton_cursor = 0;
+    Meshlet* meshlet = NULL;
+
+    for (u32 written_triangles = 0; written_triangles < triangle_count; ++written_triangles)
+    {
+        // Prefer the neighbouring triangle that adds the fewest new vertices
+        u32 best_triangle = UINT32_MAX;
+        u32 best_new_vertices = 4;
+        u32 current = meshlet_count - 1;
+        for (u32 i = 0; meshlet && i < meshlet_vertex_count && best_new_vertices > 0; ++i)
+        {
+            u32 v = meshlet_vertices[i];
+            if (live_triangles[v] == 0)
+            {
+                continue;
+            }
+
+            for (u32 j = adjacency_first[v]; j < adjacency_first[v + 1]; ++j)
+            {
+                u32 t = adjacency[j];
+                if (emitted[t])
+                {
+                    continue;
+                }
+
+                u32 a = indices[3 * t];
+                u32 b = indices[3 * t + 1];
+                u32 c = indices[3 * t + 2];
+                u32 new_vertices = (vertex_meshlet[a] != current)
+                    + (vertex_meshlet[b] != current && b != a)
+                    + (vertex_meshlet[c] != current && c != a && c != b);
+                if (new_vertices < best_new_vertices)
+                {
+                    best_triangle = t;
+                    best_new_vertices = new_vertices;
+                    if (new_vertices == 0)
+                    {
+                        break;
+                    }
+                }
+            }
+        }
+
+        if (best_triangle == UINT32_MAX)
+        {
+            while (emitted[morton_order[morton_cursor]])
+            {
+                ++morton_cursor;
+            }
+            best_triangle = morton_order[morton_cursor];
+            best_new_vertices = 3;
+        }
+
+        // Start a new meshlet when the triangle doesn't fit
+        if (!meshlet || meshlet_vertex_count + best_new_vertices > MESHLET_MAX_VERTICES || meshlet->index_count == 3 * MESHLET_MAX_TRIANGLES)
+        {
+            if (meshlet)
+            {
+                compute_meshlet_bounds(meshlet, &out_indices[meshlet->first_index], meshlet_vertices, meshlet_vertex_count, positions);
+            }
+
+            meshlet = &out_meshlets[meshlet_count++];
+            memset(meshlet, 0, sizeof(*meshlet));
+            meshlet->first_index = written_indices;
+            meshlet_vertex_count = 0;
+            current = meshlet_count - 1;
+        }
+
+        for (u32 corner = 0; corner < 3; ++corner)
+        {
+            u32 v = indices[3 * best_triangle + corner];
+            if (vertex_meshlet[v] != current)
+            {
+                vertex_meshlet[v] = current;
+                meshlet_vertices[meshlet_vertex_count++] = v;
+            }
+            --live_triangles[v];
+            out_indices[written_indices++] = v;
+        }
+        meshlet->index_count += 3;
+        emitted[best_triangle] = 1;
+    }
+    compute_meshlet_bounds(meshlet, &out_indices[meshlet->first_index], meshlet_vertices, meshlet_vertex_count, positions);
+
+    free(morton_keys);
+    free(morton_order);
+    free(live_triangles);
+    free(adjacency_first);
+    free(adjacency_fill);
+    free(adjacency);
+    free(emitted);
+    free(vertex_meshlet);
+
+    return meshlet_count;
+}
+
+u16
+quantize_unorm16(f32 v)
+{
+    v = v < 0.0f ? 0.0f : (v > 1.0f ? 1.0f : v);
+    return (u16)(v * 65535.0f + 0.5f);
+}
+
+s16
+quantize_snorm16(f32 v)
+{
+    v = v < -1.0f ? -1.0f : (v > 1.0f ? 1.0f : v);
+    return (s16)lroundf(v * 32767.0f);
+}
+
+u16
+quantize_half(f32 v)
+{
+    u32 bits;
+    memcpy(&bits, &v, sizeof(bits));
+    u16 sign = (u16)((bits >> 16) & 0x8000);
+    s32 exponent = (s32)((bits >> 23) & 0xFF) - 127 + 15;
+    u32 mantissa = bits & 0x7FFFFF;
+
+    if (exponent >= 31)
+    {
+        // Too big, infinity, or NaN (keeping a mantissa bit so it stays NaN)
+        b32 is_nan = ((bits >> 23) & 0xFF) == 0xFF && mantissa != 0;
+        return sign | 0x7C00 | (is_nan ? 0x200 : 0);
+    }
+    if (exponent <= 0)
+    {
+        // Denormal or zero, shift the implicit leading bit into the mantissa
+        if (exponent < -10)
+        {
+            return sign;
+        }
+        mantissa |= 0x800000;
+        u32 shift = (u32)(14 - exponent);
+        u32 rounded = (mantissa + (1u << (shift - 1))) >> shift;
+        return sign | (u16)rounded;
+    }
+
+    // Round to nearest, a carry out of the mantissa correctly bumps the exponent
+    u32 rounded = (((u32)exponent << 10) | (mantissa >> 13)) + ((mantissa >> 12) & 1);
+    return sign | (u16)(rounded >= 0x7C00 ? 0x7C00 : rounded);
+}
+
+void
+encode_octahedral_snorm16(const f32* n, s16* out)
+{
+    // Project onto the octahedron |x| + |y| + |z| = 1, then fold the lower half over the diagonals
+    f32 l1 = fabsf(n[0]) + fabsf(n[1]) + fabsf(n[2]);
+    if (l1 == 0.0f)
+    {
+        out[0] = 0;
+        out[1] = 0;
+        return;
+    }
+
+    f32 x = n[0] / l1;
+    f32 y = n[1] / l1;
+    if (n[2] < 0.0f)
+    {
+        f32 folded_x = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+        f32 folded_y = (1.0f - fabsf(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+        x = folded_x;
+        y = folded_y;
+    }
+
+    out[0] = quantize_snorm16(x);
+    out[1] = quantize_snorm16(y);
+}
+
+#define VERTEX_CACHE_SCORE_SIZE 32  // LRU cache size the vertex cache optimizer scores positions in
+#define VERTEX_CACHE_VALENCE_TABLE_SIZE 64
+
+static f32
+vertex_cache_score(const f32* position_scores, const f32* valence_scores, s32 cache_position, u32 live_count)
+{
+    // Forsyth's scoring: the last triangle's vertices get a fixed score so the next triangle doesn't just reuse
+    // the same edge, older cache entries decay, and vertices with few triangles left get a boost to finish them off
+    if (live_count == 0)
+    {
+        return -1.0f;
+    }
+
+    f32 score = cache_position >= 0 ? position_scores[cache_position] : 0.0f;
+    score += live_count < VERTEX_CACHE_VALENCE_TABLE_SIZE ? valence_scores[live_count] : 2.0f / sqrtf((f32)live_count);
+    return score;
+}
+
+void
+optimize_vertex_cache(u32* out_indices, const u32* indices, u32 index_count, u32 vertex_count)
+{
+    u32 triangle_count = index_count / 3;
+    if (triangle_count == 0)
+    {
+        return;
+    }
+
+    f32 position_scores[VERTEX_CACHE_SCORE_SIZE];
+    for (s32 i = 0; i < VERTEX_CACHE_SCORE_SIZE; ++i)
+    {
+        position_scores[i] = i < 3 ? 0.75f : powf(1.0f - (f32)(i - 3) / (f32)(VERTEX_CACHE_SCORE_SIZE - 3), 1.5f);
+    }
+    f32 valence_scores[VERTEX_CACHE_VALENCE_TABLE_SIZE];
+    valence_scores[0] = 0.0f;
+    for (u32 i = 1; i < VERTEX_CACHE_VALENCE_TABLE_SIZE; ++i)
+    {
+        valence_scores[i] = 2.0f / sqrtf((f32)i);
+    }
+
+    // Triangles of each vertex, the first live_counts[v] of them are the ones not emitted yet
+    u32* live_counts = calloc(vertex_count, sizeof(u32));
+    u32* adjacency_offsets = malloc((vertex_count + 1) * sizeof(u32));
+    u32* adjacency = malloc(3 * triangle_count * sizeof(u32));
+    for (u32 i = 0; i < 3 * triangle_count; ++i)
+    {
+        ++live_counts[indices[i]];
+    }
+    adjacency_offsets[0] = 0;
+    for (u32 v = 0; v < vertex_count; ++v)
+    {
+        adjacency_offsets[v + 1] = adjacency_offsets[v] + live_counts[v];
+        live_counts[v] = 0;
+    }
+    for (u32 t = 0; t < triangle_count; ++t)
+    {
+        for (u32 k = 0; k < 3; ++k)
+        {
+            u32 v = indices[3 * t + k];
+            adjacency[adjacency_offsets[v] + live_counts[v]++] = t;
+        }
+    }
+
+    s32* cache_positions = malloc(vertex_count * sizeof(s32));
+    f32* vertex_scores = malloc(vertex_count * sizeof(f32));
+    for (u32 v = 0; v < vertex_count; ++v)
+    {
+        cache_positions[v] = -1;
+        vertex_scores[v] = vertex_cache_score(position_scores, valence_scores, -1, live_counts[v]);
+    }
+
+    f32* triangle_scores = malloc(triangle_count * sizeof(f32));
+    u8* is_emitted = calloc(triangle_count, sizeof(u8));
+    s64 best_triangle = 0;
+    for (u32 t = 0; t < triangle_count; ++t)
+    {
+        const u32* tri = &indices[3 * t];
+        triangle_scores[t] = vertex_scores[tri[0]] + vertex_scores[tri[1]] + vertex_scores[tri[2]];
+        if (triangle_scores[t] > triangle_scores[best_triangle])
+        {
+            best_triangle = t;
+        }
+    }
+
+    u32 cache[VERTEX_CACHE_SCORE_SIZE + 3];
+    u32 cache_count = 0;
+    u32 input_cursor = 0;
+    for (u32 emitted = 0; emitted < triangle_count; ++emitted)
+    {
+        // Nothing left around the cache, carry on from the next triangle in input order
+        if (best_triangle < 0)
+        {
+            while (is_emitted[input_cursor])
+            {
+                ++input_cursor;
+            }
+            best_triangle = input_cursor;
+        }
+
+        u32 t = (u32)best_triangle;
+        const u32* tri = &indices[3 * t];
+        memcpy(&out_indices[3 * emitted], tri, 3 * sizeof(u32));
+        is_emitted[t] = 1;
+
+        for (u32 k = 0; k < 3; ++k)
+        {
+            // Swap the triangle out of its vertices' live ranges (degenerate triangles list a vertex more than once)
+            u32 v = tri[k];
+            u32* triangles = &adjacency[adjacency_offsets[v]];
+            for (u32 i = 0; i < live_counts[v]; ++i)
+            {
+                if (triangles[i] == t)
+                {
+                    triangles[i] = triangles[--live_counts[v]];
+                    break;
+                }
+            }
+        }
+
+        // Move the triangle's vertices to the front of the LRU cache, the entries pushed past the end are evicted
+        u32 new_cache[VERTEX_CACHE_SCORE_SIZE + 3];
+        u32 new_cache_count = 0;
+        for (u32 k = 0; k < 3; ++k)
+        {
+            if ((k < 1 || tri[k] != tri[0]) && (k < 2 || tri[k] != tri[1]))
+            {
+                new_cache[new_cache_count++] = tri[k];
+            }
+        }
+        for (u32 i = 0; i < cache_count; ++i)
+        {
+            u32 v = cache[i];
+            if (v != tri[0] && v != tri[1] && v != tri[2])
+            {
+                new_cache[new_cache_count++] = v;
+            }
+        }
+
+        for (u32 i = 0; i < new_cache_count; ++i)
+        {
+            u32 v = new_cache[i];
+            cache_positions[v] = i < VERTEX_CACHE_SCORE_SIZE ? (s32)i : -1;
+            vertex_scores[v] = vertex_cache_score(position_scores, valence_scores, cache_positions[v], live_counts[v]);
+        }
+        cache_count = min(new_cache_count, VERTEX_CACHE_SCORE_SIZE);
+        memcpy(cache, new_cache, cache_count * sizeof(u32));
+
+        // Only triangles around vertices whose score changed can change, pick the best of those
+        best_triangle = -1;
+        f32 best_score = -1.0f;
+        for (u32 i = 0; i < new_cache_count; ++i)
+        {
+            u32 v = new_cache[i];
+            u32* triangles = &adjacency[adjacency_offsets[v]];
+            for (u32 j = 0; j < live_counts[v]; ++j)
+            {
+                u32 neighbour = triangles[j];
+                const u32* neighbour_tri = &indices[3 * neighbour];
+                f32 score = vertex_scores[neighbour_tri[0]] + vertex_scores[neighbour_tri[1]] + vertex_scores[neighbour_tri[2]];
+                triangle_scores[neighbour] = score;
+                if (score > best_score)
+                {
+                    best_score = score;
+                    best_triangle = neighbour;
+                }
+            }
+        }
+    }
+
+    free(is_emitted);
+    free(triangle_scores);
+    free(vertex_scores);
+    free(cache_positions);
+    free(adjacency);
+    free(adjacency_offsets);
+    free(live_counts);
+}
+
+static u32
+vertex_cache_fifo_misses(const u32* tri, u32* timestamps, u32* timestamp)
+{
+    // A vertex is in the FIFO if it was added in the last VERTEX_CACHE_FIFO_SIZE misses
+    u32 misses = 0;
+    for (u32 k = 0; k < 3; ++k)
+    {
+        u32 v = tri[k];
+        if (*timestamp - timestamps[v] > VERTEX_CACHE_FIFO_SIZE)
+        {
+            timestamps[v] = (*timestamp)++;
+            ++misses;
+        }
+    }
+    return misses;
+}
+
+u32
+count_vertex_cache_misses(const u32* indices, u32 index_count, u32 vertex_count)
+{
+    u32* timestamps = calloc(vertex_count > 0 ? vertex_count : 1, sizeof(u32));
+    u32 timestamp = VERTEX_CACHE_FIFO_SIZE + 1;
+    u32 misses = 0;
+    for (u32 i = 0; i + 2 < index_count; i += 3)
+    {
+        misses += vertex_cache_fifo_misses(&indices[i], timestamps, &timestamp);
+    }
+    free(timestamps);
+    return misses;
+}
+
+void
+optimize_overdraw(u32* out_indices, const u32* indices, u32 index_count, const f32* positions, u32 vertex_count, f32 threshold)
+{
+    u32 triangle_count = index_count / 3;
+    if (triangle_count == 0)
+    {
+        return;
+    }
+
+    u32* timestamps = calloc(vertex_count, sizeof(u32));
+    u32 timestamp = VERTEX_CACHE_FIFO_SIZE + 1;
+
+    // Hard boundaries where a triangle misses on all three vertices, the vertex cache order started a new patch there
+    u32* hard_clusters = malloc(triangle_count * sizeof(u32));
+    u32 hard_cluster_count = 0;
+    for (u32 t = 0; t < triangle_count; ++t)
+    {
+        u32 misses = vertex_cache_fifo_misses(&indices[3 * t], timestamps, &timestamp);
+        if (t == 0 || misses == 3)
+        {
+            hard_clusters[hard_cluster_count++] = t;
+        }
+    }
+
+    // Split each of those further wherever the running miss ratio (with a cold cache at the split) is already within
+    // threshold of the whole cluster's, merging the leftover tail into the last split
+    u32* clusters = malloc((triangle_count + 1) * sizeof(u32));
+    u32 cluster_count = 0;
+    for (u32 hard_i = 0; hard_i < hard_cluster_count; ++hard_i)
+    {
+        u32 start = hard_clusters[hard_i];
+        u32 end = hard_i + 1 < hard_cluster_count ? hard_clusters[hard_i + 1] : triangle_count;
+
+        timestamp += VERTEX_CACHE_FIFO_SIZE + 1;
+        u32 cluster_misses = 0;
+        for (u32 t = start; t < end; ++t)
+        {
+            cluster_misses += vertex_cache_fifo_misses(&indices[3 * t], timestamps, &timestamp);
+        }
+        f32 cluster_threshold = threshold * (f32)cluster_misses / (f32)(end - start);
+
+        clusters[cluster_count++] = start;
+        timestamp += VERTEX_CACHE_FIFO_SIZE + 1;
+        u32 running_misses = 0;
+        u32 running_triangles = 0;
+        for (u32 t = start; t < end; ++t)
+        {
+            running_misses += vertex_cache_fifo_misses(&indices[3 * t], timestamps, &timestamp);
+            ++running_triangles;
+            if ((f32)running_misses / (f32)running_triangles <= cluster_threshold)
+            {
+                clusters[cluster_count++] = t + 1;
+                timestamp += VERTEX_CACHE_FIFO_SIZE + 1;
+                running_misses = 0;
+                running_triangles = 0;
+            }
+        }
+
+        if (clusters[cluster_count - 1] != start)
+        {
+            --cluster_count;
+        }
+    }
+    clusters[cluster_count] = triangle_count;
+
+    // Area weighted centroid and normal of every cluster, and of the whole mesh
+    f64 mesh_centroid[3] = { 0.0, 0.0, 0.0 };
+    f64 mesh_area = 0.0;
+    f64* cluster_data = calloc(7 * cluster_count, sizeof(f64));  // Centroid * area, area, normal * area
+    for (u32 c = 0; c < cluster_count; ++c)
+    {
+        f64* data = &cluster_data[7 * c];
+        for (u32 t = clusters[c]; t < clusters[c + 1]; ++t)
+        {
+            const f32* p0 = &positions[3 * indices[3 * t + 0]];
+            const f32* p1 = &positions[3 * indices[3 * t + 1]];
+            const f32* p2 = &positions[3 * indices[3 * t + 2]];
+
+            f64 normal[3];
+            triangle_normal(p0, p1, p2, normal);
+            f64 area = sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+            for (u32 k = 0; k < 3; ++k)
+            {
+                data[k] += area * ((f64)p0[k] + p1[k] + p2[k]) / 3.0;
+                data[4 + k] += normal[k];
+            }
+            data[3] += area;
+        }
+
+        for (u32 k = 0; k < 3; ++k)
+        {
+            mesh_centroid[k] += data[k];
+        }
+        mesh_area += data[3];
+    }
+    for (u32 k = 0; k < 3; ++k)
+    {
+        mesh_centroid[k] = mesh_area > 0.0 ? mesh_centroid[k] / mesh_area : 0.0;
+    }
+
+    // Clusters further out along their normal tend to occlude the others, sort by that descending
+    u64* keys = malloc(2 * cluster_count * sizeof(u64));
+    u32* order = malloc(2 * cluster_count * sizeof(u32));
+    for (u32 c = 0; c < cluster_count; ++c)
+    {
+        f64* data = &cluster_data[7 * c];
+        f64 normal_length = sqrt(data[4] * data[4] + data[5] * data[5] + data[6] * data[6]);
+        f32 facing = 0.0f;
+        if (data[3] > 0.0 && normal_length > 0.0)
+        {
+            f64 dot = 0.0;
+            for (u32 k = 0; k < 3; ++k)
+            {
+                dot += (data[k] / data[3] - mesh_centroid[k]) * data[4 + k];
+            }
+            facing = (f32)(dot / normal_length);
+        }
+
+        // Flip the float's bits so bigger values sort first as unsigned integers
+        u32 bits;
+        memcpy(&bits, &facing, sizeof(bits));
+        bits = (bits & 0x80000000) ? bits : ~bits & 0x7FFFFFFF;
+        keys[c] = bits;
+        order[c] = c;
+    }
+    radix_sort_u64(keys, order, cluster_count, keys + cluster_count, order + cluster_count);
+
+    u32 written = 0;
+    for (u32 i = 0; i < cluster_count; ++i)
+    {
+        u32 c = order[i];
+        u32 cluster_index_count = 3 * (clusters[c + 1] - clusters[c]);
+        memcpy(&out_indices[written], &indices[3 * clusters[c]], cluster_index_count * sizeof(u32));
+        written += cluster_index_count;
+    }
+    assert(written == 3 * triangle_count);
+
+    free(order);
+    free(keys);
+    free(cluster_data);
+    free(clusters);
+    free(hard_clusters);
+    free(timestamps);
+}
+
+void
+optimize_vertex_fetch_remap(u32* out_remap, u32* indices, u32 index_count, u32 vertex_count)
+{
+    memset(out_remap, 0xFF, vertex_count * sizeof(u32));
+    u32 next = 0;
+    for (u32 i = 0; i < index_count; ++i)
+    {
+        u32 v = indices[i];
+        if (out_remap[v] == ~0u)
+        {
+            out_remap[v] = next++;
+        }
+        indices[i] = out_remap[v];
+    }
+
+    for (u32 v = 0; v < vertex_count; ++v)
+    {
+        if (out_remap[v] == ~0u)
+        {
+            out_remap[v] = next++;
+        }
+    }
+}
+
+#define COPLANAR_MERGE_MAX_POINTS 64  // Including collinear points, which are dropped from the output
+#define COPLANAR_MERGE_MIN_COS 0.9999  // Triangles whose normals are within ~0.8 degrees count as coplanar
+#define COPLANAR_MERGE_EPSILON 1e-6  // Sine of the smallest turn that counts as a corner
+
+static u32
+find_edge_slot(const u64* keys, u32 table_size, u64 key)
+{
+    u32 slot = hash_u32((u32)key ^ hash_u32((u32)(key >> 32))) & (table_size - 1);
+    while (keys[slot] != 0 && keys[slot] != key)
+    {
+        slot = (slot + 1) & (table_size - 1);
+    }
+    return slot;
+}
+
+static s32
+polygon_turn(const u32* polygon, u32 n, u32 i, const f32* positions, const f64* normal)
+{
+    // 1 for a convex corner, 0 for a point on a straight edge, -1 for a reflex corner or the polygon doubling back
+    const f32* p0 = &positions[3 * polygon[(i + n - 1) % n]];
+    const f32* p1 = &positions[3 * polygon[i]];
+    const f32* p2 = &positions[3 * polygon[(i + 1) % n]];
+    f64 e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+    f64 e2[3] = { p2[0] - p1[0], p2[1] - p1[1], p2[2] - p1[2] };
+
+    f64 turn[3];
+    triangle_normal(p0, p1, p2, turn);
+    f64 sine = turn[0] * normal[0] + turn[1] * normal[1] + turn[2] * normal[2];
+    f64 scale = sqrt(e1[0] * e1[0] + e1[1] * e1[1] + e1[2] * e1[2]) * sqrt(e2[0] * e2[0] + e2[1] * e2[1] + e2[2] * e2[2]);
+
+    if (sine > COPLANAR_MERGE_EPSILON * scale)
+    {
+        return 1;
+    }
+    if (sine < -COPLANAR_MERGE_EPSILON * scale || e1[0] * e2[0] + e1[1] * e2[1] + e1[2] * e2[2] < 0.0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static u32
+count_convex_corners(const u32* polygon, u32 n, const f32* positions, const f64* normal)
+{
+    // 0 when the polygon isn't convex
+    u32 corners = 0;
+    for (u32 i = 0; i < n; ++i)
+    {
+        s32 turn = polygon_turn(polygon, n, i, positions, normal);
+        if (turn < 0)
+        {
+            return 0;
+        }
+        corners += (u32)turn;
+    }
+    return corners;
+}
+
+u32
+merge_coplanar_triangles(u32* out_polygon_sizes, f32* out_points, const u32* indices, u32 index_count, const f32* positions,
+                         u32 vertex_count, u32 max_points)
+{
+    assert(max_points >= 3);
+    u32 triangle_count = index_count / 3;
+
+    u32* group_of = malloc(vertex_count * sizeof(u32));
+    build_position_groups(positions, vertex_count, group_of);
+
+    // Directed edge between position groups to its triangle. A neighbour wound the same way has the edge the other way
+    // around, non-manifold edges keep their first triangle
+    u32 table_size = table_size_for(index_count);
+    u64* keys = calloc(table_size, sizeof(u64));  // 0 is empty, an edge between different groups is never 0
+    u32* edge_triangles = malloc(table_size * sizeof(u32));
+    for (u32 i = 0; i < index_count - index_count % 3; ++i)
+    {
+        u32 a = group_of[indices[i]];
+        u32 b = group_of[indices[i - i % 3 + (i + 1) % 3]];
+        if (a == b)
+        {
+            continue;
+        }
+
+        u64 key = ((u64)a << 32) | b;
+        u32 slot = find_edge_slot(keys, table_size, key);
+        if (keys[slot] == 0)
+        {
+            keys[slot] = key;
+            edge_triangles[slot] = i / 3;
+        }
+    }
+
+    // Unit normals, degenerate triangles start out used so they're never merged or emitted
+    f64* normals = malloc(3 * triangle_count * sizeof(f64));
+    u8* used = calloc(triangle_count, 1);
+    for (u32 t = 0; t < triangle_count; ++t)
+    {
+        const f32* p0 = &positions[3 * indices[3 * t + 0]];
+        const f32* p1 = &positions[3 * indices[3 * t + 1]];
+        const f32* p2 = &positions[3 * indices[3 * t + 2]];
+        f64* normal = &normals[3 * t];
+        triangle_normal(p0, p1, p2, normal);
+
+        f64 length = sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+        u32 polygon[3] = { indices[3 * t + 0], indices[3 * t + 1], indices[3 * t + 2] };
+        if (length > 0.0)
+        {
+            normal[0] /= length;
+            normal[1] /= length;
+            normal[2] /= length;
+        }
+        used[t] = length == 0.0 || count_convex_corners(polygon, 3, positions, normal) != 3;
+    }
+
+    u32 polygon_count = 0;
+    u32 points_count = 0;
+    for (u32 seed = 0; seed < triangle_count; ++seed)
+    {
+        if (used[seed])
+        {
+            continue;
+        }
+        used[seed] = 1;
+
+        const f64* normal = &normals[3 * seed];
+        u32 polygon[COPLANAR_MERGE_MAX_POINTS];
+        u32 n = 3;
+        memcpy(polygon, &indices[3 * seed], 3 * sizeof(u32));
+
+        // Keep adding the triangle across one of the polygon's edges for as long as it stays convex and small enough
+        b32 is_growing = 1;
+        while (is_growing && n < COPLANAR_MERGE_MAX_POINTS)
+        {
+            is_growing = 0;
+            for (u32 i = 0; i < n && !is_growing; ++i)
+            {
+                u32 a = group_of[polygon[i]];
+                u32 b = group_of[polygon[(i + 1) % n]];
+                u32 slot = find_edge_slot(keys, table_size, ((u64)b << 32) | a);
+                if (keys[slot] == 0)
+                {
+                    continue;
+                }
+
+                u32 t = edge_triangles[slot];
+                const f64* other = &normals[3 * t];
+                if (used[t] || normal[0] * other[0] + normal[1] * other[1] + normal[2] * other[2] < COPLANAR_MERGE_MIN_COS)
+                {
+                    continue;
+                }
+
+                u32 apex = ~0u;
+                for (u32 k = 0; k < 3; ++k)
+                {
+                    u32 group = group_of[indices[3 * t + k]];
+                    apex = group != a && group != b ? indices[3 * t + k] : apex;
+                }
+                b32 is_apex_in_polygon = 0;
+                for (u32 k = 0; k < n; ++k)
+                {
+                    is_apex_in_polygon |= group_of[polygon[k]] == group_of[apex];
+                }
+                if (is_apex_in_polygon)
+                {
+                    continue;
+                }
+
+                u32 candidate[COPLANAR_MERGE_MAX_POINTS];
+                memcpy(candidate, polygon, (i + 1) * sizeof(u32));
+                candidate[i + 1] = apex;
+                memcpy(&candidate[i + 2], &polygon[i + 1], (n - i - 1) * sizeof(u32));
+
+                u32 corners = count_convex_corners(candidate, n + 1, positions, normal);
+                if (corners >= 3 && corners <= max_points)
+                {
+                    memcpy(polygon, candidate, (n + 1) * sizeof(u32));
+                    ++n;
+                    used[t] = 1;
+                    is_growing = 1;
+                }
+            }
+        }
+
+        u32 size = 0;
+        for (u32 i = 0; i < n; ++i)
+        {
+            if (polygon_turn(polygon, n, i, positions, normal) != 0)
+            {
+                memcpy(&out_points[3 * (points_count + size)], &positions[3 * polygon[i]], 3 * sizeof(f32));
+                ++size;
+            }
+        }
+        out_polygon_sizes[polygon_count++] = size;
+        points_count += size;
+    }
+
+    free(group_of);
+    free(keys);
+    free(edge_triangles);
+    free(normals);
+    free(used);
+    return polygon_count;
+}
@@ -0,0 +1,61 @@
+#include "radix_sort.h"
+
+#include <string.h>
+
+void
+radix_sort_u64(u64* keys, u32* values, u32 count, u64* temp_keys, u32* temp_values)
+{
+    // Histogram every digit in one pass over the keys
+    u32 histograms[8][256];
+    memset(histograms, 0, sizeof(histograms));
+    for (u32 i = 0; i < count; ++i)
+    {
+        u64 key = keys[i];
+        for (int digit = 0; digit < 8; ++digit)
+        {
+            ++histograms[digit][(key >> (8 * digit)) & 0xFF];
+        }
+    }
+
+    u64* src_keys = keys;
+    u32* src_values = values;
+    u64* dst_keys = temp_keys;
+    u32* dst_values = temp_values;
+
+    for (int digit = 0; digit < 8; ++digit)
+    {
+        u32* histogram = histograms[digit];
+
+        // Sort keys usually leave whole bit ranges unused (or all the same), skip passes that wouldn't move anything
+        if (count == 0 || histogram[(src_keys[0] >> (8 * digit)) & 0xFF] == count)
+        {
+            continue;
+        }
+
+        // Prefix sum into starting offsets
+        u32 offset = 0;
+        for (int bucket = 0; bucket < 256; ++bucket)
+        {
+            u32 bucket_count = histogram[bucket];
+            histogram[bucket] = offset;
+            offset += bucket_count;
+        }
+
+        for (u32 i = 0; i < count; ++i)
+        {
+            u32 destination = histogram[(src_keys[i] >> (8 * digit)) & 0xFF]++;
+            dst_keys[destination] = src_keys[i];
+            dst_values[destination] = src_values[i];
+        }
+
+        u64* swap_keys = src_keys; src_keys = dst_keys; dst_keys = swap_keys;
+        u32* swap_values = src_values; src_values = dst_values; dst_values = swap_values;
+    }
+
+    // An odd number of passes leaves the result in the temp buffers
+    if (src_keys != keys)
+    {
+        memcpy(keys, src_keys, count * sizeof(u64));
+        memcpy(values, src_values, count * sizeof(u32));
+    }
+}
@@ -0,0 +1,833 @@
+#include "texture_cache.h"
+#include "cache.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+typedef struct CachedTextureHeader
+{
+    u32 format;
+    u32 width;
+    u32 height;
+    u32 level_count;
+    u32 level_sizes[TEXTURE_MAX_LEVELS];
+}
+CachedTextureHeader;
+
+u32
+texture_level_count(u32 width, u32 height)
+{
+    u32 size = width > height ? width : height;
+    u32 count = 1;
+    while (size > 1 && count < TEXTURE_MAX_LEVELS)
+    {
+        size /= 2;
+        ++count;
+    }
+    return count;
+}
+
+static u32
+get_level_dimension(u32 size, u32 level)
+{
+    size >>= level;
+    return size > 0 ? size : 1;
+}
+
+static f32
+srgb_to_linear(f32 c)
+{
+    return c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+}
+
+static f32
+linear_to_srgb(f32 c)
+{
+    return c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1.0f / 2.4f) - 0.055f;
+}
+
+static void
+average_texels(f32 out[4], const f32* t00, const f32* t01, const f32* t10, const f32* t11, TextureMipFilter filter)
+{
+    for (u32 c = 0; c < 4; ++c)
+    {
+        out[c] = 0.25f * (t00[c] + t01[c] + t10[c] + t11[c]);
+    }
+
+    // Averaged normals get shorter where they disagree, keep them unit length
+    if (filter == TEXTURE_MIP_FILTER_NORMAL)
+    {
+        f32 length = sqrtf(out[0] * out[0] + out[1] * out[1] + out[2] * out[2]);
+        if (length > 0.0f)
+        {
+            out[0] /= length;
+            out[1] /= length;
+            out[2] /= length;
+        }
+    }
+}
+
+static void
+downsample_level(f32* dst, const f32* src, u32 src_width, u32 src_height, TextureMipFilter filter)
+{
+    // 2x2 box filter on linear values, odd sizes clamp the last row/column
+    u32 dst_width = get_level_dimension(src_width, 1);
+    u32 dst_height = get_level_dimension(src_height, 1);
+    for (u32 y = 0; y < dst_height; ++y)
+    {
+        u32 y0 = 2 * y < src_height ? 2 * y : src_height - 1;
+        u32 y1 = 2 * y + 1 < src_height ? 2 * y + 1 : src_height - 1;
+        for (u32 x = 0; x < dst_width; ++x)
+        {
+            u32 x0 = 2 * x < src_width ? 2 * x : src_width - 1;
+            u32 x1 = 2 * x + 1 < src_width ? 2 * x + 1 : src_width - 1;
+            average_texels(&dst[4 * (y * dst_width + x)], &src[4 * (y0 * src_width + x0)], &src[4 * (y0 * src_width + x1)],
+                &src[4 * (y1 * src_width + x0)], &src[4 * (y1 * src_width + x1)], filter);
+        }
+    }
+}
+
+static void
+downsample_rgba8_level(f32* dst, const u8* src, u32 src_width, u32 src_height, const f32 byte_to_float[256], TextureMipFilter filter)
+{
+    // downsample_level() for level 0, converting each texel as it's read so level 0 never needs a float copy
+    u32 dst_width = get_level_dimension(src_width, 1);
+    u32 dst_height = get_level_dimension(src_height, 1);
+    for (u32 y = 0; y < dst_height; ++y)
+    {
+        u32 y0 = 2 * y < src_height ? 2 * y : src_height - 1;
+        u32 y1 = 2 * y + 1 < src_height ? 2 * y + 1 : src_height - 1;
+        for (u32 x = 0; x < dst_width; ++x)
+        {
+            u32 x0 = 2 * x < src_width ? 2 * x : src_width - 1;
+            u32 x1 = 2 * x + 1 < src_width ? 2 * x + 1 : src_width - 1;
+            const u8* texels[4] = {
+                &src[4 * (y0 * src_width + x0)], &src[4 * (y0 * src_width + x1)],
+                &src[4 * (y1 * src_width + x0)], &src[4 * (y1 * src_width + x1)],
+            };
+
+            f32 float_texels[4][4];
+            for (u32 t = 0; t < 4; ++t)
+            {
+                for (u32 c = 0; c < 4; ++c)
+                {
+                    float_texels[t][c] = c == 3 ? texels[t][c] / 255.0f : byte_to_float[texels[t][c]];
+                }
+            }
+            average_texels(&dst[4 * (y * dst_width + x)], float_texels[0], float_texels[1], float_texels[2], float_texels[3], filter);
+        }
+    }
+}
+
+static void
+level_to_rgba8(u8* dst, const f32* src, u32 pixel_count, TextureMipFilter filter)
+{
+    for (u32 i = 0; i < 4 * pixel_count; ++i)
+    {
+        f32 v = src[i];
+        if (filter == TEXTURE_MIP_FILTER_SRGB && i % 4 != 3)
+        {
+            v = linear_to_srgb(v);
+        }
+        else if (filter == TEXTURE_MIP_FILTER_NORMAL && i % 4 != 3)
+        {
+            v = v * 0.5f + 0.5f;
+        }
+        v = v < 0.0f ? 0.0f : (v > 1.0f ? 1.0f : v);
+        dst[i] = (u8)(v * 255.0f + 0.5f);
+    }
+}
+
+// Block compression
+//
+// Each 4x4 block is fit with a line through color space: its principal axis gives the starting endpoints, then
+// one least squares pass refits them to the chosen indices and is kept when it lowers the error.
+
+static void
+find_principal_axis(const f32 pixels[16][4], int channel_count, f32 mean[4], f32 axis[4])
+{
+    for (int c = 0; c < 4; ++c)
+    {
+        mean[c] = 0.0f;
+        axis[c] = 0.0f;
+    }
+    for (int i = 0; i < 16; ++i)
+    {
+        for (int c = 0; c < channel_count; ++c)
+        {
+            mean[c] += pixels[i][c] / 16.0f;
+        }
+    }
+
+    f32 covariance[4][4] = { 0 };
+    for (int i = 0; i < 16; ++i)
+    {
+        for (int a = 0; a < channel_count; ++a)
+        {
+            for (int b = 0; b < channel_count; ++b)
+            {
+                covariance[a][b] += (pixels[i][a] - mean[a]) * (pixels[i][b] - mean[b]);
+            }
+        }
+    }
+
+    // Power iteration, starting from the channel that varies the most
+    int start = 0;
+    for (int c = 1; c < channel_count; ++c)
+    {
+        if (covariance[c][c] > covariance[start][start])
+        {
+            start = c;
+        }
+    }
+    if (covariance[start][start] <= 0.0f)
+    {
+        return;  // Flat block, the zero axis puts both endpoints on the mean
+    }
+
+    for (int c = 0; c < channel_count; ++c)
+    {
+        axis[c] = covariance[start][c];
+    }
+    for (int iteration = 0; iteration < 8; ++iteration)
+    {
+        f32 next[4] = { 0 };
+        f32 length = 0.0f;
+        for (int a = 0; a < channel_count; ++a)
+        {
+            for (int b = 0; b < channel_count; ++b)
+            {
+                next[a] += covariance[a][b] * axis[b];
+            }
+            length += next[a] * next[a];
+        }
+
+        length = sqrtf(length);
+        if (length <= 0.0f)
+        {
+            break;
+        }
+        for (int c = 0; c < channel_count; ++c)
+        {
+            axis[c] = next[c] / length;
+        }
+    }
+}
+
+static void
+find_endpoints_on_axis(const f32 pixels[16][4], int channel_count, f32 out_a[4], f32 out_b[4])
+{
+    f32 mean[4], axis[4];
+    find_principal_axis(pixels, channel_count, mean, axis);
+
+    f32 t_lo = 0.0f;
+    f32 t_hi = 0.0f;
+    for (int i = 0; i < 16; ++i)
+    {
+        f32 t = 0.0f;
+        for (int c = 0; c < channel_count; ++c)
+        {
+            t += (pixels[i][c] - mean[c]) * axis[c];
+        }
+        t_lo = t < t_lo ? t : t_lo;
+        t_hi = t > t_hi ? t : t_hi;
+    }
+
+    for (int c = 0; c < 4; ++c)
+    {
+        out_a[c] = mean[c] + t_hi * axis[c];
+        out_b[c] = mean[c] + t_lo * axis[c];
+    }
+}
+
+// Least squares endpoints for pixels interpolated at t (0 is a, 1 is b). Returns 0 when every t is the same
+static int
+fit_endpoints(const f32 pixels[16][4], const f32 t[16], int channel_count, f32 out_a[4], f32 out_b[4])
+{
+    f32 aa = 0.0f, ab = 0.0f, bb = 0.0f;
+    f32 ax[4] = { 0 }, bx[4] = { 0 };
+    for (int i = 0; i < 16; ++i)
+    {
+        f32 s = 1.0f - t[i];
+        aa += s * s;
+        ab += s * t[i];
+        bb += t[i] * t[i];
+        for (int c = 0; c < channel_count; ++c)
+        {
+            ax[c] += s * pixels[i][c];
+            bx[c] += t[i] * pixels[i][c];
+        }
+    }
+
+    f32 determinant = aa * bb - ab * ab;
+    if (fabsf(determinant) < 1e-6f)
+    {
+        return 0;
+    }
+    for (int c = 0; c < channel_count; ++c)
+    {
+        out_a[c] = (ax[c] * bb - bx[c] * ab) / determinant;
+        out_b[c] = (bx[c] * aa - ax[c] * ab) / determinant;
+    }
+    return 1;
+}
+
+static f32
+clamp_byte(f32 v)
+{
+    return v < 0.0f ? 0.0f : (v > 255.0f ? 255.0f : v);
+}
+
+static u16
+pack_rgb565(const f32 color[3])
+{
+    u32 r = (u32)(clamp_byte(color[0]) * 31.0f / 255.0f + 0.5f);
+    u32 g = (u32)(clamp_byte(color[1]) * 63.0f / 255.0f + 0.5f);
+    u32 b = (u32)(clamp_byte(color[2]) * 31.0f / 255.0f + 0.5f);
+    return (u16)((r << 11) | (g << 5) | b);
+}
+
+static void
+unpack_rgb565(u16 packed, f32 out[3])
+{
+    u32 r = (packed >> 11) & 31;
+    u32 g = (packed >> 5) & 63;
+    u32 b = packed & 31;
+    out[0] = (f32)((r << 3) | (r >> 2));
+    out[1] = (f32)((g << 2) | (g >> 4));
+    out[2] = (f32)((b << 3) | (b >> 2));
+}
+
+// Picks the nearest of the 4 colors the endpoints decode to for each pixel. Returns the squared error
+static f32
+find_bc1_indices(const f32 pixels[16][4], u16 color0, u16 color1, u32* out_indices)
+{
+    f32 palette[4][3];
+    unpack_rgb565(color0, palette[0]);
+    unpack_rgb565(color1, palette[1]);
+    for (int c = 0; c < 3; ++c)
+    {
+        palette[2][c] = (2.0f * palette[0][c] + palette[1][c]) / 3.0f;
+        palette[3][c] = (palette[0][c] + 2.0f * palette[1][c]) / 3.0f;
+    }
+    int palette_size = color0 > color1 ? 4 : 1;  // Equal endpoints would switch to the 3 color mode, only use the first
+
+    f32 total_error = 0.0f;
+    u32 indices = 0;
+    for (int i = 0; i < 16; ++i)
+    {
+        int best = 0;
+        f32 best_error = INFINITY;
+        for (int p = 0; p < palette_size; ++p)
+        {
+            f32 error = 0.0f;
+            for (int c = 0; c < 3; ++c)
+            {
+                f32 d = pixels[i][c] - palette[p][c];
+                error += d * d;
+            }
+            if (error < best_error)
+            {
+                best = p;
+                best_error = error;
+            }
+        }
+        indices |= (u32)best << (2 * i);
+        total_error += best_error;
+    }
+
+    *out_indices = indices;
+    return total_error;
+}
+
+static void
+encode_bc1_block(const f32 pixels[16][4], u8* out)
+{
+    static const f32 index_t[4] = { 0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f };
+
+    f32 a[4], b[4];
+    find_endpoints_on_axis(pixels, 3, a, b);
+    u16 color0 = pack_rgb565(a);
+    u16 color1 = pack_rgb565(b);
+    if (color0 < color1)
+    {
+        u16 swap = color0; color0 = color1; color1 = swap;
+    }
+
+    u32 indices;
+    f32 error = find_bc1_indices(pixels, color0, color1, &indices);
+
+    f32 t[16];
+    for (int i = 0; i < 16; ++i)
+    {
+        t[i] = index_t[(indices >> (2 * i)) & 3];
+    }
+    if (fit_endpoints(pixels, t, 3, a, b))
+    {
+        u16 refit_color0 = pack_rgb565(a);
+        u16 refit_color1 = pack_rgb565(b);
+        if (refit_color0 < refit_color1)
+        {
+            u16 swap = refit_color0; refit_color0 = refit_color1; refit_color1 = swap;
+        }
+
+        u32 refit_indices;
+        f32 refit_error = find_bc1_indices(pixels, refit_color0, refit_color1, &refit_indices);
+        if (refit_error < error)
+        {
+            color0 = refit_color0;
+            color1 = refit_color1;
+            indices = refit_indices;
+        }
+    }
+
+    out[0] = color0 & 0xFF;
+    out[1] = color0 >> 8;
+    out[2] = color1 & 0xFF;
+    out[3] = color1 >> 8;
+    for (int i = 0; i < 4; ++i)
+    {
+        out[4 + i] = (indices >> (8 * i)) & 0xFF;
+    }
+}
+
+static void
+encode_bc4_block(const f32 pixels[16][4], int channel, u8* out)
+{
+    // Endpoints on the min and max with the 8 value mode (first endpoint larger), 3 bit indices
+    f32 lo = 255.0f;
+    f32 hi = 0.0f;
+    for (int i = 0; i < 16; ++i)
+    {
+        lo = pixels[i][channel] < lo ? pixels[i][channel] : lo;
+        hi = pixels[i][channel] > hi ? pixels[i][channel] : hi;
+    }
+    u8 value0 = (u8)(hi + 0.5f);
+    u8 value1 = (u8)(lo + 0.5f);
+
+    u64 indices = 0;
+    if (value0 > value1)
+    {
+        for (int i = 0; i < 16; ++i)
+        {
+            // Position along value0 -> value1 in sevenths, index 0 and 1 are the endpoints and 2-7 the steps between
+            int step = (int)((value0 - pixels[i][channel]) * 7.0f / (value0 - value1) + 0.5f);
+            step = step < 0 ? 0 : (step > 7 ? 7 : step);
+            u64 index = step == 0 ? 0 : (step == 7 ? 1 : step + 1);
+            indices |= index << (3 * i);
+        }
+    }
+
+    out[0] = value0;
+    out[1] = value1;
+    for (int i = 0; i < 6; ++i)
+    {
+        out[2 + i] = (indices >> (8 * i)) & 0xFF;
+    }
+}
+
+// BC7 mode 6: one subset, RGBA endpoints of 7 bits plus a p-bit each, 4 bit indices
+static const u32 bc7_weights4[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+
+static void
+quantize_bc7_mode6_endpoint(const f32 endpoint[4], u8 out[4])
+{
+    // The p-bit is the shared low bit of all four 8 bit channels, pick whichever lands closer
+    f32 best_error = INFINITY;
+    for (u32 p = 0; p < 2; ++p)
+    {
+        u8 quantized[4];
+        f32 error = 0.0f;
+        for (int c = 0; c < 4; ++c)
+        {
+            f32 v = (clamp_byte(endpoint[c]) - (f32)p) / 2.0f;
+            int q = (int)(v + 0.5f);
+            q = q < 0 ? 0 : (q > 127 ? 127 : q);
+            quantized[c] = (u8)(2 * q + p);
+            f32 d = endpoint[c] - quantized[c];
+            error += d * d;
+        }
+        if (error < best_error)
+        {
+            best_error = error;
+            memcpy(out, quantized, 4);
+        }
+    }
+}
+
+static f32
+find_bc7_mode6_indices(const f32 pixels[16][4], const u8 endpoint0[4], const u8 endpoint1[4], u8 out_indices[16])
+{
+    f32 palette[16][4];
+    for (int p = 0; p < 16; ++p)
+    {
+        for (int c = 0; c < 4; ++c)
+        {
+            palette[p][c] = (f32)(((64 - bc7_weights4[p]) * endpoint0[c] + bc7_weights4[p] * endpoint1[c] + 32) >> 6);
+        }
+    }
+
+    f32 total_error = 0.0f;
+    for (int i = 0; i < 16; ++i)
+    {
+        int best = 0;
+        f32 best_error = INFINITY;
+        for (int p = 0; p < 16; ++p)
+        {
+            f32 error = 0.0f;
+            for (int c = 0; c < 4; ++c)
+            {
+                f32 d = pixels[i][c] - palette[p][c];
+                error += d * d;
+            }
+            if (error < best_error)
+            {
+                best = p;
+                best_error = error;
+            }
+        }
+        out_indices[i] = (u8)best;
+        total_error += best_error;
+    }
+    return total_error;
+}
+
+static void
+write_bits(u8* block, u32* bit_position, u32 value, u32 count)
+{
+    for (u32 i = 0; i < count; ++i, ++*bit_position)
+    {
+        if (value & (1u << i))
+        {
+            block[*bit_position / 8] |= (u8)(1u << (*bit_position % 8));
+        }
+    }
+}
+
+static void
+encode_bc7_block(const f32 pixels[16][4], u8* out)
+{
+    f32 a[4], b[4];
+    find_endpoints_on_axis(pixels, 4, a, b);
+
+    u8 endpoint0[4], endpoint1[4], indices[16];
+    quantize_bc7_mode6_endpoint(a, endpoint0);
+    quantize_bc7_mode6_endpoint(b, endpoint1);
+    f32 error = find_bc7_mode6_indices(pixels, endpoint0, endpoint1, indices);
+
+    f32 t[16];
+    for (int i = 0; i < 16; ++i)
+    {
+        t[i] = bc7_weights4[indices[i]] / 64.0f;
+    }
+    if (fit_endpoints(pixels, t, 4, a, b))
+    {
+        u8 refit_endpoint0[4], refit_endpoint1[4], refit_indices[16];
+        quantize_bc7_mode6_endpoint(a, refit_endpoint0);
+        quantize_bc7_mode6_endpoint(b, refit_endpoint1);
+        f32 refit_error = find_bc7_mode6_indices(pixels, refit_endpoint0, refit_endpoint1, refit_indices);
+        if (refit_error < error)
+        {
+            memcpy(endpoint0, refit_endpoint0, 4);
+            memcpy(endpoint1, refit_endpoint1, 4);
+            memcpy(indices, refit_indices, 16);
+        }
+    }
+
+    // The first index is stored without its top bit, flip the block around so it's clear (the weights are symmetric)
+    if (indices[0] & 8)
+    {
+        u8 swap[4];
+        memcpy(swap, endpoint0, 4);
+        memcpy(endpoint0, endpoint1, 4);
+        memcpy(endpoint1, swap, 4);
+        for (int i = 0; i < 16; ++i)
+        {
+            indices[i] = 15 - indices[i];
+        }
+    }
+
+    memset(out, 0, 16);
+    u32 bit = 0;
+    write_bits(out, &bit, 1u << 6, 7);  // Mode 6
+    for (int c = 0; c < 4; ++c)
+    {
+        write_bits(out, &bit, endpoint0[c] >> 1, 7);
+        write_bits(out, &bit, endpoint1[c] >> 1, 7);
+    }
+    write_bits(out, &bit, endpoint0[0] & 1, 1);
+    write_bits(out, &bit, endpoint1[0] & 1, 1);
+    write_bits(out, &bit, indices[0], 3);
+    for (int i = 1; i < 16; ++i)
+    {
+        write_bits(out, &bit, indices[i], 4);
+    }
+    assert(bit == 128);
+}
+
+static u32
+get_block_size(TextureFormat format)
+{
+    switch (format)
+    {
+        case TEXTURE_FORMAT_BC1: return 8;
+        case TEXTURE_FORMAT_BC3: return 16;
+        case TEXTURE_FORMAT_BC5: return 16;
+        case TEXTURE_FORMAT_BC7: return 16;
+        default: return 0;
+    }
+}
+
+static u32
+get_level_size(TextureFormat format, u32 width, u32 height)
+{
+    if (format == TEXTURE_FORMAT_RGBA8)
+    {
+        return 4 * width * height;
+    }
+    return ((width + 3) / 4) * ((height + 3) / 4) * get_block_size(format);
+}
+
+u32
+texture_level_size(u32 format, u32 width, u32 height, u32 level)
+{
+    if (format != TEXTURE_FORMAT_RGBA8 && get_block_size(format) == 0)
+    {
+        return 0;
+    }
+    return get_level_size(format, get_level_dimension(width, level), get_level_dimension(height, level));
+}
+
+static void
+encode_level(u8* out, const u8* rgba, u32 width, u32 height, TextureFormat format)
+{
+    if (format == TEXTURE_FORMAT_RGBA8)
+    {
+        memcpy(out, rgba, 4 * width * height);
+        return;
+    }
+
+    u32 block_size = get_block_size(format);
+    for (u32 block_y = 0; block_y < (height + 3) / 4; ++block_y)
+    {
+        for (u32 block_x = 0; block_x < (width + 3) / 4; ++block_x)
+        {
+            // Blocks hanging off the edge repeat the last row/column
+            f32 pixels[16][4];
+            for (u32 i = 0; i < 16; ++i)
+            {
+                u32 x = 4 * block_x + i % 4;
+                u32 y = 4 * block_y + i / 4;
+                x = x < width ? x : width - 1;
+                y = y < height ? y : height - 1;
+                for (int c = 0; c < 4; ++c)
+                {
+                    pixels[i][c] = rgba[4 * (y * width + x) + c];
+                }
+            }
+
+            switch (format)
+            {
+                case TEXTURE_FORMAT_BC1:
+                    encode_bc1_block(pixels, out);
+                    break;
+                case TEXTURE_FORMAT_BC3:
+                    encode_bc4_block(pixels, 3, out);
+                    encode_bc1_block(pixels, out + 8);
+                    break;
+                case TEXTURE_FORMAT_BC5:
+                    encode_bc4_block(pixels, 0, out);
+                    encode_bc4_block(pixels, 1, out + 8);
+                    break;
+                case TEXTURE_FORMAT_BC7:
+                    encode_bc7_block(pixels, out);
+                    break;
+                default:
+                    assert(0 && "Unknown texture format");
+            }
+            out += block_size;
+        }
+    }
+}
+
+TextureLevels
+build_texture_levels(const u8* rgba, u32 width, u32 height, TextureFormat format, TextureMipFilter filter)
+{
+    if (format == TEXTURE_FORMAT_BC1)
+    {
+        for (u32 i = 0; i < width * height; ++i)
+        {
+            if (rgba[4 * i + 3] != 255)
+            {
+                format = TEXTURE_FORMAT_BC3;
+                break;
+            }
+        }
+    }
+
+    TextureLevels levels = { 0 };
+    levels.format = format;
+    levels.width = width;
+    levels.height = height;
+    levels.level_count = texture_level_count(width, height);
+
+    u32 total_size = 0;
+    for (u32 level = 0; level < levels.level_count; ++level)
+    {
+        levels.level_offsets[level] = total_size;
+        levels.level_sizes[level] = get_level_size(format, get_level_dimension(width, level), get_level_dimension(height, level));
+        total_size += levels.level_sizes[level];
+    }
+    levels.data = malloc(total_size);
+    levels.allocation = levels.data;
+
+    // Filtering happens on float images in linear space (or as unit vectors for normal maps), each level is then
+    // converted back to 8 bits for encoding. Level 1 is filtered straight from the 8 bit level 0, after that two float
+    // images ping-pong between levels: odd levels in the first (sized for level 1) and even ones in the second (sized
+    // for level 2). That's 5 bytes per level 0 pixel, against 16 for a float copy of level 0 alone
+    f32 byte_to_float[256];
+    for (u32 i = 0; i < 256; ++i)
+    {
+        f32 v = i / 255.0f;
+        byte_to_float[i] = v;
+        if (filter == TEXTURE_MIP_FILTER_SRGB)
+            byte_to_float[i] = srgb_to_linear(v);
+        else if (filter == TEXTURE_MIP_FILTER_NORMAL)
+            byte_to_float[i] = v * 2.0f - 1.0f;
+    }
+
+    size_t level1_pixel_count = (size_t)get_level_dimension(width, 1) * get_level_dimension(height, 1);
+    size_t level2_pixel_count = (size_t)get_level_dimension(width, 2) * get_level_dimension(height, 2);
+    f32* float_levels[2] = { malloc(4 * level2_pixel_count * sizeof(f32)), malloc(4 * level1_pixel_count * sizeof(f32)) };
+    u8* level_rgba = malloc(4 * level1_pixel_count);  // Level 0 is encoded straight from rgba
+
+    for (u32 level = 0; level < levels.level_count; ++level)
+    {
+        u32 level_width = get_level_dimension(width, level);
+        u32 level_height = get_level_dimension(height, level);
+        const u8* source = rgba;
+        if (level == 1)
+        {
+            downsample_rgba8_level(float_levels[1], rgba, width, height, byte_to_float, filter);
+        }
+        else if (level > 1)
+        {
+            downsample_level(float_levels[level % 2], float_levels[(level - 1) % 2],
+                get_level_dimension(width, level - 1), get_level_dimension(height, level - 1), filter);
+        }
+        if (level > 0)
+        {
+            level_to_rgba8(level_rgba, float_levels[level % 2], level_width * level_height, filter);
+            source = level_rgba;
+        }
+
+        encode_level(levels.data + levels.level_offsets[level], source, level_width, level_height, format);
+    }
+
+    free(float_levels[0]);
+    free(float_levels[1]);
+    free(level_rgba);
+    return levels;
+}
+
+void
+free_texture_levels(TextureLevels* levels)
+{
+    free(levels->allocation);
+    memset(levels, 0, sizeof(*levels));
+}
+
+u64
+texture_cache_key(const void* file_data, size_t file_size, TextureFormat format, TextureMipFilter filter)
+{
+    u64 key = hash_fnv1a_64(file_data, file_size, FNV1A_64_OFFSET_BASIS);
+    u32 settings[2] = { format, filter };
+    return hash_fnv1a_64(settings, sizeof(settings), key);
+}
+
+b32
+read_cached_texture(u64 key, TextureLevels* out_levels)
+{
+    size_t size;
+    u8* cached = cache_read("texture", key, TEXTURE_CACHE_VERSION, &size);
+    if (!cached)
+    {
+        return 0;
+    }
+
+    // Anything that doesn't match what build_texture_levels() would have made from its format and dimensions is a miss,
+    // so a corrupt entry is rebuilt instead of uploaded
+    CachedTextureHeader header;
+    b32 is_valid = size >= sizeof(header);
+    if (is_valid)
+    {
+        memcpy(&header, cached, sizeof(header));
+        is_valid = (header.format == TEXTURE_FORMAT_RGBA8 || get_block_size(header.format) != 0)
+            && header.width > 0 && header.width <= TEXTURE_MAX_SIZE
+            && header.height > 0 && header.height <= TEXTURE_MAX_SIZE
+            && header.level_count == texture_level_count(header.width, header.height);
+    }
+
+    size_t total_size = sizeof(header);
+    for (u32 level = 0; is_valid && level < header.level_count; ++level)
+    {
+        u32 level_size = texture_level_size(header.format, header.width, header.height, level);
+        is_valid = header.level_sizes[level] == level_size;
+        total_size += level_size;
+    }
+    if (!is_valid || total_size != size)
+    {
+        free(cached);
+        return 0;
+    }
+
+    TextureLevels levels = { 0 };
+    levels.format = header.format;
+    levels.width = header.width;
+    levels.height = header.height;
+    levels.level_count = header.level_count;
+    levels.data = cached + sizeof(header);
+    levels.allocation = cached;
+
+    u32 offset = 0;
+    for (u32 level = 0; level < levels.level_count; ++level)
+    {
+        levels.level_offsets[level] = offset;
+        levels.level_sizes[level] = header.level_sizes[level];
+        offset += header.level_sizes[level];
+    }
+
+    *out_levels = levels;
+    return 1;
+}
+
+void
+write_cached_texture(u64 key, const TextureLevels* levels)
+{
+    CachedTextureHeader header = { 0 };
+    header.format = levels->format;
+    header.width = levels->width;
+    header.height = levels->height;
+    header.level_count = levels->level_count;
+
+    size_t total_size = sizeof(header);
+    for (u32 level = 0; level < levels->level_count; ++level)
+    {
+        header.level_sizes[level] = levels->level_sizes[level];
+        total_size += levels->level_sizes[level];
+    }
+
+    u8* blob = malloc(total_size);
+    memcpy(blob, &header, sizeof(header));
+    u8* write_pointer = blob + sizeof(header);
+    for (u32 level = 0; level < levels->level_count; ++level)
+    {
+        memcpy(write_pointer, levels->data + levels->level_offsets[level], levels->level_sizes[level]);
+        write_pointer += levels->level_sizes[level];
+    }
+
+    cache_write("texture", key, TEXTURE_CACHE_VERSION, blob, total_size);
+    free(blob);
+}